@@ -94,6 +94,7 @@
 #include <syntax.h>                     /* IsBuiltInPromiseType() */
 #include <mod_common.h>
 #include <mod_custom.h>                 /* EvaluateCustomPromise(), Intialize/FinalizeCustomPromises() */
+#include <command_prefetch.h>         /* CommandPrefetchSection(), CommandPrefetchClear() */
 
 #ifdef HAVE_AVAHI_CLIENT_CLIENT_H
 #ifdef HAVE_AVAHI_COMMON_ADDRESS_H
@@ -152,6 +153,7 @@ static void FreeFixedStringArray(int size, char **array);
 static void CheckAgentAccess(const Rlist *list, const Policy *policy);
 static void KeepControlPromises(EvalContext *ctx, const Policy *policy, GenericAgentConfig *config);
 static PromiseResult KeepAgentPromise(EvalContext *ctx, const Promise *pp, void *param);
+static PromiseResult KeepAgentPromiseTracked(EvalContext *ctx, const Promise *pp, void *param);
 static void NewTypeContext(TypeSequence type);
 static void DeleteTypeContext(EvalContext *ctx, TypeSequence type);
 static PromiseResult ParallelFindAndVerifyFilesPromises(EvalContext *ctx, const Promise *pp);
@@ -329,6 +331,11 @@ int main(int argc, char *argv[])
     KeepPromises(ctx, policy, config);
     EvalContextProfilingEnd(ctx);
 
+    if (TIMING)
+    {
+        EvalContextLogClassExpressionCacheStats(ctx);
+    }
+
     if (EvalAborted(ctx))
     {
         ret = EC_EVAL_ABORTED;
@@ -345,6 +352,7 @@ int main(int argc, char *argv[])
 
     /* Update packages cache. */
     UpdatePackagesCache(ctx, false);
+    FinalizePackageModules();
 
     /* Finalize custom promises before waiting for background processes because
      * they can be background processes and need special handling. */
@@ -1385,6 +1393,23 @@ static void KeepControlPromises(EvalContext *ctx, const Policy *policy, GenericA
                 }
                 continue;
             }
+
+            if (StringEqual(cp->lval, CFA_CONTROLBODY[AGENT_CONTROL_LOCK_JOURNAL].lval))
+            {
+                const bool lock_journal = BooleanFromString(value);
+                Log(LOG_LEVEL_VERBOSE, "SET lock_journal %s", lock_journal ? "true" : "false");
+                LocksSetJournal(lock_journal);
+                continue;
+            }
+
+            if (StringEqual(cp->lval, CFA_CONTROLBODY[AGENT_CONTROL_SKIP_CONVERGED_PROMISES].lval))
+            {
+                const bool skip = BooleanFromString(value);
+                Log(LOG_LEVEL_VERBOSE, "SET skip_converged_promises %s", skip ? "true" : "false");
+                // Lets the later passes skip promises that already converged.
+                EvalContextPromiseInputsTrackingEnable(ctx, skip);
+                continue;
+            }
         }
     }
 
@@ -1601,11 +1626,101 @@ static void AllClassesReport(const EvalContext *ctx)
 PromiseResult ScheduleAgentOperations(EvalContext *ctx, const Bundle *bp)
 // NB - this function can be called recursively through "methods"
 {
+    /* With lock_journal, the last-run times of the promises of a top-level
+     * bundle are written when it is done. */
+    LocksJournalBegin();
+
+    PromiseResult result;
     if (EvalContextIsClassicOrder(ctx, bp))
     {
-        return ScheduleAgentOperationsNormalOrder(ctx, bp);
+        result = ScheduleAgentOperationsNormalOrder(ctx, bp);
+    }
+    else
+    {
+        result = ScheduleAgentOperationsTopDownOrder(ctx, bp);
+    }
+
+    LocksJournalEnd();
+    return result;
+}
+
+/**
+ * Records of the previous evaluations of the promises of a bundle, indexed
+ * by the position of the promise in the evaluation order of a pass.
+ */
+typedef struct
+{
+    PromiseInputs **records;
+    size_t size;
+    size_t skipped;
+} PassRecords;
+
+static void PassRecordsDestroy(PassRecords *records)
+{
+    for (size_t i = 0; i < records->size; i++)
+    {
+        PromiseInputsDestroy(records->records[i]);
+    }
+    free(records->records);
+}
+
+/**
+ * Evaluates the promise number #index of the pass, unless its previous
+ * evaluation found or took the locks of all its instances and nothing it
+ * read has changed since. In that case evaluating it again would only find
+ * the locks in the lock cache and do nothing.
+ */
+static PromiseResult EvaluateAgentPromise(EvalContext *ctx, const Promise *pp,
+                                          PassRecords *records, size_t index)
+{
+    if (index >= records->size)
+    {
+        size_t new_size = MAX(2 * records->size, index + 1);
+        records->records = xrealloc(records->records, new_size * sizeof(PromiseInputs *));
+        for (size_t i = records->size; i < new_size; i++)
+        {
+            records->records[i] = NULL;
+        }
+        records->size = new_size;
+    }
+
+    PromiseInputs *previous = records->records[index];
+    if (previous != NULL && !EvalContextPromiseInputsChanged(ctx, previous))
+    {
+        Log(LOG_LEVEL_DEBUG, "Skipping promise '%s', its inputs did not change since it was verified",
+            pp->promiser);
+        records->skipped++;
+        return PROMISE_RESULT_SKIPPED;
+    }
+
+    PromiseInputs *inputs = EvalContextPromiseInputsBegin(ctx);
+    PromiseResult result = ExpandPromise(ctx, pp, KeepAgentPromiseTracked, inputs);
+    EvalContextPromiseInputsEnd(ctx, inputs);
+
+    PromiseInputsDestroy(previous);
+    records->records[index] = NULL;
+    if (inputs != NULL)
+    {
+        if (PromiseInputsAreTracked(inputs) && PromiseInputsLockCount(inputs) > 0)
+        {
+            records->records[index] = inputs;
+        }
+        else
+        {
+            PromiseInputsDestroy(inputs);
+        }
+    }
+
+    return result;
+}
+
+static void NoteSkippedEvaluations(const Bundle *bp, const PassRecords *records)
+{
+    if (records->skipped > 0)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Skipped %zu evaluations of converged promises in bundle '%s'",
+            records->skipped, bp->name);
     }
-    return ScheduleAgentOperationsTopDownOrder(ctx, bp);
 }
 
 PromiseResult ScheduleAgentOperationsNormalOrder(EvalContext *ctx, const Bundle *bp)
@@ -1623,9 +1738,12 @@ PromiseResult ScheduleAgentOperationsNormalOrder(EvalContext *ctx, const Bundle
     }
 
     PromiseResult result = PROMISE_RESULT_SKIPPED;
+    PassRecords records = { NULL, 0, 0 };
 
     for (int pass = 1; pass < CF_DONEPASSES; pass++)
     {
+        size_t index = 0;
+
         // Evaluate built-in (non-custom) promise types, according to type sequence (normal order):
         for (TypeSequence type = 0; AGENT_TYPESEQUENCE[type] != NULL; type++)
         {
@@ -1640,6 +1758,7 @@ PromiseResult ScheduleAgentOperationsNormalOrder(EvalContext *ctx, const Bundle
 
             SpecialTypeBanner(type, pass);
             EvalContextStackPushBundleSectionFrame(ctx, sp);
+            CommandPrefetchSection(ctx, sp);
 
             for (size_t ppi = 0; ppi < SeqLength(sp->promises); ppi++)
             {
@@ -1647,18 +1766,21 @@ PromiseResult ScheduleAgentOperationsNormalOrder(EvalContext *ctx, const Bundle
 
                 EvalContextSetPass(ctx, pass);
 
-                PromiseResult promise_result = ExpandPromise(ctx, pp, KeepAgentPromise, NULL);
+                PromiseResult promise_result = EvaluateAgentPromise(ctx, pp, &records, index++);
                 result = PromiseResultUpdate(result, promise_result);
 
                 if (EvalAborted(ctx) || BundleAbort(ctx))
                 {
+                    CommandPrefetchClear(sp);
                     DeleteTypeContext(ctx, type);
                     EvalContextStackPopFrame(ctx);
                     NoteBundleCompliance(bp, save_pr_kept, save_pr_repaired, save_pr_notkept, start);
+                    PassRecordsDestroy(&records);
                     return result;
                 }
             }
 
+            CommandPrefetchClear(sp);
             DeleteTypeContext(ctx, type);
             EvalContextStackPopFrame(ctx);
 
@@ -1684,13 +1806,14 @@ PromiseResult ScheduleAgentOperationsNormalOrder(EvalContext *ctx, const Bundle
 
                 EvalContextSetPass(ctx, pass);
 
-                PromiseResult promise_result = ExpandPromise(ctx, pp, KeepAgentPromise, NULL);
+                PromiseResult promise_result = EvaluateAgentPromise(ctx, pp, &records, index++);
                 result = PromiseResultUpdate(result, promise_result);
 
                 if (EvalAborted(ctx) || BundleAbort(ctx))
                 {
                     EvalContextStackPopFrame(ctx);
                     NoteBundleCompliance(bp, save_pr_kept, save_pr_repaired, save_pr_notkept, start);
+                    PassRecordsDestroy(&records);
                     return result;
                 }
             }
@@ -1698,6 +1821,8 @@ PromiseResult ScheduleAgentOperationsNormalOrder(EvalContext *ctx, const Bundle
         }
     }
 
+    NoteSkippedEvaluations(bp, &records);
+    PassRecordsDestroy(&records);
     NoteBundleCompliance(bp, save_pr_kept, save_pr_repaired, save_pr_notkept, start);
     return result;
 }
@@ -1946,6 +2071,27 @@ static void LogVariableValue(const EvalContext *ctx, const Promise *pp)
     VarRefDestroy(ref);
 }
 
+/**
+ * KeepAgentPromise() for an evaluation recorded in #param, which is only
+ * worth keeping if every instance of the promise found or took its lock.
+ */
+static PromiseResult KeepAgentPromiseTracked(EvalContext *ctx, const Promise *pp, void *param)
+{
+    PromiseInputs *inputs = param;
+    if (inputs == NULL)
+    {
+        return KeepAgentPromise(ctx, pp, NULL);
+    }
+
+    const size_t locks = PromiseInputsLockCount(inputs);
+    PromiseResult result = KeepAgentPromise(ctx, pp, NULL);
+    if (PromiseInputsLockCount(inputs) == locks)
+    {
+        PromiseInputsSetUntracked(inputs);
+    }
+    return result;
+}
+
 static PromiseResult KeepAgentPromise(EvalContext *ctx, const Promise *pp, ARG_UNUSED void *param)
 {
     assert(param == NULL);
@@ -2192,6 +2338,7 @@ static void DeleteTypeContext(EvalContext *ctx, TypeSequence type)
     case TYPE_SEQUENCE_PACKAGES:
         ExecuteScheduledPackages(ctx);
         CleanScheduledPackages();
+        ExecuteScheduledPackageTransactions(ctx);
         break;
 
     default:
@@ -0,0 +1,499 @@
+/*
+  Copyright 2024 Northern.tech AS
+
+  This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; version 3.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#include <dir_walker.h>
+
+#include <alloc.h>
+#include <logging.h>
+#include <mutex.h>                                            /* ThreadLock */
+#include <sequence.h>
+#include <file_lib.h>                                         /* JoinPaths */
+#include <cf3.defs.h>                           /* CF_BUFSIZE, CF_RECURSION_LIMIT */
+
+
+/* Cap on listings read ahead and not handed out yet, so that a wide tree
+ * cannot get far ahead of the search. */
+#define DIR_WALKER_MAX_AHEAD 1024
+
+#if !defined(__MINGW32__) && HAVE_DECL_FSTATAT && HAVE_DECL_FDOPENDIR
+# define DIR_WALKER_SUPPORTED 1
+#endif
+
+#ifndef O_DIRECTORY
+# define O_DIRECTORY 0
+#endif
+#ifndef O_NOFOLLOW
+# define O_NOFOLLOW 0
+#endif
+
+typedef enum
+{
+    LISTING_QUEUED,
+    LISTING_RUNNING,
+    LISTING_READY,
+} ListingState;
+
+typedef struct
+{
+    char *name;
+    struct stat lsb;
+    int lstat_errno;                               /* 0 if lsb is valid */
+    DirListing *child;                             /* read ahead, or NULL */
+} DirListingEntry;
+
+struct DirListing_
+{
+    char *path;
+    int rlevel;
+    ListingState state;
+    bool abandoned;                    /* released while a worker reads it */
+    int error;                         /* errno of reading the directory */
+    dev_t dev;                         /* directory actually read */
+    ino_t ino;
+    DirListingEntry *entries;
+    size_t count;
+};
+
+struct DirWalker_
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work;                       /* queued, or stopping */
+    pthread_cond_t ready;                      /* some listing is read */
+    Seq *queue;                                /* LIFO of queued listings */
+    size_t ahead;                              /* read ahead, not handed out */
+    bool stopping;
+
+    pthread_t *threads;
+    size_t thread_count;
+
+    int max_level;
+    bool xdev;
+    dev_t rootdevice;
+
+    DirWalkerStats stats;
+};
+
+
+static DirListing *DirListingNew(const char *path, int rlevel)
+{
+    DirListing *listing = xcalloc(1, sizeof(DirListing));
+    listing->path = xstrdup(path);
+    listing->rlevel = rlevel;
+    return listing;
+}
+
+/**
+ * Fill @listing from the directory open on @fd, which is closed.
+ */
+static void ReadListing(DirListing *listing, int fd)
+{
+#ifdef DIR_WALKER_SUPPORTED
+    struct stat dsb;
+    if (fd == -1)
+    {
+        listing->error = errno;
+        return;
+    }
+    if (fstat(fd, &dsb) == -1)
+    {
+        listing->error = errno;
+        close(fd);
+        return;
+    }
+    listing->dev = dsb.st_dev;
+    listing->ino = dsb.st_ino;
+
+    DIR *dir = fdopendir(fd);
+    if (dir == NULL)
+    {
+        listing->error = errno;
+        close(fd);
+        return;
+    }
+
+    size_t capacity = 0;
+    const struct dirent *dirp;
+    while ((dirp = readdir(dir)) != NULL)
+    {
+        if (listing->count == capacity)
+        {
+            capacity = (capacity == 0) ? 32 : capacity * 2;
+            listing->entries = xrealloc(listing->entries,
+                                        capacity * sizeof(DirListingEntry));
+        }
+
+        DirListingEntry *entry = &listing->entries[listing->count++];
+        entry->name = xstrdup(dirp->d_name);
+        entry->child = NULL;
+        entry->lstat_errno = 0;
+        if (fstatat(dirfd(dir), dirp->d_name, &entry->lsb, AT_SYMLINK_NOFOLLOW) == -1)
+        {
+            entry->lstat_errno = errno;
+        }
+    }
+
+    closedir(dir);
+#else
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    listing->error = ENOSYS;
+#endif
+}
+
+static void QueueRemove(DirWalker *walker, const DirListing *listing)
+{
+    const size_t length = SeqLength(walker->queue);
+    for (size_t i = 0; i < length; i++)
+    {
+        if (SeqAt(walker->queue, i) == listing)
+        {
+            SeqRemove(walker->queue, i);
+            return;
+        }
+    }
+    assert(false);
+}
+
+/**
+ * Free @listing and everything read ahead below it.
+ *
+ * @note Called with walker->lock held.
+ */
+static void FreeListing(DirWalker *walker, DirListing *listing)
+{
+    for (size_t i = 0; i < listing->count; i++)
+    {
+        DirListing *child = listing->entries[i].child;
+        if (child != NULL)
+        {
+            walker->ahead--;
+            walker->stats.discarded++;
+            switch (child->state)
+            {
+            case LISTING_QUEUED:
+                QueueRemove(walker, child);
+                FreeListing(walker, child);
+                break;
+            case LISTING_RUNNING:
+                /* The worker frees it when done. */
+                child->abandoned = true;
+                break;
+            case LISTING_READY:
+                FreeListing(walker, child);
+                break;
+            }
+        }
+        free(listing->entries[i].name);
+    }
+
+    free(listing->entries);
+    free(listing->path);
+    free(listing);
+}
+
+/**
+ * Queue the subdirectories of @listing the search is going to enter,
+ * first ones on top.
+ *
+ * @note Called with walker->lock held.
+ */
+static void ScheduleChildren(DirWalker *walker, DirListing *listing)
+{
+    if (listing->error != 0 || listing->rlevel > walker->max_level ||
+        listing->rlevel >= CF_RECURSION_LIMIT)
+    {
+        return;
+    }
+
+    size_t last = 0;
+    char path[CF_BUFSIZE];
+    for (size_t i = 0; i < listing->count && walker->ahead < DIR_WALKER_MAX_AHEAD; i++)
+    {
+        DirListingEntry *entry = &listing->entries[i];
+        if (entry->lstat_errno != 0 || !S_ISDIR(entry->lsb.st_mode) ||
+            strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0 ||
+            (walker->xdev && entry->lsb.st_dev != walker->rootdevice))
+        {
+            continue;
+        }
+
+        size_t len = strlcpy(path, listing->path, sizeof(path));
+        if (len >= sizeof(path) || JoinPaths(path, sizeof(path), entry->name) == NULL)
+        {
+            continue;
+        }
+
+        entry->child = DirListingNew(path, listing->rlevel + 1);
+        walker->ahead++;
+        last = i + 1;
+    }
+
+    for (size_t i = last; i > 0; i--)
+    {
+        DirListing *child = listing->entries[i - 1].child;
+        if (child != NULL)
+        {
+            SeqAppend(walker->queue, child);
+        }
+    }
+
+    if (last > 0)
+    {
+        pthread_cond_broadcast(&walker->work);
+    }
+}
+
+static void *DirWalkerWorker(void *arg)
+{
+    DirWalker *walker = arg;
+
+    ThreadLock(&walker->lock);
+    while (!walker->stopping)
+    {
+        const size_t length = SeqLength(walker->queue);
+        if (length == 0)
+        {
+            pthread_cond_wait(&walker->work, &walker->lock);
+            continue;
+        }
+
+        DirListing *listing = SeqAt(walker->queue, length - 1);
+        SeqRemove(walker->queue, length - 1);
+        listing->state = LISTING_RUNNING;
+        ThreadUnlock(&walker->lock);
+
+        ReadListing(listing,
+                    open(listing->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW));
+
+        ThreadLock(&walker->lock);
+        if (listing->abandoned)
+        {
+            FreeListing(walker, listing);
+        }
+        else
+        {
+            listing->state = LISTING_READY;
+            ScheduleChildren(walker, listing);
+            pthread_cond_broadcast(&walker->ready);
+        }
+    }
+    ThreadUnlock(&walker->lock);
+
+    return NULL;
+}
+
+DirWalker *DirWalkerNew(size_t threads, int max_level, bool xdev, dev_t rootdevice)
+{
+#ifdef DIR_WALKER_SUPPORTED
+    assert(threads > 0);
+
+    DirWalker *walker = xcalloc(1, sizeof(DirWalker));
+    pthread_mutex_init(&walker->lock, NULL);
+    pthread_cond_init(&walker->work, NULL);
+    pthread_cond_init(&walker->ready, NULL);
+    walker->queue = SeqNew(64, NULL);
+    walker->max_level = max_level;
+    walker->xdev = xdev;
+    walker->rootdevice = rootdevice;
+
+    walker->threads = xcalloc(threads, sizeof(pthread_t));
+    for (size_t i = 0; i < threads; i++)
+    {
+        int ret = pthread_create(&walker->threads[i], NULL, DirWalkerWorker, walker);
+        if (ret != 0)
+        {
+            Log(LOG_LEVEL_VERBOSE,
+                "Could only start %zu of %zu directory read-ahead threads (pthread_create: %s)",
+                i, threads, GetErrorStrFromCode(ret));
+            break;
+        }
+        walker->thread_count++;
+    }
+
+    if (walker->thread_count == 0)
+    {
+        DirWalkerDestroy(walker);
+        return NULL;
+    }
+    return walker;
+#else
+    UNUSED(threads);
+    UNUSED(max_level);
+    UNUSED(xdev);
+    UNUSED(rootdevice);
+    return NULL;
+#endif
+}
+
+void DirWalkerDestroy(DirWalker *walker)
+{
+    if (walker == NULL)
+    {
+        return;
+    }
+
+    ThreadLock(&walker->lock);
+    walker->stopping = true;
+    pthread_cond_broadcast(&walker->work);
+    ThreadUnlock(&walker->lock);
+
+    for (size_t i = 0; i < walker->thread_count; i++)
+    {
+        pthread_join(walker->threads[i], NULL);
+    }
+
+    /* Everything queued hangs off listings the caller has released. */
+    assert(SeqLength(walker->queue) == 0);
+
+    SeqDestroy(walker->queue);
+    free(walker->threads);
+    pthread_cond_destroy(&walker->ready);
+    pthread_cond_destroy(&walker->work);
+    pthread_mutex_destroy(&walker->lock);
+    free(walker);
+}
+
+DirListing *DirWalkerList(DirWalker *walker, DirListing *parent, size_t index,
+                          const char *path, int rlevel, const struct stat *sb)
+{
+    assert(walker != NULL);
+    assert(parent == NULL || index < parent->count);
+
+    DirListing *listing = NULL;
+
+    ThreadLock(&walker->lock);
+    if (parent != NULL && parent->entries[index].child != NULL)
+    {
+        listing = parent->entries[index].child;
+        parent->entries[index].child = NULL;
+        walker->ahead--;
+
+        if (listing->state == LISTING_QUEUED)
+        {
+            /* Not started yet, cheaper to read it right here. */
+            QueueRemove(walker, listing);
+            FreeListing(walker, listing);
+            listing = NULL;
+        }
+        else
+        {
+            const bool waited = (listing->state != LISTING_READY);
+            while (listing->state != LISTING_READY)
+            {
+                pthread_cond_wait(&walker->ready, &walker->lock);
+            }
+
+            /* Replaced or unreadable since it was read: read what the
+             * search actually entered. */
+            if (listing->error != 0 ||
+                listing->dev != sb->st_dev || listing->ino != sb->st_ino)
+            {
+                walker->stats.discarded++;
+                FreeListing(walker, listing);
+                listing = NULL;
+            }
+            else if (waited)
+            {
+                walker->stats.waited++;
+            }
+            else
+            {
+                walker->stats.read_ahead++;
+            }
+        }
+    }
+    ThreadUnlock(&walker->lock);
+
+    if (listing != NULL)
+    {
+        return listing;
+    }
+
+    listing = DirListingNew(path, rlevel);
+    ReadListing(listing, open(".", O_RDONLY | O_DIRECTORY));
+
+    ThreadLock(&walker->lock);
+    walker->stats.read_inline++;
+    if (listing->error != 0)
+    {
+        errno = listing->error;
+        FreeListing(walker, listing);
+        listing = NULL;
+    }
+    else
+    {
+        ScheduleChildren(walker, listing);
+    }
+    ThreadUnlock(&walker->lock);
+
+    return listing;
+}
+
+void DirWalkerRelease(DirWalker *walker, DirListing *listing)
+{
+    assert(walker != NULL);
+    if (listing != NULL)
+    {
+        ThreadLock(&walker->lock);
+        FreeListing(walker, listing);
+        ThreadUnlock(&walker->lock);
+    }
+}
+
+void DirWalkerGetStats(const DirWalker *walker, DirWalkerStats *stats)
+{
+    assert(walker != NULL);
+    assert(stats != NULL);
+
+    ThreadLock((pthread_mutex_t *) &walker->lock);
+    *stats = walker->stats;
+    ThreadUnlock((pthread_mutex_t *) &walker->lock);
+}
+
+size_t DirListingCount(const DirListing *listing)
+{
+    assert(listing != NULL);
+    return listing->count;
+}
+
+const char *DirListingName(const DirListing *listing, size_t index)
+{
+    assert(listing != NULL && index < listing->count);
+    return listing->entries[index].name;
+}
+
+const struct stat *DirListingStat(const DirListing *listing, size_t index)
+{
+    assert(listing != NULL && index < listing->count);
+
+    const DirListingEntry *entry = &listing->entries[index];
+    if (entry->lstat_errno != 0)
+    {
+        errno = entry->lstat_errno;
+        return NULL;
+    }
+    return &entry->lsb;
+}
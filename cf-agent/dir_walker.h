@@ -0,0 +1,96 @@
+/*
+  Copyright 2024 Northern.tech AS
+
+  This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; version 3.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#ifndef CFENGINE_DIR_WALKER_H
+#define CFENGINE_DIR_WALKER_H
+
+
+#include <platform.h>
+
+
+/**
+ * Reads directories ahead of a depth search, on a pool of threads.
+ *
+ * The search itself stays on the calling thread. It asks for the listing
+ * of every directory it enters, in its own order, and gets the entries in
+ * the order the directory returned them, each with its lstat() result.
+ * Meanwhile the workers list the subdirectories found in every listing,
+ * first ones first, so that the listing is usually ready by the time the
+ * search gets there. Workers read with fdopendir() and fstatat() and never
+ * change the working directory.
+ *
+ * Read-ahead listings of subdirectories belong to their parent listing
+ * until they are handed out: releasing a listing also drops whatever was
+ * read ahead below it and never entered.
+ *
+ * @note Only the thread running the search may call these functions.
+ */
+typedef struct DirWalker_ DirWalker;
+typedef struct DirListing_ DirListing;
+
+typedef struct
+{
+    size_t read_ahead;          /* listings handed out ready */
+    size_t waited;              /* listings handed out after waiting */
+    size_t read_inline;         /* listings read by the caller */
+    size_t discarded;           /* read ahead, never entered or stale */
+} DirWalkerStats;
+
+/**
+ * @param threads number of worker threads
+ * @param max_level deepest recursion level whose subdirectories are read
+ *                  ahead (see DepthSearch())
+ * @param xdev if true, do not read ahead on devices other than @rootdevice
+ * @return NULL if directories cannot be read without chdir() here
+ */
+DirWalker *DirWalkerNew(size_t threads, int max_level, bool xdev, dev_t rootdevice);
+void DirWalkerDestroy(DirWalker *walker);
+
+/**
+ * Get the listing of the directory the caller has just changed into.
+ *
+ * @param parent listing the directory was found in (entry @index), or NULL
+ *               for the root of the search
+ * @param path full path of the directory
+ * @param sb stat of the directory, a read-ahead listing of another inode
+ *           is discarded and "." is read instead
+ * @return NULL and sets errno if the directory cannot be read
+ */
+DirListing *DirWalkerList(DirWalker *walker, DirListing *parent, size_t index,
+                          const char *path, int rlevel, const struct stat *sb);
+void DirWalkerRelease(DirWalker *walker, DirListing *listing);
+void DirWalkerGetStats(const DirWalker *walker, DirWalkerStats *stats);
+
+size_t DirListingCount(const DirListing *listing);
+const char *DirListingName(const DirListing *listing, size_t index);
+
+/**
+ * @return the lstat() result of entry @index, or NULL and sets errno if
+ *         lstat() failed
+ * @note Taken when the directory was read ahead, so it is only good for
+ *       deciding where to search. Take it again before acting on the file.
+ */
+const struct stat *DirListingStat(const DirListing *listing, size_t index);
+
+#endif
@@ -342,6 +342,72 @@ static bool OpenChangesDB(CF_DB **db)
     return true;
 }
 
+/*
+  A session keeps the changes database open for a whole files promise, so
+  that a depth search doesn't open and close it for every file. The writes
+  are committed every CHANGES_SESSION_BATCH operations instead of after
+  each one, which keeps the write transaction (and the lock it holds on
+  the database) short, but still spares most of the commits.
+*/
+#define CHANGES_SESSION_BATCH 1000
+
+/* cf-agent evaluates promises in a single thread. */
+static CF_DB *SESSION_DB = NULL;                                /* GLOBAL_X */
+static size_t SESSION_NESTING = 0;                              /* GLOBAL_X */
+static size_t SESSION_PENDING = 0;                              /* GLOBAL_X */
+
+bool FileChangesBeginSession(void)
+{
+    if (SESSION_NESTING == 0)
+    {
+        if (!OpenChangesDB(&SESSION_DB))
+        {
+            SESSION_DB = NULL;
+            return false;
+        }
+        SESSION_PENDING = 0;
+    }
+    SESSION_NESTING++;
+    return true;
+}
+
+void FileChangesEndSession(void)
+{
+    assert(SESSION_NESTING > 0);
+    if (SESSION_NESTING > 0 && --SESSION_NESTING == 0)
+    {
+        CloseDB(SESSION_DB);                                /* commits, too */
+        SESSION_DB = NULL;
+    }
+}
+
+/**
+ * Get the session's database handle if there is a session, or open the
+ * database. Release it with ReleaseChangesDB().
+ */
+static bool AcquireChangesDB(CF_DB **db)
+{
+    if (SESSION_DB != NULL)
+    {
+        *db = SESSION_DB;
+        return true;
+    }
+    return OpenChangesDB(db);
+}
+
+static void ReleaseChangesDB(CF_DB *db)
+{
+    if (db != SESSION_DB)
+    {
+        CloseDB(db);
+    }
+    else if (++SESSION_PENDING >= CHANGES_SESSION_BATCH)
+    {
+        CommitDB(db);
+        SESSION_PENDING = 0;
+    }
+}
+
 static void RemoveAllFileTraces(CF_DB *db, const char *path)
 {
     for (int c = 0; c < HASH_METHOD_NONE; c++)
@@ -397,14 +463,14 @@ static bool GetDirectoryListFromDatabase(CF_DB *db, const char *path, Seq *files
 bool FileChangesGetDirectoryList(const char *path, Seq *files)
 {
     CF_DB *db;
-    if (!OpenChangesDB(&db))
+    if (!AcquireChangesDB(&db))
     {
         Log(LOG_LEVEL_ERR, "Could not open changes database");
         return false;
     }
 
     bool result = GetDirectoryListFromDatabase(db, path, files);
-    CloseDB(db);
+    ReleaseChangesDB(db);
     return result;
 }
 
@@ -482,7 +548,7 @@ bool FileChangesCheckAndUpdateHash(EvalContext *ctx,
     bool ret = false;
     bool update = attr->change.update;
 
-    if (!OpenChangesDB(&dbp))
+    if (!AcquireChangesDB(&dbp))
     {
         RecordFailure(ctx, pp, attr, "Unable to open the hash database!");
         *result = PromiseResultUpdate(*result, PROMISE_RESULT_FAIL);
@@ -544,7 +610,7 @@ bool FileChangesCheckAndUpdateHash(EvalContext *ctx,
         ret = false;
     }
 
-    CloseDB(dbp);
+    ReleaseChangesDB(dbp);
     return ret;
 }
 
@@ -560,7 +626,7 @@ void FileChangesCheckAndUpdateDirectory(EvalContext *ctx, const Attributes *attr
                                         bool update, const Promise *pp, PromiseResult *result)
 {
     CF_DB *db;
-    if (!OpenChangesDB(&db))
+    if (!AcquireChangesDB(&db))
     {
         RecordFailure(ctx, pp, attr, "Could not open changes database");
         *result = PromiseResultUpdate(*result, PROMISE_RESULT_FAIL);
@@ -666,7 +732,7 @@ void FileChangesCheckAndUpdateDirectory(EvalContext *ctx, const Attributes *attr
     }
 
     SeqSoftDestroy(disk_file_set);
-    CloseDB(db);
+    ReleaseChangesDB(db);
 }
 
 void FileChangesCheckAndUpdateStats(EvalContext *ctx,
@@ -680,7 +746,7 @@ void FileChangesCheckAndUpdateStats(EvalContext *ctx,
     struct stat cmpsb;
     CF_DB *dbp;
 
-    if (!OpenChangesDB(&dbp))
+    if (!AcquireChangesDB(&dbp))
     {
         RecordFailure(ctx, pp, attr, "Could not open changes database");
         *result = PromiseResultUpdate(*result, PROMISE_RESULT_FAIL);
@@ -707,7 +773,7 @@ void FileChangesCheckAndUpdateStats(EvalContext *ctx,
             }
         }
 
-        CloseDB(dbp);
+        ReleaseChangesDB(dbp);
         return;
     }
 
@@ -719,7 +785,7 @@ void FileChangesCheckAndUpdateStats(EvalContext *ctx,
         && cmpsb.st_mtime == sb->st_mtime)
     {
         RecordNoChange(ctx, pp, attr, "No stat information change for '%s'", file);
-        CloseDB(dbp);
+        ReleaseChangesDB(dbp);
         return;
     }
 
@@ -886,7 +952,7 @@ void FileChangesCheckAndUpdateStats(EvalContext *ctx,
         }
     }
 
-    CloseDB(dbp);
+    ReleaseChangesDB(dbp);
 }
 
 static char FileStateToChar(FileState status)
@@ -35,6 +35,14 @@ typedef enum
     FILE_STATE_STATS_CHANGED
 } FileState;
 
+/**
+ * Keep the changes database open until the matching
+ * FileChangesEndSession(), for checking many files in a row. Sessions may
+ * be nested.
+ */
+bool FileChangesBeginSession(void);
+void FileChangesEndSession(void);
+
 bool FileChangesLogChange(const char *file, FileState status, char *msg, const Promise *pp);
 bool FileChangesCheckAndUpdateHash(EvalContext *ctx,
                                    const char *filename,
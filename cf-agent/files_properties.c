@@ -94,6 +94,23 @@ bool ConsiderLocalFile(const char *filename, const char *directory)
     }
 }
 
+/**
+ * Like ConsiderLocalFile(), for a file already lstat()-ed.
+ *
+ * @param lsb the lstat() result of @filename, or NULL if it failed
+ */
+bool ConsiderLocalFileStat(const char *filename, const char *directory,
+                           const struct stat *lsb)
+{
+    if (lsb == NULL)
+    {
+        return ConsiderFile(filename, directory, NULL);
+    }
+
+    struct stat stat = *lsb;
+    return ConsiderFile(filename, directory, &stat);
+}
+
 bool ConsiderAbstractFile(const char *filename, const char *directory, const FileCopy *fc, AgentConnection *conn)
 {
     /* First check if the file should be avoided, e.g. ".." - before sending
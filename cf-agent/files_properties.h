@@ -35,6 +35,8 @@ void AddFilenameToListOfSuspicious(const char *filename);
  * can be stat'ed at relative path (if it is a local file).
  */
 bool ConsiderLocalFile(const char *filename, const char *path);
+bool ConsiderLocalFileStat(const char *filename, const char *path,
+                           const struct stat *lsb);
 
 bool ConsiderAbstractFile(const char *nodename, const char *path, const FileCopy *fc, AgentConnection *conn);
 
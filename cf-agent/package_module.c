@@ -40,6 +40,12 @@
 #include <changes_chroot.h>     /* RecordPkgOperationInChroot() */
 #include <simulate_mode.h>      /* CHROOT_PKG_OPERATION_* */
 #include <csv_writer.h>         /* safely write csv entries */
+#include <map.h>
+#include <set.h>
+#include <vercmp_internal.h>    /* ComparePackageVersionsInternal() */
+#include <promises.h>           /* DeRefCopyPromise() */
+#include <attributes.h>         /* GetPackageAttributes() */
+#include <verify_new_packages.h> /* ReportNewPackagePromiseResult() */
 
 #define INVENTORY_LIST_BUFFER_SIZE 100 * 80 /* 100 entries with 80 characters
                                              * per line */
@@ -50,6 +56,544 @@ static bool UpdateSinglePackageModuleCache(EvalContext *ctx,
 static void GetPackageModuleExecInfo(const PackageModuleBody *package_module, char **exec_path,
                                      char **script_path, char **script_path_quoted, char **script_exec_opts);
 static int NegotiateSupportedAPIVersion(PackageModuleWrapper *wrapper);
+static char *PackageWrapperArgs(const PackageModuleWrapper *wrapper, const char *command);
+static void FreePackageInfo(PackageInfo *package_info);
+static PackageInfo *CopyPackageInfo(const PackageInfo *package_info);
+static char *ParseOptions(Rlist *options);
+
+/*
+ * Persistent package modules
+ *
+ * By default a package module is run once per request: the agent runs
+ * '<module> <command>', writes the request to its stdin, closes it and reads
+ * the response until the module exits. A package module body with
+ * 'persistent => "true"' is instead started once per agent run as
+ * '<module> persistent' and gets all the requests of the run on the same
+ * pipes, so that it can load the state of the package manager only once:
+ *
+ *   request:  Command=<command>, the request lines, an empty line
+ *   response: the response lines, an empty line
+ *
+ * A response line 'ExitCode=<n>' with a non-zero <n> reports the failure of
+ * the command, like the exit code of the module does for one-shot
+ * requests. The module gets EOF on its stdin at the end of the agent run and
+ * should exit then. It must not keep the package manager locked while
+ * waiting for the next request. Its installs and removals are batched, see
+ * the package transactions below.
+ *
+ * The session of a module also remembers the negotiated API version, so the
+ * one-shot modules are not asked about it for each promise either.
+ */
+
+struct PackageModuleSession_
+{
+    bool persistent;            /* whether #io is a running module */
+    IOData io;
+    pid_t owner;                /* the process that started the module */
+    int api_version;            /* -1 if not negotiated yet */
+};
+
+static void PackageModuleSessionDestroy_untyped(void *p)
+{
+    PackageModuleSession *session = p;
+    if (session != NULL)
+    {
+        if (session->persistent && session->owner == getpid())
+        {
+            cf_pclose_full_duplex(&(session->io));
+        }
+        free(session);
+    }
+}
+
+TYPED_MAP_DECLARE(PackageModuleSession, char *, PackageModuleSession *)
+
+TYPED_MAP_DEFINE(PackageModuleSession, char *, PackageModuleSession *,
+                 StringHash_untyped,
+                 StringEqual_untyped,
+                 free,
+                 PackageModuleSessionDestroy_untyped)
+
+/* module command -> PackageModuleSession */
+static PackageModuleSessionMap *PACKAGE_MODULE_SESSIONS = NULL;      /* GLOBAL_X */
+
+static void StopPersistentPackageModule(const PackageModuleWrapper *wrapper)
+{
+    PackageModuleSession *session = wrapper->session;
+    if (session->persistent)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Stopping persistent package module '%s'",
+            wrapper->name);
+        if (session->owner == getpid())
+        {
+            cf_pclose_full_duplex(&(session->io));
+        }
+        session->persistent = false;
+    }
+}
+
+static PackageModuleSession *GetPackageModuleSession(const PackageModuleWrapper *wrapper)
+{
+    if (PACKAGE_MODULE_SESSIONS == NULL)
+    {
+        PACKAGE_MODULE_SESSIONS = PackageModuleSessionMapNew();
+    }
+
+    char *args = PackageWrapperArgs(wrapper, "persistent");
+    char *command = StringFormat("%s %s", wrapper->path, args);
+    free(args);
+
+    PackageModuleSession *session =
+        PackageModuleSessionMapGet(PACKAGE_MODULE_SESSIONS, command);
+    if (session != NULL)
+    {
+        free(command);
+        return session;
+    }
+
+    session = xcalloc(1, sizeof(PackageModuleSession));
+    session->api_version = -1;
+    session->owner = getpid();
+
+    if (wrapper->package_module->persistent)
+    {
+        Log(LOG_LEVEL_VERBOSE,
+            "Starting persistent package module '%s' with command '%s'",
+            wrapper->name, command);
+        session->io = cf_popen_full_duplex(command, false, true);
+        if (session->io.write_fd == -1 || session->io.read_fd == -1)
+        {
+            Log(LOG_LEVEL_ERR,
+                "Failed to start persistent package module '%s',"
+                " running it for each request instead", wrapper->name);
+        }
+        else
+        {
+            session->persistent = true;
+        }
+    }
+
+    PackageModuleSessionMapInsert(PACKAGE_MODULE_SESSIONS, command, session);
+    return session;
+}
+
+/* Whether the requests of #wrapper go to a module running in this process. */
+static bool PackageModuleIsRunning(const PackageModuleWrapper *wrapper)
+{
+    return (wrapper->session != NULL && wrapper->session->persistent &&
+            wrapper->session->owner == getpid());
+}
+
+/*
+ * Package transactions
+ *
+ * The installs and removals of the packages promises using a persistent
+ * module are not run when the promise is evaluated. Like the bulk operations
+ * of the old packages promises, they are collected until the end of the
+ * packages promises of the bundle and then sent as one request per module,
+ * command and options, so that the package manager resolves the dependencies
+ * of them all at once.
+ *
+ * The response of the module does not tell which package failed, so the
+ * outcome of each promise is told from the installed packages cache,
+ * refreshed after the request, and reported then, classes included. Promises
+ * later in the same bundle do not see these classes yet.
+ */
+
+typedef struct
+{
+    Promise *pp;                /* copy, the outcome is reported on it */
+    NewPackageAction action;
+    PromiseResult result;       /* of the parts of the promise already done */
+    Seq *packages;              /* PackageInfo to look up in the cache */
+} PackageTransactionItem;
+
+typedef struct
+{
+    PackageModuleBody *module;
+    char *command;
+    Rlist *options;
+    char *options_str;
+    Buffer *request;            /* the package lines of all the items */
+    Seq *items;
+} PackageTransaction;
+
+static void PackageTransactionItemDestroy(void *p)
+{
+    PackageTransactionItem *item = p;
+    if (item != NULL)
+    {
+        PromiseDestroy(item->pp);
+        SeqDestroy(item->packages);
+        free(item);
+    }
+}
+
+static void PackageTransactionDestroy(void *p)
+{
+    PackageTransaction *transaction = p;
+    if (transaction != NULL)
+    {
+        free(transaction->command);
+        RlistDestroy(transaction->options);
+        free(transaction->options_str);
+        BufferDestroy(transaction->request);
+        SeqDestroy(transaction->items);
+        free(transaction);
+    }
+}
+
+/* PackageTransaction, in the order they were started */
+static Seq *PACKAGE_TRANSACTIONS = NULL;                             /* GLOBAL_X */
+
+/* Whether the installs and removals of #wrapper are scheduled. */
+static bool PackageOperationsScheduled(const PackageModuleWrapper *wrapper)
+{
+    return PackageModuleIsRunning(wrapper);
+}
+
+/**
+ * Add an operation of #pp to the transaction of its module, command and
+ * options.
+ *
+ * @param packages the package lines of the request
+ * @param to_check the PackageInfo to look up in the installed packages cache
+ *                 after the transaction, copied
+ * @param result the result of the rest of the promise
+ */
+static void SchedulePackageOperation(EvalContext *ctx, const Promise *pp,
+                                     const PackageModuleWrapper *wrapper,
+                                     const char *command, Rlist *options,
+                                     const char *packages, const Seq *to_check,
+                                     NewPackageAction action, PromiseResult result)
+{
+    assert(PackageOperationsScheduled(wrapper));
+
+    if (PACKAGE_TRANSACTIONS == NULL)
+    {
+        PACKAGE_TRANSACTIONS = SeqNew(1, PackageTransactionDestroy);
+    }
+
+    char *options_str = ParseOptions(options);
+    PackageTransaction *transaction = NULL;
+    for (size_t i = 0; i < SeqLength(PACKAGE_TRANSACTIONS); i++)
+    {
+        PackageTransaction *candidate = SeqAt(PACKAGE_TRANSACTIONS, i);
+        if (StringEqual(candidate->module->name, wrapper->package_module->name) &&
+            StringEqual(candidate->command, command) &&
+            StringEqual(candidate->options_str, options_str))
+        {
+            transaction = candidate;
+            break;
+        }
+    }
+
+    if (transaction == NULL)
+    {
+        transaction = xcalloc(1, sizeof(PackageTransaction));
+        transaction->module = wrapper->package_module;
+        transaction->command = xstrdup(command);
+        transaction->options = RlistCopy(options);
+        transaction->options_str = options_str;
+        transaction->request = BufferNew();
+        transaction->items = SeqNew(1, PackageTransactionItemDestroy);
+        SeqAppend(PACKAGE_TRANSACTIONS, transaction);
+    }
+    else
+    {
+        free(options_str);
+    }
+
+    PackageTransactionItem *item = xcalloc(1, sizeof(PackageTransactionItem));
+    item->pp = DeRefCopyPromise(ctx, pp);
+    item->action = action;
+    item->result = result;
+    item->packages = SeqNew(SeqLength(to_check), FreePackageInfo);
+    for (size_t i = 0; i < SeqLength(to_check); i++)
+    {
+        SeqAppend(item->packages, CopyPackageInfo(SeqAt(to_check, i)));
+    }
+    SeqAppend(transaction->items, item);
+
+    BufferAppendString(transaction->request, packages);
+
+    Log(LOG_LEVEL_VERBOSE,
+        "Scheduled '%s' of package(s) for promise '%s' with package module '%s'",
+        command, pp->promiser, wrapper->name);
+}
+
+/* Same as SchedulePackageOperation(), for a single package. */
+static void SchedulePackageOperationSingle(EvalContext *ctx, const Promise *pp,
+                                           const PackageModuleWrapper *wrapper,
+                                           const char *command, Rlist *options,
+                                           const char *packages,
+                                           const PackageInfo *to_check,
+                                           NewPackageAction action)
+{
+    Seq *to_check_seq = SeqNew(1, NULL);
+    SeqAppend(to_check_seq, (void *) to_check);
+    SchedulePackageOperation(ctx, pp, wrapper, command, options, packages,
+                             to_check_seq, action, PROMISE_RESULT_NOOP);
+    SeqDestroy(to_check_seq);
+}
+
+/*
+ * In-memory index of the package caches
+ *
+ * The installed packages and available updates caches of a package module
+ * are loaded from their databases the first time they are needed in the
+ * agent run, instead of opening the database for every lookup, and
+ * UpdatePackagesDB() replaces them together with the databases.
+ */
+
+static void PackageUpdatesDestroy_untyped(void *p)
+{
+    SeqDestroy(p);
+}
+
+TYPED_MAP_DECLARE(PackageUpdates, char *, Seq *)
+
+TYPED_MAP_DEFINE(PackageUpdates, char *, Seq *,
+                 StringHash_untyped,
+                 StringEqual_untyped,
+                 free,
+                 PackageUpdatesDestroy_untyped)
+
+typedef struct
+{
+    /* The keys of the installed packages cache: N<name>, N<name>V<version>,
+     * N<name>A<arch> and N<name>V<version>A<arch>. NULL if not loaded. */
+    StringSet *installed;
+    /* name -> PackageInfo of its updates, newest version first. NULL if not
+     * loaded. */
+    PackageUpdatesMap *updates;
+} PackageInventory;
+
+static void PackageInventoryDestroy_untyped(void *p)
+{
+    PackageInventory *inventory = p;
+    if (inventory != NULL)
+    {
+        StringSetDestroy(inventory->installed);
+        PackageUpdatesMapDestroy(inventory->updates);
+        free(inventory);
+    }
+}
+
+TYPED_MAP_DECLARE(PackageInventory, char *, PackageInventory *)
+
+TYPED_MAP_DEFINE(PackageInventory, char *, PackageInventory *,
+                 StringHash_untyped,
+                 StringEqual_untyped,
+                 free,
+                 PackageInventoryDestroy_untyped)
+
+/* package module name -> PackageInventory */
+static PackageInventoryMap *PACKAGE_INVENTORIES = NULL;              /* GLOBAL_X */
+
+static PackageInventory *GetPackageInventory(const char *pm_name)
+{
+    if (PACKAGE_INVENTORIES == NULL)
+    {
+        PACKAGE_INVENTORIES = PackageInventoryMapNew();
+    }
+
+    PackageInventory *inventory = PackageInventoryMapGet(PACKAGE_INVENTORIES, pm_name);
+    if (inventory == NULL)
+    {
+        inventory = xcalloc(1, sizeof(PackageInventory));
+        PackageInventoryMapInsert(PACKAGE_INVENTORIES, xstrdup(pm_name), inventory);
+    }
+    return inventory;
+}
+
+static void PackageInventoryAddInstalled(StringSet *installed, const char *name,
+                                         const char *ver, const char *arch)
+{
+    StringSetAdd(installed, StringFormat("N<%s>", name));
+    StringSetAdd(installed, StringFormat("N<%s>V<%s>", name, ver));
+    StringSetAdd(installed, StringFormat("N<%s>A<%s>", name, arch));
+    StringSetAdd(installed, StringFormat("N<%s>V<%s>A<%s>", name, ver, arch));
+}
+
+static void PackageInventoryAddUpdate(PackageUpdatesMap *updates, const char *name,
+                                      const char *ver, const char *arch)
+{
+    Seq *versions = PackageUpdatesMapGet(updates, name);
+    if (versions == NULL)
+    {
+        versions = SeqNew(3, FreePackageInfo);
+        PackageUpdatesMapInsert(updates, xstrdup(name), versions);
+    }
+
+    PackageInfo *package = xcalloc(1, sizeof(PackageInfo));
+    package->name = xstrdup(name);
+    package->version = xstrdup(ver);
+    package->arch = xstrdup(arch);
+    package->type = PACKAGE_TYPE_REPO;
+    SeqAppend(versions, package);
+}
+
+/* Newest version first. Versions of incompatible formats are ordered by
+ * strcmp(), so that the order is still deterministic. */
+static int ComparePackageUpdates(const void *a, const void *b,
+                                 ARG_UNUSED void *user_data)
+{
+    const PackageInfo *package_a = a;
+    const PackageInfo *package_b = b;
+
+    if (StringEqual(package_a->version, package_b->version))
+    {
+        return 0;
+    }
+
+    VersionCmpResult newer =
+        ComparePackageVersionsInternal(package_a->version, package_b->version,
+                                       PACKAGE_VERSION_COMPARATOR_GT);
+    if (newer == VERCMP_ERROR)
+    {
+        return strcmp(package_b->version, package_a->version);
+    }
+    return (newer == VERCMP_MATCH) ? -1 : 1;
+}
+
+static void SortPackageUpdates(PackageUpdatesMap *updates)
+{
+    MapIterator it = MapIteratorInit(updates->impl);
+    MapKeyValue *item;
+    while ((item = MapIteratorNext(&it)) != NULL)
+    {
+        SeqSort(item->value, ComparePackageUpdates, NULL);
+    }
+}
+
+/* Parse the "V<version>A<arch>" lines of an entry of the updates cache. */
+static void PackageInventoryAddUpdatesEntry(PackageUpdatesMap *updates, const char *name,
+                                            const char *entry, size_t entry_size)
+{
+    char *lines = xstrndup(entry, entry_size);
+    Seq *packages = SeqStringFromString(lines, '\n');
+    free(lines);
+
+    for (size_t i = 0; i < SeqLength(packages); i++)
+    {
+        const char *package_line = SeqAt(packages, i);
+        char version[strlen(package_line) + 1];
+        char arch[strlen(package_line) + 1];
+
+        if (sscanf(package_line, "V<%[^>]>A<%[^>]>", version, arch) == 2)
+        {
+            PackageInventoryAddUpdate(updates, name, version, arch);
+        }
+        else
+        {
+            Log(LOG_LEVEL_INFO,
+                "Unable to parse available updates line: %s", package_line);
+        }
+    }
+    SeqDestroy(packages);
+}
+
+static bool LoadPackageInventory(PackageInventory *inventory, const char *pm_name,
+                                 UpdateType type)
+{
+    const bool installed = (type == UPDATE_TYPE_INSTALLED);
+    dbid db_id = installed ? dbid_packages_installed : dbid_packages_updates;
+
+    CF_DB *db_cached;
+    if (!OpenSubDB(&db_cached, db_id, pm_name))
+    {
+        Log(LOG_LEVEL_INFO, "Can not open cache database.");
+        return false;
+    }
+
+    CF_DBC *cursor;
+    if (!NewDBCursor(db_cached, &cursor))
+    {
+        Log(LOG_LEVEL_INFO, "Can not read cache database.");
+        CloseDB(db_cached);
+        return false;
+    }
+
+    StringSet *installed_keys = installed ? StringSetNew() : NULL;
+    PackageUpdatesMap *updates = installed ? NULL : PackageUpdatesMapNew();
+
+    char *key;
+    int key_size;
+    void *value;
+    int value_size;
+    while (NextDB(cursor, &key, &key_size, &value, &value_size))
+    {
+        if (StringEqual(key, "<inventory>"))
+        {
+            continue;
+        }
+
+        if (installed)
+        {
+            /* Just make sure DB is not corrupted. */
+            if (value_size >= 1 && ((const char *) value)[0] == '1')
+            {
+                StringSetAdd(installed_keys, xstrdup(key));
+            }
+            else
+            {
+                Log(LOG_LEVEL_INFO,
+                    "Seem to have corrupted data in cache database for key '%s'", key);
+            }
+        }
+        else
+        {
+            char name[key_size + 1];
+            if (sscanf(key, "N<%[^>]>", name) == 1)
+            {
+                PackageInventoryAddUpdatesEntry(updates, name, value, value_size);
+            }
+        }
+    }
+
+    DeleteDBCursor(cursor);
+    CloseDB(db_cached);
+
+    if (installed)
+    {
+        StringSetDestroy(inventory->installed);
+        inventory->installed = installed_keys;
+    }
+    else
+    {
+        SortPackageUpdates(updates);
+        PackageUpdatesMapDestroy(inventory->updates);
+        inventory->updates = updates;
+    }
+
+    Log(LOG_LEVEL_DEBUG, "Loaded %s packages cache of package module '%s'",
+        installed ? "installed" : "updates", pm_name);
+    return true;
+}
+
+static PackageInventory *GetLoadedPackageInventory(const char *pm_name, UpdateType type)
+{
+    PackageInventory *inventory = GetPackageInventory(pm_name);
+    const bool loaded = (type == UPDATE_TYPE_INSTALLED) ?
+        (inventory->installed != NULL) : (inventory->updates != NULL);
+
+    if (!loaded && !LoadPackageInventory(inventory, pm_name, type))
+    {
+        return NULL;
+    }
+    return inventory;
+}
+
+void FinalizePackageModules(void)
+{
+    SeqDestroy(PACKAGE_TRANSACTIONS);
+    PACKAGE_TRANSACTIONS = NULL;
+    PackageModuleSessionMapDestroy(PACKAGE_MODULE_SESSIONS);
+    PACKAGE_MODULE_SESSIONS = NULL;
+    PackageInventoryMapDestroy(PACKAGE_INVENTORIES);
+    PACKAGE_INVENTORIES = NULL;
+}
 
 
 void DeletePackageModuleWrapper(PackageModuleWrapper *wrapper)
@@ -76,6 +620,7 @@ PackageModuleWrapper *NewPackageModuleWrapper(PackageModuleBody *package_module)
                              &(wrapper->script_exec_opts));
     wrapper->name = SafeStringDuplicate(package_module->name);
     wrapper->package_module = package_module;
+    wrapper->session = NULL;
 
     if (wrapper->path == NULL)
     {
@@ -121,8 +666,14 @@ PackageModuleWrapper *NewPackageModuleWrapper(PackageModuleBody *package_module)
         return NULL;
     }
 
-    /* Negotiate API version */
-    wrapper->supported_api_version = NegotiateSupportedAPIVersion(wrapper);
+    wrapper->session = GetPackageModuleSession(wrapper);
+
+    /* Negotiate API version, once per agent run */
+    if (wrapper->session->api_version == -1)
+    {
+        wrapper->session->api_version = NegotiateSupportedAPIVersion(wrapper);
+    }
+    wrapper->supported_api_version = wrapper->session->api_version;
     if (wrapper->supported_api_version != 1)
     {
         Log(LOG_LEVEL_ERR,
@@ -139,25 +690,103 @@ PackageModuleWrapper *NewPackageModuleWrapper(PackageModuleBody *package_module)
     return wrapper;
 }
 
-static int PackageWrapperCommunicate(const PackageModuleWrapper *wrapper, const char *args,
-                                     const char *request, Rlist **response)
+/* The arguments for running the module with #command, including the
+ * script and its interpreter options if the module is a script. */
+static char *PackageWrapperArgs(const PackageModuleWrapper *wrapper, const char *command)
 {
-    char *all_args = NULL;
-    if (wrapper->script_path != NULL)
+    if (wrapper->script_path == NULL)
+    {
+        return xstrdup(command);
+    }
+    else if (wrapper->script_exec_opts == NULL)
+    {
+        return StringConcatenate(3, wrapper->script_path_quoted, " ", command);
+    }
+    else
+    {
+        return StringConcatenate(5, wrapper->script_exec_opts, " ",
+                                 wrapper->script_path_quoted, " ", command);
+    }
+}
+
+/* Send the request to the persistent module of the wrapper.
+ * @return 0 on success, -1 on failure, -2 if the module did not get it */
+static int PersistentPackageWrapperCommunicate(const PackageModuleWrapper *wrapper,
+                                               const char *command,
+                                               const char *request, Rlist **response)
+{
+    PackageModuleSession *session = wrapper->session;
+
+    const size_t request_len = strlen(request);
+    const bool add_newline = (request_len > 0 && request[request_len - 1] != '\n');
+    char *message = StringFormat("Command=%s\n%s%s\n", command, request,
+                                 add_newline ? "\n" : "");
+    const size_t message_len = strlen(message);
+    const ssize_t written = FullWrite(session->io.write_fd, message, message_len);
+    free(message);
+
+    if (written < 0 || (size_t) written != message_len)
     {
-        if (wrapper->script_exec_opts == NULL)
+        Log(LOG_LEVEL_VERBOSE,
+            "Failed to send request to persistent package module '%s': %s",
+            wrapper->name, GetErrorStr());
+        StopPersistentPackageModule(wrapper);
+        return -2;
+    }
+
+    Rlist *res = NULL;
+    if (!PipeReadMessage(&(session->io), PACKAGE_PROMISE_SCRIPT_TIMEOUT_SEC,
+                         PACKAGE_PROMISE_TERMINATION_CHECK_SEC, &res))
+    {
+        Log(LOG_LEVEL_ERR,
+            "Failed to read response to '%s' from persistent package module '%s'",
+            command, wrapper->name);
+        StopPersistentPackageModule(wrapper);
+        return -1;
+    }
+
+    int exit_code = 0;
+    Rlist *rp = res;
+    while (rp != NULL)
+    {
+        Rlist *next = rp->next;
+        const char *line = RlistScalarValue(rp);
+        if (StringStartsWith(line, "ExitCode="))
         {
-            all_args = StringConcatenate(3, wrapper->script_path_quoted, " ", args);
-            args = all_args;
+            exit_code = atoi(line + strlen("ExitCode="));
+            RlistDestroyEntry(&res, rp);
         }
-        else
+        rp = next;
+    }
+
+    if (exit_code != 0)
+    {
+        Log(LOG_LEVEL_VERBOSE,
+            "Persistent package module '%s' failed '%s' with code: %d",
+            wrapper->name, command, exit_code);
+        RlistDestroy(res);
+        return -1;
+    }
+
+    *response = res;
+    return 0;
+}
+
+static int PackageWrapperCommunicate(const PackageModuleWrapper *wrapper, const char *args,
+                                     const char *request, Rlist **response)
+{
+    if (PackageModuleIsRunning(wrapper))
+    {
+        int ret = PersistentPackageWrapperCommunicate(wrapper, args, request, response);
+        if (ret != -2)
         {
-            all_args = StringConcatenate(5, wrapper->script_exec_opts, " ",
-                                         wrapper->script_path_quoted, " ", args);
-            args = all_args;
+            return ret;
         }
+        /* The module is gone, run it for this request as usual. */
     }
-    int ret = PipeReadWriteData(wrapper->path, args, request, response,
+
+    char *all_args = PackageWrapperArgs(wrapper, args);
+    int ret = PipeReadWriteData(wrapper->path, all_args, request, response,
                                 PACKAGE_PROMISE_SCRIPT_TIMEOUT_SEC,
                                 PACKAGE_PROMISE_TERMINATION_CHECK_SEC);
     free(all_args);
@@ -278,6 +907,16 @@ static void FreePackageInfo(PackageInfo *package_info)
     }
 }
 
+static PackageInfo *CopyPackageInfo(const PackageInfo *package_info)
+{
+    PackageInfo *copy = xcalloc(1, sizeof(PackageInfo));
+    copy->name = SafeStringDuplicate(package_info->name);
+    copy->version = SafeStringDuplicate(package_info->version);
+    copy->arch = SafeStringDuplicate(package_info->arch);
+    copy->type = package_info->type;
+    return copy;
+}
+
 static char *ParseOptions(Rlist *options)
 {
     if (RlistIsNullList(options))
@@ -545,11 +1184,11 @@ static int IsPackageInCache(EvalContext *ctx,
         }
     }
 
-    CF_DB *db_cached;
-    if (!OpenSubDB(&db_cached, dbid_packages_installed,
-                   module_wrapper->package_module->name))
+    const PackageInventory *inventory =
+        GetLoadedPackageInventory(module_wrapper->package_module->name,
+                                  UPDATE_TYPE_INSTALLED);
+    if (inventory == NULL)
     {
-        Log(LOG_LEVEL_INFO, "Can not open cache database.");
         return -1;
     }
 
@@ -571,31 +1210,14 @@ static int IsPackageInCache(EvalContext *ctx,
          key = StringFormat("N<%s>", name);
     }
 
-    int is_in_cache = 0;
-    char buff[1];
-
     Log(LOG_LEVEL_DEBUG, "Looking for key in installed packages cache: %s", key);
 
-    if (ReadDB(db_cached, key, buff, 1))
-    {
-        /* Just make sure DB is not corrupted. */
-        if (buff[0] == '1')
-        {
-            is_in_cache = 1;
-        }
-        else
-        {
-            Log(LOG_LEVEL_INFO,
-                "Seem to have corrupted data in cache database");
-            is_in_cache = -1;
-        }
-    }
+    int is_in_cache = StringSetContains(inventory->installed, key) ? 1 : 0;
+    free(key);
 
     Log(LOG_LEVEL_DEBUG,
         "Looking for package %s in cache returned: %d", name, is_in_cache);
 
-    CloseDB(db_cached);
-
     return is_in_cache;
 }
 
@@ -646,6 +1268,19 @@ void WritePackageDataToDB(CF_DB *db_installed,
     }
 }
 
+static void AddPackageDataToIndex(StringSet *installed, PackageUpdatesMap *updates,
+                                  const char *name, const char *ver, const char *arch)
+{
+    if (installed != NULL)
+    {
+        PackageInventoryAddInstalled(installed, name, ver, arch);
+    }
+    else
+    {
+        PackageInventoryAddUpdate(updates, name, ver, arch);
+    }
+}
+
 int UpdatePackagesDB(Rlist *data, const char *pm_name, UpdateType type)
 {
     assert(pm_name);
@@ -655,10 +1290,23 @@ int UpdatePackagesDB(Rlist *data, const char *pm_name, UpdateType type)
     CF_DB *db_cached;
     dbid db_id = type == UPDATE_TYPE_INSTALLED ? dbid_packages_installed :
                                                  dbid_packages_updates;
+    PackageInventory *inventory = GetPackageInventory(pm_name);
     if (OpenSubDB(&db_cached, db_id, pm_name))
     {
         CleanDB(db_cached);
 
+        /* The in-memory index gets the same contents as the database. */
+        StringSet *installed = NULL;
+        PackageUpdatesMap *updates = NULL;
+        if (type == UPDATE_TYPE_INSTALLED)
+        {
+            installed = StringSetNew();
+        }
+        else
+        {
+            updates = PackageUpdatesMapNew();
+        }
+
         Writer *idw = StringWriter();
         CsvWriter *idcw = CsvWriterOpen(idw);
 
@@ -677,6 +1325,8 @@ int UpdatePackagesDB(Rlist *data, const char *pm_name, UpdateType type)
                         WritePackageDataToDB(db_cached, package_data[0],
                                              package_data[1], package_data[2],
                                              type);
+                        AddPackageDataToIndex(installed, updates, package_data[0],
+                                              package_data[1], package_data[2]);
 
                         CsvWriterField(idcw, package_data[0]);
                         CsvWriterField(idcw, package_data[1]);
@@ -728,6 +1378,8 @@ int UpdatePackagesDB(Rlist *data, const char *pm_name, UpdateType type)
         {
             WritePackageDataToDB(db_cached, package_data[0],
                              package_data[1], package_data[2], type);
+            AddPackageDataToIndex(installed, updates, package_data[0],
+                                  package_data[1], package_data[2]);
 
             CsvWriterField(idcw, package_data[0]);
             CsvWriterField(idcw, package_data[1]);
@@ -766,9 +1418,33 @@ int UpdatePackagesDB(Rlist *data, const char *pm_name, UpdateType type)
         }
 
         CloseDB(db_cached);
+
+        if (type == UPDATE_TYPE_INSTALLED)
+        {
+            StringSetDestroy(inventory->installed);
+            inventory->installed = installed;
+        }
+        else
+        {
+            SortPackageUpdates(updates);
+            PackageUpdatesMapDestroy(inventory->updates);
+            inventory->updates = updates;
+        }
+
         return have_error ? -1 : 0;
     }
-    /* Unable to open database. */
+
+    /* Unable to open database, don't use the index either. */
+    if (type == UPDATE_TYPE_INSTALLED)
+    {
+        StringSetDestroy(inventory->installed);
+        inventory->installed = NULL;
+    }
+    else
+    {
+        PackageUpdatesMapDestroy(inventory->updates);
+        inventory->updates = NULL;
+    }
     return -1;
 }
 
@@ -826,6 +1502,33 @@ bool UpdateCache(Rlist* options, const PackageModuleWrapper *wrapper,
 }
 
 
+/* The result of installing or removing #package_info, as told by the
+ * installed packages cache. */
+static PromiseResult PackageChangeResult(const PackageModuleWrapper *wrapper,
+                                         const PackageInfo *package_info,
+                                         NewPackageAction action_type)
+{
+    int is_in_cache = IsPackageInCache(NULL, wrapper, package_info->name,
+                                       package_info->version,
+                                       package_info->arch);
+    if (is_in_cache == 1)
+    {
+        return action_type == NEW_PACKAGE_ACTION_PRESENT ?
+            PROMISE_RESULT_CHANGE : PROMISE_RESULT_FAIL;
+    }
+    else if (is_in_cache == 0)
+    {
+        return action_type == NEW_PACKAGE_ACTION_PRESENT ?
+            PROMISE_RESULT_FAIL : PROMISE_RESULT_CHANGE;
+    }
+    else
+    {
+        Log(LOG_LEVEL_INFO,
+            "Some error occurred while reading installed packages cache.");
+        return PROMISE_RESULT_FAIL;
+    }
+}
+
 PromiseResult ValidateChangedPackage(const NewPackages *policy_data,
                                      const PackageModuleWrapper *wrapper,
                                      const PackageInfo *package_info,
@@ -851,25 +1554,7 @@ PromiseResult ValidateChangedPackage(const NewPackages *policy_data,
         return PROMISE_RESULT_FAIL;
     }
 
-    int is_in_cache = IsPackageInCache(NULL, wrapper, package_info->name,
-                                       package_info->version,
-                                       package_info->arch);
-    if (is_in_cache == 1)
-    {
-        return action_type == NEW_PACKAGE_ACTION_PRESENT ?
-            PROMISE_RESULT_CHANGE : PROMISE_RESULT_FAIL;
-    }
-    else if (is_in_cache == 0)
-    {
-        return action_type == NEW_PACKAGE_ACTION_PRESENT ?
-            PROMISE_RESULT_FAIL : PROMISE_RESULT_CHANGE;
-    }
-    else
-    {
-        Log(LOG_LEVEL_INFO,
-            "Some error occurred while reading installed packages cache.");
-        return PROMISE_RESULT_FAIL;
-    }
+    return PackageChangeResult(wrapper, package_info, action_type);
 }
 
 PromiseResult RemovePackage(const char *name, Rlist* options,
@@ -914,6 +1599,23 @@ PromiseResult RemovePackage(const char *name, Rlist* options,
 }
 
 
+/* The lines of a package in a request, #key being "Name" or "File". */
+static char *PackageRequestLines(const char *key, const char *name,
+                                 const char *version, const char *architecture)
+{
+    Buffer *lines = BufferNew();
+    BufferAppendF(lines, "%s=%s\n", key, name);
+    if (version != NULL)
+    {
+        BufferAppendF(lines, "Version=%s\n", version);
+    }
+    if (architecture != NULL)
+    {
+        BufferAppendF(lines, "Architecture=%s\n", architecture);
+    }
+    return BufferClose(lines);
+}
+
 static PromiseResult InstallPackageGeneric(Rlist *options,
         PackageType type, const char *packages_list_formatted,
         const PackageModuleWrapper *wrapper)
@@ -1047,6 +1749,15 @@ static PromiseResult FileInstallPackage(EvalContext *ctx,
             RecordPkgOperationInChroot(CHROOT_PKG_OPERATION_INSTALL, package_file_path, NULL, NULL);
             return PROMISE_RESULT_CHANGE;
         }
+        if (PackageOperationsScheduled(wrapper))
+        {
+            char *packages = PackageRequestLines("File", package_file_path, NULL, NULL);
+            SchedulePackageOperationSingle(ctx, pp, wrapper, "file-install",
+                                           policy_data->package_options, packages,
+                                           info, NEW_PACKAGE_ACTION_PRESENT);
+            free(packages);
+            return PROMISE_RESULT_SKIPPED;
+        }
         res = InstallPackage(policy_data->package_options,
                              PACKAGE_TYPE_FILE, package_file_path,
                              NULL, NULL, wrapper);
@@ -1066,8 +1777,6 @@ static Seq *GetVersionsFromUpdates(EvalContext *ctx, const PackageInfo *info,
 {
     assert(info && info->name);
 
-    CF_DB *db_updates;
-    dbid db_id = dbid_packages_updates;
     Seq *updates_list = NULL;
 
     /* Make sure cache is updated. */
@@ -1077,56 +1786,30 @@ static Seq *GetVersionsFromUpdates(EvalContext *ctx, const PackageInfo *info,
         Log(LOG_LEVEL_INFO, "Can not update packages cache.");
     }
 
-    if (OpenSubDB(&db_updates, db_id, module_wrapper->package_module->name))
+    const PackageInventory *inventory =
+        GetLoadedPackageInventory(module_wrapper->package_module->name,
+                                  UPDATE_TYPE_UPDATES);
+    if (inventory != NULL)
     {
-        char package_key[strlen(info->name) + 4];
-
-        xsnprintf(package_key, sizeof(package_key),
-                "N<%s>", info->name);
+        Log(LOG_LEVEL_DEBUG, "Looking for package '%s' in updates", info->name);
 
-        Log(LOG_LEVEL_DEBUG, "Looking for key in updates: %s", package_key);
-
-        if (HasKeyDB(db_updates, package_key, sizeof(package_key)))
+        const Seq *versions = PackageUpdatesMapGet(inventory->updates, info->name);
+        if (versions != NULL)
         {
-            Log(LOG_LEVEL_DEBUG, "Found key in updates database");
-
-            updates_list = SeqNew(3, FreePackageInfo);
-            size_t val_size =
-                    ValueSizeDB(db_updates, package_key, sizeof(package_key));
-            char buff[val_size + 1];
-            buff[val_size] = '\0';
-
-            ReadDB(db_updates, package_key, buff, val_size);
-            Seq* updates = SeqStringFromString(buff, '\n');
+            Log(LOG_LEVEL_DEBUG, "Found package in updates database");
 
-            for (size_t i = 0; i < SeqLength(updates); i++)
+            updates_list = SeqNew(SeqLength(versions), FreePackageInfo);
+            for (size_t i = 0; i < SeqLength(versions); i++)
             {
-                char *package_line = SeqAt(updates, i);
-                Log(LOG_LEVEL_DEBUG, "Got line in updates database: '%s",
-                    package_line);
-
-                char version[strlen(package_line)];
-                char arch[strlen(package_line)];
-
-                if (sscanf(package_line, "V<%[^>]>A<%[^>]>", version, arch) == 2)
-                {
-                    PackageInfo *package = xcalloc(1, sizeof(PackageInfo));
+                const PackageInfo *update = SeqAt(versions, i);
+                PackageInfo *package = xcalloc(1, sizeof(PackageInfo));
 
-                    package->name = SafeStringDuplicate(info->name);
-                    package->version = SafeStringDuplicate(version);
-                    package->arch = SafeStringDuplicate(arch);
-                    SeqAppend(updates_list, package);
-                }
-                else
-                {
-                    /* Some error occurred while scanning package updates. */
-                    Log(LOG_LEVEL_INFO,
-                        "Unable to parse available updates line: %s",
-                        package_line);
-                }
+                package->name = SafeStringDuplicate(update->name);
+                package->version = SafeStringDuplicate(update->version);
+                package->arch = SafeStringDuplicate(update->arch);
+                SeqAppend(updates_list, package);
             }
         }
-        CloseDB(db_updates);
     }
     return updates_list;
 }
@@ -1173,6 +1856,16 @@ static PromiseResult RepoInstall(EvalContext *ctx,
                                            package_version, package_info->arch);
                 return PROMISE_RESULT_CHANGE;
             }
+            if (PackageOperationsScheduled(wrapper))
+            {
+                char *packages = PackageRequestLines("Name", package_name, version,
+                                                     package_info->arch);
+                SchedulePackageOperationSingle(ctx, pp, wrapper, "repo-install",
+                                               policy_data->package_options, packages,
+                                               package_info, NEW_PACKAGE_ACTION_PRESENT);
+                free(packages);
+                return PROMISE_RESULT_SKIPPED;
+            }
             *verified = false; /* Verification will be done in RepoInstallPackage(). */
             result = InstallPackage(policy_data->package_options, PACKAGE_TYPE_REPO,
                                     package_name, version, package_info->arch,
@@ -1324,23 +2017,34 @@ static PromiseResult RepoInstall(EvalContext *ctx,
             Log(LOG_LEVEL_DEBUG,
                 "Formatted list of packages to be send to package module: "
                 "[%s]", install_formatted_list);
-            res = InstallPackageGeneric(policy_data->package_options,
-                                        PACKAGE_TYPE_REPO,
-                                        install_formatted_list, wrapper);
-
-            for (size_t i = 0; i < SeqLength(packages_to_install); i++)
+            if (PackageOperationsScheduled(wrapper))
+            {
+                SchedulePackageOperation(ctx, pp, wrapper, "repo-install",
+                                         policy_data->package_options,
+                                         install_formatted_list, packages_to_install,
+                                         NEW_PACKAGE_ACTION_PRESENT, res);
+                res = PROMISE_RESULT_SKIPPED;
+            }
+            else
             {
-                PackageInfo *to_verify = SeqAt(packages_to_install, i);
-                PromiseResult validate =
-                    ValidateChangedPackage(policy_data, wrapper,
-                                           to_verify,
-                                           NEW_PACKAGE_ACTION_PRESENT);
-                Log(LOG_LEVEL_DEBUG,
-                    "Validating package %s:%s:%s installation result: %d",
-                    to_verify->name, to_verify->version,
-                    to_verify->arch, validate);
-                res = PromiseResultUpdate(res, validate);
-                *verified = true;
+                res = InstallPackageGeneric(policy_data->package_options,
+                                            PACKAGE_TYPE_REPO,
+                                            install_formatted_list, wrapper);
+
+                for (size_t i = 0; i < SeqLength(packages_to_install); i++)
+                {
+                    PackageInfo *to_verify = SeqAt(packages_to_install, i);
+                    PromiseResult validate =
+                        ValidateChangedPackage(policy_data, wrapper,
+                                               to_verify,
+                                               NEW_PACKAGE_ACTION_PRESENT);
+                    Log(LOG_LEVEL_DEBUG,
+                        "Validating package %s:%s:%s installation result: %d",
+                        to_verify->name, to_verify->version,
+                        to_verify->arch, validate);
+                    res = PromiseResultUpdate(res, validate);
+                    *verified = true;
+                }
             }
         }
         free(install_formatted_list);
@@ -1558,6 +2262,22 @@ PromiseResult HandleAbsentPromiseAction(EvalContext *ctx,
                                            policy_data->package_architecture);
                 return PROMISE_RESULT_CHANGE;
             }
+            if (PackageOperationsScheduled(wrapper))
+            {
+                const PackageInfo pkg_info = {
+                    .name = (char *) package_name,
+                    .version = policy_data->package_version,
+                    .arch = policy_data->package_architecture
+                };
+                char *packages = PackageRequestLines("Name", package_name,
+                                                     policy_data->package_version,
+                                                     policy_data->package_architecture);
+                SchedulePackageOperationSingle(ctx, pp, wrapper, "remove",
+                                               policy_data->package_options, packages,
+                                               &pkg_info, NEW_PACKAGE_ACTION_ABSENT);
+                free(packages);
+                return PROMISE_RESULT_SKIPPED;
+            }
             res = RemovePackage(package_name,
                     policy_data->package_options, policy_data->package_version,
                     policy_data->package_architecture, wrapper);
@@ -1602,6 +2322,104 @@ PromiseResult HandleAbsentPromiseAction(EvalContext *ctx,
 }
 
 
+static void RunPackageTransaction(EvalContext *ctx, const PackageTransaction *transaction)
+{
+    PackagePromiseGlobalLock global_lock = AcquireGlobalPackagePromiseLock(ctx);
+    if (global_lock.g_lock.lock == NULL)
+    {
+        Log(LOG_LEVEL_INFO,
+            "Can not acquire global lock for package promise. Skipping '%s'"
+            " of %zu package promise(s) with package module '%s'",
+            transaction->command, SeqLength(transaction->items),
+            transaction->module->name);
+        return;
+    }
+
+    PackageModuleWrapper *wrapper = NewPackageModuleWrapper(transaction->module);
+    bool cache_updated = false;
+    if (wrapper != NULL)
+    {
+        Log(LOG_LEVEL_VERBOSE,
+            "Running '%s' of %zu package promise(s) with package module '%s'",
+            transaction->command, SeqLength(transaction->items), wrapper->name);
+
+        char *request = StringFormat("%s%s", transaction->options_str,
+                                     BufferData(transaction->request));
+        Rlist *error_message = NULL;
+        if (PackageWrapperCommunicate(wrapper, transaction->command, request,
+                                      &error_message) != 0)
+        {
+            Log(LOG_LEVEL_INFO, "Some error occurred while communicating with "
+                "package module while running '%s'.", transaction->command);
+        }
+        if (error_message)
+        {
+            ParseAndLogErrorMessage(error_message);
+            RlistDestroy(error_message);
+        }
+        free(request);
+
+        /* Whatever the module says, the packages it did change are found in
+         * the cache. */
+        cache_updated =
+            UpdateCache(transaction->options, wrapper, UPDATE_TYPE_INSTALLED) &&
+            UpdateCache(transaction->options, wrapper, UPDATE_TYPE_LOCAL_UPDATES);
+        if (!cache_updated)
+        {
+            Log(LOG_LEVEL_INFO, "Can not update packages cache after '%s'",
+                transaction->command);
+        }
+    }
+    else
+    {
+        Log(LOG_LEVEL_ERR, "Can not set up wrapper for module: %s",
+            transaction->module->name);
+    }
+
+    for (size_t i = 0; i < SeqLength(transaction->items); i++)
+    {
+        const PackageTransactionItem *item = SeqAt(transaction->items, i);
+
+        PromiseResult result = cache_updated ? item->result : PROMISE_RESULT_FAIL;
+        for (size_t j = 0; cache_updated && j < SeqLength(item->packages); j++)
+        {
+            const PackageInfo *package = SeqAt(item->packages, j);
+            result = PromiseResultUpdate(result,
+                                         PackageChangeResult(wrapper, package, item->action));
+        }
+
+        EvalContextStackPushPromiseFrame(ctx, item->pp);
+        if (EvalContextStackPushPromiseIterationFrame(ctx, NULL))
+        {
+            Attributes a = GetPackageAttributes(ctx, item->pp);
+            ReportNewPackagePromiseResult(ctx, item->pp, &a, result);
+            EvalContextStackPopFrame(ctx);
+        }
+        EvalContextStackPopFrame(ctx);
+        EvalContextLogPromiseIterationOutcome(ctx, item->pp, result);
+    }
+
+    DeletePackageModuleWrapper(wrapper);
+    YieldGlobalPackagePromiseLock(global_lock);
+}
+
+void ExecuteScheduledPackageTransactions(EvalContext *ctx)
+{
+    if (PACKAGE_TRANSACTIONS == NULL)
+    {
+        return;
+    }
+
+    Seq *transactions = PACKAGE_TRANSACTIONS;
+    PACKAGE_TRANSACTIONS = NULL;
+
+    for (size_t i = 0; i < SeqLength(transactions); i++)
+    {
+        RunPackageTransaction(ctx, SeqAt(transactions, i));
+    }
+    SeqDestroy(transactions);
+}
+
 /* IMPORTANT: This must be called under protection of
  * GLOBAL_PACKAGE_PROMISE_LOCK_NAME lock! */
 bool UpdateSinglePackageModuleCache(EvalContext *ctx,
@@ -54,6 +54,10 @@ typedef struct
     char *message;
 } PackageError;
 
+/* The module process(es) of a package module, shared by all its wrappers
+ * for the agent run. */
+typedef struct PackageModuleSession_ PackageModuleSession;
+
 typedef struct
 {
     char *name;
@@ -63,6 +67,7 @@ typedef struct
     char *script_exec_opts;
     PackageModuleBody *package_module;
     int supported_api_version;
+    PackageModuleSession *session;
 } PackageModuleWrapper;
 
 typedef struct
@@ -91,6 +96,19 @@ void UpdatePackagesCache(EvalContext *ctx, bool force_update);
 PackageModuleWrapper *NewPackageModuleWrapper(PackageModuleBody *package_module);
 void DeletePackageModuleWrapper(PackageModuleWrapper *wrapper);
 
+/**
+ * Run the installs and removals scheduled by the packages promises using a
+ * persistent package module, and report the outcome of these promises.
+ * Called at the end of the packages promises of a bundle.
+ */
+void ExecuteScheduledPackageTransactions(EvalContext *ctx);
+
+/**
+ * Stop the persistent package modules started during the agent run and drop
+ * the package caches loaded in memory.
+ */
+void FinalizePackageModules(void);
+
 PackagePromiseGlobalLock AcquireGlobalPackagePromiseLock(EvalContext *ctx);
 void YieldGlobalPackagePromiseLock(PackagePromiseGlobalLock lock);
 
@@ -42,6 +42,7 @@
 #include <files_links.h>
 #include <files_properties.h>
 #include <files_select.h>
+#include <files_changes.h>                 /* FileChangesBeginSession() */
 #include <item_lib.h>
 #include <match_scope.h>
 #include <attributes.h>
@@ -548,6 +549,9 @@ static PromiseResult VerifyFilePromise(EvalContext *ctx, char *path, const Promi
     {
         lstat(changes_path, &oslb);     /* if doesn't exist have to stat again anyway */
 
+        /* One changes database transaction per batch of files, not per file */
+        const bool changes_session = a.havechange && FileChangesBeginSession();
+
         DepthSearch(ctx, path, &oslb, 0, &a, pp, oslb.st_dev, &result);
 
         /* normally searches do not include the base directory */
@@ -570,6 +574,11 @@ static PromiseResult VerifyFilePromise(EvalContext *ctx, char *path, const Promi
                 Log(LOG_LEVEL_VERBOSE, "Basedir '%s' not promising anything", path);
             }
         }
+
+        if (changes_session)
+        {
+            FileChangesEndSession();
+        }
     }
 
 /* Phase 2a - copying is potentially threadable if no followup actions */
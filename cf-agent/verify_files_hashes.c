@@ -31,6 +31,7 @@
 #include <files_interfaces.h>
 #include <files_lib.h>
 #include <hash.h>
+#include <hash_index.h>                                 /* HashFileIndexed */
 #include <misc_lib.h>
 #include <eval_context.h>
 #include <known_dirs.h>
@@ -48,8 +49,8 @@ bool CompareFileHashes(const char *file1, const char *file2, const struct stat *
 
     if (conn == NULL)
     {
-        HashFile(file1, digest1, CF_DEFAULT_DIGEST, false);
-        HashFile(file2, digest2, CF_DEFAULT_DIGEST, false);
+        HashFileIndexed(file1, digest1, CF_DEFAULT_DIGEST);
+        HashFileIndexed(file2, digest2, CF_DEFAULT_DIGEST);
 
         for (i = 0; i < EVP_MAX_MD_SIZE; i++)
         {
@@ -65,7 +66,8 @@ bool CompareFileHashes(const char *file1, const char *file2, const struct stat *
     else
     {
         assert(fc->servers && strcmp(RlistScalarValue(fc->servers), "localhost"));
-        return CompareHashNet(file1, file2, fc->encrypt, conn);  /* client.c */
+        HashFileIndexed(file2, digest2, CF_DEFAULT_DIGEST);
+        return CompareHashNet(file1, digest2, fc->encrypt, conn);  /* client.c */
     }
 }
 
@@ -108,6 +110,8 @@ bool CompareBinaryFiles(const char *file1, const char *file2, const struct stat
     {
         assert(fc->servers && strcmp(RlistScalarValue(fc->servers), "localhost"));
         Log(LOG_LEVEL_DEBUG, "Using network checksum instead");
-        return CompareHashNet(file1, file2, fc->encrypt, conn);  /* client.c */
+        unsigned char digest[EVP_MAX_MD_SIZE + 1] = { 0 };
+        HashFileIndexed(file2, digest, CF_DEFAULT_DIGEST);
+        return CompareHashNet(file1, digest, fc->encrypt, conn);  /* client.c */
     }
 }
@@ -43,9 +43,11 @@
 #include <item_lib.h>
 #include <client_code.h>
 #include <hash.h>
+#include <hash_multi.h>                                   /* HashFileMulti */
 #include <files_repository.h>
 #include <files_select.h>
 #include <files_changes.h>
+#include <dir_walker.h>
 #include <expand.h>
 #include <conversion.h>
 #include <pipes.h>
@@ -66,7 +68,8 @@
 #include <retcode.h>
 #include <cf-agent-enterprise-stubs.h>
 #include <conn_cache.h>
-#include <stat_cache.h>                      /* remote_stat,StatCacheLookup */
+#include <stat_cache.h>    /* remote_stat,StatCacheLookup,cf_remote_stat_tree */
+#include <protocol_version.h>   /* ProtocolSupportsStatTree,ProtocolSupportsBulkStream */
 #include <known_dirs.h>
 #include <changes_chroot.h>     /* PrepareChangesChroot(), RecordFileChangedInChroot() */
 #include <unix.h>               /* GetGroupName(), GetUserName() */
@@ -109,6 +112,10 @@ static int cf_stat(const char *file, struct stat *buf, const FileCopy *fc, Agent
 static int cf_readlink(EvalContext *ctx, const char *sourcefile, char *linkbuf, size_t buffsize, const Attributes *attr, const Promise *pp, AgentConnection *conn, PromiseResult *result);
 #endif
 static bool SkipDirLinks(EvalContext *ctx, const char *path, const char *lastnode, DirectoryRecursion r);
+static bool DepthSearchWalk(EvalContext *ctx, char *name, const struct stat *sb, int rlevel,
+                            const Attributes *attr, const Promise *pp, dev_t rootdevice,
+                            PromiseResult *result, DirWalker *walker,
+                            DirListing *parent, size_t index);
 static bool DeviceBoundary(const struct stat *sb, dev_t rootdevice);
 static PromiseResult LinkCopy(EvalContext *ctx, char *sourcefile, char *destfile, const struct stat *sb, const Attributes *attr,
                               const Promise *pp, CompressedArray **inode_cache, AgentConnection *conn);
@@ -734,6 +741,288 @@ static PromiseResult PurgeLocalFiles(EvalContext *ctx, Item *filelist, const cha
     return result;
 }
 
+/**
+ * Fetch the stat information of the whole source tree in one round trip,
+ * so that the OPENDIR/STAT (and MD5 if comparing digests) requests below
+ * are served from the stat cache. Only a shortcut: if the server doesn't
+ * support it or it fails, we just ask entry by entry.
+ */
+static void PrefetchRemoteTree(const char *from, int maxrecurse,
+                               const Attributes *attr, AgentConnection *conn)
+{
+    if (!ProtocolSupportsStatTree(ConnectionInfoProtocolVersion(conn->conn_info)))
+    {
+        return;
+    }
+
+    /* Already fetched along with a parent directory. */
+    const Stat *cached = StatCacheLookup(conn, from, conn->this_server);
+    if (cached != NULL && cached->cf_entries != NULL)
+    {
+        return;
+    }
+
+    bool digests = (attr->copy.compare == FILE_COMPARATOR_CHECKSUM ||
+                    attr->copy.compare == FILE_COMPARATOR_HASH);
+    if (!cf_remote_stat_tree(conn, from, maxrecurse, digests))
+    {
+        Log(LOG_LEVEL_VERBOSE,
+            "Could not prefetch '%s:%s', listing it entry by entry",
+            conn->this_server, from);
+    }
+}
+
+/* Files fetched ahead by PrefetchChangedFiles(): the CF_NEW file each one
+ * was written to -> its source on the server. */
+static StringMap *PREFETCHED_FILES = NULL; /* GLOBAL_X */
+
+/* Bigger files that exist locally are rather fetched as a delta, one at a
+ * time, than whole in a batch. */
+#define PREFETCH_MAX_WHOLE_SIZE (1024 * 1024)
+
+/**
+ * Mode of the local copy of a remote file, #dest_stat is NULL if the
+ * destination doesn't exist yet.
+ */
+static mode_t RemoteCopyMode(const Attributes *attr, const struct stat *sstat,
+                             const struct stat *dest_stat)
+{
+    /* Use perms from source file if preserve is true, otherwise use perms
+     * of destination file if it exists, otherwise use default perms. */
+    mode_t mode;
+    if (attr->copy.preserve)
+    {
+        mode = sstat->st_mode;
+    }
+    else if (dest_stat != NULL)
+    {
+        mode = dest_stat->st_mode;
+    }
+    else
+    {
+        mode = CF_PERMS_DEFAULT;
+    }
+    mode &= 0777; /* Never preserve SUID bit */
+
+    /* If perms are promised for this file, use those instead */
+    if ((attr->perms.plus != CF_SAMEMODE) && (attr->perms.minus != CF_SAMEMODE))
+    {
+        mode |= attr->perms.plus;
+        mode &= ~(attr->perms.minus);
+    }
+
+    return mode;
+}
+
+/**
+ * Whether the regular file #source will be copied to #dest, judging from
+ * what the stat cache knows only. A wrong guess costs a transfer, not a
+ * wrong copy: VerifyCopy() still decides.
+ */
+static bool WillCopyRemoteFile(char *source, char *dest, const Attributes *attr,
+                               AgentConnection *conn, struct stat *ssb,
+                               struct stat *dsb, bool *dest_exists)
+{
+    /* Anything not cached would cost a round trip to find out. */
+    const Stat *cached = StatCacheLookup(conn, source, conn->this_server);
+    if (cached == NULL ||
+        cf_lstat(source, ssb, &(attr->copy), conn) == -1 ||
+        !S_ISREG(ssb->st_mode) ||
+        ssb->st_nlink > 1)      /* may be hard linked instead */
+    {
+        return false;
+    }
+
+    if (attr->copy.min_size != (size_t) CF_NOINT &&
+        (((size_t) ssb->st_size < attr->copy.min_size) ||
+         ((size_t) ssb->st_size > attr->copy.max_size)))
+    {
+        return false;
+    }
+
+    *dest_exists = (lstat(dest, dsb) != -1);
+    if (!*dest_exists)
+    {
+        return true;
+    }
+
+    if (!S_ISREG(dsb->st_mode) ||
+        attr->copy.compare == FILE_COMPARATOR_EXISTS ||
+        (dsb->st_size > 0 && ssb->st_size > PREFETCH_MAX_WHOLE_SIZE))
+    {
+        return false;
+    }
+
+    if (attr->copy.force_update)
+    {
+        return true;
+    }
+
+    switch (attr->copy.compare)
+    {
+    case FILE_COMPARATOR_BINARY:
+    case FILE_COMPARATOR_ATIME:
+        /* These compare the contents over the network. */
+        return false;
+    case FILE_COMPARATOR_CHECKSUM:
+    case FILE_COMPARATOR_HASH:
+        if (cached->cf_digest == NULL)
+        {
+            return false;
+        }
+        break;
+    default:
+        break;
+    }
+
+    return CompareForFileCopy(source, dest, ssb, dsb, &(attr->copy), conn);
+}
+
+/**
+ * Fetch the files of #from that are going to be copied with pipelined GET
+ * requests, before VerifyCopy() gets to them one by one, so that N changed
+ * files don't cost N round trips. CopyRegularFile() picks them up with
+ * TakePrefetchedFile(). Relies on the listing and stat information from
+ * STATTREE, and on the bulkstream protocol to ask for whole files.
+ */
+static void PrefetchChangedFiles(const char *from, const char *to,
+                                 const Attributes *attr, AgentConnection *conn)
+{
+    if (!ProtocolSupportsBulkStream(ConnectionInfoProtocolVersion(conn->conn_info)) ||
+        conn->error ||
+        EVAL_MODE != EVAL_MODE_NORMAL ||
+        attr->transaction.action == cfa_warn ||
+        ChrootChanges())
+    {
+        return;
+    }
+
+    const Stat *dir = StatCacheLookup(conn, from, conn->this_server);
+    if (dir == NULL || dir->cf_entries == NULL)
+    {
+        return;
+    }
+
+    FileFetch *files = xcalloc(ListLen(dir->cf_entries), sizeof(FileFetch));
+    size_t n_files = 0;
+    for (const Item *entry = dir->cf_entries; entry != NULL; entry = entry->next)
+    {
+        char source[CF_BUFSIZE], dest[CF_BUFSIZE], new[CF_BUFSIZE];
+        strlcpy(source, from, sizeof(source));
+        strlcpy(dest, to, sizeof(dest));
+        if (!PathAppend(source, sizeof(source), entry->name, '/') ||
+            !PathAppend(dest, sizeof(dest), entry->name, FILE_SEPARATOR))
+        {
+            continue;
+        }
+
+        struct stat ssb, dsb;
+        bool dest_exists;
+        if (!WillCopyRemoteFile(source, dest, attr, conn, &ssb, &dsb, &dest_exists) ||
+            !ConsiderAbstractFile(entry->name, from, &(attr->copy), conn))
+        {
+            continue;
+        }
+
+        strlcpy(new, dest, sizeof(new));
+        if (!JoinSuffix(new, sizeof(new), CF_NEW))
+        {
+            continue;
+        }
+
+        files[n_files].source = xstrdup(source);
+        files[n_files].dest = xstrdup(new);
+        files[n_files].mode = RemoteCopyMode(attr, &ssb, dest_exists ? &dsb : NULL);
+        n_files++;
+    }
+
+    /* A single file is not worth a batch. */
+    if (n_files > 1)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Fetching %zu files of '%s:%s' ahead",
+            n_files, conn->this_server, from);
+
+        CopyRegularFilesNet(conn, files, n_files);
+
+        if (PREFETCHED_FILES == NULL)
+        {
+            PREFETCHED_FILES = StringMapNew();
+        }
+    }
+
+    for (size_t i = 0; i < n_files; i++)
+    {
+        if (files[i].fetched)
+        {
+            StringMapInsert(PREFETCHED_FILES, (char *) files[i].dest,
+                            (char *) files[i].source);
+        }
+        else
+        {
+            free((char *) files[i].dest);
+            free((char *) files[i].source);
+        }
+    }
+    free(files);
+}
+
+/**
+ * Whether #new already holds #source, fetched by PrefetchChangedFiles().
+ */
+static bool TakePrefetchedFile(const char *source, const char *new)
+{
+    if (PREFETCHED_FILES == NULL)
+    {
+        return false;
+    }
+
+    const char *prefetched = StringMapGet(PREFETCHED_FILES, new);
+    if (prefetched == NULL)
+    {
+        return false;
+    }
+
+    bool taken = StringEqual(prefetched, source) && (access(new, F_OK) == 0);
+    StringMapRemove(PREFETCHED_FILES, new);
+    return taken;
+}
+
+/**
+ * Remove the files fetched ahead for the directory #to which were not
+ * copied after all, or all of them if #to is NULL.
+ */
+static void DiscardPrefetchedFiles(const char *to)
+{
+    if (PREFETCHED_FILES == NULL)
+    {
+        return;
+    }
+
+    Seq *discarded = SeqNew(8, free);
+    MapIterator it = MapIteratorInit(PREFETCHED_FILES->impl);
+    MapKeyValue *item;
+    while ((item = MapIteratorNext(&it)) != NULL)
+    {
+        const char *new = item->key;
+        const size_t to_len = (to != NULL) ? strlen(to) : 0;
+        if (to == NULL ||
+            (StringStartsWith(new, to) && IsFileSep(new[to_len]) &&
+             strchr(new + to_len + 1, FILE_SEPARATOR) == NULL))
+        {
+            SeqAppend(discarded, xstrdup(item->key));
+        }
+    }
+
+    for (size_t i = 0; i < SeqLength(discarded); i++)
+    {
+        const char *new = SeqAt(discarded, i);
+        Log(LOG_LEVEL_DEBUG, "Removing '%s' fetched ahead but not copied", new);
+        unlink(new);
+        StringMapRemove(PREFETCHED_FILES, new);
+    }
+    SeqDestroy(discarded);
+}
+
 static PromiseResult SourceSearchAndCopy(EvalContext *ctx, const char *from, char *to, int maxrecurse, const Attributes *attr,
                                          const Promise *pp, dev_t rootdevice, CompressedArray **inode_cache, AgentConnection *conn)
 {
@@ -860,6 +1149,12 @@ static PromiseResult SourceSearchAndCopy(EvalContext *ctx, const char *from, cha
         }
     }
 
+    if (conn != NULL)
+    {
+        PrefetchRemoteTree(from, maxrecurse, attr, conn);
+        PrefetchChangedFiles(from, to, attr, conn);
+    }
+
     /* Send OPENDIR command. */
     AbstractDir *dirh;
     if ((dirh = AbstractDirOpen(changes_from, &(attr->copy), conn)) == NULL)
@@ -1069,6 +1364,8 @@ static PromiseResult SourceSearchAndCopy(EvalContext *ctx, const char *from, cha
         }
     }
 
+    DiscardPrefetchedFiles(to);
+
     if (attr->copy.purge)
     {
         PurgeLocalFiles(ctx, namecache, to, attr, pp, conn);
@@ -1556,32 +1853,16 @@ bool CopyRegularFile(EvalContext *ctx, const char *source, const char *dest, con
             return false;
         }
 
-        /* Use perms from source file if preserve is true, otherwise use perms
-         * of destination file if it exists, otherwise use default perms. */
-        mode_t mode;
-        if (attr->copy.preserve)
-        {
-            mode = sstat->st_mode;
-        }
-        else if (dest_exists)
-        {
-            mode = dest_stat.st_mode;
-        }
-        else
-        {
-            mode = CF_PERMS_DEFAULT;
-        }
-        mode &= 0777; /* Never preserve SUID bit */
+        const mode_t mode = RemoteCopyMode(attr, sstat,
+                                           dest_exists ? &dest_stat : NULL);
 
-        /* If perms are promised for this file, use those instead */
-        if ((attr->perms.plus != CF_SAMEMODE) && (attr->perms.minus != CF_SAMEMODE))
+        if (TakePrefetchedFile(source, ToChangesPath(new)))
         {
-            mode |= attr->perms.plus;
-            mode &= ~(attr->perms.minus);
+            Log(LOG_LEVEL_VERBOSE, "File '%s' was already fetched from '%s'",
+                source, conn->remoteip);
         }
-
-        if (!CopyRegularFileNet(source, dest, ToChangesPath(new),
-                                sstat->st_size, attr->copy.encrypt, conn, mode))
+        else if (!CopyRegularFileNet(source, dest, ToChangesPath(new),
+                                     sstat->st_size, attr->copy.encrypt, conn, mode))
         {
             RecordFailure(ctx, pp, attr, "Failed to copy file '%s' from '%s'",
                           source, conn->remoteip);
@@ -2828,13 +3109,93 @@ bool HandleFileObstruction(EvalContext *ctx, const char *path, const struct stat
     return true;
 }
 
+/**
+ * Whether the directories of a depth search can be read ahead, that is
+ * whether verifying the files leaves the tree as it is.
+ *
+ * Only the reading is done ahead. SelectLeaf() stays on the agent thread,
+ * as it sets match variables in the EvalContext and may run programs, and
+ * so does the chdir() into each directory, which the link checks rely on.
+ */
+static bool DepthSearchCanReadAhead(const Attributes *attr)
+{
+    return (attr->recursion.parallelism > 1) &&
+           (attr->recursion.depth > 1) &&
+           !attr->havedelete && !attr->haverename && !attr->havetrans &&
+           !ChrootChanges();
+}
+
 bool DepthSearch(EvalContext *ctx, char *name, const struct stat *sb, int rlevel, const Attributes *attr,
                 const Promise *pp, dev_t rootdevice, PromiseResult *result)
 {
     assert(attr != NULL);
-    Dir *dirh;
+
+    DirWalker *walker = NULL;
+    if (attr->havedepthsearch && (rlevel == 0) && DepthSearchCanReadAhead(attr))
+    {
+        walker = DirWalkerNew(attr->recursion.parallelism, attr->recursion.depth,
+                              attr->recursion.xdev, rootdevice);
+    }
+
+    bool ret = DepthSearchWalk(ctx, name, sb, rlevel, attr, pp, rootdevice, result,
+                               walker, NULL, 0);
+
+    if (walker != NULL)
+    {
+        DirWalkerStats stats;
+        DirWalkerGetStats(walker, &stats);
+        Log(LOG_LEVEL_DEBUG,
+            "Depth search of '%s' read %zu directories ahead (%zu waited for), "
+            "%zu inline, discarded %zu",
+            name, stats.read_ahead + stats.waited, stats.waited,
+            stats.read_inline, stats.discarded);
+        DirWalkerDestroy(walker);
+    }
+
+    return ret;
+}
+
+/**
+ * The lstat() of a read-ahead listing may be many listings old by the time
+ * the search gets to the entry, so take it again from the current directory.
+ * Links are not followed here, the search checks and follows them itself.
+ *
+ * @param entry_sb the read-ahead lstat() result
+ * @return false if the entry is gone or changed type since it was read
+ *         ahead, the decisions taken on the old result are then void
+ */
+static bool DepthSearchRefreshStat(const char *d_name, const char *path,
+                                   const struct stat *entry_sb, struct stat *lsb)
+{
+    if (lstat(d_name, lsb) == -1)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Recurse was looking at '%s' when an error occurred. (lstat: %s)",
+            path, GetErrorStr());
+        return false;
+    }
+    if ((lsb->st_mode & S_IFMT) != (entry_sb->st_mode & S_IFMT))
+    {
+        Log(LOG_LEVEL_VERBOSE, "'%s' changed type during the search, skipping it", path);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @param walker if not NULL, read the directories through it, the listing
+ *               of this one being entry @index of @parent
+ */
+static bool DepthSearchWalk(EvalContext *ctx, char *name, const struct stat *sb, int rlevel,
+                            const Attributes *attr, const Promise *pp, dev_t rootdevice,
+                            PromiseResult *result, DirWalker *walker,
+                            DirListing *parent, size_t index)
+{
+    assert(attr != NULL);
+    Dir *dirh = NULL;
+    DirListing *listing = NULL;
+    size_t entry = 0;
     int goback;
-    const struct dirent *dirp;
+    const char *d_name;
     struct stat lsb;
     Seq *db_file_set = NULL;
     Seq *selected_files = NULL;
@@ -2884,7 +3245,16 @@ bool DepthSearch(EvalContext *ctx, char *name, const struct stat *sb, int rlevel
         return false;
     }
 
-    if ((dirh = DirOpen(".")) == NULL)
+    if (walker != NULL)
+    {
+        listing = DirWalkerList(walker, parent, index, name, rlevel, sb);
+        if (listing == NULL)
+        {
+            Log(LOG_LEVEL_INFO, "Could not open existing directory '%s'. (opendir: %s)", name, GetErrorStr());
+            return false;
+        }
+    }
+    else if ((dirh = DirOpen(".")) == NULL)
     {
         Log(LOG_LEVEL_INFO, "Could not open existing directory '%s'. (opendir: %s)", name, GetErrorStr());
         return false;
@@ -2899,31 +3269,75 @@ bool DepthSearch(EvalContext *ctx, char *name, const struct stat *sb, int rlevel
                           "Failed to get directory listing for recording file changes in '%s'", name);
             *result = PromiseResultUpdate(*result, PROMISE_RESULT_FAIL);
             SeqDestroy(db_file_set);
-            return false;
+            retval = false;
+            goto end;
         }
         selected_files = SeqNew(1, &free);
     }
 
     char path[CF_BUFSIZE];
-    for (dirp = DirRead(dirh); dirp != NULL; dirp = DirRead(dirh))
+    for (;;)
     {
-        if (!ConsiderLocalFile(dirp->d_name, name))
+        /* Entries come in the order the directory returns them either way,
+         * read ahead ones with their lstat() result. */
+        const struct stat *entry_sb = NULL;
+        int entry_errno = 0;
+        if (listing != NULL)
         {
-            continue;
+            if (entry == DirListingCount(listing))
+            {
+                break;
+            }
+            d_name = DirListingName(listing, entry);
+            entry_sb = DirListingStat(listing, entry);
+            entry_errno = errno;
+            entry++;
+
+            if (!ConsiderLocalFileStat(d_name, name, entry_sb))
+            {
+                continue;
+            }
+        }
+        else
+        {
+            const struct dirent *dirp = DirRead(dirh);
+            if (dirp == NULL)
+            {
+                break;
+            }
+            d_name = dirp->d_name;
+
+            if (!ConsiderLocalFile(d_name, name))
+            {
+                continue;
+            }
         }
 
         size_t total_len = strlcpy(path, name, sizeof(path));
-        if ((total_len >= sizeof(path)) || (JoinPaths(path, sizeof(path), dirp->d_name) == NULL))
+        if ((total_len >= sizeof(path)) || (JoinPaths(path, sizeof(path), d_name) == NULL))
         {
             RecordFailure(ctx, pp, attr,
                           "Internal limit reached in DepthSearch(), path too long: '%s' + '%s'",
-                          path, dirp->d_name);
+                          path, d_name);
             *result = PromiseResultUpdate(*result, PROMISE_RESULT_FAIL);
             retval = false;
             goto end;
         }
 
-        if (lstat(dirp->d_name, &lsb) == -1)
+        if (listing != NULL)
+        {
+            if (entry_sb == NULL)
+            {
+                Log(LOG_LEVEL_VERBOSE, "Recurse was looking at '%s' when an error occurred. (lstat: %s)",
+                    path, GetErrorStrFromCode(entry_errno));
+                continue;
+            }
+            if (!DepthSearchRefreshStat(d_name, path, entry_sb, &lsb))
+            {
+                continue;
+            }
+        }
+        else if (lstat(d_name, &lsb) == -1)
         {
             Log(LOG_LEVEL_VERBOSE, "Recurse was looking at '%s' when an error occurred. (lstat: %s)", path, GetErrorStr());
             continue;
@@ -2954,7 +3368,7 @@ bool DepthSearch(EvalContext *ctx, char *name, const struct stat *sb, int rlevel
 
             /* if so, hide the difference by replacing with actual object */
 
-            if (stat(dirp->d_name, &lsb) == -1)
+            if (stat(d_name, &lsb) == -1)
             {
                 RecordFailure(ctx, pp, attr,
                               "Recurse was working on '%s' when this failed. (stat: %s)",
@@ -2972,7 +3386,7 @@ bool DepthSearch(EvalContext *ctx, char *name, const struct stat *sb, int rlevel
 
         if (S_ISDIR(lsb.st_mode))
         {
-            if (SkipDirLinks(ctx, path, dirp->d_name, attr->recursion))
+            if (SkipDirLinks(ctx, path, d_name, attr->recursion))
             {
                 continue;
             }
@@ -2980,7 +3394,8 @@ bool DepthSearch(EvalContext *ctx, char *name, const struct stat *sb, int rlevel
             if ((attr->recursion.depth > 1) && (rlevel <= attr->recursion.depth))
             {
                 Log(LOG_LEVEL_VERBOSE, "Entering '%s', level %d", path, rlevel);
-                goback = DepthSearch(ctx, path, &lsb, rlevel + 1, attr, pp, rootdevice, result);
+                goback = DepthSearchWalk(ctx, path, &lsb, rlevel + 1, attr, pp, rootdevice, result,
+                                         walker, listing, entry - 1);
                 if (!PopDirState(ctx, pp, attr, goback, name, sb, attr->recursion, result))
                 {
                     FatalError(ctx, "Not safe to continue");
@@ -2992,13 +3407,13 @@ bool DepthSearch(EvalContext *ctx, char *name, const struct stat *sb, int rlevel
         {
             if (attr->havechange)
             {
-                if (!SeqBinaryLookup(db_file_set, dirp->d_name, StrCmpWrapper))
+                if (!SeqBinaryLookup(db_file_set, d_name, StrCmpWrapper))
                 {
                     // See comments in FileChangesCheckAndUpdateDirectory(),
                     // regarding this function call.
                     FileChangesLogNewFile(path, pp);
                 }
-                SeqAppend(selected_files, xstrdup(dirp->d_name));
+                SeqAppend(selected_files, xstrdup(d_name));
             }
 
             VerifyFileLeaf(ctx, path, &lsb, attr, pp, result);
@@ -3028,7 +3443,14 @@ bool DepthSearch(EvalContext *ctx, char *name, const struct stat *sb, int rlevel
 end:
     SeqDestroy(selected_files);
     SeqDestroy(db_file_set);
-    DirClose(dirh);
+    if (listing != NULL)
+    {
+        DirWalkerRelease(walker, listing);
+    }
+    else
+    {
+        DirClose(dirh);
+    }
     return retval;
 }
 
@@ -3308,6 +3730,8 @@ static PromiseResult CopyFileSources(EvalContext *ctx, char *destination, const
             result, SourceSearchAndCopy(ctx, source, destination,
                                         attr->recursion.depth, attr, pp,
                                         ssb.st_dev, &inode_cache, conn));
+        /* Left behind if the search was cut short. */
+        DiscardPrefetchedFiles(NULL);
 
         if (stat(ToChangesPath(destination), &dsb) != -1)
         {
@@ -3690,7 +4114,6 @@ static PromiseResult VerifyFileIntegrity(EvalContext *ctx, const char *file, con
 {
     assert(attr != NULL);
     unsigned char digest1[EVP_MAX_MD_SIZE + 1];
-    unsigned char digest2[EVP_MAX_MD_SIZE + 1];
 
     if ((attr->change.report_changes != FILE_CHANGE_REPORT_CONTENT_CHANGE) && (attr->change.report_changes != FILE_CHANGE_REPORT_ALL))
     {
@@ -3698,19 +4121,20 @@ static PromiseResult VerifyFileIntegrity(EvalContext *ctx, const char *file, con
     }
 
     memset(digest1, 0, EVP_MAX_MD_SIZE + 1);
-    memset(digest2, 0, EVP_MAX_MD_SIZE + 1);
 
     PromiseResult result = PROMISE_RESULT_NOOP;
     bool changed = false;
     if (attr->change.hash == HASH_METHOD_BEST)
     {
-        HashFile(file, digest1, HASH_METHOD_MD5, false);
-        HashFile(file, digest2, HASH_METHOD_SHA1, false);
+        /* Read the file once for both */
+        const HashMethod types[] = { HASH_METHOD_MD5, HASH_METHOD_SHA1 };
+        unsigned char digests[2][EVP_MAX_MD_SIZE + 1] = { { 0 } };
+        HashFileMulti(file, 2, types, digests);
 
         changed = (changed ||
-                   FileChangesCheckAndUpdateHash(ctx, file, digest1, HASH_METHOD_MD5, attr, pp, &result));
+                   FileChangesCheckAndUpdateHash(ctx, file, digests[0], HASH_METHOD_MD5, attr, pp, &result));
         changed = (changed ||
-                   FileChangesCheckAndUpdateHash(ctx, file, digest2, HASH_METHOD_SHA1, attr, pp, &result));
+                   FileChangesCheckAndUpdateHash(ctx, file, digests[1], HASH_METHOD_SHA1, attr, pp, &result));
     }
     else
     {
@@ -4177,6 +4601,16 @@ static int cf_readlink(EvalContext *ctx, const char *sourcefile, char *linkbuf,
 
     const Stat *sp = StatCacheLookup(conn, sourcefile,
                                      RlistScalarValue(attr->copy.servers));
+    if (sp == NULL)
+    {
+        /* Evicted from the stat cache since it was stat'ed, refetch it. */
+        struct stat sb;
+        if (cf_remote_stat(conn, attr->copy.encrypt, sourcefile, &sb, "link") == 0)
+        {
+            sp = StatCacheLookup(conn, sourcefile,
+                                 RlistScalarValue(attr->copy.servers));
+        }
+    }
 
     if (sp)
     {
@@ -60,6 +60,70 @@ static bool NewPackagePromiseSanityCheck(const Attributes *a)
     return true;
 }
 
+void ReportNewPackagePromiseResult(EvalContext *ctx, const Promise *pp,
+                                   const Attributes *a, PromiseResult result)
+{
+    assert(a != NULL);
+
+    switch (a->new_packages.package_policy)
+    {
+        case NEW_PACKAGE_ACTION_ABSENT:
+            switch (result)
+            {
+                case PROMISE_RESULT_FAIL:
+                    cfPS(ctx, LOG_LEVEL_ERR, PROMISE_RESULT_FAIL, pp, a,
+                         "Error removing package '%s'", pp->promiser);
+                    break;
+                case PROMISE_RESULT_CHANGE:
+                    cfPS(ctx, LOG_LEVEL_INFO, PROMISE_RESULT_CHANGE, pp, a,
+                         "Successfully removed package '%s'", pp->promiser);
+                    break;
+                case PROMISE_RESULT_NOOP:
+                    /* Properly logged in HandleAbsentPromiseAction() */
+                    cfPS(ctx, LOG_LEVEL_NOTHING, PROMISE_RESULT_NOOP, pp, a, NULL);
+                    break;
+                case PROMISE_RESULT_WARN:
+                    /* Properly logged in HandleAbsentPromiseAction() */
+                    cfPS(ctx, LOG_LEVEL_NOTHING, PROMISE_RESULT_WARN, pp, a, NULL);
+                    break;
+                default:
+                    ProgrammingError("Absent promise action evaluation returned"
+                                     " unsupported result: %d", result);
+                    break;
+            }
+            break;
+        case NEW_PACKAGE_ACTION_PRESENT:
+            switch (result)
+            {
+                case PROMISE_RESULT_FAIL:
+                    cfPS(ctx, LOG_LEVEL_ERR, PROMISE_RESULT_FAIL, pp, a,
+                         "Error installing package '%s'", pp->promiser);
+                    break;
+                case PROMISE_RESULT_CHANGE:
+                    cfPS(ctx, LOG_LEVEL_INFO, PROMISE_RESULT_CHANGE, pp, a,
+                         "Successfully installed package '%s'", pp->promiser);
+                    break;
+                case PROMISE_RESULT_NOOP:
+                    cfPS(ctx, LOG_LEVEL_VERBOSE, PROMISE_RESULT_NOOP, pp, a,
+                         "Package '%s' already installed", pp->promiser);
+                    break;
+                case PROMISE_RESULT_WARN:
+                    /* Properly logged in HandlePresentPromiseAction() */
+                    cfPS(ctx, LOG_LEVEL_NOTHING, PROMISE_RESULT_WARN, pp, a, NULL);
+                    break;
+                default:
+                    ProgrammingError("Present promise action evaluation returned"
+                                     " unsupported result: %d", result);
+                    break;
+            }
+            break;
+        case NEW_PACKAGE_ACTION_NONE:
+        default:
+            ProgrammingError("Unsupported package action: %d", a->new_packages.package_policy);
+            break;
+    }
+}
+
 PromiseResult HandleNewPackagePromiseType(EvalContext *ctx, const Promise *pp, const Attributes *a)
 {
     assert(a != NULL);
@@ -120,58 +184,9 @@ PromiseResult HandleNewPackagePromiseType(EvalContext *ctx, const Promise *pp, c
     {
         case NEW_PACKAGE_ACTION_ABSENT:
             result = HandleAbsentPromiseAction(ctx, pp, a, package_module);
-
-            switch (result)
-            {
-                case PROMISE_RESULT_FAIL:
-                    cfPS(ctx, LOG_LEVEL_ERR, PROMISE_RESULT_FAIL, pp, a,
-                         "Error removing package '%s'", pp->promiser);
-                    break;
-                case PROMISE_RESULT_CHANGE:
-                    cfPS(ctx, LOG_LEVEL_INFO, PROMISE_RESULT_CHANGE, pp, a,
-                         "Successfully removed package '%s'", pp->promiser);
-                    break;
-                case PROMISE_RESULT_NOOP:
-                    /* Properly logged in HandleAbsentPromiseAction() */
-                    cfPS(ctx, LOG_LEVEL_NOTHING, PROMISE_RESULT_NOOP, pp, a, NULL);
-                    break;
-                case PROMISE_RESULT_WARN:
-                    /* Properly logged in HandleAbsentPromiseAction() */
-                    cfPS(ctx, LOG_LEVEL_NOTHING, PROMISE_RESULT_WARN, pp, a, NULL);
-                    break;
-                default:
-                    ProgrammingError("Absent promise action evaluation returned"
-                                     " unsupported result: %d", result);
-                    break;
-            }
             break;
         case NEW_PACKAGE_ACTION_PRESENT:
             result = HandlePresentPromiseAction(ctx, pp, a, package_module);
-
-            switch (result)
-            {
-                case PROMISE_RESULT_FAIL:
-                    cfPS(ctx, LOG_LEVEL_ERR, PROMISE_RESULT_FAIL, pp, a,
-                         "Error installing package '%s'", pp->promiser);
-                    break;
-                case PROMISE_RESULT_CHANGE:
-                    cfPS(ctx, LOG_LEVEL_INFO, PROMISE_RESULT_CHANGE, pp, a,
-                         "Successfully installed package '%s'", pp->promiser);
-                    break;
-                case PROMISE_RESULT_NOOP:
-                    cfPS(ctx, LOG_LEVEL_VERBOSE, PROMISE_RESULT_NOOP, pp, a,
-                         "Package '%s' already installed", pp->promiser);
-                    break;
-                case PROMISE_RESULT_WARN:
-                    /* Properly logged in HandlePresentPromiseAction() */
-                    cfPS(ctx, LOG_LEVEL_NOTHING, PROMISE_RESULT_WARN, pp, a, NULL);
-                    break;
-                default:
-                    ProgrammingError("Present promise action evaluation returned"
-                                     " unsupported result: %d", result);
-                    break;
-            }
-
             break;
         case NEW_PACKAGE_ACTION_NONE:
         default:
@@ -179,6 +194,17 @@ PromiseResult HandleNewPackagePromiseType(EvalContext *ctx, const Promise *pp, c
             break;
     }
 
+    if (result == PROMISE_RESULT_SKIPPED)
+    {
+        Log(LOG_LEVEL_VERBOSE,
+            "Package '%s' scheduled, the outcome is reported once the packages"
+            " promises of the bundle are evaluated", pp->promiser);
+    }
+    else
+    {
+        ReportNewPackagePromiseResult(ctx, pp, a, result);
+    }
+
     DeletePackageModuleWrapper(package_module);
 
     YieldCurrentLock(package_promise_lock);
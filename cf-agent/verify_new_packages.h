@@ -29,4 +29,10 @@
 
 PromiseResult HandleNewPackagePromiseType(EvalContext *ctx, const Promise *pp, const Attributes *a);
 
+/**
+ * Report the outcome of a packages promise, with its classes.
+ */
+void ReportNewPackagePromiseResult(EvalContext *ctx, const Promise *pp,
+                                   const Attributes *a, PromiseResult result);
+
 #endif
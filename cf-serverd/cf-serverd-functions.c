@@ -44,6 +44,9 @@
 #include <unix.h>
 #include <man.h>
 #include <server_tls.h>                              /* ServerTLSInitialize */
+#include <server_pool.h>                        /* ServerPoolDefaultWorkers */
+#include <file_stream.h>                     /* FileStreamEnableDeltaCache */
+#include <file_stream_cache.h>                    /* DELTA_CACHE_MAX_BYTES */
 #include <timeout.h>
 #include <known_dirs.h>
 #include <sysinfo.h>
@@ -65,6 +68,9 @@
 #define DEFAULT_LISTEN_QUEUE_SIZE 128
 #define MAX_LISTEN_QUEUE_SIZE 2048
 
+/* see CF_SERVERD_WORKER_THREADS */
+#define MAX_WORKER_THREADS 1024
+
 int NO_FORK = false; /* GLOBAL_A */
 int GRACEFUL = 0;
 
@@ -378,7 +384,9 @@ static void DeleteAuthList(Auth **list, Auth **list_tail)
 static void ClearAuthAndACLs(void)
 {
     /* Must have no currently open connections to free the ACLs. */
-    assert(SERVER_ACCESS.connectionlist == NULL);
+    assert(ConnectionTableCount(SERVER_ACCESS.connections) == 0);
+    ConnectionTableDestroy(SERVER_ACCESS.connections);
+    SERVER_ACCESS.connections = NULL;
 
     /* Bundle server access_rules legacy ACLs */
     DeleteAuthList(&SERVER_ACCESS.admit, &SERVER_ACCESS.admittail);
@@ -395,6 +403,11 @@ static void ClearAuthAndACLs(void)
     DeleteItemList(SERVER_ACCESS.allowuserlist);       SERVER_ACCESS.allowuserlist = NULL;
     DeleteItemList(SERVER_ACCESS.allowlegacyconnects); SERVER_ACCESS.allowlegacyconnects = NULL;
 
+    IPAclDestroy(SERVER_ACCESS.allowconnects);         SERVER_ACCESS.allowconnects    = NULL;
+    IPAclDestroy(SERVER_ACCESS.denyconnects);          SERVER_ACCESS.denyconnects     = NULL;
+    IPAclDestroy(SERVER_ACCESS.allowallconnects);      SERVER_ACCESS.allowallconnects = NULL;
+    IPAclDestroy(SERVER_ACCESS.legacyconnects);        SERVER_ACCESS.legacyconnects   = NULL;
+
     StringMapDestroy(SERVER_ACCESS.path_shortcuts);    SERVER_ACCESS.path_shortcuts  = NULL;
     free(SERVER_ACCESS.allowciphers);                  SERVER_ACCESS.allowciphers    = NULL;
     free(SERVER_ACCESS.allowtlsversion);               SERVER_ACCESS.allowtlsversion = NULL;
@@ -676,7 +689,7 @@ static void GracefulStop()
 
 /* Wait for connection-handler threads to finish their work.
  *
- * @return Number of live threads remaining after waiting.
+ * @return Number of open connections remaining after waiting.
  */
 static int WaitOnThreads(int graceful_time)
 {
@@ -693,7 +706,7 @@ static int WaitOnThreads(int graceful_time)
         }
 
         Log(LOG_LEVEL_VERBOSE,
-            "Waiting %ds for %d connection threads to finish",
+            "Waiting %ds for %d connections to finish",
             i, result);
 
         sleep(1);
@@ -702,14 +715,14 @@ static int WaitOnThreads(int graceful_time)
     if (result > 0)
     {
         Log(LOG_LEVEL_VERBOSE,
-            "There are %d connection threads left, exiting anyway",
+            "There are %d connections left, exiting anyway",
             result);
     }
     else
     {
         assert(result == 0);
         Log(LOG_LEVEL_VERBOSE,
-            "All threads are done, cleaning up allocations");
+            "All connections are done, cleaning up allocations");
         ClearAuthAndACLs();
         ServerTLSDeInitialize(NULL, NULL, NULL);
     }
@@ -820,6 +833,36 @@ static size_t GetListenQueueSize(void)
     return DEFAULT_LISTEN_QUEUE_SIZE;
 }
 
+static size_t GetWorkerThreads(void)
+{
+    size_t workers = ServerPoolDefaultWorkers();
+
+    const char *const workers_var = getenv("CF_SERVERD_WORKER_THREADS");
+    if (workers_var != NULL)
+    {
+        long n;
+        int ret = StringToLong(workers_var, &n);
+        if ((ret == 0) && (n > 0) && (n <= MAX_WORKER_THREADS))
+        {
+            workers = (size_t) n;
+        }
+        else
+        {
+            Log(LOG_LEVEL_WARNING,
+                "$CF_SERVERD_WORKER_THREADS = '%s' doesn't specify a valid number of worker threads, "
+                "falling back to default (%zu).",
+                workers_var, workers);
+        }
+    }
+
+    /* No point having more workers than allowed connections. */
+    if (CFD_MAXPROCESSES > 0)
+    {
+        workers = MIN(workers, (size_t) CFD_MAXPROCESSES);
+    }
+    return workers;
+}
+
 /**
  *  @retval >0 Number of threads still working
  *  @retval 0  All threads are done
@@ -834,6 +877,8 @@ int StartServer(EvalContext *ctx, Policy **policy, GenericAgentConfig *config)
     {
         return -1;
     }
+    FileStreamEnableDeltaCache(DELTA_CACHE_MAX_BYTES,
+                               DELTA_CACHE_MAX_ENTRY_BYTES);
 
     size_t queue_size = GetListenQueueSize();
     int sd = SetServerListenState(ctx, queue_size, NULL, SERVER_LISTEN, &InitServer);
@@ -855,6 +900,12 @@ int StartServer(EvalContext *ctx, Policy **policy, GenericAgentConfig *config)
     }
 
     PrepareServer(sd);
+    if (!ServerStartWorkers(GetWorkerThreads()))
+    {
+        Log(LOG_LEVEL_ERR,
+            "Unable to start connection handler threads, "
+            "connections will be handled from the main loop");
+    }
     CollectCallStart(COLLECT_INTERVAL);
 
     while (!IsPendingTermination())
@@ -900,6 +951,9 @@ int StartServer(EvalContext *ctx, Policy **policy, GenericAgentConfig *config)
         cf_closesocket(sd);                       /* Close listening socket */
     }
 
+    /* Close idle and queued connections, let busy ones finish. */
+    ServerStopWorkers();
+
     int threads_left;
 
 #if HAVE_SYSTEMD_SD_DAEMON_H
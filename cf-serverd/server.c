@@ -47,16 +47,20 @@
 #include <connection_info.h>
 #include <cf-windows-functions.h>
 #include <logging_priv.h>                          /* LoggingPrivSetContext */
-#include <printsize.h>
+#include <server_pool.h>                              /* ServerPoolSubmit */
+#include <server_ipacl.h>                                    /* IPAclMatch */
+#include <server_conntable.h>                          /* ConnectionTable* */
 
 #include "server_classic.h"                    /* BusyWithClassicConnection */
 
 
 /*
-  The only exported function in this file is the following, used only in
+  The only exported functions in this file are the following, used only in
   cf-serverd-functions.c.
 
   void ServerEntryPoint(EvalContext *ctx, const char *ipaddr, ConnectionInfo *info);
+  bool ServerStartWorkers(size_t workers);
+  void ServerStopWorkers(void);
 
   TODO move this file to cf-serverd-functions.c or most probably server_common.c.
 */
@@ -66,7 +70,7 @@
 // GLOBAL STATE
 //******************************************************************
 
-int ACTIVE_THREADS = 0; /* GLOBAL_X */
+int ACTIVE_THREADS = 0; /* GLOBAL_X */ /* admitted connections, see server.h */
 
 int CFD_MAXPROCESSES = 0; /* GLOBAL_P */
 bool DENYBADCLOCKS = true; /* GLOBAL_P */
@@ -82,30 +86,48 @@ char CFRUNCOMMAND[CF_MAXVARSIZE] = { 0 };                       /* GLOBAL_P */
 
 /******************************************************************/
 
-static void SpawnConnection(EvalContext *ctx, const char *ipaddr, ConnectionInfo *info);
-static void PurgeOldConnections(Item **list, time_t now);
-static void *HandleConnection(void *conn);
+static void SpawnConnection(EvalContext *ctx, const char *ipaddr,
+                            ConnectionInfo *info, ConnectionRecord *record);
+static ServerPoolNext ServeConnection(ServerConnectionState *conn);
+static void CloseConnection(ServerConnectionState *conn);
 static ServerConnectionState *NewConn(EvalContext *ctx, ConnectionInfo *info);
 static void DeleteConn(ServerConnectionState *conn);
 
+/* Some connections might not terminate properly. These should be cleaned
+ * every couple of hours. That should be enough to prevent spamming. */
+#define CONNECTION_LIFETIME (2 * SECONDS_PER_HOUR)
+
 /****************************************************************************/
 
+/**
+ * Match against one of the "body server control" IP lists, using its
+ * compiled form when available.
+ */
+static bool IsHostInList(const IPAcl *acl, const Item *list, const char *ipaddr)
+{
+    if (acl != NULL)
+    {
+        return IPAclMatch(acl, ipaddr);
+    }
+    return IsMatchItemIn(list, ipaddr);
+}
+
 void ServerEntryPoint(EvalContext *ctx, const char *ipaddr, ConnectionInfo *info)
 {
     Log(LOG_LEVEL_VERBOSE,
         "Obtained IP address of '%s' on socket %d from accept",
         ipaddr, ConnectionInfoSocket(info));
 
-    /* TODO change nonattackerlist, attackerlist and especially connectionlist
-     *      to binary searched lists, or remove them from the main thread! */
     if (SERVER_ACCESS.nonattackerlist
-        && !IsMatchItemIn(SERVER_ACCESS.nonattackerlist, ipaddr))
+        && !IsHostInList(SERVER_ACCESS.allowconnects,
+                         SERVER_ACCESS.nonattackerlist, ipaddr))
     {
         Log(LOG_LEVEL_ERR,
             "Remote host '%s' not in allowconnects, denying connection",
             ipaddr);
     }
-    else if (IsMatchItemIn(SERVER_ACCESS.attackerlist, ipaddr))
+    else if (IsHostInList(SERVER_ACCESS.denyconnects,
+                          SERVER_ACCESS.attackerlist, ipaddr))
     {
         Log(LOG_LEVEL_ERR,
             "Remote host '%s' is in denyconnects, denying connection",
@@ -119,36 +141,32 @@ void ServerEntryPoint(EvalContext *ctx, const char *ipaddr, ConnectionInfo *info
             now = 0;
         }
 
-        PurgeOldConnections(&SERVER_ACCESS.connectionlist, now);
+        bool multi = IsHostInList(SERVER_ACCESS.allowallconnects,
+                                  SERVER_ACCESS.multiconnlist, ipaddr);
 
-        bool allow = IsMatchItemIn(SERVER_ACCESS.multiconnlist, ipaddr);
-        if (!allow)
+        /* Purge, check and insert in one go, so that two connections from
+         * the same host can't both pass the one-connection check. */
+        ThreadLock(cft_count);
+        if (SERVER_ACCESS.connections == NULL)
         {
-            ThreadLock(cft_count);
-            /* At most one connection allowed for this host: */
-            allow = !IsItemIn(SERVER_ACCESS.connectionlist, ipaddr);
-            ThreadUnlock(cft_count);
-
-            if (!allow) /* Duplicate. */
-            {
-                Log(LOG_LEVEL_ERR,
-                    "Remote host '%s' is not in allowallconnects, denying second simultaneous connection",
-                    ipaddr);
-            }
+            SERVER_ACCESS.connections =
+                ConnectionTableNew(CONNECTION_LIFETIME);
         }
+        ConnectionTablePurge(SERVER_ACCESS.connections, now);
+        ConnectionRecord *record =
+            ConnectionTableAdd(SERVER_ACCESS.connections, ipaddr, now, multi);
+        ThreadUnlock(cft_count);
 
-        if (allow)
+        if (record != NULL)
         {
-            char intime[PRINTSIZE(now)];
-            xsnprintf(intime, sizeof(intime), "%jd", (intmax_t) now);
-
-            ThreadLock(cft_count);
-            PrependItem(&SERVER_ACCESS.connectionlist, ipaddr, intime);
-            ThreadUnlock(cft_count);
-
-            SpawnConnection(ctx, ipaddr, info);
+            SpawnConnection(ctx, ipaddr, info, record);
             return; /* Success */
         }
+
+        /* At most one connection allowed for this host: */
+        Log(LOG_LEVEL_ERR,
+            "Remote host '%s' is not in allowallconnects, denying second simultaneous connection",
+            ipaddr);
     }
     /* Tidy up on failure: */
 
@@ -160,97 +178,133 @@ void ServerEntryPoint(EvalContext *ctx, const char *ipaddr, ConnectionInfo *info
     ConnectionInfoDestroy(&info);
 }
 
-/**********************************************************************/
+/*********************************************************************/
 
-static void PurgeOldConnections(Item **list, time_t now)
-   /* Some connections might not terminate properly. These should be cleaned
-      every couple of hours. That should be enough to prevent spamming. */
-{
-    assert(list != NULL);
+/* TRIES: counts the number of consecutive connections dropped. */
+static int TRIES = 0;
 
-    Log(LOG_LEVEL_DEBUG, "Purging Old Connections...");
+/**
+ * Admission control: decide if one more connection fits within
+ * maxconnections. Done before the connection is queued for a worker, so
+ * that a flood of incoming connections never reaches the worker pool.
+ */
+static bool AdmitConnection(EvalContext *ctx, const char *ipaddr)
+{
+    /* Warn once when getting close to the limit, so that the problem is
+     * visible in the logs *before* connections start being dropped. */
+    static bool near_limit = false;
 
-    ThreadLock(cft_count);
-    Item *next;
-    for (Item *ip = *list; ip != NULL; ip = next)
+    ThreadLock(cft_server_children);
+    if (ACTIVE_THREADS >= CFD_MAXPROCESSES)
     {
-        int then = 0;
-        sscanf(ip->classes, "%d", &then);
-
-        next = ip->next;
-
-        if (now > then + 2 * SECONDS_PER_HOUR)
+        if (TRIES > MAXTRIES)
         {
-            Log(LOG_LEVEL_VERBOSE,
-                    "IP address '%s' has been more than two hours in connection list, purging",
-                    ip->name);
-            DeleteItem(list, ip);
+            /* This happens when no connection was closed while we had to
+             * drop 5 (or maxconnections/3) consecutive connections, because
+             * none of the existing connections finished. */
+            Log(LOG_LEVEL_CRIT,
+                "Server seems to be paralyzed. DOS attack? "
+                "Committing apoptosis...");
+            ThreadUnlock(cft_server_children);
+            ServerPoolLogStats(LOG_LEVEL_CRIT, "Connection handlers");
+            FatalError(ctx, "Terminating");
         }
-    }
-    ThreadUnlock(cft_count);
-
-    Log(LOG_LEVEL_DEBUG, "Done purging old connections");
-}
 
-/*********************************************************************/
-
-static void SpawnConnection(EvalContext *ctx, const char *ipaddr, ConnectionInfo *info)
-{
-    ServerConnectionState *conn = NULL;
-    int ret;
-    pthread_t tid;
-    pthread_attr_t threadattrs;
+        TRIES++;
+        Log(LOG_LEVEL_ERR,
+            "Too many connections (%d >= %d), dropping connection from '%s'! "
+            "Increase server maxconnections?",
+            ACTIVE_THREADS, CFD_MAXPROCESSES, ipaddr);
+        ThreadUnlock(cft_server_children);
 
-    conn = NewConn(ctx, info);                 /* freed in HandleConnection */
-    int sd_accepted = ConnectionInfoSocket(info);
-    strlcpy(conn->ipaddr, ipaddr, CF_MAX_IP_LEN );
+        ServerPoolLogStats(LOG_LEVEL_ERR, "Connection handlers");
+        return false;
+    }
 
-    Log(LOG_LEVEL_VERBOSE,
-        "New connection (from %s, sd %d), spawning new thread...",
-        conn->ipaddr, sd_accepted);
+    ACTIVE_THREADS++;
+    TRIES = 0;
 
-    ret = pthread_attr_init(&threadattrs);
-    if (ret != 0)
+    bool warn = false;
+    if (ACTIVE_THREADS >= CFD_MAXPROCESSES - CFD_MAXPROCESSES / 4)
     {
-        Log(LOG_LEVEL_ERR,
-            "SpawnConnection: Unable to initialize thread attributes (%s)",
-            GetErrorStr());
-        goto err;
+        warn = !near_limit;
+        near_limit = true;
     }
-    ret = pthread_attr_setdetachstate(&threadattrs, PTHREAD_CREATE_DETACHED);
-    if (ret != 0)
+    else if (ACTIVE_THREADS <= CFD_MAXPROCESSES / 2)
     {
-        Log(LOG_LEVEL_ERR,
-            "SpawnConnection: Unable to set thread to detached state (%s).",
-            GetErrorStr());
-        goto cleanup;
+        near_limit = false;
     }
-    ret = pthread_attr_setstacksize(&threadattrs, 1024 * 1024);
-    if (ret != 0)
+    int active = ACTIVE_THREADS;
+    ThreadUnlock(cft_server_children);
+
+    if (warn)
     {
         Log(LOG_LEVEL_WARNING,
-            "SpawnConnection: Unable to set thread stack size (%s).",
-            GetErrorStr());
-        /* Continue with default thread stack size. */
+            "Approaching the connection limit (%d of %d connections in use)",
+            active, CFD_MAXPROCESSES);
+        ServerPoolLogStats(LOG_LEVEL_WARNING, "Connection handlers");
     }
 
-    ret = pthread_create(&tid, &threadattrs, HandleConnection, conn);
-    if (ret != 0)
+    return true;
+}
+
+static void SpawnConnection(EvalContext *ctx, const char *ipaddr,
+                            ConnectionInfo *info, ConnectionRecord *record)
+{
+    ServerConnectionState *conn = NewConn(ctx, info); /* freed in CloseConnection */
+    if (conn == NULL)
     {
-        errno = ret;
-        Log(LOG_LEVEL_ERR,
-            "Unable to spawn worker thread. (pthread_create: %s)",
-            GetErrorStr());
-        goto cleanup;
+        ThreadLock(cft_count);
+        ConnectionTableRemove(SERVER_ACCESS.connections, record);
+        ThreadUnlock(cft_count);
+
+        if (info->is_call_collect)
+        {
+            CollectCallMarkProcessed();
+        }
+        cf_closesocket(ConnectionInfoSocket(info));
+        ConnectionInfoDestroy(&info);
+        return;
     }
 
-  cleanup:
-    pthread_attr_destroy(&threadattrs);
-  err:
-    if (ret != 0)
+    int sd_accepted = ConnectionInfoSocket(info);
+    strlcpy(conn->ipaddr, ipaddr, CF_MAX_IP_LEN );
+    conn->conn_record = record;
+
+    /* Pad with enough spaces for IPv4 addresses to be aligned. Max chars are
+     * 15 for the address plus two for "> " == 17. */
+    strlcpy(conn->log_prefix, conn->ipaddr, sizeof(conn->log_prefix));
+    strlcat(conn->log_prefix, "> ",         sizeof(conn->log_prefix));
+    size_t len;
+    for (len = strlen(conn->log_prefix);
+         len < 17 && len < sizeof(conn->log_prefix) - 1;
+         len++)
+    {
+        conn->log_prefix[len] = ' ';
+    }
+    conn->log_prefix[len] = '\0';
+
+    if (!AdmitConnection(ctx, conn->ipaddr))
+    {
+        if (info->is_call_collect)
+        {
+            CollectCallMarkProcessed();
+        }
+        DeleteConn(conn);
+        return;
+    }
+
+    Log(LOG_LEVEL_VERBOSE,
+        "New connection (from %s, sd %d), queueing for a worker thread...",
+        conn->ipaddr, sd_accepted);
+
+    if (!ServerPoolSubmit(conn))
     {
-        Log(LOG_LEVEL_WARNING, "Thread is being handled from main loop!");
-        HandleConnection(conn);
+        Log(LOG_LEVEL_WARNING, "Connection is being handled from main loop!");
+        while (ServeConnection(conn) != SERVER_POOL_CLOSE)
+        {
+        }
+        CloseConnection(conn);
     }
 }
 
@@ -277,70 +331,13 @@ static char *LogHook(LoggingPrivContext *log_ctx,
     return StringConcatenate(2, aligned_ipaddr, message);
 }
 
-/* TRIES: counts the number of consecutive connections dropped. */
-static int TRIES = 0;
-
-static void *HandleConnection(void *c)
+/**
+ * Decide the protocol from the first bytes the client sent.
+ */
+static bool StartConnection(ServerConnectionState *conn)
 {
-    ServerConnectionState *conn = c;
-    int ret;
-
-    /* Set logging prefix to be the IP address for all of thread's lifetime. */
-    /* These stack-allocated variables should be valid for all the lifetime of
-     * the thread. */
-    char aligned_ipaddr[CF_MAX_IP_LEN + 2];
-    LoggingPrivContext log_ctx = {
-        .log_hook = LogHook,
-        .param = aligned_ipaddr
-    };
-
-    strlcpy(aligned_ipaddr, conn->ipaddr, sizeof(aligned_ipaddr));
-    strlcat(aligned_ipaddr, "> ",         sizeof(aligned_ipaddr));
-    /* Pad with enough spaces for IPv4 addresses to be aligned. Max chars are
-     * 15 for the address plus two for "> " == 17. */
-    size_t len;
-    for (len = strlen(aligned_ipaddr); len < 17; len++)
-    {
-        aligned_ipaddr[len] = ' ';
-    }
-    aligned_ipaddr[len] = '\0';
-
-    LoggingPrivSetContext(&log_ctx);
-
     Log(LOG_LEVEL_INFO, "Accepting connection");
 
-    /* We test if number of active threads is greater than max, if so we deny
-       connection, if it happened too many times within a short timeframe then we
-       kill ourself.TODO this test should be done *before* spawning the thread. */
-    ThreadLock(cft_server_children);
-    if (ACTIVE_THREADS > CFD_MAXPROCESSES)
-    {
-        if (TRIES > MAXTRIES)
-        {
-            /* This happens when no thread was freed while we had to drop 5
-             * (or maxconnections/3) consecutive connections, because none of
-             * the existing threads finished. */
-            Log(LOG_LEVEL_CRIT,
-                "Server seems to be paralyzed. DOS attack? "
-                "Committing apoptosis...");
-            ThreadUnlock(cft_server_children);
-            FatalError(conn->ctx, "Terminating");
-        }
-
-        TRIES++;
-        Log(LOG_LEVEL_ERR,
-            "Too many threads (%d > %d), dropping connection! "
-            "Increase server maxconnections?",
-            ACTIVE_THREADS, CFD_MAXPROCESSES);
-
-        ThreadUnlock(cft_server_children);
-        goto conndone;
-    }
-
-    ACTIVE_THREADS++;
-    TRIES = 0;
-    ThreadUnlock(cft_server_children);
-
     DisableSendDelays(ConnectionInfoSocket(conn->conn_info));
 
     /* 20 times the connect() timeout should be enough to avoid MD5
@@ -354,95 +351,403 @@ static void *HandleConnection(void *c)
         bool success = ServerTLSPeek(conn->conn_info);
         if (!success)
         {
-            goto dethread;
+            return false;
         }
     }
 
     ProtocolVersion protocol_version = ConnectionInfoProtocolVersion(conn->conn_info);
     Log(LOG_LEVEL_DEBUG, "CFEngine protocol version '%s'", ProtocolVersionString(protocol_version));
 
+    return true;
+}
+
+static bool AdmitClassicConnection(const ServerConnectionState *conn)
+{
+    /* This connection is legacy protocol.
+     * We are not allowing it by default. */
+    if (!IsHostInList(SERVER_ACCESS.legacyconnects,
+                      SERVER_ACCESS.allowlegacyconnects, conn->ipaddr))
+    {
+        Log(LOG_LEVEL_INFO,
+            "Connection is not using latest protocol, denying");
+        return false;
+    }
+    return true;
+}
+
+/* New protocol does DNS reverse look up of the connected
+ * IP address, to check hostname access_rules. */
+static void ReverseLookup(ServerConnectionState *conn)
+{
+    if (NEED_REVERSE_LOOKUP)
+    {
+        int ret = getnameinfo((const struct sockaddr *) &conn->conn_info->ss,
+                              conn->conn_info->ss_len,
+                              conn->revdns, sizeof(conn->revdns),
+                              NULL, 0, NI_NAMEREQD);
+        if (ret != 0)
+        {
+            Log(LOG_LEVEL_INFO,
+                "Reverse lookup failed (getnameinfo: %s)!",
+                gai_strerror(ret));
+        }
+        else
+        {
+            Log(LOG_LEVEL_INFO,
+                "Hostname (reverse looked up): %s",
+                conn->revdns);
+        }
+    }
+}
+
+/**
+ * Decide the protocol and run the whole handshake, waiting for the client
+ * as needed, up to the point where the connection is ready to accept
+ * requests. Only used where connections can't be parked.
+ */
+static bool EstablishConnection(ServerConnectionState *conn)
+{
+    if (!StartConnection(conn))
+    {
+        return false;
+    }
+
+    ProtocolVersion protocol_version = ConnectionInfoProtocolVersion(conn->conn_info);
     if (ProtocolIsTLS(protocol_version))
     {
         bool established = ServerTLSSessionEstablish(conn, NULL);
         if (!established)
         {
-            goto dethread;
+            return false;
         }
+        ReverseLookup(conn);
     }
     else if (ProtocolIsClassic(protocol_version))
     {
-        /* This connection is legacy protocol.
-         * We are not allowing it by default. */
-        if (!IsMatchItemIn(SERVER_ACCESS.allowlegacyconnects, conn->ipaddr))
+        if (!AdmitClassicConnection(conn))
         {
-            Log(LOG_LEVEL_INFO,
-                "Connection is not using latest protocol, denying");
-            goto dethread;
+            return false;
         }
     }
     else
     {
-        UnexpectedError("HandleConnection: ProtocolVersion %d!",
+        UnexpectedError("EstablishConnection: ProtocolVersion %d!",
                         ConnectionInfoProtocolVersion(conn->conn_info));
-        goto dethread;
+        return false;
     }
 
+    conn->phase = CONN_PHASE_ESTABLISHED;
+    return true;
+}
 
-    /* =========================  MAIN LOOPS  ========================= */
-    if (ProtocolIsTLS(protocol_version))
+static ServerPoolNext FinishIdentification(ServerConnectionState *conn,
+                                           const char *identity)
+{
+    char username[sizeof(conn->username)] = "";
+    if (!ServerIdentificationParseIdentity(identity, username, sizeof(username)) ||
+        !ServerTLSSessionAuthorize(conn, username))
+    {
+        return SERVER_POOL_CLOSE;
+    }
+    ReverseLookup(conn);
+
+    conn->phase = CONN_PHASE_ESTABLISHED;
+    return SERVER_POOL_WAIT_READ;
+}
+
+/**
+ * Run the next step of the handshake. Each step only reads what
+ * ConnectionReady() found to be there already, so that a client that stops
+ * half way through is left parked instead of blocking a worker.
+ */
+static ServerPoolNext EstablishConnectionStep(ServerConnectionState *conn)
+{
+    char identity[1024] = "";
+    bool want_write = false;
+
+    switch (conn->phase)
+    {
+    case CONN_PHASE_NEW:
     {
-        /* New protocol does DNS reverse look up of the connected
-         * IP address, to check hostname access_rules. */
-        if (NEED_REVERSE_LOOKUP)
+        if (!StartConnection(conn))
         {
-            ret = getnameinfo((const struct sockaddr *) &conn->conn_info->ss,
-                              conn->conn_info->ss_len,
-                              conn->revdns, sizeof(conn->revdns),
-                              NULL, 0, NI_NAMEREQD);
-            if (ret != 0)
-            {
-                Log(LOG_LEVEL_INFO,
-                    "Reverse lookup failed (getnameinfo: %s)!",
-                    gai_strerror(ret));
-            }
-            else
+            return SERVER_POOL_CLOSE;
+        }
+
+        ProtocolVersion protocol_version =
+            ConnectionInfoProtocolVersion(conn->conn_info);
+        if (ProtocolIsClassic(protocol_version))
+        {
+            if (!AdmitClassicConnection(conn))
             {
-                Log(LOG_LEVEL_INFO,
-                    "Hostname (reverse looked up): %s",
-                    conn->revdns);
+                return SERVER_POOL_CLOSE;
             }
+            conn->phase = CONN_PHASE_ESTABLISHED;
+            return SERVER_POOL_WAIT_READ;
         }
+        if (!ProtocolIsTLS(protocol_version))
+        {
+            UnexpectedError("EstablishConnectionStep: ProtocolVersion %d!",
+                            protocol_version);
+            return SERVER_POOL_CLOSE;
+        }
+        conn->phase = CONN_PHASE_TLS_ACCEPT;
+    }
+    // fall through
+    case CONN_PHASE_TLS_ACCEPT:
+        switch (ServerTLSAcceptStep(conn, &want_write))
+        {
+        case 1:
+            break;
+        case 0:
+            return want_write ? SERVER_POOL_WAIT_WRITE : SERVER_POOL_WAIT_READ;
+        default:
+            return SERVER_POOL_CLOSE;
+        }
+
+        Log(LOG_LEVEL_VERBOSE, "TLS session established, checking trust...");
+        if (!ServerIdentificationSendHello(conn->conn_info))
+        {
+            return SERVER_POOL_CLOSE;
+        }
+        conn->phase = CONN_PHASE_TLS_VERSION;
+        return SERVER_POOL_WAIT_READ;
+
+    case CONN_PHASE_TLS_VERSION:
+        if (!ServerIdentificationRecvVersion(conn->conn_info,
+                                             identity, sizeof(identity)))
+        {
+            return SERVER_POOL_CLOSE;
+        }
+        if (identity[0] == '\0')
+        {
+            conn->phase = CONN_PHASE_TLS_IDENTITY;
+            return SERVER_POOL_WAIT_READ;
+        }
+        return FinishIdentification(conn, identity);
 
-        while (BusyWithNewProtocol(conn->ctx, conn))
+    case CONN_PHASE_TLS_IDENTITY:
+        if (!ServerIdentificationRecvIdentity(conn->conn_info,
+                                              identity, sizeof(identity)))
         {
+            return SERVER_POOL_CLOSE;
         }
+        return FinishIdentification(conn, identity);
+
+    case CONN_PHASE_ESTABLISHED:
+    default:
+        assert(!"EstablishConnectionStep on an established connection!");
+        return SERVER_POOL_CLOSE;
     }
-    else if (ProtocolIsClassic(protocol_version))
+}
+
+/**
+ * @return true if the TLS layer has already read more input, which parking
+ *         the connection would never report.
+ */
+static bool HasPendingInput(const ServerConnectionState *conn)
+{
+    SSL *ssl = ConnectionInfoSSL(conn->conn_info);
+    return (ssl != NULL && SSL_pending(ssl) > 0);
+}
+
+static ServerPoolNext ServeRequests(ServerConnectionState *conn)
+{
+    ProtocolVersion protocol_version =
+        ConnectionInfoProtocolVersion(conn->conn_info);
+
+    /* =========================  MAIN LOOPS  ========================= */
+    if (ProtocolIsTLS(protocol_version))
     {
-        while (BusyWithClassicConnection(conn->ctx, conn))
+        bool keep;
+        do
         {
-        }
+            keep = BusyWithNewProtocol(conn->ctx, conn);
+        } while (keep && HasPendingInput(conn));
+
+        return keep ? SERVER_POOL_WAIT_READ : SERVER_POOL_CLOSE;
     }
-    else
+    else if (ProtocolIsClassic(protocol_version))
     {
-        assert(!"Bogus protocol version - but we checked that already !");
+        bool keep = BusyWithClassicConnection(conn->ctx, conn);
+        return keep ? SERVER_POOL_WAIT_READ : SERVER_POOL_CLOSE;
     }
     /* ============================================================ */
 
-    Log(LOG_LEVEL_INFO, "Closing connection, terminating thread");
+    assert(!"Bogus protocol version - but we checked that already !");
+    return SERVER_POOL_CLOSE;
+}
 
-  dethread:
-    ThreadLock(cft_server_children);
-    ACTIVE_THREADS--;
-    ThreadUnlock(cft_server_children);
+/**
+ * Run the handshake one step at a time, then serve requests as long as the
+ * client keeps sending them. Called by the worker threads of server_pool.c,
+ * see ServerPoolServeFn.
+ *
+ * Where connections can't be parked, the whole handshake is done at once
+ * instead, waiting for the client as needed.
+ */
+static ServerPoolNext ServeConnection(ServerConnectionState *conn)
+{
+    /* Set logging prefix to be the IP address for the whole dispatch. */
+    LoggingPrivContext *prior = LoggingPrivGetContext();
+    LoggingPrivContext log_ctx = {
+        .log_hook = LogHook,
+        .param = conn->log_prefix
+    };
+    LoggingPrivSetContext(&log_ctx);
+
+    ServerPoolNext next;
+    if (conn->phase == CONN_PHASE_ESTABLISHED)
+    {
+        next = ServeRequests(conn);
+    }
+    else if (ServerPoolCanPark())
+    {
+        next = EstablishConnectionStep(conn);
+    }
+    else if (EstablishConnection(conn))
+    {
+        next = ServeRequests(conn);
+    }
+    else
+    {
+        next = SERVER_POOL_CLOSE;
+    }
+
+    LoggingPrivSetContext(prior);
+    return next;
+}
+
+/**
+ * Peek at the next request without consuming it.
+ *
+ * @return the number of bytes peeked, 0 if nothing arrived yet, -1 if the
+ *         connection is broken or closed.
+ */
+static int PeekRequest(const ServerConnectionState *conn,
+                       char *buf, size_t buf_size)
+{
+    if (ConnectionInfoSSL(conn->conn_info) != NULL)
+    {
+        return ServerTLSPeekRecord(conn->conn_info, buf, buf_size);
+    }
+
+#ifdef MSG_DONTWAIT
+    ssize_t got = recv(ConnectionInfoSocket(conn->conn_info),
+                       buf, buf_size, MSG_PEEK | MSG_DONTWAIT);
+    if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        return 0;
+    }
+    return (got > 0) ? (int) got : -1;
+#else
+    /* Connections are never parked, see ServerPoolCanPark(). */
+    return -1;
+#endif
+}
+
+/**
+ * Decide whether a parked connection can be served without waiting for the
+ * client, see ServerPoolReadyFn.
+ *
+ * During the handshake that's when a whole line has arrived, afterwards
+ * when a whole transaction (header and payload) has. The TLS client sends
+ * each of them in a single record, and SSL_peek() only ever sees the first
+ * pending record, so a client that splits them stays parked until it times
+ * out.
+ */
+static bool ConnectionReady(ServerConnectionState *conn)
+{
+    char buf[CF_BUFSIZE];
+    int got;
+
+    switch (conn->phase)
+    {
+    case CONN_PHASE_NEW:
+    case CONN_PHASE_TLS_ACCEPT:
+        /* Both only read what is already there. */
+        return true;
+
+    case CONN_PHASE_TLS_VERSION:
+    case CONN_PHASE_TLS_IDENTITY:
+        /* Same limit as ServerIdentificationRecvVersion(). */
+        got = PeekRequest(conn, buf, 1024);
+        return (got == -1 || got == 1024 || (got > 0 && buf[got - 1] == '\n'));
+
+    case CONN_PHASE_ESTABLISHED:
+    {
+        got = PeekRequest(conn, buf, sizeof(buf));
+        if (got == -1)
+        {
+            return true;
+        }
+        if (got < CF_INBAND_OFFSET)
+        {
+            return false;
+        }
+
+        /* Same parsing as ReceiveTransaction(), a bogus header is rejected
+         * there without reading any further. */
+        char proto[CF_INBAND_OFFSET + 1] = { 0 };
+        char status = 'x';
+        int len = 0;
+        memcpy(proto, buf, CF_INBAND_OFFSET);
+        if (sscanf(proto, "%c %d", &status, &len) != 2 ||
+            len <= 0 || len > CF_MSGSIZE)
+        {
+            return true;
+        }
+        return (got >= CF_INBAND_OFFSET + len);
+    }
+
+    default:
+        return true;
+    }
+}
+
+/**
+ * Counterpart of AdmitConnection(), see ServerPoolCloseFn.
+ */
+static void CloseConnection(ServerConnectionState *conn)
+{
+    LoggingPrivContext *prior = LoggingPrivGetContext();
+    LoggingPrivContext log_ctx = {
+        .log_hook = LogHook,
+        .param = conn->log_prefix
+    };
+    LoggingPrivSetContext(&log_ctx);
+
+    if (conn->phase == CONN_PHASE_ESTABLISHED)
+    {
+        Log(LOG_LEVEL_INFO, "Closing connection");
+    }
 
-  conndone:
     if (conn->conn_info->is_call_collect)
     {
         CollectCallMarkProcessed();
     }
     DeleteConn(conn);
-    return NULL;
+
+    LoggingPrivSetContext(prior);
+
+    /* Only once the connection is gone: a reload waits for ACTIVE_THREADS
+     * to drop to zero before freeing what connections refer to. */
+    ThreadLock(cft_server_children);
+    ACTIVE_THREADS--;
+    ThreadUnlock(cft_server_children);
+}
+
+/*********************************************************************/
+
+bool ServerStartWorkers(size_t workers)
+{
+    return ServerPoolStart(workers, CONNTIMEOUT * 20,
+                           ServeConnection, ConnectionReady, CloseConnection);
+}
+
+void ServerStopWorkers(void)
+{
+    ServerPoolStop();
 }
 
 
@@ -495,10 +800,10 @@ static void DeleteConn(ServerConnectionState *conn)
     }
     ConnectionInfoDestroy(&conn->conn_info);
 
-    if (conn->ipaddr[0] != '\0')
+    if (conn->conn_record != NULL)
     {
         ThreadLock(cft_count);
-        DeleteItemMatching(&SERVER_ACCESS.connectionlist, conn->ipaddr);
+        ConnectionTableRemove(SERVER_ACCESS.connections, conn->conn_record);
         ThreadUnlock(cft_count);
     }
 
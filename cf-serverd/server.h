@@ -30,6 +30,8 @@
 #include <cfnet.h>                                       /* AgentConnection */
 
 #include <generic_agent.h>
+#include <server_ipacl.h>                                          /* IPAcl */
+#include <server_conntable.h>                            /* ConnectionTable */
 
 
 //*******************************************************************
@@ -56,7 +58,7 @@ struct Auth_
 
 typedef struct
 {
-    Item *connectionlist;             /* List of currently open connections */
+    ConnectionTable *connections;     /* Currently open connections */
 
     /* body server control options */
     Item *nonattackerlist;                            /* "allowconnects" */
@@ -68,6 +70,13 @@ typedef struct
     char *allowciphers;
     char *allowtlsversion;
 
+    /* Compiled forms of the IP lists above, built once the policy is
+     * loaded; NULL when the respective list is empty. */
+    IPAcl *allowconnects;
+    IPAcl *denyconnects;
+    IPAcl *allowallconnects;
+    IPAcl *legacyconnects;
+
     /* ACL for resource_type "path". */
     Auth *admit;
     Auth *admittail;
@@ -88,6 +97,16 @@ typedef struct
 
 } ServerAccess;
 
+/* How far a connection got, see ServeConnection(). */
+typedef enum
+{
+    CONN_PHASE_NEW,                                 /* nothing received yet */
+    CONN_PHASE_TLS_ACCEPT,                   /* TLS handshake in progress */
+    CONN_PHASE_TLS_VERSION,     /* server hello sent, waiting for version */
+    CONN_PHASE_TLS_IDENTITY,             /* waiting for the IDENTITY line */
+    CONN_PHASE_ESTABLISHED,                          /* ready for requests */
+} ConnectionPhase;
+
 /* TODO rename to IncomingConnection */
 struct ServerConnectionState_
 {
@@ -124,6 +143,20 @@ struct ServerConnectionState_
     EvalContext *ctx;
 
     bool dump_reports;
+
+    /* Logging prefix for all messages about this connection, the IP address
+     * padded for alignment. */
+    char log_prefix[CF_MAX_IP_LEN + 2];
+
+    /* Entry in SERVER_ACCESS.connections, released when closing. */
+    ConnectionRecord *conn_record;
+
+    /* Connection dispatch state, see server_pool.c. */
+    ConnectionPhase phase;
+    bool wait_write;           /* parked until writable rather than readable */
+    time_t last_active;                  /* last time it was parked */
+    ServerConnectionState *parked_prev;
+    ServerConnectionState *parked_next;
 };
 
 typedef struct
@@ -138,6 +171,8 @@ typedef struct
 
 /* Used in cf-serverd-functions.c. */
 void ServerEntryPoint(EvalContext *ctx, const char *ipaddr, ConnectionInfo *info);
+bool ServerStartWorkers(size_t workers);
+void ServerStopWorkers(void);
 
 
 AgentConnection *ExtractCallBackChannel(ServerConnectionState *conn);
@@ -149,6 +184,8 @@ AgentConnection *ExtractCallBackChannel(ServerConnectionState *conn);
 #define CLOCK_DRIFT 3600
 
 
+/* Number of admitted connections not yet closed (queued, being served or
+ * parked idle); protected by cft_server_children. */
 extern int ACTIVE_THREADS;
 extern int CFD_MAXPROCESSES;
 extern bool DENYBADCLOCKS;
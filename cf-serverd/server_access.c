@@ -34,6 +34,10 @@
 #include <misc_lib.h>
 #include <file_lib.h>
 #include <regex.h>
+#include <alloc.h>
+#include <set.h>                                              /* StringSet */
+#include <item_lib.h>
+#include "server_ipacl.h"                                     /* IPAcl */
 
 
 struct acl *paths_acl;
@@ -289,6 +293,418 @@ static bool access_CheckResource(const struct resource_acl *acl,
 }
 
 
+/*******************************************************************/
+/* Compiled ACL                                                    */
+/*******************************************************************/
+
+/* Admit or deny rules of one resource, as hash sets and prefix tries. */
+struct admitdeny_index
+{
+    IPAcl *ips;
+    StrList *ip_patterns;                   /* legacy regex entries */
+    StringSet *hostnames;                   /* names and ".domain" suffixes */
+    StrList *hostname_patterns;             /* legacy regex entries */
+    StringSet *keys;
+    StringSet *usernames;
+};
+
+struct resource_index
+{
+    struct admitdeny_index admit;
+    struct admitdeny_index deny;
+};
+
+/**
+ * One path component. #dir is the resource for the path ending with this
+ * component and a FILE_SEPARATOR, #exact the one for the path ending with
+ * this component, or (size_t) -1 if there is no such entry.
+ */
+typedef struct PathNode_ PathNode;
+
+TYPED_MAP_DECLARE(PathNode, char *, PathNode *)
+
+struct PathNode_
+{
+    PathNodeMap *children;
+    size_t dir;
+    size_t exact;
+};
+
+struct acl_index
+{
+    PathNode *root;
+    size_t len;
+    struct resource_index resources[];
+};
+
+static void PathNodeDestroy(PathNode *node);
+
+TYPED_MAP_DEFINE(PathNode, char *, PathNode *,
+                 StringHash_untyped,
+                 StringEqual_untyped,
+                 free,
+                 PathNodeDestroy)
+
+static PathNode *PathNodeNew(void)
+{
+    PathNode *node = xcalloc(1, sizeof(PathNode));
+    node->dir   = (size_t) -1;
+    node->exact = (size_t) -1;
+    return node;
+}
+
+static void PathNodeDestroy(PathNode *node)
+{
+    if (node != NULL)
+    {
+        if (node->children != NULL)
+        {
+            PathNodeMapDestroy(node->children);
+        }
+        free(node);
+    }
+}
+
+static PathNode *PathNodeChild(const PathNode *node, const char *component)
+{
+    return (node->children != NULL) ?
+        PathNodeMapGet(node->children, component) : NULL;
+}
+
+static PathNode *PathNodeAddChild(PathNode *node, const char *component)
+{
+    PathNode *child = PathNodeChild(node, component);
+    if (child == NULL)
+    {
+        if (node->children == NULL)
+        {
+            node->children = PathNodeMapNew();
+        }
+        child = PathNodeNew();
+        PathNodeMapInsert(node->children, xstrdup(component), child);
+    }
+    return child;
+}
+
+static void PathIndexInsert(PathNode *root, const char *path, size_t pos)
+{
+    char *copy = xstrdup(path);
+    char *component = copy;
+    PathNode *node = root;
+
+    while (true)
+    {
+        char *sep = strchr(component, FILE_SEPARATOR);
+        if (sep == NULL)
+        {
+            if (component[0] == '\0')           /* directory, trailing '/' */
+            {
+                node->dir = pos;
+            }
+            else
+            {
+                PathNodeAddChild(node, component)->exact = pos;
+            }
+            break;
+        }
+
+        *sep = '\0';
+        node = PathNodeAddChild(node, component);
+        component = sep + 1;
+    }
+
+    free(copy);
+}
+
+/**
+ * Same result as StrList_SearchLongestPrefix(acl->resource_names, path,
+ * path_len, FILE_SEPARATOR, true): the deepest directory entry that is a
+ * parent of #path, or the entry equal to #path. One hash lookup per path
+ * component, no allocations.
+ */
+static size_t PathIndexSearch(const PathNode *root,
+                              const char *path, size_t path_len)
+{
+    char buf[PATH_MAX];
+    assert(path_len < sizeof(buf));
+    memcpy(buf, path, path_len);
+    buf[path_len] = '\0';
+
+    size_t found = (size_t) -1;
+    const PathNode *node = root;
+    char *component = buf;
+
+    while (node != NULL)
+    {
+        char *sep = strchr(component, FILE_SEPARATOR);
+        if (sep == NULL)
+        {
+            if (component[0] != '\0')
+            {
+                const PathNode *child = PathNodeChild(node, component);
+                if (child != NULL && child->exact != (size_t) -1)
+                {
+                    found = child->exact;
+                }
+            }
+            break;
+        }
+
+        *sep = '\0';
+        node = PathNodeChild(node, component);
+        if (node != NULL && node->dir != (size_t) -1)
+        {
+            found = node->dir;
+        }
+        component = sep + 1;
+    }
+
+    return found;
+}
+
+static StringSet *StringSetFromStrList(const StrList *sl)
+{
+    if (StrList_Len(sl) == 0)
+    {
+        return NULL;
+    }
+
+    StringSet *set = StringSetNew();
+    for (size_t i = 0; i < StrList_Len(sl); i++)
+    {
+        StringSetAdd(set, xstrdup(StrList_At(sl, i)));
+    }
+    return set;
+}
+
+/* Characters that make StringMatchFull() differ from a plain string
+ * compare. The legacy matcher regex-matches every entry, so a '.' in a
+ * name or address matches any character too. */
+static const char REGEX_CHARS[] = ".^$*+?()[]{}|\\";
+
+static StrList *PatternsFromStrList(const StrList *sl)
+{
+    StrList *patterns = NULL;
+    for (size_t i = 0; i < StrList_Len(sl); i++)
+    {
+        if (strpbrk(StrList_At(sl, i), REGEX_CHARS) != NULL)
+        {
+            StrList_Append(&patterns, StrList_At(sl, i));
+        }
+    }
+    return patterns;
+}
+
+/**
+ * StringMatchFull(#pattern, #s) for a pattern whose only special character
+ * is '.', without compiling it: most entries are plain dotted names and
+ * addresses.
+ */
+static bool DotPatternMatch(const char *pattern, const char *s)
+{
+    for (; *pattern != '\0' && *s != '\0'; pattern++, s++)
+    {
+        if (*pattern != '.' && *pattern != *s)
+        {
+            return false;
+        }
+    }
+    return (*pattern == '\0' && *s == '\0');
+}
+
+static bool PatternsMatch(const StrList *patterns, const char *s)
+{
+    for (size_t i = 0; i < StrList_Len(patterns); i++)
+    {
+        const char *pattern = StrList_At(patterns, i);
+        if (strpbrk(pattern, REGEX_CHARS + 1) == NULL ?
+            DotPatternMatch(pattern, s) : StringMatchFull(pattern, s))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void admitdeny_Compile(struct admitdeny_index *ad,
+                              const struct admitdeny_acl *src)
+{
+    if (StrList_Len(src->ips) > 0)
+    {
+        Item *ips = NULL;
+        for (size_t i = 0; i < StrList_Len(src->ips); i++)
+        {
+            PrependItem(&ips, StrList_At(src->ips, i), NULL);
+        }
+        ad->ips = IPAclCompile(ips);
+        DeleteItemList(ips);
+    }
+    ad->ip_patterns       = PatternsFromStrList(src->ips);
+    ad->hostnames         = StringSetFromStrList(src->hostnames);
+    ad->hostname_patterns = PatternsFromStrList(src->hostnames);
+    ad->keys              = StringSetFromStrList(src->keys);
+    ad->usernames         = StringSetFromStrList(src->usernames);
+}
+
+static void admitdeny_Destroy(struct admitdeny_index *ad)
+{
+    IPAclDestroy(ad->ips);
+    StrList_Free(&ad->ip_patterns);
+    StringSetDestroy(ad->hostnames);
+    StrList_Free(&ad->hostname_patterns);
+    StringSetDestroy(ad->keys);
+    StringSetDestroy(ad->usernames);
+}
+
+static bool admitdeny_MatchHostname(const struct admitdeny_index *ad,
+                                    const char *hostname)
+{
+    if (ad->hostnames != NULL)
+    {
+        /* "host.cfengine.com", then ".cfengine.com", then ".com". */
+        if (StringSetContains(ad->hostnames, hostname))
+        {
+            return true;
+        }
+        for (const char *dot = strchr(hostname, '.');
+             dot != NULL;
+             dot = strchr(dot + 1, '.'))
+        {
+            if (StringSetContains(ad->hostnames, dot))
+            {
+                return true;
+            }
+        }
+    }
+    return PatternsMatch(ad->hostname_patterns, hostname);
+}
+
+static bool admitdeny_Match(const struct admitdeny_index *ad, bool admit,
+                            const char *ipaddr, const char *hostname,
+                            const char *key, const char *username)
+{
+    const char *verdict = admit ? "Admit" : "Deny";
+
+    if (!NULL_OR_EMPTY(ipaddr) &&
+        ((ad->ips != NULL && IPAclMatch(ad->ips, ipaddr)) ||
+         PatternsMatch(ad->ip_patterns, ipaddr)))
+    {
+        Log(LOG_LEVEL_DEBUG, "%s IP due to rule matching: %s",
+            verdict, ipaddr);
+        return true;
+    }
+    if (!NULL_OR_EMPTY(hostname) &&
+        (ad->hostnames != NULL || ad->hostname_patterns != NULL))
+    {
+        if (admitdeny_MatchHostname(ad, hostname))
+        {
+            Log(LOG_LEVEL_DEBUG, "%s hostname due to rule matching: %s",
+                verdict, hostname);
+            return true;
+        }
+        if (admit)
+        {
+            Log(LOG_LEVEL_VERBOSE, "Hostname '%s' not admitted", hostname);
+        }
+    }
+    if (!NULL_OR_EMPTY(key) &&
+        ad->keys != NULL && StringSetContains(ad->keys, key))
+    {
+        Log(LOG_LEVEL_DEBUG, "%s key due to rule: %s", verdict, key);
+        return true;
+    }
+    if (!NULL_OR_EMPTY(username) &&
+        ad->usernames != NULL && StringSetContains(ad->usernames, username))
+    {
+        Log(LOG_LEVEL_DEBUG, "%s username due to rule: %s", verdict, username);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Same as access_CheckResource() with #found == NULL, using the compiled
+ * rules.
+ */
+static bool index_CheckResource(const struct resource_index *r,
+                                const char *ipaddr, const char *hostname,
+                                const char *key, const char *username)
+{
+    /* Denial takes precedence, but is only checked if admitted. */
+    return admitdeny_Match(&r->admit, true,  ipaddr, hostname, key, username) &&
+          !admitdeny_Match(&r->deny,  false, ipaddr, hostname, key, username);
+}
+
+static void acl_IndexDestroy(struct acl_index *index)
+{
+    if (index != NULL)
+    {
+        for (size_t i = 0; i < index->len; i++)
+        {
+            admitdeny_Destroy(&index->resources[i].admit);
+            admitdeny_Destroy(&index->resources[i].deny);
+        }
+        PathNodeDestroy(index->root);
+        free(index);
+    }
+}
+
+/**
+ * Build the lookup structures used by acl_CheckPath(): a trie of path
+ * components over acl->resource_names, and hash sets / IP prefix tries for
+ * the admit and deny rules of every resource. Call it once the ACL is fully
+ * populated; acl_SortedInsert() may not be called afterwards.
+ */
+void acl_Compile(struct acl *acl)
+{
+    assert(acl != NULL);
+    assert(acl->len == StrList_Len(acl->resource_names));
+
+    acl_IndexDestroy(acl->index);
+
+    struct acl_index *index =
+        xcalloc(1, sizeof(*index) + sizeof(*index->resources) * acl->len);
+    index->root = PathNodeNew();
+    index->len  = acl->len;
+
+    for (size_t i = 0; i < acl->len; i++)
+    {
+        PathIndexInsert(index->root, StrList_At(acl->resource_names, i), i);
+        admitdeny_Compile(&index->resources[i].admit, &acl->acls[i].admit);
+        admitdeny_Compile(&index->resources[i].deny,  &acl->acls[i].deny);
+    }
+
+    acl->index = index;
+    Log(LOG_LEVEL_DEBUG, "Compiled ACL with %zu entries", acl->len);
+}
+
+/* Find the entry for #path, see StrList_SearchLongestPrefix(). */
+static size_t acl_SearchPath(const struct acl *acl,
+                             const char *path, size_t path_len)
+{
+    if (acl->index != NULL && path_len < PATH_MAX)
+    {
+        return PathIndexSearch(acl->index->root, path, path_len);
+    }
+    return StrList_SearchLongestPrefix(acl->resource_names,
+                                       path, path_len,
+                                       FILE_SEPARATOR, true);
+}
+
+static bool acl_CheckResourceAt(const struct acl *acl, size_t pos,
+                                const char *ipaddr, const char *hostname,
+                                const char *key)
+{
+    if (acl->index != NULL)
+    {
+        return index_CheckResource(&acl->index->resources[pos],
+                                   ipaddr, hostname, key, NULL);
+    }
+    return access_CheckResource(&acl->acls[pos], NULL,
+                                ipaddr, hostname, key, NULL);
+}
+
+
 /**
  * Search #req_path in #acl, if found check its rules. The longest parent
  * directory of #req_path is searched, or an exact match. Directories *must*
@@ -305,14 +721,11 @@ bool acl_CheckPath(const struct acl *acl, const char *reqpath,
     size_t reqpath_len = strlen(reqpath);
 
     /* CHECK 1: Search for parent directory or exact entry in ACL. */
-    size_t pos = StrList_SearchLongestPrefix(acl->resource_names,
-                                             reqpath, reqpath_len,
-                                             FILE_SEPARATOR, true);
+    size_t pos = acl_SearchPath(acl, reqpath, reqpath_len);
 
     if (pos != (size_t) -1)                          /* acl entry was found */
     {
-        const struct resource_acl *racl = &acl->acls[pos];
-        bool ret = access_CheckResource(racl, NULL, ipaddr, hostname, key, NULL);
+        bool ret = acl_CheckResourceAt(acl, pos, ipaddr, hostname, key);
         if (ret == true)                  /* entry found that grants access */
         {
             access = true;
@@ -338,20 +751,17 @@ bool acl_CheckPath(const struct acl *acl, const char *reqpath,
     if (mangled_path_len != 0 &&
         mangled_path_len != (size_t) -1) /* Overflow, TODO handle separately. */
     {
-        size_t pos2 = StrList_SearchLongestPrefix(acl->resource_names,
-                                                  mangled_path, mangled_path_len,
-                                                  FILE_SEPARATOR, true);
+        size_t pos2 = acl_SearchPath(acl, mangled_path, mangled_path_len);
 
         if (pos2 != (size_t) -1)                   /* acl entry was found */
         {
             /* TODO make sure this match is more specific than the other one. */
-            const struct resource_acl *racl = &acl->acls[pos2];
             /* Check if the magic strings are allowed or denied. */
             bool ret =
-                access_CheckResource(racl, NULL,
-                                     "$(connection.ip)",
-                                     "$(connection.hostname)",
-                                     "$(connection.key)", NULL);
+                acl_CheckResourceAt(acl, pos2,
+                                    "$(connection.ip)",
+                                    "$(connection.hostname)",
+                                    "$(connection.key)");
             if (ret == true)                  /* entry found that grants access */
             {
                 access = true;
@@ -453,6 +863,7 @@ size_t acl_SortedInsert(struct acl **a, const char *handle)
     assert(handle != NULL);
 
     struct acl *acl = *a;                                    /* for clarity */
+    assert(acl->index == NULL);              /* would invalidate the index */
 
     size_t position = (size_t) -1;
     bool found = StrList_BinarySearch(acl->resource_names,
@@ -516,6 +927,7 @@ size_t acl_SortedInsert(struct acl **a, const char *handle)
 
 void acl_Free(struct acl *a)
 {
+    acl_IndexDestroy(a->index);
     StrList_Free(&a->resource_names);
 
     size_t i;
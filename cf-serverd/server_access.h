@@ -49,6 +49,9 @@ struct admitdeny_acl
     StrList *usernames;      /* currently used only in roles access promise */
 };
 
+/* Compiled lookup structures for a struct acl, see acl_Compile(). */
+struct acl_index;
+
 /**
  * This is a list of all resorce ACLs for one resource. E.g. for resource_type
  * == path, this should contain a list of all paths together with a list of
@@ -67,6 +70,7 @@ struct acl
     size_t len;                        /* Length of resource_names,acls[] */
     size_t alloc_len;                  /* Used for realloc() economy  */
     StrList *resource_names;           /* paths, class names, variables etc */
+    struct acl_index *index;           /* NULL until acl_Compile() */
     struct resource_acl
     {
         struct admitdeny_acl admit;
@@ -99,6 +103,7 @@ size_t ReplaceSpecialVariables(char *buf, size_t buf_size,
                                const char *find3, const char *repl3);
 
 size_t acl_SortedInsert(struct acl **a, const char *handle);
+void   acl_Compile(struct acl *acl);
 void   acl_Free(struct acl *a);
 void   acl_Summarise(const struct acl *acl, const char *title);
 
@@ -35,6 +35,7 @@ static const int CF_NOSIZE = -1;
 #include <files_names.h>
 #include <files_interfaces.h>
 #include <hash.h>
+#include <hash_index.h>                                 /* HashFileIndexed */
 #include <file_lib.h>
 #include <eval_context.h>
 #include <dir.h>
@@ -441,7 +442,7 @@ void CfGetFile(ServerFileGetState *args)
             Log(LOG_LEVEL_VERBOSE, "REFUSAL to user='%s' of request: %s",
                 NULL_OR_EMPTY(args->conn->username) ? "?" : args->conn->username,
                 args->replyfile);
-            FileStreamRefuse(args->conn->conn_info->ssl);
+            FileStreamRefuse(args->conn->conn_info->ssl, version);
             return;
         }
         /* Else then handle older protocols */
@@ -464,7 +465,7 @@ void CfGetFile(ServerFileGetState *args)
 
     const ProtocolVersion version = ConnectionInfoProtocolVersion(conn_info);
     if (ProtocolSupportsFileStream(version)) {
-        FileStreamServe(conn_info->ssl, filename);
+        FileStreamServe(conn_info->ssl, filename, version);
         return;
     }
 
@@ -727,62 +728,63 @@ void CfEncryptGetFile(ServerFileGetState *args)
     close(fd);
 }
 
-int StatFile(ServerConnectionState *conn, char *sendbuffer, char *ofilename)
+/**
+ * Fill #cfst with the information that STAT returns for #filename, with
+ * #linkbuf receiving the link target if it's a symlink ("" otherwise).
+ *
+ * @return 0 on success, -1 in which case #errmsg contains the "BAD: ..."
+ *         reply to send.
+ */
+static int StatFileInfo(const char *filename, Stat *cfst,
+                        char *linkbuf, size_t linkbuf_size,
+                        char *errmsg, size_t errmsg_size)
 /* Because we do not know the size or structure of remote datatypes,*/
 /* the simplest way to transfer the data is to convert them into */
 /* plain text and interpret them on the other side. */
 {
-    assert(conn != NULL);
-    Stat cfst;
     struct stat statbuf, statlinkbuf;
-    char linkbuf[CF_BUFSIZE], filename[CF_BUFSIZE - 128];
     int islink = false;
 
-    TranslatePath(ofilename, filename, sizeof(filename));
-
-    memset(&cfst, 0, sizeof(Stat));
+    memset(cfst, 0, sizeof(Stat));
 
     if (strlen(ReadLastNode(filename)) > CF_MAXLINKSIZE)
     {
-        snprintf(sendbuffer, CF_MSGSIZE, "BAD: Filename suspiciously long [%s]", filename);
-        Log(LOG_LEVEL_ERR, "%s", sendbuffer);
-        SendTransaction(conn->conn_info, sendbuffer, 0, CF_DONE);
+        snprintf(errmsg, errmsg_size, "BAD: Filename suspiciously long [%s]", filename);
+        Log(LOG_LEVEL_ERR, "%s", errmsg);
         return -1;
     }
 
     if (lstat(filename, &statbuf) == -1)
     {
-        snprintf(sendbuffer, CF_MSGSIZE, "BAD: unable to stat file %s", filename);
-        Log(LOG_LEVEL_VERBOSE, "%s. (lstat: %s)", sendbuffer, GetErrorStr());
-        SendTransaction(conn->conn_info, sendbuffer, 0, CF_DONE);
+        snprintf(errmsg, errmsg_size, "BAD: unable to stat file %s", filename);
+        Log(LOG_LEVEL_VERBOSE, "%s. (lstat: %s)", errmsg, GetErrorStr());
         return -1;
     }
 
-    cfst.cf_readlink = NULL;
-    cfst.cf_lmode = 0;
-    cfst.cf_nlink = CF_NOSIZE;
+    cfst->cf_readlink = NULL;
+    cfst->cf_lmode = 0;
+    cfst->cf_nlink = CF_NOSIZE;
 
-    memset(linkbuf, 0, CF_BUFSIZE);
+    memset(linkbuf, 0, linkbuf_size);
 
 #ifndef __MINGW32__                   // windows doesn't support symbolic links
     if (S_ISLNK(statbuf.st_mode))
     {
         islink = true;
-        cfst.cf_type = FILE_TYPE_LINK; /* pointless - overwritten */
-        cfst.cf_lmode = statbuf.st_mode & 07777;
-        cfst.cf_nlink = statbuf.st_nlink;
+        cfst->cf_type = FILE_TYPE_LINK; /* pointless - overwritten */
+        cfst->cf_lmode = statbuf.st_mode & 07777;
+        cfst->cf_nlink = statbuf.st_nlink;
 
-        if (readlink(filename, linkbuf, CF_BUFSIZE - 1) == -1)
+        if (readlink(filename, linkbuf, linkbuf_size - 1) == -1)
         {
-            strcpy(sendbuffer, "BAD: unable to read link");
-            Log(LOG_LEVEL_ERR, "%s. (readlink: %s)", sendbuffer, GetErrorStr());
-            SendTransaction(conn->conn_info, sendbuffer, 0, CF_DONE);
+            strlcpy(errmsg, "BAD: unable to read link", errmsg_size);
+            Log(LOG_LEVEL_ERR, "%s. (readlink: %s)", errmsg, GetErrorStr());
             return -1;
         }
 
         Log(LOG_LEVEL_DEBUG, "readlink '%s'", linkbuf);
 
-        cfst.cf_readlink = linkbuf;
+        cfst->cf_readlink = linkbuf;
     }
 
     if (islink && (stat(filename, &statlinkbuf) != -1))       /* linktype=copy used by agent */
@@ -800,77 +802,99 @@ int StatFile(ServerConnectionState *conn, char *sendbuffer, char *ofilename)
 
     if (S_ISDIR(statbuf.st_mode))
     {
-        cfst.cf_type = FILE_TYPE_DIR;
+        cfst->cf_type = FILE_TYPE_DIR;
     }
 
     if (S_ISREG(statbuf.st_mode))
     {
-        cfst.cf_type = FILE_TYPE_REGULAR;
+        cfst->cf_type = FILE_TYPE_REGULAR;
     }
 
     if (S_ISSOCK(statbuf.st_mode))
     {
-        cfst.cf_type = FILE_TYPE_SOCK;
+        cfst->cf_type = FILE_TYPE_SOCK;
     }
 
     if (S_ISCHR(statbuf.st_mode))
     {
-        cfst.cf_type = FILE_TYPE_CHAR_;
+        cfst->cf_type = FILE_TYPE_CHAR_;
     }
 
     if (S_ISBLK(statbuf.st_mode))
     {
-        cfst.cf_type = FILE_TYPE_BLOCK;
+        cfst->cf_type = FILE_TYPE_BLOCK;
     }
 
     if (S_ISFIFO(statbuf.st_mode))
     {
-        cfst.cf_type = FILE_TYPE_FIFO;
+        cfst->cf_type = FILE_TYPE_FIFO;
     }
 
-    cfst.cf_mode = statbuf.st_mode & 07777;
-    cfst.cf_uid = statbuf.st_uid & 0xFFFFFFFF;
-    cfst.cf_gid = statbuf.st_gid & 0xFFFFFFFF;
-    cfst.cf_size = statbuf.st_size;
-    cfst.cf_atime = statbuf.st_atime;
-    cfst.cf_mtime = statbuf.st_mtime;
-    cfst.cf_ctime = statbuf.st_ctime;
-    cfst.cf_ino = statbuf.st_ino;
-    cfst.cf_dev = statbuf.st_dev;
-    cfst.cf_readlink = linkbuf;
+    cfst->cf_mode = statbuf.st_mode & 07777;
+    cfst->cf_uid = statbuf.st_uid & 0xFFFFFFFF;
+    cfst->cf_gid = statbuf.st_gid & 0xFFFFFFFF;
+    cfst->cf_size = statbuf.st_size;
+    cfst->cf_atime = statbuf.st_atime;
+    cfst->cf_mtime = statbuf.st_mtime;
+    cfst->cf_ctime = statbuf.st_ctime;
+    cfst->cf_ino = statbuf.st_ino;
+    cfst->cf_dev = statbuf.st_dev;
+    cfst->cf_readlink = linkbuf;
 
-    if (cfst.cf_nlink == CF_NOSIZE)
+    if (cfst->cf_nlink == CF_NOSIZE)
     {
-        cfst.cf_nlink = statbuf.st_nlink;
+        cfst->cf_nlink = statbuf.st_nlink;
     }
 
     /* Is file sparse? */
     if (statbuf.st_size > ST_NBYTES(statbuf))
     {
-        cfst.cf_makeholes = 1;  /* must have a hole to get checksum right */
+        cfst->cf_makeholes = 1;  /* must have a hole to get checksum right */
     }
     else
     {
-        cfst.cf_makeholes = 0;
+        cfst->cf_makeholes = 0;
     }
 
-    memset(sendbuffer, 0, CF_MSGSIZE);
-
-    /* send as plain text */
+    return 0;
+}
 
+/* The "OK: ..." STAT reply, parsed by StatParseResponse() on the client. */
+static void StatFileFormat(const Stat *cfst, char *buf, size_t buf_size)
+{
     Log(LOG_LEVEL_DEBUG, "OK: type = %d, mode = %jo, lmode = %jo, "
         "uid = %ju, gid = %ju, size = %jd, atime=%jd, mtime = %jd",
-        cfst.cf_type, (uintmax_t) cfst.cf_mode, (uintmax_t) cfst.cf_lmode,
-        (uintmax_t) cfst.cf_uid, (uintmax_t) cfst.cf_gid, (intmax_t) cfst.cf_size,
-        (intmax_t) cfst.cf_atime, (intmax_t) cfst.cf_mtime);
+        cfst->cf_type, (uintmax_t) cfst->cf_mode, (uintmax_t) cfst->cf_lmode,
+        (uintmax_t) cfst->cf_uid, (uintmax_t) cfst->cf_gid, (intmax_t) cfst->cf_size,
+        (intmax_t) cfst->cf_atime, (intmax_t) cfst->cf_mtime);
 
-    snprintf(sendbuffer, CF_MSGSIZE,
+    snprintf(buf, buf_size,
              "OK: %d %ju %ju %ju %ju %jd %jd %jd %jd %d %d %d %jd",
-             cfst.cf_type, (uintmax_t) cfst.cf_mode, (uintmax_t) cfst.cf_lmode,
-             (uintmax_t) cfst.cf_uid, (uintmax_t) cfst.cf_gid,   (intmax_t) cfst.cf_size,
-             (intmax_t) cfst.cf_atime, (intmax_t) cfst.cf_mtime, (intmax_t) cfst.cf_ctime,
-             cfst.cf_makeholes, cfst.cf_ino, cfst.cf_nlink, (intmax_t) cfst.cf_dev);
+             cfst->cf_type, (uintmax_t) cfst->cf_mode, (uintmax_t) cfst->cf_lmode,
+             (uintmax_t) cfst->cf_uid, (uintmax_t) cfst->cf_gid,   (intmax_t) cfst->cf_size,
+             (intmax_t) cfst->cf_atime, (intmax_t) cfst->cf_mtime, (intmax_t) cfst->cf_ctime,
+             cfst->cf_makeholes, cfst->cf_ino, cfst->cf_nlink, (intmax_t) cfst->cf_dev);
+}
 
+int StatFile(ServerConnectionState *conn, char *sendbuffer, char *ofilename)
+{
+    assert(conn != NULL);
+    Stat cfst;
+    char linkbuf[CF_BUFSIZE], filename[CF_BUFSIZE - 128];
+
+    TranslatePath(ofilename, filename, sizeof(filename));
+
+    if (StatFileInfo(filename, &cfst, linkbuf, sizeof(linkbuf),
+                     sendbuffer, CF_MSGSIZE) == -1)
+    {
+        SendTransaction(conn->conn_info, sendbuffer, 0, CF_DONE);
+        return -1;
+    }
+
+    memset(sendbuffer, 0, CF_MSGSIZE);
+
+    /* send as plain text */
+    StatFileFormat(&cfst, sendbuffer, CF_MSGSIZE);
     SendTransaction(conn->conn_info, sendbuffer, 0, CF_DONE);
 
     memset(sendbuffer, 0, CF_MSGSIZE);
@@ -906,7 +930,7 @@ bool CompareLocalHash(const char *filename, const unsigned char digest[EVP_MAX_M
 
     unsigned char file_digest[EVP_MAX_MD_SIZE + 1] = { 0 };
     /* TODO connection might timeout if this takes long! */
-    HashFile(translated_filename, file_digest, CF_DEFAULT_DIGEST, false);
+    HashFileIndexed(translated_filename, file_digest, CF_DEFAULT_DIGEST);
 
     if (HashesMatch(digest, file_digest, CF_DEFAULT_DIGEST))
     {
@@ -1115,6 +1139,278 @@ int CfSecOpenDirectory(ServerConnectionState *conn, char *sendbuffer, char *dirn
     return 0;
 }
 
+/**************************************************************/
+
+/* Limits for one STATTREE reply (STATTREE_MAX_ENTRIES is in
+ * protocol_version.h): past them, directories are sent without their
+ * contents and the client asks for them separately. The depth limit also
+ * bounds the recursion in StatTreeWalk(). */
+#define STATTREE_MAX_DEPTH   32
+
+typedef struct
+{
+    ServerConnectionState *conn;
+    const char *key;                    /* client's key, for the ACL */
+    char *sendbuffer;                   /* CF_MSGSIZE */
+    size_t offset;
+    size_t entries;
+    size_t max_entries;                 /* STATTREE_MAX_ENTRIES */
+    int maxdepth;
+    bool digests;
+    char path[CF_BUFSIZE];              /* current directory, trailing '/' */
+    char relpath[CF_BUFSIZE];           /* same, relative to the request */
+} StatTreeState;
+
+/**
+ * Append a record of NUL-terminated fields to the reply, sending the
+ * current transaction first if the record doesn't fit.
+ */
+static bool StatTreeAppend(StatTreeState *st, const char *const *fields,
+                           size_t num_fields)
+{
+    size_t len = 0;
+    for (size_t i = 0; i < num_fields; i++)
+    {
+        len += strlen(fields[i]) + 1;
+    }
+    if (len > CF_MSGSIZE)
+    {
+        return false;
+    }
+
+    if (st->offset + len > CF_MSGSIZE)
+    {
+        if (SendTransaction(st->conn->conn_info, st->sendbuffer,
+                            st->offset, CF_MORE) == -1)
+        {
+            return false;
+        }
+        st->offset = 0;
+    }
+
+    for (size_t i = 0; i < num_fields; i++)
+    {
+        size_t field_len = strlen(fields[i]) + 1;
+        memcpy(st->sendbuffer + st->offset, fields[i], field_len);
+        st->offset += field_len;
+    }
+    return true;
+}
+
+static bool StatTreeWalk(StatTreeState *st, Dir *dirh, int depth)
+{
+    const size_t path_len    = strlen(st->path);
+    const size_t relpath_len = strlen(st->relpath);
+    bool ok = true;
+
+    for (const struct dirent *dirp = DirRead(dirh);
+         ok && dirp != NULL;
+         dirp = DirRead(dirh))
+    {
+        if (strcmp(dirp->d_name, ".") == 0 || strcmp(dirp->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        /* The listing has to be complete, so give up if it can't be. */
+        if (path_len + strlen(dirp->d_name) + 2 > sizeof(st->path) ||
+            relpath_len + strlen(dirp->d_name) + 2 > sizeof(st->relpath))
+        {
+            Log(LOG_LEVEL_INFO, "STATTREE: path too long in '%s'", st->path);
+            ok = false;
+            break;
+        }
+        strcpy(st->path + path_len, dirp->d_name);
+        strcpy(st->relpath + relpath_len, dirp->d_name);
+
+        char translated[CF_BUFSIZE - 128];
+        TranslatePath(st->path, translated, sizeof(translated));
+
+        Stat cfst;
+        char linkbuf[CF_BUFSIZE];
+        char statline[CF_MAXVARSIZE];
+        char digest_str[CF_HOSTKEY_STRING_SIZE] = "";
+        Dir *subdir = NULL;
+
+        if (StatFileInfo(translated, &cfst, linkbuf, sizeof(linkbuf),
+                         statline, sizeof(statline)) == -1)
+        {
+            linkbuf[0] = '\0';
+        }
+        else
+        {
+            bool is_dir = (cfst.cf_type == FILE_TYPE_DIR && cfst.cf_lmode == 0);
+            if (is_dir)
+            {
+                PathAppendTrailingSlash(st->path, strlen(st->path));
+            }
+
+            if (!acl_CheckPath(paths_acl, st->path, st->conn->ipaddr,
+                               st->conn->revdns, st->key))
+            {
+                /* Listed, but the client gets the denial from STAT. */
+                Log(LOG_LEVEL_VERBOSE, "access denied to STAT: %s", st->path);
+                strlcpy(statline, "BAD: access denied", sizeof(statline));
+                linkbuf[0] = '\0';
+            }
+            else if (strlen(linkbuf) + 3 > CF_MSGSIZE)
+            {
+                strlcpy(statline, "BAD: Symlink resolves to a path too long",
+                        sizeof(statline));
+                linkbuf[0] = '\0';
+            }
+            else
+            {
+                StatFileFormat(&cfst, statline, sizeof(statline));
+
+                if (st->digests && cfst.cf_type == FILE_TYPE_REGULAR)
+                {
+                    unsigned char digest[EVP_MAX_MD_SIZE + 1];
+                    HashFileIndexed(translated, digest, CF_DEFAULT_DIGEST);
+                    HashPrintSafe(digest_str, sizeof(digest_str), digest,
+                                  CF_DEFAULT_DIGEST, false);
+                }
+
+                if (is_dir && depth < st->maxdepth &&
+                    st->entries < st->max_entries)
+                {
+                    subdir = DirOpen(translated);
+                }
+            }
+        }
+
+        const char *fields[] =
+        {
+            st->relpath, statline, linkbuf, digest_str,
+            (subdir != NULL) ? "1" : "0"
+        };
+        ok = StatTreeAppend(st, fields, sizeof(fields) / sizeof(fields[0]));
+        st->entries++;
+
+        if (ok && subdir != NULL)
+        {
+            PathAppendTrailingSlash(st->relpath, strlen(st->relpath));
+            ok = StatTreeWalk(st, subdir, depth + 1);
+        }
+        if (subdir != NULL)
+        {
+            DirClose(subdir);
+        }
+
+        st->path[path_len]       = '\0';
+        st->relpath[relpath_len] = '\0';
+    }
+
+    return ok;
+}
+
+/**
+ * Send the STATTREE reply for #dirname, which must end with '/', with the
+ * limits and client set up in #st.
+ */
+static int StatTreeSend(StatTreeState *st, const char *dirname)
+{
+    strlcpy(st->path, dirname, sizeof(st->path));
+
+    char translated[CF_BUFSIZE - 128];
+    TranslatePath(dirname, translated, sizeof(translated));
+
+    Stat cfst;
+    char linkbuf[CF_BUFSIZE];
+    char statline[CF_MAXVARSIZE];
+    Dir *dirh = NULL;
+
+    if (!IsAbsoluteFileName(translated))
+    {
+        strlcpy(statline, "BAD: request to access a non-absolute filename",
+                sizeof(statline));
+    }
+    else if (StatFileInfo(translated, &cfst, linkbuf, sizeof(linkbuf),
+                          statline, sizeof(statline)) == 0)
+    {
+        if (cfst.cf_type != FILE_TYPE_DIR || st->maxdepth < 1)
+        {
+            snprintf(statline, sizeof(statline),
+                     "BAD: cfengine, couldn't open dir %s", dirname);
+        }
+        else if ((dirh = DirOpen(translated)) == NULL)
+        {
+            Log(LOG_LEVEL_INFO, "Couldn't open directory '%s' (DirOpen:%s)",
+                translated, GetErrorStr());
+            snprintf(statline, sizeof(statline),
+                     "BAD: cfengine, couldn't open dir %s", dirname);
+        }
+    }
+
+    if (dirh == NULL)
+    {
+        SendTransaction(st->conn->conn_info, statline, 0, CF_DONE);
+        return -1;
+    }
+
+    StatFileFormat(&cfst, statline, sizeof(statline));
+    const char *root[] = { ".", statline, linkbuf, "", "1" };
+    bool ok = StatTreeAppend(st, root, sizeof(root) / sizeof(root[0])) &&
+              StatTreeWalk(st, dirh, 1);
+    DirClose(dirh);
+
+    int ret = 0;
+    if (ok)
+    {
+        const char *end[] = { CFD_TERMINATOR };
+        ok = StatTreeAppend(st, end, 1);
+    }
+    if (ok)
+    {
+        SendTransaction(st->conn->conn_info, st->sendbuffer, st->offset,
+                        CF_DONE);
+        Log(LOG_LEVEL_VERBOSE, "STATTREE: sent %zu entries of '%s'",
+            st->entries, dirname);
+    }
+    else
+    {
+        /* The client drops everything it got so far. */
+        strlcpy(st->sendbuffer, "BAD: cfengine, couldn't list tree",
+                CF_MSGSIZE);
+        SendTransaction(st->conn->conn_info, st->sendbuffer, 0, CF_DONE);
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/**
+ * Reply to STATTREE: stat everything under #dirname, #maxdepth directory
+ * levels deep, in one streamed reply. Each entry is a record of five
+ * NUL-terminated fields:
+ *
+ *   relative path ("." for #dirname itself)
+ *   STAT reply, "OK: ..." or "BAD: ..." if the entry can't be stat'ed
+ *   link target, or ""
+ *   CF_DEFAULT_DIGEST of regular files in hex if #digests, or ""
+ *   "1" if the entries of this directory follow, else "0"
+ *
+ * Records are in depth-first order, so the entries of a directory follow
+ * it. The last record is CFD_TERMINATOR alone.
+ */
+int CfStatTree(ServerConnectionState *conn, char *sendbuffer,
+               const char *dirname, int maxdepth, bool digests)
+{
+    assert(conn != NULL);
+    assert(dirname != NULL);
+
+    StatTreeState *st = xcalloc(1, sizeof(StatTreeState));
+    st->conn        = conn;
+    st->key         = KeyPrintableHash(ConnectionInfoKey(conn->conn_info));
+    st->sendbuffer  = sendbuffer;
+    st->max_entries = STATTREE_MAX_ENTRIES;
+    st->maxdepth    = MIN(maxdepth, STATTREE_MAX_DEPTH);
+    st->digests     = digests;
+
+    int ret = StatTreeSend(st, dirname);
+    free(st);
+    return ret;
+}
 
 /********************* MISC UTILITY FUNCTIONS *************************/
 
@@ -0,0 +1,229 @@
+/*
+  Copyright 2024 Northern.tech AS
+
+  This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; version 3.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#include <server_conntable.h>
+
+#include <alloc.h>
+#include <logging.h>
+#include <map.h>
+#include <string_lib.h>                              /* StringHash_untyped */
+
+
+/**
+   Define HostCountMap.
+   Key:   remote IP address
+   Value: number of connections from it (size_t *)
+*/
+TYPED_MAP_DECLARE(HostCount, char *, size_t *)
+
+TYPED_MAP_DEFINE(HostCount, char *, size_t *,
+                 StringHash_untyped,
+                 StringEqual_untyped,
+                 free,
+                 free)
+
+struct ConnectionRecord_
+{
+    char *ipaddr;
+    time_t since;
+    bool expired;                       /* purged, only waiting for Remove */
+    ConnectionRecord *prev;
+    ConnectionRecord *next;
+};
+
+struct ConnectionTable_
+{
+    HostCountMap *hosts;
+    time_t lifetime;
+    size_t count;
+
+    /* Expiry queue, oldest first. */
+    ConnectionRecord *head;
+    ConnectionRecord *tail;
+};
+
+
+ConnectionTable *ConnectionTableNew(time_t lifetime)
+{
+    ConnectionTable *table = xcalloc(1, sizeof(ConnectionTable));
+    table->hosts = HostCountMapNew();
+    table->lifetime = lifetime;
+    return table;
+}
+
+void ConnectionTableDestroy(ConnectionTable *table)
+{
+    if (table != NULL)
+    {
+        /* Records belong to their connections, just mark them orphaned. */
+        for (ConnectionRecord *r = table->head; r != NULL; r = r->next)
+        {
+            r->expired = true;
+        }
+        HostCountMapDestroy(table->hosts);
+        free(table);
+    }
+}
+
+static void Unlink(ConnectionTable *table, ConnectionRecord *record)
+{
+    assert(!record->expired);
+
+    if (record->prev != NULL)
+    {
+        record->prev->next = record->next;
+    }
+    else
+    {
+        table->head = record->next;
+    }
+    if (record->next != NULL)
+    {
+        record->next->prev = record->prev;
+    }
+    else
+    {
+        table->tail = record->prev;
+    }
+    record->prev = NULL;
+    record->next = NULL;
+    record->expired = true;
+    table->count--;
+
+    size_t *n = HostCountMapGet(table->hosts, record->ipaddr);
+    assert(n != NULL && *n > 0);
+    if (n != NULL && --(*n) == 0)
+    {
+        HostCountMapRemove(table->hosts, record->ipaddr);
+    }
+}
+
+/**
+ * Register a new connection.
+ *
+ * @param allow_multiple If false and there is already a connection from
+ *                       ipaddr, the connection is refused.
+ * @return the record to pass to ConnectionTableRemove() when the connection
+ *         is closed, or NULL if the connection was refused.
+ */
+ConnectionRecord *ConnectionTableAdd(ConnectionTable *table,
+                                     const char *ipaddr, time_t now,
+                                     bool allow_multiple)
+{
+    assert(table != NULL);
+    assert(ipaddr != NULL);
+
+    size_t *n = HostCountMapGet(table->hosts, ipaddr);
+    if (n != NULL && !allow_multiple)
+    {
+        return NULL;
+    }
+    if (n == NULL)
+    {
+        n = xcalloc(1, sizeof(size_t));
+        HostCountMapInsert(table->hosts, xstrdup(ipaddr), n);
+    }
+    (*n)++;
+
+    ConnectionRecord *record = xcalloc(1, sizeof(ConnectionRecord));
+    record->ipaddr = xstrdup(ipaddr);
+    record->since = now;
+
+    /* Clock might have jumped backwards, keep the queue sorted anyway. */
+    if (table->tail != NULL && record->since < table->tail->since)
+    {
+        record->since = table->tail->since;
+    }
+
+    record->prev = table->tail;
+    if (table->tail != NULL)
+    {
+        table->tail->next = record;
+    }
+    else
+    {
+        table->head = record;
+    }
+    table->tail = record;
+    table->count++;
+
+    return record;
+}
+
+void ConnectionTableRemove(ConnectionTable *table, ConnectionRecord *record)
+{
+    if (record == NULL)
+    {
+        return;
+    }
+
+    if (!record->expired)
+    {
+        assert(table != NULL);
+        Unlink(table, record);
+    }
+    free(record->ipaddr);
+    free(record);
+}
+
+/**
+ * Some connections might not terminate properly. Forget about the ones
+ * older than the table's lifetime, so that they stop counting against the
+ * one-connection-per-host limit.
+ *
+ * @return number of connections purged.
+ */
+size_t ConnectionTablePurge(ConnectionTable *table, time_t now)
+{
+    assert(table != NULL);
+
+    size_t purged = 0;
+    while (table->head != NULL &&
+           now > table->head->since + table->lifetime)
+    {
+        ConnectionRecord *record = table->head;
+        Log(LOG_LEVEL_VERBOSE,
+            "IP address '%s' has been more than %jd seconds in connection list, purging",
+            record->ipaddr, (intmax_t) table->lifetime);
+        Unlink(table, record);
+        purged++;
+    }
+    return purged;
+}
+
+size_t ConnectionTableCount(const ConnectionTable *table)
+{
+    return (table != NULL) ? table->count : 0;
+}
+
+size_t ConnectionTableCountHost(const ConnectionTable *table,
+                                const char *ipaddr)
+{
+    if (table == NULL)
+    {
+        return 0;
+    }
+    const size_t *n = HostCountMapGet(table->hosts, ipaddr);
+    return (n != NULL) ? *n : 0;
+}
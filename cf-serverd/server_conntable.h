@@ -0,0 +1,62 @@
+/*
+  Copyright 2024 Northern.tech AS
+
+  This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; version 3.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#ifndef CFENGINE_SERVER_CONNTABLE_H
+#define CFENGINE_SERVER_CONNTABLE_H
+
+
+#include <platform.h>
+
+
+/**
+ * Currently open connections, counted per remote IP address.
+ *
+ * Lookups by address are hashed. Every connection also sits on an expiry
+ * queue ordered by the time it was added; since all connections share the
+ * same lifetime, purging stale entries only ever looks at the head of the
+ * queue.
+ *
+ * @note Not thread-safe, callers serialise access (cft_count).
+ */
+typedef struct ConnectionTable_ ConnectionTable;
+
+/**
+ * One connection in the table, owned by the connection it was handed to
+ * and released with ConnectionTableRemove(), even after it expired.
+ */
+typedef struct ConnectionRecord_ ConnectionRecord;
+
+ConnectionTable *ConnectionTableNew(time_t lifetime);
+void ConnectionTableDestroy(ConnectionTable *table);
+
+ConnectionRecord *ConnectionTableAdd(ConnectionTable *table,
+                                     const char *ipaddr, time_t now,
+                                     bool allow_multiple);
+void ConnectionTableRemove(ConnectionTable *table, ConnectionRecord *record);
+size_t ConnectionTablePurge(ConnectionTable *table, time_t now);
+size_t ConnectionTableCount(const ConnectionTable *table);
+size_t ConnectionTableCountHost(const ConnectionTable *table,
+                                const char *ipaddr);
+
+#endif
@@ -0,0 +1,329 @@
+/*
+  Copyright 2024 Northern.tech AS
+
+  This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; version 3.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#include <server_ipacl.h>
+
+#include <alloc.h>
+#include <logging.h>
+#include <string_lib.h>                                      /* StringEqual */
+
+
+typedef struct IPAclNode_ IPAclNode;
+struct IPAclNode_
+{
+    IPAclNode *child[2];
+    bool terminal;                      /* a prefix ends here: match */
+};
+
+struct IPAcl_
+{
+    IPAclNode *v4;
+    IPAclNode *v6;
+    Item *residual;                     /* entries matched the slow way */
+};
+
+
+static void NodeDestroy(IPAclNode *node)
+{
+    if (node != NULL)
+    {
+        NodeDestroy(node->child[0]);
+        NodeDestroy(node->child[1]);
+        free(node);
+    }
+}
+
+static inline int AddressBit(const unsigned char *addr, size_t i)
+{
+    return (addr[i / 8] >> (7 - i % 8)) & 1;
+}
+
+static void NodeInsert(IPAclNode **root, const unsigned char *addr,
+                       size_t prefix_len)
+{
+    if (*root == NULL)
+    {
+        *root = xcalloc(1, sizeof(IPAclNode));
+    }
+
+    IPAclNode *node = *root;
+    for (size_t i = 0; i < prefix_len && !node->terminal; i++)
+    {
+        int bit = AddressBit(addr, i);
+        if (node->child[bit] == NULL)
+        {
+            node->child[bit] = xcalloc(1, sizeof(IPAclNode));
+        }
+        node = node->child[bit];
+    }
+
+    /* A shorter prefix already covers this one, or we reached the end. */
+    node->terminal = true;
+}
+
+static bool NodeMatch(const IPAclNode *node, const unsigned char *addr,
+                      size_t addr_len)
+{
+    for (size_t i = 0; node != NULL; i++)
+    {
+        if (node->terminal)
+        {
+            return true;
+        }
+        if (i == addr_len)
+        {
+            break;
+        }
+        node = node->child[AddressBit(addr, i)];
+    }
+    return false;
+}
+
+/**
+ * Parse a decimal octet the way FuzzySetMatch() would match it textually:
+ * no sign, no leading zeros, at most 255.
+ */
+static bool ParseOctet(const char *s, size_t len, unsigned char *octet)
+{
+    if (len == 0 || len > 3 || (len > 1 && s[0] == '0'))
+    {
+        return false;
+    }
+
+    unsigned int value = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (!isdigit((unsigned char) s[i]))
+        {
+            return false;
+        }
+        value = value * 10 + (s[i] - '0');
+    }
+
+    if (value > 255)
+    {
+        return false;
+    }
+    *octet = value;
+    return true;
+}
+
+/**
+ * "a.b", "a.b.c" or "a.b.c.d": FuzzySetMatch() matches these as a prefix
+ * ending at an octet boundary, i.e. as /16, /24 or /32.
+ */
+static bool ParsePartialIPv4(const char *entry, unsigned char addr[4],
+                             size_t *prefix_len)
+{
+    size_t octets = 0;
+    const char *s = entry;
+
+    while (octets < 4)
+    {
+        size_t len = strcspn(s, ".");
+        if (!ParseOctet(s, len, &addr[octets]))
+        {
+            return false;
+        }
+        octets++;
+        s += len;
+        if (*s == '\0')
+        {
+            break;
+        }
+        s++;                                                /* skip the dot */
+    }
+
+    if (*s != '\0' || octets < 2)
+    {
+        return false;
+    }
+
+    for (size_t i = octets; i < 4; i++)
+    {
+        addr[i] = 0;
+    }
+    *prefix_len = octets * 8;
+    return true;
+}
+
+static bool ParseCIDR(const char *entry, int family, unsigned char *addr,
+                      size_t *prefix_len)
+{
+    const char *slash = strchr(entry, '/');
+    assert(slash != NULL);
+
+    char address[INET6_ADDRSTRLEN];
+    size_t address_len = slash - entry;
+    if (address_len == 0 || address_len >= sizeof(address))
+    {
+        return false;
+    }
+    memcpy(address, entry, address_len);
+    address[address_len] = '\0';
+
+    if (inet_pton(family, address, addr) != 1)
+    {
+        return false;
+    }
+
+    char *end;
+    errno = 0;
+    unsigned long mask = strtoul(slash + 1, &end, 10);
+    unsigned long max = (family == AF_INET) ? 32 : 128;
+    if (errno != 0 || end == slash + 1 || *end != '\0' || mask > max)
+    {
+        return false;
+    }
+
+    *prefix_len = mask;
+    return true;
+}
+
+/**
+ * @return true if the entry was added to the trie, false if it must be
+ *         matched the slow way.
+ */
+static bool CompileEntry(IPAcl *acl, const char *entry)
+{
+    bool has_dot   = (strchr(entry, '.') != NULL);
+    bool has_colon = (strchr(entry, ':') != NULL);
+    size_t prefix_len;
+
+    /* FuzzySetMatch() refuses to match anything mixing both. */
+    if (has_dot == has_colon)
+    {
+        return false;
+    }
+
+    if (has_dot)
+    {
+        unsigned char addr[4];
+        if (strchr(entry, '/') != NULL)
+        {
+            if (!ParseCIDR(entry, AF_INET, addr, &prefix_len))
+            {
+                return false;
+            }
+        }
+        else if (!ParsePartialIPv4(entry, addr, &prefix_len))
+        {
+            return false;
+        }
+        NodeInsert(&acl->v4, addr, prefix_len);
+        return true;
+    }
+
+    unsigned char addr[16];
+    if (strchr(entry, '/') != NULL)
+    {
+        /* FuzzySetMatch() compares IPv6 prefixes whole bytes at a time, so
+         * leave the others to it rather than matching them differently. */
+        if (!ParseCIDR(entry, AF_INET6, addr, &prefix_len) ||
+            prefix_len % 8 != 0)
+        {
+            return false;
+        }
+    }
+    else
+    {
+        /* A plain IPv6 address only ever matched textually, so only accept
+         * it if it's in the same canonical form getnameinfo() gives us. */
+        char canonical[INET6_ADDRSTRLEN];
+        if (inet_pton(AF_INET6, entry, addr) != 1 ||
+            inet_ntop(AF_INET6, addr, canonical, sizeof(canonical)) == NULL ||
+            !StringEqual(canonical, entry))
+        {
+            return false;
+        }
+        prefix_len = 128;
+    }
+    NodeInsert(&acl->v6, addr, prefix_len);
+    return true;
+}
+
+/*******************************************************************/
+
+IPAcl *IPAclCompile(const Item *list)
+{
+    IPAcl *acl = xcalloc(1, sizeof(IPAcl));
+    size_t compiled = 0, residual = 0;
+
+    for (const Item *ip = list; ip != NULL; ip = ip->next)
+    {
+        if (CompileEntry(acl, ip->name))
+        {
+            compiled++;
+        }
+        else
+        {
+            AppendItem(&acl->residual, ip->name, ip->classes);
+            residual++;
+        }
+    }
+
+    Log(LOG_LEVEL_DEBUG,
+        "Compiled IP access list: %zu prefixes, %zu entries matched by pattern",
+        compiled, residual);
+    return acl;
+}
+
+void IPAclDestroy(IPAcl *acl)
+{
+    if (acl != NULL)
+    {
+        NodeDestroy(acl->v4);
+        NodeDestroy(acl->v6);
+        DeleteItemList(acl->residual);
+        free(acl);
+    }
+}
+
+bool IPAclMatch(const IPAcl *acl, const char *ipaddr)
+{
+    assert(acl != NULL);
+
+    if (ipaddr == NULL || ipaddr[0] == '\0')
+    {
+        return true;                                /* like IsMatchItemIn() */
+    }
+
+    unsigned char addr[16];
+    if (inet_pton(AF_INET, ipaddr, addr) == 1)
+    {
+        if (NodeMatch(acl->v4, addr, 32))
+        {
+            return true;
+        }
+    }
+    else if (inet_pton(AF_INET6, ipaddr, addr) == 1)
+    {
+        if (NodeMatch(acl->v6, addr, 128))
+        {
+            return true;
+        }
+    }
+
+    return (acl->residual != NULL && IsMatchItemIn(acl->residual, ipaddr));
+}
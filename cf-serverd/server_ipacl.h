@@ -0,0 +1,51 @@
+/*
+  Copyright 2024 Northern.tech AS
+
+  This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; version 3.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#ifndef CFENGINE_SERVER_IPACL_H
+#define CFENGINE_SERVER_IPACL_H
+
+
+#include <platform.h>
+#include <item_lib.h>                                               /* Item */
+
+
+/**
+ * Compiled form of an IP address list from body server control, like
+ * "allowconnects" or "denyconnects".
+ *
+ * Entries that are plain IPv4/IPv6 addresses, CIDR blocks or partial IPv4
+ * addresses ("192.168") are stored in a binary prefix trie, so matching an
+ * address costs at most one step per address bit, independently of the
+ * number of entries. Anything else (address ranges, regular expressions,
+ * hostnames, IPv6 CIDR blocks not ending on a byte boundary) is kept in a
+ * residual list and matched with IsMatchItemIn(),
+ * so the semantics are exactly those of IsMatchItemIn() on the full list.
+ */
+typedef struct IPAcl_ IPAcl;
+
+IPAcl *IPAclCompile(const Item *list);
+void IPAclDestroy(IPAcl *acl);
+bool IPAclMatch(const IPAcl *acl, const char *ipaddr);
+
+#endif
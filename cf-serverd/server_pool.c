@@ -0,0 +1,644 @@
+/*
+  Copyright 2024 Northern.tech AS
+
+  This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; version 3.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#include <server_pool.h>
+
+#include <alloc.h>
+#include <mutex.h>                                     /* ThreadLock */
+#include <threaded_queue.h>
+#include <connection_info.h>                           /* ConnectionInfoSocket */
+
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+# include <poll.h>                                             /* WaitReady */
+#endif
+
+
+#define POOL_MIN_WORKERS   4
+#define POOL_POP_TIMEOUT   1                                     /* seconds */
+#define POLLER_MAX_EVENTS  64
+#define POLLER_TIMEOUT_MS  1000
+
+
+//******************************************************************
+// GLOBAL STATE
+//******************************************************************
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER; /* GLOBAL_T */
+
+/* All the following are protected by pool_lock. */
+static bool POOL_RUNNING = false;                               /* GLOBAL_X */
+static bool POOL_STOPPING = false;                              /* GLOBAL_X */
+static ServerPoolStats POOL_STATS = { 0 };                      /* GLOBAL_X */
+static ServerConnectionState *PARKED_HEAD = NULL;               /* GLOBAL_X */
+static ServerConnectionState *PARKED_TAIL = NULL;               /* GLOBAL_X */
+static int POOL_EPOLL_FD = -1;                                  /* GLOBAL_X */
+
+/* Written once in ServerPoolStart(), read-only afterwards. */
+static ThreadedQueue *POOL_QUEUE = NULL;                        /* GLOBAL_P */
+static ServerPoolServeFn POOL_SERVE = NULL;                     /* GLOBAL_P */
+static ServerPoolReadyFn POOL_READY = NULL;                     /* GLOBAL_P */
+static ServerPoolCloseFn POOL_CLOSE = NULL;                     /* GLOBAL_P */
+static time_t POOL_IDLE_TIMEOUT = 0;                            /* GLOBAL_P */
+
+/******************************************************************/
+
+static bool PoolIsStopping(void)
+{
+    ThreadLock(&pool_lock);
+    bool stopping = POOL_STOPPING;
+    ThreadUnlock(&pool_lock);
+    return stopping;
+}
+
+/**
+ * Number of workers used when not configured otherwise: twice the number of
+ * online CPUs, since workers block on network and disk I/O for a good part
+ * of each request.
+ */
+size_t ServerPoolDefaultWorkers(void)
+{
+    long cpus = 1;
+#if defined(HAVE_SYSCONF) && defined(_SC_NPROCESSORS_ONLN)
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+    {
+        cpus = 1;
+    }
+#endif
+    return MAX(POOL_MIN_WORKERS, 2 * (size_t) cpus);
+}
+
+/**
+ * Queue a connection for the next idle worker.
+ *
+ * @note Admission control (maxconnections) is done by the caller of
+ *       ServerPoolSubmit(), the queue itself is unbounded since it can
+ *       never hold more than the admitted connections.
+ * @return false if the pool is not running, the connection is untouched.
+ */
+static bool Enqueue(ServerConnectionState *conn)
+{
+    ThreadLock(&pool_lock);
+    if (!POOL_RUNNING)
+    {
+        ThreadUnlock(&pool_lock);
+        return false;
+    }
+    POOL_STATS.queued++;
+    POOL_STATS.queued_peak = MAX(POOL_STATS.queued_peak, POOL_STATS.queued);
+    ThreadUnlock(&pool_lock);
+
+    ThreadedQueuePush(POOL_QUEUE, conn);
+    return true;
+}
+
+/*********************************************************************/
+/* Parking                                                           */
+/*********************************************************************/
+
+/* Must be called with pool_lock held. */
+static void ParkedListRemove(ServerConnectionState *conn)
+{
+    if (conn->parked_prev != NULL)
+    {
+        conn->parked_prev->parked_next = conn->parked_next;
+    }
+    else
+    {
+        assert(PARKED_HEAD == conn);
+        PARKED_HEAD = conn->parked_next;
+    }
+
+    if (conn->parked_next != NULL)
+    {
+        conn->parked_next->parked_prev = conn->parked_prev;
+    }
+    else
+    {
+        assert(PARKED_TAIL == conn);
+        PARKED_TAIL = conn->parked_prev;
+    }
+
+    conn->parked_prev = NULL;
+    conn->parked_next = NULL;
+    POOL_STATS.parked--;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+
+/**
+ * Hand a connection that waits for the client over to the poller thread.
+ *
+ * Connections are appended to the parked list in order of last activity, so
+ * the poller only needs to look at the head of the list to find expired
+ * ones.
+ *
+ * They are registered edge-triggered: a connection that isn't ready yet is
+ * only looked at again once more data arrives, even if what it has so far
+ * stays unread in the socket. Data that is already there when parking is
+ * reported right away.
+ *
+ * @param write Whether to wait for the socket to be writable rather than
+ *              readable.
+ * @return false if the connection could not be parked, the caller must then
+ *         keep serving it or close it.
+ */
+static bool Park(ServerConnectionState *conn, bool write)
+{
+    int sd = ConnectionInfoSocket(conn->conn_info);
+    struct epoll_event ev = {
+        .events = (write ? EPOLLOUT : (EPOLLIN | EPOLLRDHUP)) | EPOLLET,
+        .data.ptr = conn
+    };
+
+    conn->last_active = time(NULL);
+    conn->wait_write = write;
+
+    ThreadLock(&pool_lock);
+    if (POOL_STOPPING)
+    {
+        ThreadUnlock(&pool_lock);
+        return false;
+    }
+
+    conn->parked_prev = PARKED_TAIL;
+    conn->parked_next = NULL;
+    if (PARKED_TAIL != NULL)
+    {
+        PARKED_TAIL->parked_next = conn;
+    }
+    else
+    {
+        PARKED_HEAD = conn;
+    }
+    PARKED_TAIL = conn;
+    POOL_STATS.parked++;
+
+    /* Registering under the lock guarantees that the poller, which also
+     * takes the lock before touching the list, never sees an event for a
+     * connection that is not yet on the list. */
+    if (epoll_ctl(POOL_EPOLL_FD, EPOLL_CTL_ADD, sd, &ev) == -1)
+    {
+        Log(LOG_LEVEL_ERR,
+            "Failed to park idle connection on socket %d (epoll_ctl: %s)",
+            sd, GetErrorStr());
+        ParkedListRemove(conn);
+        ThreadUnlock(&pool_lock);
+        return false;
+    }
+    ThreadUnlock(&pool_lock);
+
+    Log(LOG_LEVEL_DEBUG, "Parked idle connection on socket %d", sd);
+    return true;
+}
+
+/**
+ * Wait in the worker for a connection that could not be parked.
+ *
+ * @return false if the connection stayed idle for the whole idle timeout.
+ */
+static bool WaitReady(ServerConnectionState *conn, bool write)
+{
+    struct pollfd pfd = {
+        .fd = ConnectionInfoSocket(conn->conn_info),
+        .events = write ? POLLOUT : POLLIN
+    };
+
+    int ret;
+    do
+    {
+        ret = poll(&pfd, 1, POOL_IDLE_TIMEOUT * 1000);
+    } while (ret == -1 && errno == EINTR);
+
+    /* Errors and hangups are for the serve function to find out. */
+    return (ret != 0);
+}
+
+/* Must be called with pool_lock held. */
+static void Unpark(ServerConnectionState *conn)
+{
+    int sd = ConnectionInfoSocket(conn->conn_info);
+    if (epoll_ctl(POOL_EPOLL_FD, EPOLL_CTL_DEL, sd, NULL) == -1)
+    {
+        Log(LOG_LEVEL_DEBUG,
+            "Failed to unregister socket %d from epoll set (epoll_ctl: %s)",
+            sd, GetErrorStr());
+    }
+    ParkedListRemove(conn);
+}
+
+/**
+ * Apart from ServerPoolStop(), this is the only thread that removes
+ * connections from the parked list, so an event returned by epoll_wait()
+ * always refers to a live connection.
+ *
+ * @param arg The epoll set, closed by the poller when it exits: once the
+ *            pool is stopped, it is the only one still using it.
+ */
+static void *PollerThread(void *arg)
+{
+    const int epoll_fd = (int) (intptr_t) arg;
+    struct epoll_event events[POLLER_MAX_EVENTS];
+    ServerConnectionState *ready[POLLER_MAX_EVENTS];
+    int n_ready;
+
+    while (!PoolIsStopping())
+    {
+        int n = epoll_wait(epoll_fd, events, POLLER_MAX_EVENTS,
+                           POLLER_TIMEOUT_MS);
+        if (n == -1)
+        {
+            if (errno != EINTR)
+            {
+                Log(LOG_LEVEL_ERR,
+                    "Error while waiting on idle connections (epoll_wait: %s)",
+                    GetErrorStr());
+                sleep(1);
+            }
+            n = 0;
+        }
+
+        ServerConnectionState *expired = NULL;
+        time_t now = time(NULL);
+
+        ThreadLock(&pool_lock);
+        if (POOL_STOPPING || POOL_EPOLL_FD != epoll_fd)
+        {
+            /* ServerPoolStop() already closed everything that was parked,
+             * including connections we might have events for. The pool may
+             * even have been started again since, with another poller. */
+            ThreadUnlock(&pool_lock);
+            break;
+        }
+        n_ready = 0;
+        for (int i = 0; i < n; i++)
+        {
+            /* Only queue connections that can be served without waiting
+             * for the client, the others stay parked until more arrives.
+             * POOL_READY() doesn't block, it is called under the lock so
+             * that ServerPoolStop() can't close the connection meanwhile. */
+            ServerConnectionState *conn = events[i].data.ptr;
+            if (conn->wait_write ||
+                (events[i].events & (EPOLLERR | EPOLLHUP)) != 0 ||
+                POOL_READY(conn))
+            {
+                Unpark(conn);
+                ready[n_ready++] = conn;
+            }
+        }
+
+        /* The list is sorted by last activity, oldest first. */
+        while (PARKED_HEAD != NULL &&
+               now > PARKED_HEAD->last_active + POOL_IDLE_TIMEOUT)
+        {
+            ServerConnectionState *conn = PARKED_HEAD;
+            Unpark(conn);
+            conn->parked_next = expired;
+            expired = conn;
+            POOL_STATS.expired++;
+        }
+        ThreadUnlock(&pool_lock);
+
+        for (int i = 0; i < n_ready; i++)
+        {
+            if (!Enqueue(ready[i]))
+            {
+                POOL_CLOSE(ready[i]);
+            }
+        }
+
+        while (expired != NULL)
+        {
+            ServerConnectionState *next = expired->parked_next;
+            expired->parked_next = NULL;
+            Log(LOG_LEVEL_VERBOSE,
+                "Connection from '%s' idle for more than %jd seconds, closing",
+                expired->ipaddr, (intmax_t) POOL_IDLE_TIMEOUT);
+            POOL_CLOSE(expired);
+            expired = next;
+        }
+    }
+
+    close(epoll_fd);
+    return NULL;
+}
+
+#endif  /* HAVE_SYS_EPOLL_H */
+
+/*********************************************************************/
+/* Workers                                                           */
+/*********************************************************************/
+
+static void *WorkerThread(ARG_UNUSED void *arg)
+{
+    while (!PoolIsStopping())
+    {
+        void *item;
+        if (!ThreadedQueuePop(POOL_QUEUE, &item, POOL_POP_TIMEOUT))
+        {
+            continue;
+        }
+        ServerConnectionState *conn = item;
+
+        ThreadLock(&pool_lock);
+        POOL_STATS.queued--;
+        POOL_STATS.busy++;
+        POOL_STATS.dispatched++;
+        ThreadUnlock(&pool_lock);
+
+        ServerPoolNext next = POOL_SERVE(conn);
+        bool parked = false;
+        while (next != SERVER_POOL_CLOSE && !parked)
+        {
+            const bool write = (next == SERVER_POOL_WAIT_WRITE);
+#ifdef HAVE_SYS_EPOLL_H
+            parked = Park(conn, write);
+#endif
+            if (!parked)
+            {
+                /* Could not hand it over, keep serving it in this worker. */
+                if (PoolIsStopping())
+                {
+                    break;
+                }
+#ifdef HAVE_SYS_EPOLL_H
+                if (!WaitReady(conn, write))
+                {
+                    break;
+                }
+#endif
+                next = POOL_SERVE(conn);
+            }
+        }
+
+        ThreadLock(&pool_lock);
+        POOL_STATS.busy--;
+        ThreadUnlock(&pool_lock);
+
+        if (!parked)
+        {
+            POOL_CLOSE(conn);
+        }
+    }
+
+    return NULL;
+}
+
+static bool SpawnDetached(void *(*routine) (void *), void *arg)
+{
+    pthread_attr_t attrs;
+    pthread_t tid;
+
+    int ret = pthread_attr_init(&attrs);
+    if (ret != 0)
+    {
+        Log(LOG_LEVEL_ERR,
+            "Unable to initialize thread attributes (%s)", GetErrorStr());
+        return false;
+    }
+    pthread_attr_setdetachstate(&attrs, PTHREAD_CREATE_DETACHED);
+    ret = pthread_attr_setstacksize(&attrs, 1024 * 1024);
+    if (ret != 0)
+    {
+        Log(LOG_LEVEL_WARNING,
+            "Unable to set thread stack size (%s).", GetErrorStr());
+        /* Continue with default thread stack size. */
+    }
+
+    ret = pthread_create(&tid, &attrs, routine, arg);
+    pthread_attr_destroy(&attrs);
+    if (ret != 0)
+    {
+        errno = ret;
+        Log(LOG_LEVEL_ERR,
+            "Unable to spawn worker thread. (pthread_create: %s)",
+            GetErrorStr());
+        return false;
+    }
+    return true;
+}
+
+/*********************************************************************/
+/* Public API                                                        */
+/*********************************************************************/
+
+/**
+ * @param idle_timeout seconds a parked connection may stay idle before it is
+ *                     closed, should match the socket receive timeout.
+ */
+bool ServerPoolStart(size_t workers, time_t idle_timeout,
+                     ServerPoolServeFn serve_fn, ServerPoolReadyFn ready_fn,
+                     ServerPoolCloseFn close_fn)
+{
+    assert(workers > 0);
+    assert(serve_fn != NULL && ready_fn != NULL && close_fn != NULL);
+    assert(!POOL_RUNNING);
+
+    POOL_SERVE = serve_fn;
+    POOL_READY = ready_fn;
+    POOL_CLOSE = close_fn;
+    POOL_IDLE_TIMEOUT = idle_timeout;
+    POOL_QUEUE = ThreadedQueueNew(workers, NULL);
+    POOL_STATS = (ServerPoolStats) { 0 };
+    POOL_STOPPING = false;
+
+#ifdef HAVE_SYS_EPOLL_H
+    const int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1)
+    {
+        Log(LOG_LEVEL_ERR, "Unable to create epoll set (epoll_create1: %s)",
+            GetErrorStr());
+        ThreadedQueueDestroy(POOL_QUEUE);
+        POOL_QUEUE = NULL;
+        return false;
+    }
+
+    /* Under the lock, a poller left over from a previous start reads it. */
+    ThreadLock(&pool_lock);
+    POOL_EPOLL_FD = epoll_fd;
+    ThreadUnlock(&pool_lock);
+
+    if (!SpawnDetached(PollerThread, (void *) (intptr_t) epoll_fd))
+    {
+        ThreadLock(&pool_lock);
+        POOL_EPOLL_FD = -1;
+        ThreadUnlock(&pool_lock);
+        close(epoll_fd);
+        ThreadedQueueDestroy(POOL_QUEUE);
+        POOL_QUEUE = NULL;
+        return false;
+    }
+#endif
+
+    size_t spawned = 0;
+    for (size_t i = 0; i < workers; i++)
+    {
+        if (SpawnDetached(WorkerThread, NULL))
+        {
+            spawned++;
+        }
+    }
+
+    if (spawned == 0)
+    {
+        /* The poller (if any) exits on its own and closes the epoll set,
+         * but the queue is leaked since it might still be using it. */
+        ThreadLock(&pool_lock);
+        POOL_STOPPING = true;
+        POOL_EPOLL_FD = -1;
+        ThreadUnlock(&pool_lock);
+        return false;
+    }
+
+    ThreadLock(&pool_lock);
+    POOL_STATS.workers = spawned;
+    POOL_RUNNING = true;
+    ThreadUnlock(&pool_lock);
+
+    Log(LOG_LEVEL_VERBOSE,
+        "Started %zu connection handler threads", spawned);
+    return true;
+}
+
+/**
+ * Stop accepting work, close all connections that are queued or parked and
+ * let the workers exit once they finish the request they are busy with.
+ *
+ * Connections being served at the time of the call are closed by their
+ * worker; callers should wait for them through ACTIVE_THREADS.
+ */
+void ServerPoolStop(void)
+{
+    ThreadLock(&pool_lock);
+    if (!POOL_RUNNING)
+    {
+        ThreadUnlock(&pool_lock);
+        return;
+    }
+    POOL_RUNNING = false;
+    POOL_STOPPING = true;
+
+    ServerConnectionState *parked = NULL;
+    while (PARKED_HEAD != NULL)
+    {
+        ServerConnectionState *conn = PARKED_HEAD;
+#ifdef HAVE_SYS_EPOLL_H
+        Unpark(conn);
+#else
+        ParkedListRemove(conn);
+#endif
+        conn->parked_next = parked;
+        parked = conn;
+    }
+    /* Nothing is parked anymore, and the poller closes the set. */
+    POOL_EPOLL_FD = -1;
+    ThreadUnlock(&pool_lock);
+
+    while (parked != NULL)
+    {
+        ServerConnectionState *next = parked->parked_next;
+        parked->parked_next = NULL;
+        POOL_CLOSE(parked);
+        parked = next;
+    }
+
+    void *item;
+    while (ThreadedQueuePop(POOL_QUEUE, &item, 0))
+    {
+        ThreadLock(&pool_lock);
+        POOL_STATS.queued--;
+        ThreadUnlock(&pool_lock);
+        POOL_CLOSE(item);
+    }
+
+    /* Workers are detached and may still be running, so the queue is
+     * intentionally left allocated. */
+}
+
+bool ServerPoolIsRunning(void)
+{
+    ThreadLock(&pool_lock);
+    bool running = POOL_RUNNING;
+    ThreadUnlock(&pool_lock);
+    return running;
+}
+
+/**
+ * @return true if connections waiting for the client are parked, so that
+ *         the serve function should return instead of waiting.
+ */
+bool ServerPoolCanPark(void)
+{
+    ThreadLock(&pool_lock);
+    bool can_park = (POOL_RUNNING && POOL_EPOLL_FD != -1);
+    ThreadUnlock(&pool_lock);
+    return can_park;
+}
+
+/**
+ * Hand a newly accepted connection over to the pool. It is parked until
+ * the client sent something, or queued right away where parking isn't
+ * available.
+ *
+ * @return false if the pool is not running, the connection is untouched.
+ */
+bool ServerPoolSubmit(ServerConnectionState *conn)
+{
+    assert(conn != NULL);
+
+    if (!ServerPoolIsRunning())
+    {
+        return false;
+    }
+
+#ifdef HAVE_SYS_EPOLL_H
+    if (Park(conn, false))
+    {
+        return true;
+    }
+#endif
+    return Enqueue(conn);
+}
+
+void ServerPoolGetStats(ServerPoolStats *stats)
+{
+    assert(stats != NULL);
+
+    ThreadLock(&pool_lock);
+    *stats = POOL_STATS;
+    ThreadUnlock(&pool_lock);
+}
+
+void ServerPoolLogStats(LogLevel level, const char *reason)
+{
+    ServerPoolStats stats;
+    ServerPoolGetStats(&stats);
+
+    Log(level,
+        "%s: %zu workers, %zu busy, %zu queued (peak %zu), %zu idle parked, "
+        "%lu dispatches, %lu idle timeouts",
+        reason, stats.workers, stats.busy, stats.queued, stats.queued_peak,
+        stats.parked, stats.dispatched, stats.expired);
+}
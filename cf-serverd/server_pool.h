@@ -0,0 +1,106 @@
+/*
+  Copyright 2024 Northern.tech AS
+
+  This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; version 3.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#ifndef CFENGINE_SERVER_POOL_H
+#define CFENGINE_SERVER_POOL_H
+
+
+#include <platform.h>
+#include <logging.h>                                            /* LogLevel */
+#include <server.h>                                /* ServerConnectionState */
+
+
+/**
+ * Fixed-size pool of connection handler threads.
+ *
+ * Accepted connections are handed over with ServerPoolSubmit() and *parked*
+ * in an epoll set until the client has sent something. Whenever a worker
+ * would have to wait for the client (during the handshake or between
+ * requests) it parks the connection again and moves on. Parked connections
+ * cost only their ServerConnectionState, so idle or slow clients never tie
+ * up a worker.
+ *
+ * When a parked connection becomes readable, the poller thread asks
+ * ServerPoolReadyFn whether the client sent all that the next step needs,
+ * and only then queues it for the first idle worker. Connections parked for
+ * longer than the receive timeout are closed.
+ *
+ * On platforms without epoll connections are queued right away and the
+ * worker stays with the connection until it is closed, exactly like the
+ * old thread-per-connection model but with a bounded number of threads.
+ */
+
+typedef enum
+{
+    SERVER_POOL_CLOSE,                          /* close the connection */
+    SERVER_POOL_WAIT_READ,       /* park it until the client sent more */
+    SERVER_POOL_WAIT_WRITE,          /* park it until it's writable */
+} ServerPoolNext;
+
+/**
+ * Serve a connection until it would have to wait for the client.
+ *
+ * @return what to do with the connection next (ServerPoolCloseFn is called
+ *         for SERVER_POOL_CLOSE).
+ */
+typedef ServerPoolNext (*ServerPoolServeFn)(ServerConnectionState *conn);
+
+/**
+ * Called by the poller thread when a connection parked with
+ * SERVER_POOL_WAIT_READ is readable. Must not block.
+ *
+ * @return true if ServerPoolServeFn can run without waiting for the client
+ *         (including when the connection is broken), false to keep it
+ *         parked until more data arrives.
+ */
+typedef bool (*ServerPoolReadyFn)(ServerConnectionState *conn);
+
+/**
+ * Close the connection and free all its resources.
+ */
+typedef void (*ServerPoolCloseFn)(ServerConnectionState *conn);
+
+typedef struct
+{
+    size_t workers;                    /* number of worker threads */
+    size_t queued;                     /* ready, waiting for a worker */
+    size_t busy;                       /* currently being served */
+    size_t parked;                     /* idle, waiting for client input */
+    size_t queued_peak;                /* high-water mark of queued */
+    unsigned long dispatched;          /* total number of dispatches */
+    unsigned long expired;             /* parked connections timed out */
+} ServerPoolStats;
+
+size_t ServerPoolDefaultWorkers(void);
+bool ServerPoolStart(size_t workers, time_t idle_timeout,
+                     ServerPoolServeFn serve_fn, ServerPoolReadyFn ready_fn,
+                     ServerPoolCloseFn close_fn);
+void ServerPoolStop(void);
+bool ServerPoolIsRunning(void);
+bool ServerPoolCanPark(void);
+bool ServerPoolSubmit(ServerConnectionState *conn);
+void ServerPoolGetStats(ServerPoolStats *stats);
+void ServerPoolLogStats(LogLevel level, const char *reason);
+
+#endif
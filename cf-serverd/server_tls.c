@@ -98,6 +98,12 @@ bool ServerTLSInitialize(RSA *priv_key, RSA *pub_key, SSL_CTX **ssl_ctx)
 
     TLSSetDefaultOptions(*ssl_ctx, SERVER_ACCESS.allowtlsversion);
 
+#ifdef SSL_OP_ENABLE_KTLS
+    /* Where the kernel supports it, lets FileStreamServe() send whole files
+     * with SSL_sendfile(). Otherwise OpenSSL silently does it all itself. */
+    SSL_CTX_set_options(*ssl_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
     /*
      * CFEngine is not a web server so it does not need to support many
      * ciphers. It only allows a safe but very common subset by default,
@@ -266,42 +272,39 @@ bool ServerTLSPeek(ConnectionInfo *conn_info)
 }
 
 /**
- * 1. Send "CFE_v%d" server hello.
- * 2. Receive two lines: One "CFE_v%d" with the protocol version the client
- *    wishes to have, and one "IDENTITY USERNAME=blah ..." with identification
- *    information for the client.
- *
- * @note For Identification dialog to end successfully, one "OK WELCOME" line
- *       must be sent right after this function, after identity is verified.
- *
- * @TODO More protocol identity. E.g.
- *       IDENTITY USERNAME=xxx HOSTNAME=xxx CUSTOMNAME=xxx
- *
- * @retval true if protocol version was successfully negotiated and IDENTITY
- *         command was parsed correctly. Identity fields (only #username for
- *         now) have the respective string values, or they are empty if field
- *         was not on IDENTITY line.  #conn_info->protocol has been updated
- *         with the negotiated protocol version.
- * @retval false in case of error.
+ * Send "CFE_v%d" server hello, the first step of the identification dialog.
  */
-bool ServerIdentificationDialog(ConnectionInfo *conn_info,
-                                char *username, size_t username_size)
+bool ServerIdentificationSendHello(ConnectionInfo *conn_info)
 {
-    int ret;
-    char input[1024] = "";
-
     /* Send "CFE_v%d cf-serverd version". */
     char version_string[CF_MAXVARSIZE];
     int len = snprintf(version_string, sizeof(version_string),
                        "CFE_v%d cf-serverd %s\n",
                        CF_PROTOCOL_LATEST, VERSION);
 
-    ret = TLSSend(conn_info->ssl, version_string, len);
+    int ret = TLSSend(conn_info->ssl, version_string, len);
     if (ret != len)
     {
         Log(LOG_LEVEL_NOTICE, "Connection was hung up!");
         return false;
     }
+    return true;
+}
+
+/**
+ * Receive the "CFE_v%d" line with the protocol version the client wishes to
+ * have, and negotiate the version.
+ *
+ * @param identity Set to the "IDENTITY USERNAME=blah ..." line if the client
+ *                 sent it along, else to the empty string.
+ * @retval true if protocol version was successfully negotiated,
+ *         #conn_info->protocol has been updated with it.
+ * @retval false in case of error.
+ */
+bool ServerIdentificationRecvVersion(ConnectionInfo *conn_info,
+                                     char *identity, size_t identity_size)
+{
+    char input[1024] = "";
 
     /* Receive CFE_v%d ... \n IDENTITY USERNAME=... */
     int input_len = TLSRecvLines(conn_info->ssl, input, sizeof(input));
@@ -342,26 +345,54 @@ bool ServerIdentificationDialog(ConnectionInfo *conn_info,
 
     /* Did we receive 2nd line or do we need to receive again? */
     const char id_line[] = "\nIDENTITY ";
-    char *line2 = memmem(input, input_len, id_line, strlen(id_line));
+    const char *line2 = memmem(input, input_len, id_line, strlen(id_line));
     if (line2 == NULL)
     {
-        /* Wait for 2nd line to arrive. */
-        input_len = TLSRecvLines(conn_info->ssl, input, sizeof(input));
-        if (input_len <= 0)
-        {
-            Log(LOG_LEVEL_NOTICE,
-                "Client closed connection during identification dialog!");
-            return false;
-        }
-        line2 = input;
+        identity[0] = '\0';
     }
     else
     {
-        line2++;                                               /* skip '\n' */
+        strlcpy(identity, line2 + 1, identity_size);           /* skip '\n' */
     }
 
-    /***** Parse all IDENTITY fields from line2 *****/
+    /* Version client and server agreed on. */
+    conn_info->protocol = protocol;
+
+    return true;
+}
+
+/**
+ * Receive the "IDENTITY USERNAME=blah ..." line, when it didn't come along
+ * with the version line.
+ */
+bool ServerIdentificationRecvIdentity(ConnectionInfo *conn_info,
+                                      char *identity, size_t identity_size)
+{
+    /* Wait for 2nd line to arrive. */
+    int input_len = TLSRecvLines(conn_info->ssl, identity, identity_size);
+    if (input_len <= 0)
+    {
+        Log(LOG_LEVEL_NOTICE,
+            "Client closed connection during identification dialog!");
+        return false;
+    }
+    return true;
+}
 
+/**
+ * Parse all IDENTITY fields from the IDENTITY line.
+ *
+ * @TODO More protocol identity. E.g.
+ *       IDENTITY USERNAME=xxx HOSTNAME=xxx CUSTOMNAME=xxx
+ *
+ * @retval true if the IDENTITY command was parsed correctly. Identity fields
+ *         (only #username for now) have the respective string values, or
+ *         they are empty if field was not on IDENTITY line.
+ * @retval false in case of error.
+ */
+bool ServerIdentificationParseIdentity(const char *identity,
+                                       char *username, size_t username_size)
+{
     char word1[1024], word2[1024];
     int line2_pos = 0, chars_read = 0;
 
@@ -370,10 +401,13 @@ bool ServerIdentificationDialog(ConnectionInfo *conn_info,
     username[0] = '\0';
 
     /* Assert sscanf() is safe to use. */
-    nt_static_assert(sizeof(word1) >= sizeof(input));
-    nt_static_assert(sizeof(word2) >= sizeof(input));
+    if (strlen(identity) >= sizeof(word1))
+    {
+        Log(LOG_LEVEL_NOTICE, "Received too long IDENTITY: %s", identity);
+        return false;
+    }
 
-    ret = sscanf(line2, "IDENTITY %[^=]=%s%n", word1, word2, &chars_read);
+    int ret = sscanf(identity, "IDENTITY %[^=]=%s%n", word1, word2, &chars_read);
     while (ret >= 2)
     {
         /* Found USERNAME identity setting */
@@ -400,16 +434,50 @@ bool ServerIdentificationDialog(ConnectionInfo *conn_info,
         }
 
         line2_pos += chars_read;
-        ret = sscanf(&line2[line2_pos], " %[^=]=%s%n", word1, word2, &chars_read);
+        ret = sscanf(&identity[line2_pos], " %[^=]=%s%n", word1, word2, &chars_read);
     }
 
-    /* Version client and server agreed on. */
-    assert(ProtocolIsKnown(protocol));
-    conn_info->protocol = protocol;
-
     return true;
 }
 
+/**
+ * 1. Send "CFE_v%d" server hello.
+ * 2. Receive two lines: One "CFE_v%d" with the protocol version the client
+ *    wishes to have, and one "IDENTITY USERNAME=blah ..." with identification
+ *    information for the client.
+ *
+ * @note For Identification dialog to end successfully, one "OK WELCOME" line
+ *       must be sent right after this function, after identity is verified.
+ *
+ * @note cf-serverd runs these steps one by one, see ServeConnection().
+ *
+ * @retval true if protocol version was successfully negotiated and IDENTITY
+ *         command was parsed correctly. Identity fields (only #username for
+ *         now) have the respective string values, or they are empty if field
+ *         was not on IDENTITY line.  #conn_info->protocol has been updated
+ *         with the negotiated protocol version.
+ * @retval false in case of error.
+ */
+bool ServerIdentificationDialog(ConnectionInfo *conn_info,
+                                char *username, size_t username_size)
+{
+    char identity[1024];
+
+    if (!ServerIdentificationSendHello(conn_info) ||
+        !ServerIdentificationRecvVersion(conn_info, identity, sizeof(identity)))
+    {
+        return false;
+    }
+
+    if (identity[0] == '\0' &&
+        !ServerIdentificationRecvIdentity(conn_info, identity, sizeof(identity)))
+    {
+        return false;
+    }
+
+    return ServerIdentificationParseIdentity(identity, username, username_size);
+}
+
 bool ServerSendWelcome(const ServerConnectionState *conn)
 {
     char s[1024] = "OK WELCOME";
@@ -450,6 +518,39 @@ bool ServerSendWelcome(const ServerConnectionState *conn)
     return true;
 }
 
+static SSL *ServerTLSNew(ServerConnectionState *conn, SSL_CTX *ssl_ctx)
+{
+    if (ssl_ctx == NULL)
+    {
+        ssl_ctx = SSLSERVERCONTEXT;
+    }
+    assert(ConnectionInfoSSL(conn->conn_info) == NULL);
+    SSL *ssl = SSL_new(ssl_ctx);
+    if (ssl == NULL)
+    {
+        Log(LOG_LEVEL_ERR, "SSL_new: %s",
+            TLSErrorString(ERR_get_error()));
+        return NULL;
+    }
+    ConnectionInfoSetSSL(conn->conn_info, ssl);
+
+    /* Pass conn_info inside the ssl struct for TLSVerifyCallback(). */
+    SSL_set_ex_data(ssl, CONNECTIONINFO_SSL_IDX, conn->conn_info);
+
+    /* Now we are letting OpenSSL take over the open socket. */
+    SSL_set_fd(ssl, ConnectionInfoSocket(conn->conn_info));
+
+    return ssl;
+}
+
+static void LogTLSNegotiated(SSL *ssl)
+{
+    Log(LOG_LEVEL_VERBOSE, "TLS version negotiated: %8s; Cipher: %s,%s",
+        SSL_get_version(ssl),
+        SSL_get_cipher_name(ssl),
+        SSL_get_cipher_version(ssl));
+}
+
 /**
  * @brief Accept a TLS connection and authenticate and identify.
  *
@@ -468,25 +569,11 @@ bool BasicServerTLSSessionEstablish(ServerConnectionState *conn, SSL_CTX *ssl_ct
     {
         return true;
     }
-    if (ssl_ctx == NULL)
-    {
-        ssl_ctx = SSLSERVERCONTEXT;
-    }
-    assert(ConnectionInfoSSL(conn->conn_info) == NULL);
-    SSL *ssl = SSL_new(ssl_ctx);
+    SSL *ssl = ServerTLSNew(conn, ssl_ctx);
     if (ssl == NULL)
     {
-        Log(LOG_LEVEL_ERR, "SSL_new: %s",
-            TLSErrorString(ERR_get_error()));
         return false;
     }
-    ConnectionInfoSetSSL(conn->conn_info, ssl);
-
-    /* Pass conn_info inside the ssl struct for TLSVerifyCallback(). */
-    SSL_set_ex_data(ssl, CONNECTIONINFO_SSL_IDX, conn->conn_info);
-
-    /* Now we are letting OpenSSL take over the open socket. */
-    SSL_set_fd(ssl, ConnectionInfoSocket(conn->conn_info));
 
     int remaining_tries = MAX_ACCEPT_RETRIES;
     int ret = -1;
@@ -514,14 +601,125 @@ bool BasicServerTLSSessionEstablish(ServerConnectionState *conn, SSL_CTX *ssl_ct
         return false;
     }
 
-    Log(LOG_LEVEL_VERBOSE, "TLS version negotiated: %8s; Cipher: %s,%s",
-        SSL_get_version(ssl),
-        SSL_get_cipher_name(ssl),
-        SSL_get_cipher_version(ssl));
+    LogTLSNegotiated(ssl);
 
     return true;
 }
 
+static bool SetSocketBlocking(int sd, bool blocking)
+{
+#ifdef __MINGW32__
+    u_long non_blocking = blocking ? 0 : 1;
+    return (ioctlsocket(sd, FIONBIO, &non_blocking) == 0);
+#else
+    int flags = fcntl(sd, F_GETFL, 0);
+    if (flags == -1)
+    {
+        return false;
+    }
+    flags = blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+    return (fcntl(sd, F_SETFL, flags) != -1);
+#endif
+}
+
+/**
+ * @brief Run the TLS handshake as far as it goes without waiting for the
+ *        client, so that cf-serverd can park the connection meanwhile.
+ *
+ * @param want_write Set to true if the handshake must continue once the
+ *                   socket is writable, false if once it is readable.
+ * @return 1 when the handshake is done, 0 when it must be called again,
+ *         -1 on error.
+ */
+int ServerTLSAcceptStep(ServerConnectionState *conn, bool *want_write)
+{
+    assert(conn != NULL);
+    assert(want_write != NULL);
+
+    SSL *ssl = ConnectionInfoSSL(conn->conn_info);
+    if (ssl == NULL)
+    {
+        ssl = ServerTLSNew(conn, NULL);
+        if (ssl == NULL)
+        {
+            return -1;
+        }
+    }
+
+    /* Non-blocking only for this call, the rest of the TLS code expects a
+     * blocking socket. */
+    int sd = ConnectionInfoSocket(conn->conn_info);
+    if (!SetSocketBlocking(sd, false))
+    {
+        Log(LOG_LEVEL_ERR,
+            "Failed to set socket to non-blocking mode (fcntl: %s)",
+            GetErrorStr());
+        return -1;
+    }
+    int ret = SSL_accept(ssl);
+    int code = (ret <= 0) ? SSL_get_error(ssl, ret) : SSL_ERROR_NONE;
+    if (!SetSocketBlocking(sd, true))
+    {
+        Log(LOG_LEVEL_ERR,
+            "Failed to set socket to blocking mode (fcntl: %s)",
+            GetErrorStr());
+        return -1;
+    }
+
+    if (ret == 1)
+    {
+        LogTLSNegotiated(ssl);
+        return 1;
+    }
+    if (code == SSL_ERROR_WANT_READ || code == SSL_ERROR_WANT_WRITE)
+    {
+        *want_write = (code == SSL_ERROR_WANT_WRITE);
+        return 0;
+    }
+
+    TLSLogError(ssl, LOG_LEVEL_ERR, "Failed to accept TLS connection", ret);
+    return -1;
+}
+
+/**
+ * @brief Peek at the next TLS record the client sent, without waiting for
+ *        it if it isn't complete yet.
+ *
+ * @return the number of bytes peeked (the record is then complete, or fills
+ *         #buf), 0 if there's no complete record yet, -1 if the connection
+ *         is broken or closed.
+ */
+int ServerTLSPeekRecord(ConnectionInfo *conn_info, char *buf, size_t buf_size)
+{
+    assert(conn_info != NULL);
+    assert(buf != NULL);
+
+    SSL *ssl = ConnectionInfoSSL(conn_info);
+    assert(ssl != NULL);
+
+    int sd = ConnectionInfoSocket(conn_info);
+    if (!SetSocketBlocking(sd, false))
+    {
+        return -1;
+    }
+    int ret = SSL_peek(ssl, buf, (int) MIN(buf_size, (size_t) INT_MAX));
+    int code = (ret <= 0) ? SSL_get_error(ssl, ret) : SSL_ERROR_NONE;
+    if (!SetSocketBlocking(sd, true))
+    {
+        return -1;
+    }
+
+    if (ret > 0)
+    {
+        return ret;
+    }
+    if (code == SSL_ERROR_WANT_READ || code == SSL_ERROR_WANT_WRITE)
+    {
+        return 0;
+    }
+    return -1;
+}
+
 /**
  * @brief Accept a TLS connection and authenticate and identify.
  *
@@ -562,6 +760,23 @@ bool ServerTLSSessionEstablish(ServerConnectionState *conn, SSL_CTX *ssl_ctx)
         return false;
     }
 
+    return ServerTLSSessionAuthorize(conn, username);
+}
+
+/**
+ * @brief Check the key of a client that went through the identification
+ *        dialog as #username, and welcome it.
+ *
+ * @see ServerTLSSessionEstablish
+ * @note Various fields in #conn are set, like username and keyhash.
+ * @return true for success false otherwise
+ */
+bool ServerTLSSessionAuthorize(ServerConnectionState *conn,
+                               const char *username)
+{
+    assert(conn != NULL);
+    assert(username != NULL);
+
     /* We *now* (maybe a bit late) verify the key that the client sent us in
      * the TLS handshake, since we need the username to do so. TODO in the
      * future store keys irrelevant of username, so that we can match them
@@ -930,6 +1145,85 @@ bool BusyWithNewProtocol(EvalContext *ctx, ServerConnectionState *conn)
 
         return true;
     }
+    case PROTOCOL_COMMAND_STATTREE:
+    {
+        if (ConnectionInfoProtocolVersion(conn->conn_info) < CF_PROTOCOL_STATTREE)
+        {
+            goto protocol_error;
+        }
+
+        long time_no_see = 0;
+        int maxdepth = 0, digests = 0;
+        memset(filename, 0, sizeof(filename));
+        int ret = sscanf(recvbuffer, "STATTREE %ld %d %d %[^\n]",
+                         &time_no_see, &maxdepth, &digests, filename);
+        if (ret != 4 || filename[0] == '\0' || maxdepth < 1)
+        {
+            goto protocol_error;
+        }
+
+        time_t tloc = time(NULL);
+        if (tloc == -1)
+        {
+            /* Should never happen. */
+            Log(LOG_LEVEL_ERR, "Couldn't read system clock. (time: %s)", GetErrorStr());
+            SendTransaction(conn->conn_info, "BAD: clocks out of synch", 0, CF_DONE);
+            return true;
+        }
+
+        time_t trem = (time_t) time_no_see;
+        int drift = (int) (tloc - trem);
+
+        Log(LOG_LEVEL_VERBOSE, "%14s %7s %s",
+            "Received:", "STATTREE", filename);
+
+        /* sizeof()-1 because we need one extra byte for
+           appending '/' afterwards. */
+        size_t zret = ShortcutsExpand(filename, sizeof(filename) - 1,
+                                      SERVER_ACCESS.path_shortcuts,
+                                      conn->ipaddr, conn->revdns,
+                                      KeyPrintableHash(ConnectionInfoKey(conn->conn_info)));
+        if (zret == (size_t) -1)
+        {
+            goto protocol_error;
+        }
+
+        zret = PreprocessRequestPath(filename, sizeof(filename) - 1);
+        if (zret == (size_t) -1)
+        {
+            RefuseAccess(conn, recvbuffer);
+            return true;
+        }
+
+        /* Like OPENDIR, STATTREE *must* be directory. */
+        PathAppendTrailingSlash(filename, strlen(filename));
+
+        Log(LOG_LEVEL_VERBOSE, "%14s %7s %s",
+            "Translated to:", "STATTREE", filename);
+
+        if (acl_CheckPath(paths_acl, filename,
+                          conn->ipaddr, conn->revdns,
+                          KeyPrintableHash(ConnectionInfoKey(conn->conn_info)))
+            == false)
+        {
+            Log(LOG_LEVEL_INFO, "access denied to STATTREE: %s", filename);
+            RefuseAccess(conn, recvbuffer);
+            return true;
+        }
+
+        if (DENYBADCLOCKS && (drift * drift > CLOCK_DRIFT * CLOCK_DRIFT))
+        {
+            snprintf(sendbuffer, sizeof(sendbuffer),
+                     "BAD: Clocks are too far unsynchronized %ld/%ld",
+                     (long) tloc, (long) trem);
+            Log(LOG_LEVEL_INFO, "denybadclocks %s", sendbuffer);
+            SendTransaction(conn->conn_info, sendbuffer, 0, CF_DONE);
+            return true;
+        }
+
+        CfStatTree(conn, sendbuffer, filename, maxdepth, digests != 0);
+        return true;
+    }
     case PROTOCOL_COMMAND_MD5:
     {
         int ret = sscanf(recvbuffer, "MD5 %[^\n]", filename);
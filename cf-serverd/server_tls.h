@@ -46,6 +46,7 @@ typedef enum
     PROTOCOL_COMMAND_QUERY,
     PROTOCOL_COMMAND_CALL_ME_BACK,
     PROTOCOL_COMMAND_COOKIE,
+    PROTOCOL_COMMAND_STATTREE,
     PROTOCOL_COMMAND_BAD
 } ProtocolCommandNew;
 
@@ -62,6 +63,7 @@ static const char *const PROTOCOL_NEW[PROTOCOL_COMMAND_BAD + 1] =
     "QUERY",
     "SCALLBACK",
     "COOKIE",
+    "STATTREE",
     NULL
 };
 
@@ -70,10 +72,21 @@ void ServerTLSDeInitialize(RSA **priv_key, RSA **pub_key, SSL_CTX **ctx);
 bool ServerTLSPeek(ConnectionInfo *conn_info);
 bool BasicServerTLSSessionEstablish(ServerConnectionState *conn, SSL_CTX *ssl_ctx);
 bool ServerTLSSessionEstablish(ServerConnectionState *conn, SSL_CTX *ssl_ctx);
+bool ServerTLSSessionAuthorize(ServerConnectionState *conn,
+                               const char *username);
+int ServerTLSAcceptStep(ServerConnectionState *conn, bool *want_write);
+int ServerTLSPeekRecord(ConnectionInfo *conn_info, char *buf, size_t buf_size);
 bool BusyWithNewProtocol(EvalContext *ctx, ServerConnectionState *conn);
 bool ServerSendWelcome(const ServerConnectionState *conn);
 bool ServerIdentificationDialog(ConnectionInfo *conn_info,
                                 char *username, size_t username_size);
+bool ServerIdentificationSendHello(ConnectionInfo *conn_info);
+bool ServerIdentificationRecvVersion(ConnectionInfo *conn_info,
+                                     char *identity, size_t identity_size);
+bool ServerIdentificationRecvIdentity(ConnectionInfo *conn_info,
+                                      char *identity, size_t identity_size);
+bool ServerIdentificationParseIdentity(const char *identity,
+                                       char *username, size_t username_size);
 ProtocolCommandNew GetCommandNew(char *str);
 
 #endif  /* CFENGINE_SERVER_TLS_H */
@@ -64,6 +64,7 @@ static void InstallServerAuthPath(const char *path, Auth **list, Auth **listtail
 static void KeepServerRolePromise(EvalContext *ctx, const Promise *pp);
 static void KeepPromiseBundles(EvalContext *ctx, const Policy *policy);
 static void KeepControlPromises(EvalContext *ctx, const Policy *policy, GenericAgentConfig *config, bool *unresolved_vars);
+static void CompileConnectLists(void);
 static void KeepBundlesAccessPromise(EvalContext *ctx, const Promise *pp);
 static Auth *GetAuthPath(const char *path, Auth *list);
 
@@ -243,10 +244,34 @@ void KeepPromises(EvalContext *ctx, const Policy *policy, GenericAgentConfig *co
 
     KeepControlPromises(ctx, policy, config, unresolved_constraints);
     KeepPromiseBundles(ctx, policy);
+    CompileConnectLists();
+
+    /* Every file request is checked against it, index it once. */
+    acl_Compile(paths_acl);
 }
 
 /*******************************************************************/
 
+static IPAcl *CompileIfNotEmpty(const Item *list)
+{
+    return (list != NULL) ? IPAclCompile(list) : NULL;
+}
+
+/* The lists are checked for every accepted connection, from the main
+ * thread, so turn them into prefix tries once. */
+static void CompileConnectLists(void)
+{
+    assert(SERVER_ACCESS.allowconnects    == NULL);
+    assert(SERVER_ACCESS.denyconnects     == NULL);
+    assert(SERVER_ACCESS.allowallconnects == NULL);
+    assert(SERVER_ACCESS.legacyconnects   == NULL);
+
+    SERVER_ACCESS.allowconnects    = CompileIfNotEmpty(SERVER_ACCESS.nonattackerlist);
+    SERVER_ACCESS.denyconnects     = CompileIfNotEmpty(SERVER_ACCESS.attackerlist);
+    SERVER_ACCESS.allowallconnects = CompileIfNotEmpty(SERVER_ACCESS.multiconnlist);
+    SERVER_ACCESS.legacyconnects   = CompileIfNotEmpty(SERVER_ACCESS.allowlegacyconnects);
+}
+
 static bool SetMaxOpenFiles(int n)
 #ifdef HAVE_SYS_RESOURCE_H
 {
@@ -91,7 +91,7 @@ static inline bool ConnectionFlagsEqual(const ConnectionFlags *f1,
     x.tv_usec = DEFAULT_TLS_TIMEOUT_USECONDS
 #define DEFAULT_TLS_TRIES 5
 
-struct Stat_;              /* defined in stat_cache.h, typedef'ed to "Stat" */
+struct StatCache_;    /* defined in stat_cache.c, typedef'ed to "StatCache" */
 
 typedef struct
 {
@@ -104,7 +104,7 @@ typedef struct
     unsigned char *session_key;
     char encryption_type;
     short error;
-    struct Stat_ *cache;                          /* cache for remote STATs */
+    struct StatCache_ *cache;         /* cache for remote STATs, or NULL */
 
     /* The following consistutes the ID of a server host, mostly taken from
      * the copy_from connection attributes. */
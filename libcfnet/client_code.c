@@ -38,7 +38,7 @@
 #include <client_protocol.h>
 #include <crypto.h>         /* CryptoInitialize,SavePublicKey,EncryptString */
 #include <logging.h>
-#include <hash.h>                                               /* HashFile */
+#include <hash.h>                                          /* HashPrintSafe */
 #include <mutex.h>                                            /* ThreadLock */
 #include <files_lib.h>                               /* FullWrite,safe_open */
 #include <string_lib.h>                           /* MemSpan,MemSpanInverse */
@@ -46,6 +46,7 @@
 #include <printsize.h>                                         /* PRINTSIZE */
 #include <lastseen.h>                                            /* LastSaw */
 #include <file_stream.h>
+#include <stat_cache.h>                  /* StatCacheLookup, cf_remote_stat_tree */
 
 
 #define CFENGINE_SERVICE "cfengine"
@@ -357,6 +358,29 @@ Item *RemoteDirList(const char *dirname, bool encrypt, AgentConnection *conn)
         return NULL;
     }
 
+    /* Already listed by STATTREE? */
+    const Stat *cached = StatCacheLookup(conn, dirname, conn->this_server);
+    if (cached != NULL && cached->cf_entries != NULL)
+    {
+        Item *start = NULL, *end = NULL;
+        for (const Item *entry = cached->cf_entries; entry != NULL; entry = entry->next)
+        {
+            Item *ip = xcalloc(1, sizeof(Item));
+            ip->name = (char *) AllocateDirentForFilename(entry->name);
+
+            if (start == NULL)
+            {
+                start = ip;
+            }
+            else
+            {
+                end->next = ip;
+            }
+            end = ip;
+        }
+        return start;
+    }
+
     /* We encrypt only for CLASSIC protocol. The TLS protocol is always over
      * encrypted layer, so it does not support encrypted (S*) commands. */
     encrypt = encrypt && conn->conn_info->protocol == CF_PROTOCOL_CLASSIC;
@@ -478,15 +502,27 @@ Item *RemoteDirList(const char *dirname, bool encrypt, AgentConnection *conn)
 
 /*********************************************************************/
 
-bool CompareHashNet(const char *file1, const char *file2, bool encrypt, AgentConnection *conn)
+/**
+ * @param d The CF_DEFAULT_DIGEST digest of the local file, to compare with
+ *          the one of remote #file1
+ * @return true if the digests differ (or we could not tell)
+ */
+bool CompareHashNet(const char *file1, const unsigned char d[EVP_MAX_MD_SIZE + 1],
+                    bool encrypt, AgentConnection *conn)
 {
-    unsigned char d[EVP_MAX_MD_SIZE + 1];
     char *sp;
     char sendbuffer[CF_BUFSIZE] = {0};
     char recvbuffer[CF_BUFSIZE] = {0};
     int i, tosend, cipherlen;
 
-    HashFile(file2, d, CF_DEFAULT_DIGEST, false);
+    /* STATTREE may have sent us the digest already. */
+    const Stat *cached = StatCacheLookup(conn, file1, conn->this_server);
+    if (cached != NULL && cached->cf_digest != NULL)
+    {
+        char local[CF_HOSTKEY_STRING_SIZE];
+        HashPrintSafe(local, sizeof(local), d, CF_DEFAULT_DIGEST, false);
+        return !StringEqual(local, cached->cf_digest);
+    }
 
     memset(recvbuffer, 0, CF_BUFSIZE);
 
@@ -794,7 +830,8 @@ bool CopyRegularFileNet(const char *source, const char *basis, const char *dest,
 
     const ProtocolVersion version = ConnectionInfoProtocolVersion(conn->conn_info);
     if (ProtocolSupportsFileStream(version)) {
-        return FileStreamFetch(conn->conn_info->ssl, basis, dest, mode, false);
+        return FileStreamFetch(conn->conn_info->ssl, version, basis, dest,
+                               mode, false);
     }
 
     int dd = safe_open_create_perms(dest, O_WRONLY | O_CREAT | O_TRUNC | O_EXCL | O_BINARY, mode);
@@ -924,3 +961,85 @@ bool CopyRegularFileNet(const char *source, const char *basis, const char *dest,
     free(buf);
     return true;
 }
+
+/* GET requests on the wire at once in CopyRegularFilesNet(). The requests
+ * are written before their replies are read, so all of them must fit in the
+ * socket buffers, or client and server would both block in send(). */
+#define GET_PIPELINE_MAX_REQUESTS 16
+#define GET_PIPELINE_MAX_BYTES 16384
+
+/* A GET request and the stream mode message following it. */
+static size_t GetRequestSize(const char *source)
+{
+    return strlen(source) + 32;
+}
+
+static bool SendGetWhole(AgentConnection *conn, ProtocolVersion version,
+                         const char *source)
+{
+    char workbuf[CF_BUFSIZE];
+    int tosend = snprintf(workbuf, CF_BUFSIZE, "GET %d %s", 2048, source);
+    if (tosend <= 0 || tosend >= CF_BUFSIZE)
+    {
+        Log(LOG_LEVEL_ERR, "Failed to compose GET command for file %s",
+            source);
+        return false;
+    }
+
+    if (SendTransaction(conn->conn_info, workbuf, tosend, CF_DONE) == -1)
+    {
+        Log(LOG_LEVEL_ERR, "Couldn't send GET command");
+        return false;
+    }
+
+    return FileStreamAskWhole(conn->conn_info->ssl, version);
+}
+
+bool CopyRegularFilesNet(AgentConnection *conn, FileFetch *files, size_t n_files)
+{
+    assert(conn != NULL);
+    assert(files != NULL || n_files == 0);
+
+    const ProtocolVersion version = ConnectionInfoProtocolVersion(conn->conn_info);
+    assert(ProtocolSupportsBulkStream(version));
+
+    for (size_t i = 0; i < n_files; i++)
+    {
+        files[i].fetched = false;
+    }
+
+    size_t sent = 0;
+    size_t bytes_in_flight = 0;
+    for (size_t i = 0; i < n_files; i++)
+    {
+        /* Top up the window, always at least with the file we wait for. */
+        while (sent < n_files &&
+               (sent == i ||
+                (sent - i < GET_PIPELINE_MAX_REQUESTS &&
+                 bytes_in_flight + GetRequestSize(files[sent].source)
+                 <= GET_PIPELINE_MAX_BYTES)))
+        {
+            if (!SendGetWhole(conn, version, files[sent].source))
+            {
+                /* Error is already logged */
+                return false;
+            }
+            bytes_in_flight += GetRequestSize(files[sent].source);
+            sent++;
+        }
+
+        Log(LOG_LEVEL_VERBOSE, "Fetching remote file '%s:%s' (%zu requests ahead)",
+            conn->this_server, files[i].source, sent - i - 1);
+        files[i].fetched = FileStreamRecvWhole(conn->conn_info->ssl, version,
+                                               files[i].dest, files[i].mode);
+        bytes_in_flight -= GetRequestSize(files[i].source);
+
+        if (!files[i].fetched &&
+            conn->conn_info->status != CONNECTIONINFO_STATUS_ESTABLISHED)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
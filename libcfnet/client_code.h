@@ -46,9 +46,27 @@ AgentConnection *ServerConnection(const char *server, const char *port, const Rl
                                   ConnectionFlags flags, int *err);
 void DisconnectServer(AgentConnection *conn);
 
-bool CompareHashNet(const char *file1, const char *file2, bool encrypt, AgentConnection *conn);
+bool CompareHashNet(const char *file1, const unsigned char d[EVP_MAX_MD_SIZE + 1],
+                    bool encrypt, AgentConnection *conn);
 bool CopyRegularFileNet(const char *source, const char *basis, const char *dest, off_t size,
                         bool encrypt, AgentConnection *conn, mode_t mode);
+
+typedef struct
+{
+    const char *source;         /* path on the server */
+    const char *dest;           /* local file to create */
+    mode_t mode;
+    bool fetched;               /* set by CopyRegularFilesNet() */
+} FileFetch;
+
+/**
+  Fetch whole files with pipelined GET requests, so that a batch of small
+  files doesn't cost a round trip each. Needs the bulkstream protocol.
+
+  @return false if the connection broke, the files not fetched by then have
+          #fetched false.
+  */
+bool CopyRegularFilesNet(AgentConnection *conn, FileFetch *files, size_t n_files);
 Item *RemoteDirList(const char *dirname, bool encrypt, AgentConnection *conn);
 
 int TLSConnectCallCollect(ConnectionInfo *conn_info, const char *username);
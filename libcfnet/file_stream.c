@@ -30,9 +30,18 @@
 #include <definitions.h>
 #include <logging.h>
 #include <file_lib.h>
+#include <alloc.h>
+#include <cfnet.h>                                          /* EnforceBwLimit */
+#include <hash.h>                                         /* HashPrintSafe */
+#include <file_stream_cache.h>
 #include <stdint.h>
 #include <stdarg.h>
 
+/* Whole files can go out with SSL_sendfile() if kernel TLS is in use. */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(OPENSSL_NO_KTLS)
+# define HAVE_KTLS_SENDFILE 1
+#endif
+
 /*********************************************************/
 /* Network protocol                                      */
 /*********************************************************/
@@ -60,8 +69,20 @@
  * @note If the End-of-File flag is set, there may still be data to process in
  *       in the payload. If the Error flag is set, there may be an error
  *       message in the payload.
+ *
+ * From protocol version 6 (bulkstream) on, the header is 32 bits with the
+ * same fields, only the SDU Length is 28 bits wide:
+ *   +----------+----------+----------+----------+
+ *   | SDU Len. | Reserved | EOF Flag | ERR Flag |
+ *   +----------+----------+----------+----------+
+ *   | 28 bits  | 2 bits   | 1 bit    | 1 bit    |
+ *   +----------+----------+----------+----------+
+ *
+ * and messages carry up to PROTOCOL_BULK_MESSAGE_SIZE bytes, so that big
+ * files don't cost one TLS write per 4 KiB.
  */
 #define PROTOCOL_HEADER_SIZE 2
+#define PROTOCOL_BULK_HEADER_SIZE 4
 
 /**
  * @note The TLS Generic API requires that the message length is less than
@@ -70,65 +91,159 @@
  *       with 12 bits (2^12 - 1 = 4095).
  */
 #define PROTOCOL_MESSAGE_SIZE MIN(CF_BUFSIZE - 1, 4095)
+#define PROTOCOL_BULK_MESSAGE_SIZE (256 * 1024)
 
 /**
- * @brief Send a message using the file stream protocol
- * @warning You probably want to use ProtocolSendMessage() or
- *          ProtocolSendError() instead
+ * @brief The SSL connection along with the framing negotiated for it and
+ *        the buffers sized accordingly.
+ */
+typedef struct
+{
+    SSL *ssl;
+    ProtocolVersion version;
+    size_t header_size;  /* PROTOCOL_HEADER_SIZE or PROTOCOL_BULK_HEADER_SIZE */
+    size_t message_size; /* maximum payload of one message */
+
+    /* Allocated by StreamConnInit(): the input buffer is twice the message
+     * size, so that it can fit a new message, as well as some tail data from
+     * the last job iteration. Both have room for the NUL-byte TLSRecv()
+     * appends. */
+    char *in_buf;
+    char *out_buf;
+} StreamConn;
+
+/* Without the buffers, enough for sending errors. */
+static void StreamConnInitFraming(
+    StreamConn *conn, SSL *ssl, ProtocolVersion version)
+{
+    assert(conn != NULL);
+    assert(ssl != NULL);
+
+    conn->ssl = ssl;
+    conn->version = version;
+    if (ProtocolSupportsBulkStream(version))
+    {
+        conn->header_size = PROTOCOL_BULK_HEADER_SIZE;
+        conn->message_size = PROTOCOL_BULK_MESSAGE_SIZE;
+    }
+    else
+    {
+        conn->header_size = PROTOCOL_HEADER_SIZE;
+        conn->message_size = PROTOCOL_MESSAGE_SIZE;
+    }
+    conn->in_buf = NULL;
+    conn->out_buf = NULL;
+}
+
+static void StreamConnInit(StreamConn *conn, SSL *ssl, ProtocolVersion version)
+{
+    StreamConnInitFraming(conn, ssl, version);
+    conn->in_buf = xmalloc(conn->message_size * 2 + 1);
+    conn->out_buf = xmalloc(conn->message_size + 1);
+}
+
+static void StreamConnDestroy(StreamConn *conn)
+{
+    assert(conn != NULL);
+
+    free(conn->in_buf);
+    free(conn->out_buf);
+}
+
+/**
+ * @brief Send the header of a message using the file stream protocol
  *
- * @param conn The SSL connection object
- * @param msg The message to send
- * @param len The length of the message to send (must be less or equal to
- *            PROTOCOL_MESSAGE_SIZE Bytes)
- * @param eof Set to true if this is the last message in a transaction,
- *            otherwise false
- * @param err Set to true if transaction must be canceled (e.g., due to an
- *            unexpected error), otherwise false
- * @note If the err parameter is set to true, the expected return value is
- *       still true.
+ * @param conn The stream connection
+ * @param len The length of the message that follows (must be less or equal
+ *            to the message size of the stream)
+ * @param eof Set to true if this is the last message in a transaction
+ * @param err Set to true if transaction must be canceled
  * @return true on success, otherwise false
  */
-static bool __ProtocolSendMessage(
-    SSL *conn, const char *msg, size_t len, bool eof, bool err)
+static bool ProtocolSendHeader(
+    const StreamConn *conn, size_t len, bool eof, bool err)
 {
     assert(conn != NULL);
-    assert(msg != NULL || len == 0);
-    assert(len <= PROTOCOL_MESSAGE_SIZE);
+    assert(len <= conn->message_size);
 
     /* Set message length */
-    assert(sizeof(len) >= 3); /* It's probably guaranteed, but let's make sure
+    assert(sizeof(len) >= 4); /* It's probably guaranteed, but let's make sure
                                * to avoid potentially nasty surprises */
-    uint16_t header = len << 4;
+    uint32_t flags = 0;
 
     /* Set Error flag */
     if (err)
     {
-        header |= (1 << 0);
+        flags |= (1 << 0);
     }
 
     /* Set End-of-File flag */
     if (eof)
     {
-        header |= (1 << 1);
+        flags |= (1 << 1);
+    }
+
+    char header_buf[PROTOCOL_BULK_HEADER_SIZE];
+    if (conn->header_size == PROTOCOL_BULK_HEADER_SIZE)
+    {
+        uint32_t header = htonl(((uint32_t) len << 4) | flags);
+        memcpy(header_buf, &header, PROTOCOL_BULK_HEADER_SIZE);
+    }
+    else
+    {
+        uint16_t header = htons((uint16_t) ((len << 4) | flags));
+        memcpy(header_buf, &header, PROTOCOL_HEADER_SIZE);
     }
 
     /* Send header */
-    header = htons(header);
-    int ret = TLSSend(conn, (char *) &header, PROTOCOL_HEADER_SIZE);
-    if (ret != PROTOCOL_HEADER_SIZE)
+    int ret = TLSSend(conn->ssl, header_buf, conn->header_size);
+    if (ret != (int) conn->header_size)
     {
         Log(LOG_LEVEL_ERR,
             "Failed to send message header during file stream: "
-            "Expected to send %d bytes, but sent %d bytes",
-            PROTOCOL_HEADER_SIZE,
+            "Expected to send %zu bytes, but sent %d bytes",
+            conn->header_size,
             ret);
         return false;
     }
 
+    return true;
+}
+
+/**
+ * @brief Send a message using the file stream protocol
+ * @warning You probably want to use ProtocolSendMessage() or
+ *          ProtocolSendError() instead
+ *
+ * @param conn The stream connection
+ * @param msg The message to send
+ * @param len The length of the message to send (must be less or equal to
+ *            the message size of the stream)
+ * @param eof Set to true if this is the last message in a transaction,
+ *            otherwise false
+ * @param err Set to true if transaction must be canceled (e.g., due to an
+ *            unexpected error), otherwise false
+ * @note If the err parameter is set to true, the expected return value is
+ *       still true.
+ * @return true on success, otherwise false
+ */
+static bool __ProtocolSendMessage(
+    const StreamConn *conn, const char *msg, size_t len, bool eof, bool err)
+{
+    assert(conn != NULL);
+    assert(msg != NULL || len == 0);
+    assert(len <= conn->message_size);
+
+    if (!ProtocolSendHeader(conn, len, eof, err))
+    {
+        /* Error is already logged */
+        return false;
+    }
+
     if (len > 0)
     {
         /* Send payload */
-        ret = TLSSend(conn, msg, len);
+        int ret = TLSSend(conn->ssl, msg, len);
         if (ret != (int) len)
         {
             Log(LOG_LEVEL_ERR,
@@ -146,16 +261,16 @@ static bool __ProtocolSendMessage(
 /**
  * @brief Send a message using the file stream protocol
  *
- * @param conn The SSL connection object
+ * @param conn The stream connection
  * @param msg The message to send
  * @param len The length of the message to send (must be less or equal to
- *            PROTOCOL_MESSAGE_SIZE Bytes)
+ *            the message size of the stream)
  * @param eof Set to true if this is the last message in a transaction,
  *            otherwise false
  * @return true on success, otherwise false
  */
 static inline bool ProtocolSendMessage(
-    SSL *conn, const char *msg, size_t len, bool eof)
+    const StreamConn *conn, const char *msg, size_t len, bool eof)
 {
     assert(conn != NULL);
     assert(msg != NULL || len == 0);
@@ -166,9 +281,9 @@ static inline bool ProtocolSendMessage(
 /**
  * @brief Receive a message using the file stream protocol
  *
- * @param conn The SSL connection object
- * @param msg The message receive buffer (must be PROTOCOL_MESSAGE_SIZE bytes
- *            large)
+ * @param conn The stream connection
+ * @param msg The message receive buffer (must be the message size of the
+ *            stream + 1 bytes large)
  * @param len The length of the received message
  * @param eof Is set to true if this was the last message in the transaction
  * @return true on success, otherwise false
@@ -177,34 +292,43 @@ static inline bool ProtocolSendMessage(
  *       received an error from the remote host. In both cases, we should not
  *       try to flush the stream.
  */
-static bool ProtocolRecvMessage(SSL *conn, char *msg, size_t *len, bool *eof)
+static bool ProtocolRecvMessage(
+    const StreamConn *conn, char *msg, size_t *len, bool *eof)
 {
     assert(conn != NULL);
     assert(msg != NULL);
     assert(len != NULL);
     assert(eof != NULL);
 
-    /* TLSRecv() expects a buffer this size */
-    char recv_buffer[CF_BUFSIZE];
+    /* Why not receive the bytes directly into header in the TLSRecv()?
+     * Because it actually writes a NUL-Byte after the requested bytes which
+     * would cause memory violations. */
+    char header_buf[PROTOCOL_BULK_HEADER_SIZE + 1];
 
     /* Receive header */
-    int ret = TLSRecv(conn, recv_buffer, PROTOCOL_HEADER_SIZE);
-    if (ret != PROTOCOL_HEADER_SIZE)
+    int ret = TLSRecv(conn->ssl, header_buf, conn->header_size);
+    if (ret != (int) conn->header_size)
     {
         Log(LOG_LEVEL_ERR,
             "Failed to receive message header during file stream: "
-            "Expected to receive %d bytes, but received %d bytes",
-            PROTOCOL_HEADER_SIZE,
+            "Expected to receive %zu bytes, but received %d bytes",
+            conn->header_size,
             ret);
         return false;
     }
 
-    /* Why not receive the bytes directly into header in the TLSRecv()?
-     * Because it actually writes a NUL-Byte after the requested bytes which
-     * would cause memory violations. */
-    uint16_t header;
-    memcpy(&header, recv_buffer, PROTOCOL_HEADER_SIZE);
-    header = ntohs(header);
+    uint32_t header;
+    if (conn->header_size == PROTOCOL_BULK_HEADER_SIZE)
+    {
+        memcpy(&header, header_buf, PROTOCOL_BULK_HEADER_SIZE);
+        header = ntohl(header);
+    }
+    else
+    {
+        uint16_t short_header;
+        memcpy(&short_header, header_buf, PROTOCOL_HEADER_SIZE);
+        header = ntohs(short_header);
+    }
 
     /* Extract Error flag */
     bool err = header & (1 << 0);
@@ -213,41 +337,44 @@ static bool ProtocolRecvMessage(SSL *conn, char *msg, size_t *len, bool *eof)
     *eof = header & (1 << 1);
 
     /* Extract message length */
-    assert(sizeof(*len) >= 2); /* It's probably guaranteed, but let's make
-                                * sure to avoid potentially nasty surprises */
     *len = header >> 4;
+    if (*len > conn->message_size)
+    {
+        Log(LOG_LEVEL_ERR,
+            "Message too large during file stream: "
+            "Message is %zu bytes, but maximum message size is %zu bytes",
+            *len,
+            conn->message_size);
+        return false;
+    }
 
     /* Read payload */
-    if (*len > 0)
-    {
-        /* The TLSRecv() function's doc string says that the returned value
-         * may be less than the requested length if the other side completed a
-         * send with less bytes. I take it that this means that there is no
-         * short reads/recvs. Furthermore, TLSSend() says that its return
-         * value is always equal to the requested length as long as TLS is
-         * setup correctly. I take it that the same is true for TLSRecv().
-         * Hence, we will interpret a shorter read than what we expect as an
-         * error. */
-        ret = TLSRecv(conn, recv_buffer, *len);
-        if (ret != *len)
+    size_t received = 0;
+    while (received < *len)
+    {
+        /* TLSRecv() returns at most one TLS record, which can be shorter
+         * than the message, so keep reading until we have all of it. It
+         * also appends a NUL-Byte, hence the extra byte in msg. */
+        const int toget = MIN(*len - received, CF_BUFSIZE - 1);
+        ret = TLSRecv(conn->ssl, msg + received, toget);
+        if (ret <= 0)
         {
             Log(LOG_LEVEL_ERR,
                 "Failed to receive message payload during file stream: "
-                "Expected to receive %zu bytes, but received %d bytes",
+                "Expected to receive %zu bytes, but received %zu bytes",
                 *len,
-                ret);
+                received);
             return false;
         }
-        memcpy(msg, recv_buffer, *len);
+        received += ret;
+    }
 
-        if (err)
-        {
-            /* If the error flag is set, then the payload contains an error
-             * message of 'len' bytes. */
-            assert(*len < sizeof(recv_buffer));
-            recv_buffer[*len] = '\0'; /* Set terminating null-byte */
-            Log(LOG_LEVEL_ERR, "Remote file stream error: %s", recv_buffer);
-        }
+    if (err)
+    {
+        /* If the error flag is set, then the payload contains an error
+         * message of 'len' bytes. */
+        msg[*len] = '\0'; /* Set terminating null-byte */
+        Log(LOG_LEVEL_ERR, "Remote file stream error: %s", msg);
     }
 
     return !err;
@@ -261,41 +388,45 @@ static bool ProtocolRecvMessage(SSL *conn, char *msg, size_t *len, bool *eof)
  * abort the file stream. Once the stream has been successfully flushed, the
  * remote host will be ready to receive our error message.
  *
- * @param conn The SSL connection object
+ * @param conn The stream connection
  * @return true on success, otherwise false
  */
-static bool ProtocolFlushStream(SSL *conn)
+static bool ProtocolFlushStream(const StreamConn *conn)
 {
     assert(conn != NULL);
 
-    char msg[PROTOCOL_MESSAGE_SIZE];
+    char *msg = xmalloc(conn->message_size + 1);
     size_t len;
     bool eof;
     while (ProtocolRecvMessage(conn, msg, &len, &eof))
     {
         if (eof)
         {
+            free(msg);
             return true;
         }
     }
 
     /* Error is already logged in ProtocolRecvMessage() */
+    free(msg);
     return false;
 }
 
 /**
  * @brief Send an error message using the file stream protocol
  *
- * @param conn The SSL connection object
+ * @param conn The stream connection
  * @param flush Whether or not to flush the stream (see ProtocolFlushStream())
  * @param fmt The format string
  * @param ... The format string arguments
  * @return true on success, otherwise false
  */
-static bool ProtocolSendError(SSL *conn, bool flush, const char *fmt, ...)
+static bool ProtocolSendError(
+    const StreamConn *conn, bool flush, const char *fmt, ...)
     FUNC_ATTR_PRINTF(3, 4);
 
-static bool ProtocolSendError(SSL *conn, bool flush, const char *fmt, ...)
+static bool ProtocolSendError(
+    const StreamConn *conn, bool flush, const char *fmt, ...)
 {
     assert(conn != NULL);
     assert(fmt != NULL);
@@ -373,11 +504,11 @@ static void MoveLeftoversToFrontOfInputBuffer(rs_buffers_t *bufs, char *in_buf)
  *
  * @param bufs RS buffers
  * @param in_buf Input buffer
- * @param conn SSL connection
+ * @param conn Stream connection
  * @return false in case of failure
  */
 static bool FillInputBufferFromHost(
-    rs_buffers_t *bufs, char *in_buf, SSL *conn)
+    rs_buffers_t *bufs, char *in_buf, const StreamConn *conn)
 {
     assert(bufs != NULL);
     assert(in_buf != NULL);
@@ -391,7 +522,7 @@ static bool FillInputBufferFromHost(
         return true;
     }
 
-    if (bufs->avail_in > PROTOCOL_MESSAGE_SIZE)
+    if (bufs->avail_in > conn->message_size)
     {
         /* We don't have space for another message */
         return true;
@@ -415,11 +546,12 @@ static bool FillInputBufferFromHost(
  *
  * @param bufs RS buffers
  * @param in_buf Input buffer
+ * @param buf_size Size of the input buffer
  * @param file The file
  * @return false in case of failure
  */
 static bool FillInputBufferFromFile(
-    rs_buffers_t *bufs, char *in_buf, FILE *file)
+    rs_buffers_t *bufs, char *in_buf, size_t buf_size, FILE *file)
 {
     assert(bufs != NULL);
     assert(in_buf != NULL);
@@ -433,8 +565,8 @@ static bool FillInputBufferFromFile(
         return true;
     }
 
-    assert(bufs->avail_in <= PROTOCOL_MESSAGE_SIZE);
-    const size_t remaining = PROTOCOL_MESSAGE_SIZE - bufs->avail_in;
+    assert(bufs->avail_in <= buf_size);
+    const size_t remaining = buf_size - bufs->avail_in;
     if (remaining == 0)
     {
         /* There is no more space in buffer */
@@ -460,18 +592,18 @@ static bool FillInputBufferFromFile(
  * @param bufs RS buffers
  * @param out_buf Output buffer
  * @param is_done Whether to set End-of-File flag
- * @param conn SSL connection
+ * @param conn Stream connection
  * @return false in case of failure
  */
 static bool DrainOutputBufferToHost(
-    rs_buffers_t *bufs, char *out_buf, bool is_done, SSL *conn)
+    rs_buffers_t *bufs, char *out_buf, bool is_done, const StreamConn *conn)
 {
     assert(bufs != NULL);
     assert(out_buf != NULL);
     assert(conn != NULL);
 
     const size_t num_bytes = bufs->next_out - out_buf;
-    assert(num_bytes <= PROTOCOL_MESSAGE_SIZE);
+    assert(num_bytes <= conn->message_size);
     if ((num_bytes == 0) && !is_done)
     {
         /* There is nothing to send (avoid sending empty messages) */
@@ -485,7 +617,7 @@ static bool DrainOutputBufferToHost(
     }
 
     bufs->next_out = out_buf;
-    bufs->avail_out = PROTOCOL_MESSAGE_SIZE;
+    bufs->avail_out = conn->message_size;
     return true;
 }
 
@@ -494,13 +626,18 @@ static bool DrainOutputBufferToHost(
  *
  * @param bufs RS buffers
  * @param out_buf The output buffer
+ * @param buf_size Size of the output buffer
  * @param fd The file descriptor
  * @param last_write_made_hole Output parameter to tell whether last write
  *                             made a hole in the sparse file
  * @return false in case of failure
  */
 static bool DrainOutputBufferToFile(
-    rs_buffers_t *bufs, char *out_buf, int fd, bool *last_write_made_hole)
+    rs_buffers_t *bufs,
+    char *out_buf,
+    size_t buf_size,
+    int fd,
+    bool *last_write_made_hole)
 {
     assert(bufs != NULL);
     assert(out_buf != NULL);
@@ -508,7 +645,7 @@ static bool DrainOutputBufferToFile(
 
     /* Drain output buffer, if there is data */
     size_t num_bytes = bufs->next_out - out_buf;
-    assert(num_bytes <= PROTOCOL_MESSAGE_SIZE);
+    assert(num_bytes <= buf_size);
     if (num_bytes == 0)
     {
         /* There is nothing to write */
@@ -522,7 +659,7 @@ static bool DrainOutputBufferToFile(
     }
 
     bufs->next_out = out_buf;
-    bufs->avail_out = PROTOCOL_MESSAGE_SIZE;
+    bufs->avail_out = buf_size;
     return true;
 }
 
@@ -533,27 +670,53 @@ static bool DrainOutputBufferToFile(
 #define ERROR_MSG_UNSPECIFIED_SERVER_REFUSAL "Unspecified server refusal"
 #define ERROR_MSG_INTERNAL_SERVER_ERROR "Internal server error"
 
-bool FileStreamRefuse(SSL *conn)
+/* Request sent by the client ahead of the signature, from protocol version
+ * 6 (bulkstream) on. */
+#define STREAM_MODE_DELTA 'D'   /* signature follows, reply with delta */
+#define STREAM_MODE_WHOLE 'W'   /* no signature, reply with the whole file */
+
+/* Set once by FileStreamEnableDeltaCache() before serving, read-only
+ * afterwards. */
+static DeltaCache *DELTA_CACHE = NULL;                         /* GLOBAL_P */
+static SignatureCache *SIGNATURE_CACHE = NULL;                 /* GLOBAL_P */
+
+static void FreeSignature(void *sig)
+{
+    rs_free_sumset(sig);
+}
+
+void FileStreamEnableDeltaCache(size_t max_bytes, size_t max_entry_bytes)
+{
+    if (DELTA_CACHE == NULL)
+    {
+        DELTA_CACHE = DeltaCacheNew(max_bytes, max_entry_bytes,
+                                    DELTA_CACHE_WAIT_TIMEOUT);
+        SIGNATURE_CACHE = SignatureCacheNew(SIGNATURE_CACHE_MAX_BYTES,
+                                            FreeSignature);
+    }
+}
+
+bool FileStreamRefuse(SSL *conn, ProtocolVersion version)
 {
+    StreamConn stream;
+    StreamConnInitFraming(&stream, conn, version);
     return ProtocolSendError(
-        conn, false, ERROR_MSG_UNSPECIFIED_SERVER_REFUSAL);
+        &stream, false, ERROR_MSG_UNSPECIFIED_SERVER_REFUSAL);
 }
 
 /**
  * @brief Receive and load signature into memory
  *
- * @param conn The SSL connection object
+ * @param conn The stream connection
  * @param sig The signature of the outdated file
  * @return true on success, otherwise false
  */
-static bool RecvSignature(SSL *conn, rs_signature_t **sig)
+static bool RecvSignature(StreamConn *conn, rs_signature_t **sig)
 {
     assert(conn != NULL);
     assert(sig != NULL);
 
-    /* The input buffer has to be twice the message size, so that it can fit a
-     * new message, as well as some tail data from the last job iteration */
-    char in_buf[PROTOCOL_MESSAGE_SIZE * 2];
+    char *in_buf = conn->in_buf;
 
     /* Start a job for loading a signature into memory */
     rs_job_t *job = rs_loadsig_begin(sig);
@@ -599,46 +762,222 @@ static bool RecvSignature(SSL *conn, rs_signature_t **sig)
     return true;
 }
 
+/* A signature takes a few dozen bytes per block of the basis file, a small
+ * fraction of its size. This is what a signature may exceed the size of the
+ * source file by, for a basis a lot larger than the source. */
+#define SIGNATURE_MAX_EXTRA_SIZE (1024 * 1024)
+
 /**
- * @brief Compute and send delta based on the source file and the signature of
- *        the basis file
+ * @brief Receive a signature without loading it, so that it can be looked up
+ *        in the signature cache first
  *
- * @param conn The SSL connection object
- * @param sig The signature of the basis file
- * @param filename The name of the source file
+ * @param conn The stream connection
+ * @param max_len The size a signature is refused beyond
+ * @param data The raw signature, to be freed by the caller
+ * @param len The size of the raw signature
+ * @return true on success, otherwise false
+ */
+static bool RecvSignatureData(
+    StreamConn *conn, size_t max_len, char **data, size_t *len)
+{
+    assert(conn != NULL);
+    assert(data != NULL);
+    assert(len != NULL);
+
+    char *buf = NULL;
+    size_t buf_len = 0;
+    bool eof;
+    do
+    {
+        size_t msg_len;
+        if (!ProtocolRecvMessage(conn, conn->in_buf, &msg_len, &eof))
+        {
+            /* Error is already logged */
+            free(buf);
+            return false;
+        }
+
+        if (msg_len > max_len - buf_len)
+        {
+            Log(LOG_LEVEL_ERR,
+                "Refusing signature of more than %zu bytes during file stream",
+                max_len);
+            ProtocolSendError(conn, !eof, ERROR_MSG_INTERNAL_SERVER_ERROR);
+            free(buf);
+            return false;
+        }
+
+        buf = xrealloc(buf, buf_len + msg_len);
+        memcpy(buf + buf_len, conn->in_buf, msg_len);
+        buf_len += msg_len;
+    } while (!eof);
+
+    *data = buf;
+    *len = buf_len;
+    return true;
+}
+
+/**
+ * @brief Build the hash table of a signature for computing deltas
+ *
+ * @param conn The stream connection
+ * @param sig The signature
  * @return true on success, otherwise false
  */
-static bool SendDelta(SSL *conn, rs_signature_t *sig, const char *filename)
+static bool IndexSignature(StreamConn *conn, rs_signature_t *sig)
 {
     assert(conn != NULL);
     assert(sig != NULL);
-    assert(filename != NULL);
 
-    /* In this case, the input buffer does not need to be twice the message
-     * size, because we can control how much we read into it */
-    char in_buf[PROTOCOL_MESSAGE_SIZE], out_buf[PROTOCOL_MESSAGE_SIZE];
+    rs_result res = rs_build_hash_table(sig);
+    if (res != RS_DONE)
+    {
+        Log(LOG_LEVEL_ERR, "Failed to build hash table: %s", rs_strerror(res));
+        ProtocolSendError(conn, false, ERROR_MSG_INTERNAL_SERVER_ERROR);
+        return false;
+    }
+    return true;
+}
 
-    /* Open source file */
-    FILE *file = safe_fopen(filename, "rb");
-    if (file == NULL)
+/**
+ * @brief Load and index a signature received with RecvSignatureData()
+ *
+ * @param conn The stream connection
+ * @param data The raw signature
+ * @param len The size of the raw signature
+ * @param sig The signature of the outdated file
+ * @return true on success, otherwise false
+ */
+static bool LoadSignature(
+    StreamConn *conn, const char *data, size_t len, rs_signature_t **sig)
+{
+    assert(conn != NULL);
+    assert(data != NULL || len == 0);
+    assert(sig != NULL);
+
+    rs_job_t *job = rs_loadsig_begin(sig);
+    if (job == NULL)
     {
-        Log(LOG_LEVEL_ERR,
-            "Failed to open the source file '%s' for computing delta during file stream: %s",
-            filename,
-            GetErrorStr());
+        Log(LOG_LEVEL_ERR, "Failed to begin job for loading signature");
         ProtocolSendError(conn, false, ERROR_MSG_INTERNAL_SERVER_ERROR);
         return false;
     }
 
-    /* Build hash table */
-    rs_result res = rs_build_hash_table(sig);
+    /* The whole signature is there, a single iteration takes it all */
+    rs_buffers_t bufs = {0};
+    bufs.next_in = (char *) data;
+    bufs.avail_in = len;
+    bufs.eof_in = 1;
+
+    rs_result res = rs_job_iter(job, &bufs);
+    rs_job_free(job);
     if (res != RS_DONE)
     {
-        Log(LOG_LEVEL_ERR, "Failed to build hash table: %s", rs_strerror(res));
+        Log(LOG_LEVEL_ERR,
+            "Failed to iterate job for loading signature: %s",
+            rs_strerror(res));
         ProtocolSendError(conn, false, ERROR_MSG_INTERNAL_SERVER_ERROR);
-        fclose(file);
+        rs_free_sumset(*sig);
+        return false;
+    }
+
+    if (!IndexSignature(conn, *sig))
+    {
+        /* Error is already logged */
+        rs_free_sumset(*sig);
         return false;
     }
+    return true;
+}
+
+/**
+ * @brief Send delta data held in memory
+ *
+ * @param conn The stream connection
+ * @param data The delta data
+ * @param len The size of the delta data
+ * @param eof Whether this is the end of the delta
+ * @return true on success, otherwise false
+ */
+static bool SendDeltaData(
+    StreamConn *conn, const char *data, size_t len, bool eof)
+{
+    assert(conn != NULL);
+    assert(data != NULL || len == 0);
+
+    size_t offset = 0;
+    while (offset < len || (eof && offset == 0))
+    {
+        const size_t msg_len = MIN(len - offset, conn->message_size);
+        const bool last = eof && (offset + msg_len == len);
+        if (!ProtocolSendMessage(conn, data + offset, msg_len, last))
+        {
+            /* Error is already logged */
+            return false;
+        }
+        offset += msg_len;
+        if (last)
+        {
+            break;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Check that the source file was neither modified nor replaced since
+ *        it was opened
+ */
+static bool SourceUnchanged(const char *filename, const struct stat *sb)
+{
+    struct stat now;
+    return (stat(filename, &now) == 0      &&
+            now.st_dev   == sb->st_dev     &&
+            now.st_ino   == sb->st_ino     &&
+            now.st_size  == sb->st_size    &&
+            now.st_mtime == sb->st_mtime   &&
+            now.st_ctime == sb->st_ctime);
+}
+
+/**
+ * @brief Compute and send delta based on the source file and the signature of
+ *        the basis file
+ *
+ * With a delta cache entry, the delta is computed into the entry and only
+ * sent once it's complete, so that other clients waiting for the entry
+ * don't wait on this client's connection. If the delta outgrows the entry,
+ * the entry is given up and the rest of the delta is sent as it comes.
+ *
+ * @param conn The stream connection
+ * @param sig The indexed signature of the basis file (see IndexSignature())
+ * @param filename The name of the source file
+ * @param file The source file, open for reading
+ * @param sb The stat of #file when it was opened
+ * @param entry If not NULL, the delta cache entry to compute, it's completed
+ *              when this returns
+ * @return true on success, otherwise false
+ */
+static bool SendDelta(
+    StreamConn *conn,
+    rs_signature_t *sig,
+    const char *filename,
+    FILE *file,
+    const struct stat *sb,
+    DeltaCacheEntry *entry)
+{
+    assert(conn != NULL);
+    assert(sig != NULL);
+    assert(filename != NULL);
+    assert(file != NULL);
+    assert(sb != NULL);
+
+    /* In this case, the input buffer does not need to be twice the message
+     * size, because we can control how much we read into it */
+    char *in_buf = conn->in_buf, *out_buf = conn->out_buf;
+
+    /* Whether the delta still goes to the cache entry */
+    bool caching = (entry != NULL);
 
     /* Start generating delta */
     rs_job_t *job = rs_delta_begin(sig);
@@ -646,7 +985,10 @@ static bool SendDelta(SSL *conn, rs_signature_t *sig, const char *filename)
     {
         Log(LOG_LEVEL_ERR, "Failed to begin job for generating delta");
         ProtocolSendError(conn, false, ERROR_MSG_INTERNAL_SERVER_ERROR);
-        fclose(file);
+        if (caching)
+        {
+            DeltaCacheComplete(DELTA_CACHE, entry, false);
+        }
         return false;
     }
 
@@ -655,11 +997,12 @@ static bool SendDelta(SSL *conn, rs_signature_t *sig, const char *filename)
     bufs.next_in = in_buf;
     bufs.next_out = out_buf;
     bufs.avail_out =
-        PROTOCOL_MESSAGE_SIZE; /* We cannot send more using the protocol */
+        conn->message_size; /* We cannot send more using the protocol */
 
+    rs_result res;
     do
     {
-        if (!FillInputBufferFromFile(&bufs, in_buf, file))
+        if (!FillInputBufferFromFile(&bufs, in_buf, conn->message_size, file))
         {
             Log(LOG_LEVEL_ERR,
                 "Failed to read the source file '%s' during file stream: %s",
@@ -667,7 +1010,10 @@ static bool SendDelta(SSL *conn, rs_signature_t *sig, const char *filename)
                 GetErrorStr());
             ProtocolSendError(conn, false, ERROR_MSG_INTERNAL_SERVER_ERROR);
 
-            fclose(file);
+            if (caching)
+            {
+                DeltaCacheComplete(DELTA_CACHE, entry, false);
+            }
             rs_job_free(job);
             return false;
         }
@@ -681,34 +1027,253 @@ static bool SendDelta(SSL *conn, rs_signature_t *sig, const char *filename)
                 rs_strerror(res));
             ProtocolSendError(conn, false, ERROR_MSG_INTERNAL_SERVER_ERROR);
 
-            fclose(file);
+            if (caching)
+            {
+                DeltaCacheComplete(DELTA_CACHE, entry, false);
+            }
             rs_job_free(job);
             return false;
         }
 
+        if (caching)
+        {
+            if (DeltaCacheAppend(
+                    DELTA_CACHE, entry, out_buf, bufs.next_out - out_buf))
+            {
+                bufs.next_out = out_buf;
+                bufs.avail_out = conn->message_size;
+                continue;
+            }
+
+            /* Too big to cache: let the waiting clients compute their own,
+             * and send what we have so far */
+            DeltaCacheComplete(DELTA_CACHE, entry, false);
+            caching = false;
+
+            size_t len;
+            const char *data = DeltaCacheEntryData(entry, &len);
+            if (!SendDeltaData(conn, data, len, false))
+            {
+                rs_job_free(job);
+                return false;
+            }
+        }
+
         if (!DrainOutputBufferToHost(&bufs, out_buf, (res == RS_DONE), conn))
         {
             /* Error is already logged in ProtocolSendMessage() */
-            fclose(file);
             rs_job_free(job);
             return false;
         }
     } while (res != RS_DONE);
 
-    fclose(file);
     rs_job_free(job);
 
+    if (caching)
+    {
+        /* Don't cache a delta of a file modified or replaced meanwhile */
+        DeltaCacheComplete(
+            DELTA_CACHE, entry, SourceUnchanged(filename, sb));
+
+        size_t len;
+        const char *data = DeltaCacheEntryData(entry, &len);
+        return SendDeltaData(conn, data, len, true);
+    }
+
     return true;
 }
 
-bool FileStreamServe(SSL *conn, const char *filename)
+/**
+ * @brief Read exactly #len bytes from #fd, unless the file is shorter
+ *
+ * @return the number of bytes read, or -1 in case of error
+ */
+static ssize_t ReadFull(int fd, char *buf, size_t len)
 {
-    assert(conn != NULL);
-    assert(filename != NULL);
-
-    Log(LOG_LEVEL_VERBOSE,
-        "Receiving- & loading signature into memory for file '%s'...",
-        filename);
+    size_t total = 0;
+    while (total < len)
+    {
+        ssize_t ret = read(fd, buf + total, len - total);
+        if (ret == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ret == -1)
+        {
+            return -1;
+        }
+        if (ret == 0)
+        {
+            break;
+        }
+        total += ret;
+    }
+    return total;
+}
+
+/**
+ * @brief Send the contents of the source file as they are, with no librsync
+ *        job in between
+ *
+ * If kernel TLS is in use on the connection, the file data is handed to
+ * SSL_sendfile() and never copied into user space. Otherwise, it's read
+ * into the output buffer and sent one message at a time.
+ *
+ * @param conn The stream connection
+ * @param filename The name of the source file
+ * @return true on success, otherwise false
+ */
+static bool SendWholeFile(StreamConn *conn, const char *filename)
+{
+    assert(conn != NULL);
+    assert(filename != NULL);
+
+    int fd = safe_open(filename, O_RDONLY | O_BINARY);
+    if (fd == -1)
+    {
+        Log(LOG_LEVEL_ERR,
+            "Failed to open the source file '%s' during file stream: %s",
+            filename,
+            GetErrorStr());
+        ProtocolSendError(conn, false, ERROR_MSG_INTERNAL_SERVER_ERROR);
+        return false;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) == -1)
+    {
+        Log(LOG_LEVEL_ERR,
+            "Failed to stat the source file '%s' during file stream: %s",
+            filename,
+            GetErrorStr());
+        ProtocolSendError(conn, false, ERROR_MSG_INTERNAL_SERVER_ERROR);
+        close(fd);
+        return false;
+    }
+
+    bool use_sendfile = false;
+#ifdef HAVE_KTLS_SENDFILE
+    use_sendfile = S_ISREG(sb.st_mode) &&
+        (BIO_get_ktls_send(SSL_get_wbio(conn->ssl)) != 0);
+#endif
+    Log(LOG_LEVEL_DEBUG,
+        "Sending whole file '%s' (%jd bytes)%s",
+        filename,
+        (intmax_t) sb.st_size,
+        use_sendfile ? " with SSL_sendfile()" : "");
+
+    /* We promise the size we stat'ed; if the file grows meanwhile, the
+     * client gets the prefix, just like with a delta. */
+    off_t offset = 0;
+    do
+    {
+        const size_t len = MIN((size_t) (sb.st_size - offset),
+                               conn->message_size);
+        const bool eof = (offset + (off_t) len == sb.st_size);
+
+#ifdef HAVE_KTLS_SENDFILE
+        if (use_sendfile && len > 0)
+        {
+            if (!ProtocolSendHeader(conn, len, eof, false))
+            {
+                /* Error is already logged */
+                close(fd);
+                return false;
+            }
+
+            EnforceBwLimit(len);
+            size_t sent = 0;
+            while (sent < len)
+            {
+                ossl_ssize_t ret = SSL_sendfile(
+                    conn->ssl, fd, offset + sent, len - sent, 0);
+                if (ret <= 0)
+                {
+                    /* The header is out, so the stream is broken now */
+                    TLSLogError(conn->ssl, LOG_LEVEL_ERR, "SSL_sendfile", (int) ret);
+                    close(fd);
+                    return false;
+                }
+                sent += ret;
+            }
+            offset += len;
+            continue;
+        }
+#endif
+
+        ssize_t n_read = ReadFull(fd, conn->out_buf, len);
+        if (n_read != (ssize_t) len)
+        {
+            Log(LOG_LEVEL_ERR,
+                "Failed to read the source file '%s' during file stream: %s",
+                filename,
+                (n_read == -1) ? GetErrorStr() : "File was truncated");
+            ProtocolSendError(conn, false, ERROR_MSG_INTERNAL_SERVER_ERROR);
+            close(fd);
+            return false;
+        }
+
+        if (!ProtocolSendMessage(conn, conn->out_buf, len, eof))
+        {
+            /* Error is already logged */
+            close(fd);
+            return false;
+        }
+        offset += len;
+    } while (offset < sb.st_size);
+
+    close(fd);
+    return true;
+}
+
+/**
+ * @brief Open the source file for computing a delta
+ *
+ * @param conn The stream connection
+ * @param filename The name of the source file
+ * @param flush Whether the signature is still to be received
+ * @param sb The stat of the opened file
+ * @return the opened file, or NULL on failure
+ */
+static FILE *OpenSource(
+    StreamConn *conn, const char *filename, bool flush, struct stat *sb)
+{
+    assert(conn != NULL);
+    assert(filename != NULL);
+    assert(sb != NULL);
+
+    FILE *file = safe_fopen(filename, "rb");
+    if (file == NULL || fstat(fileno(file), sb) == -1)
+    {
+        Log(LOG_LEVEL_ERR,
+            "Failed to open the source file '%s' for computing delta during file stream: %s",
+            filename,
+            GetErrorStr());
+        ProtocolSendError(conn, flush, ERROR_MSG_INTERNAL_SERVER_ERROR);
+        if (file != NULL)
+        {
+            fclose(file);
+        }
+        return NULL;
+    }
+    return file;
+}
+
+/**
+ * @brief Receive the signature of the basis file and reply with the delta
+ *
+ * @param conn The stream connection
+ * @param filename The name of the source file
+ * @return true on success, otherwise false
+ */
+static bool ServeDelta(StreamConn *conn, const char *filename)
+{
+    assert(conn != NULL);
+    assert(filename != NULL);
+
+    Log(LOG_LEVEL_VERBOSE,
+        "Receiving- & loading signature into memory for file '%s'...",
+        filename);
     rs_signature_t *sig;
     if (!RecvSignature(conn, &sig))
     {
@@ -716,18 +1281,195 @@ bool FileStreamServe(SSL *conn, const char *filename)
         return false;
     }
 
+    struct stat sb;
+    FILE *file = OpenSource(conn, filename, false, &sb);
+    if (file == NULL)
+    {
+        /* Error is already logged */
+        rs_free_sumset(sig);
+        return false;
+    }
+
     Log(LOG_LEVEL_VERBOSE,
         "Computing- & sending delta for file '%s'...",
         filename);
-    if (!SendDelta(conn, sig, filename))
+    bool success = IndexSignature(conn, sig) &&
+                   SendDelta(conn, sig, filename, file, &sb, NULL);
+
+    fclose(file);
+    rs_free_sumset(sig);
+    return success;
+}
+
+/**
+ * @brief Like ServeDelta(), going through the delta and signature caches
+ *
+ * The raw signature identifies the basis, so clients holding the same basis
+ * share the delta, and the loaded signature when there's no delta cached.
+ */
+static bool ServeDeltaCached(StreamConn *conn, const char *filename)
+{
+    assert(conn != NULL);
+    assert(filename != NULL);
+
+    /* Opened first, the signature is bounded by its size. */
+    struct stat sb;
+    FILE *file = OpenSource(conn, filename, true, &sb);
+    if (file == NULL)
     {
         /* Error is already logged */
-        rs_free_sumset(sig);
         return false;
     }
 
-    rs_free_sumset(sig);
-    return true;
+    Log(LOG_LEVEL_VERBOSE,
+        "Receiving signature for file '%s'...",
+        filename);
+    char *raw_sig;
+    size_t raw_len;
+    if (!RecvSignatureData(conn,
+                           (size_t) sb.st_size + SIGNATURE_MAX_EXTRA_SIZE,
+                           &raw_sig, &raw_len))
+    {
+        /* Error is already logged */
+        fclose(file);
+        return false;
+    }
+
+    unsigned char value[EVP_MAX_MD_SIZE];
+    char basis_digest[CF_HOSTKEY_STRING_SIZE];
+    if (EVP_Digest(raw_sig, raw_len, value, NULL,
+                   HashDigestFromId(HASH_METHOD_SHA256), NULL) != 1)
+    {
+        Log(LOG_LEVEL_ERR, "Failed to compute the digest of a signature");
+        ProtocolSendError(conn, false, ERROR_MSG_INTERNAL_SERVER_ERROR);
+        fclose(file);
+        free(raw_sig);
+        return false;
+    }
+    HashPrintSafe(basis_digest, sizeof(basis_digest), value,
+                  HASH_METHOD_SHA256, false);
+
+    bool compute;
+    DeltaCacheEntry *entry = DeltaCacheAcquire(
+        DELTA_CACHE, filename, &sb, basis_digest, &compute);
+    if (!compute)
+    {
+        Log(LOG_LEVEL_VERBOSE,
+            "Sending cached delta for file '%s'...",
+            filename);
+        size_t len;
+        const char *data = DeltaCacheEntryData(entry, &len);
+        bool success = SendDeltaData(conn, data, len, true);
+
+        DeltaCacheRelease(DELTA_CACHE, entry);
+        fclose(file);
+        free(raw_sig);
+        return success;
+    }
+
+    SignatureCacheEntry *sig_entry =
+        SignatureCacheAcquire(SIGNATURE_CACHE, basis_digest);
+    if (sig_entry == NULL)
+    {
+        Log(LOG_LEVEL_VERBOSE,
+            "Loading signature into memory for file '%s'...",
+            filename);
+        rs_signature_t *sig;
+        if (!LoadSignature(conn, raw_sig, raw_len, &sig))
+        {
+            /* Error is already logged */
+            if (entry != NULL)
+            {
+                DeltaCacheComplete(DELTA_CACHE, entry, false);
+                DeltaCacheRelease(DELTA_CACHE, entry);
+            }
+            fclose(file);
+            free(raw_sig);
+            return false;
+        }
+
+        /* Loaded and indexed, a signature takes about twice its raw size */
+        sig_entry = SignatureCacheInsert(
+            SIGNATURE_CACHE, basis_digest, sig, 2 * raw_len);
+    }
+    free(raw_sig);
+
+    /* Delta jobs only read the signature (librsync's statistics counters
+     * aside), so the clients using it at the same time can share it. */
+    Log(LOG_LEVEL_VERBOSE,
+        "Computing- & sending delta for file '%s'...",
+        filename);
+    bool success = SendDelta(conn, SignatureCacheEntrySignature(sig_entry),
+                             filename, file, &sb, entry);
+
+    SignatureCacheRelease(SIGNATURE_CACHE, sig_entry);
+    DeltaCacheRelease(DELTA_CACHE, entry);
+    fclose(file);
+    return success;
+}
+
+/**
+ * @brief Receive the stream mode requested by the client
+ *
+ * @return STREAM_MODE_DELTA or STREAM_MODE_WHOLE, or '\0' in case of error
+ */
+static char RecvStreamMode(StreamConn *conn)
+{
+    if (!ProtocolSupportsBulkStream(conn->version))
+    {
+        /* Older clients always send a signature */
+        return STREAM_MODE_DELTA;
+    }
+
+    size_t len;
+    bool eof;
+    if (!ProtocolRecvMessage(conn, conn->in_buf, &len, &eof))
+    {
+        /* Error is already logged */
+        return '\0';
+    }
+
+    const char mode = (len == 1) ? conn->in_buf[0] : '\0';
+    if (!eof || (mode != STREAM_MODE_DELTA && mode != STREAM_MODE_WHOLE))
+    {
+        Log(LOG_LEVEL_ERR, "Received bad stream mode during file stream");
+        ProtocolSendError(conn, !eof, ERROR_MSG_INTERNAL_SERVER_ERROR);
+        return '\0';
+    }
+
+    return mode;
+}
+
+bool FileStreamServe(SSL *conn, const char *filename, ProtocolVersion version)
+{
+    assert(conn != NULL);
+    assert(filename != NULL);
+
+    StreamConn stream;
+    StreamConnInit(&stream, conn, version);
+
+    const char mode = RecvStreamMode(&stream);
+    if (mode == '\0')
+    {
+        /* Error is already logged */
+        StreamConnDestroy(&stream);
+        return false;
+    }
+
+    if (mode == STREAM_MODE_WHOLE)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Sending whole file '%s'...", filename);
+        bool success = SendWholeFile(&stream, filename);
+        StreamConnDestroy(&stream);
+        return success;
+    }
+
+    bool success = (DELTA_CACHE != NULL) ?
+        ServeDeltaCached(&stream, filename) :
+        ServeDelta(&stream, filename);
+
+    StreamConnDestroy(&stream);
+    return success;
 }
 
 /*********************************************************/
@@ -772,12 +1514,13 @@ static rs_long_t GetSizeOfFile(FILE *file)
 /**
  * @brief Compute and send a signature of the basis file
  *
- * @param conn The SSL connection object
+ * @param conn The stream connection
  * @param filename The name of the basis file
  * @param print_stats Whether or not to print performance statistics
  * @return true on success, otherwise false
  */
-static bool SendSignature(SSL *conn, const char *filename, bool print_stats)
+static bool SendSignature(
+    StreamConn *conn, const char *filename, bool print_stats)
 {
     assert(conn != NULL);
     assert(filename != NULL);
@@ -788,7 +1531,7 @@ static bool SendSignature(SSL *conn, const char *filename, bool print_stats)
 
     /* In this case, the input buffer does not need to be twice the message
      * size, because we can control how much we read into it */
-    char in_buf[PROTOCOL_MESSAGE_SIZE], out_buf[PROTOCOL_MESSAGE_SIZE];
+    char *in_buf = conn->in_buf, *out_buf = conn->out_buf;
 
     /* Open basis file */
     FILE *file = safe_fopen(filename, "rb");
@@ -834,11 +1577,11 @@ static bool SendSignature(SSL *conn, const char *filename, bool print_stats)
     bufs.next_in = in_buf;
     bufs.next_out = out_buf;
     bufs.avail_out =
-        PROTOCOL_MESSAGE_SIZE; /* We cannot send more using the protocol */
+        conn->message_size; /* We cannot send more using the protocol */
 
     do
     {
-        if (!FillInputBufferFromFile(&bufs, in_buf, file))
+        if (!FillInputBufferFromFile(&bufs, in_buf, conn->message_size, file))
         {
             Log(LOG_LEVEL_ERR,
                 "Failed to read the basis file '%s' during file stream: %s",
@@ -898,7 +1641,7 @@ static bool SendSignature(SSL *conn, const char *filename, bool print_stats)
 /**
  * @brief Receive delta and apply patch to the outdated copy of the file
  *
- * @param conn The SSL connection object
+ * @param conn The stream connection
  * @param basis The name of basis file
  * @param dest The name of destination file
  * @param perms The desired file permissions of the destination file
@@ -906,7 +1649,7 @@ static bool SendSignature(SSL *conn, const char *filename, bool print_stats)
  * @return true on success, otherwise false
  */
 static bool RecvDelta(
-    SSL *conn,
+    StreamConn *conn,
     const char *basis,
     const char *dest,
     mode_t perms,
@@ -920,9 +1663,7 @@ static bool RecvDelta(
     size_t bytes_in = 0;
     size_t bytes_out = 0;
 
-    /* The input buffer has to be twice the message size, so that it can fit a
-     * new message, as well as some tail data from the last job iteration */
-    char in_buf[PROTOCOL_MESSAGE_SIZE * 2], out_buf[PROTOCOL_MESSAGE_SIZE];
+    char *in_buf = conn->in_buf, *out_buf = conn->out_buf;
 
     /* Open/create the destination file */
     unlink(dest);
@@ -973,7 +1714,7 @@ static bool RecvDelta(
     rs_buffers_t bufs = {0};
     bufs.next_in = in_buf;
     bufs.next_out = out_buf;
-    bufs.avail_out = PROTOCOL_MESSAGE_SIZE;
+    bufs.avail_out = conn->message_size;
 
     /* Sparse file specific */
     bool last_write_made_hole = false;
@@ -1017,7 +1758,11 @@ static bool RecvDelta(
 
         /* Drain output buffer, if there is data */
         if (!DrainOutputBufferToFile(
-                &bufs, out_buf, new_fd, &last_write_made_hole))
+                &bufs,
+                out_buf,
+                conn->message_size,
+                new_fd,
+                &last_write_made_hole))
         {
             /* Error is already logged */
             close(new_fd);
@@ -1051,8 +1796,91 @@ static bool RecvDelta(
     return true;
 }
 
+/**
+ * @brief Receive the whole file and write it to the destination file
+ *
+ * @param conn The stream connection
+ * @param dest The name of destination file
+ * @param perms The desired file permissions of the destination file
+ * @param print_stats Whether or not to print performance statistics
+ * @return true on success, otherwise false
+ */
+static bool RecvWholeFile(
+    StreamConn *conn, const char *dest, mode_t perms, bool print_stats)
+{
+    assert(conn != NULL);
+    assert(dest != NULL);
+
+    /* Variables used for performance statistics */
+    size_t bytes_in = 0;
+
+    /* Open/create the destination file */
+    unlink(dest);
+    int new_fd = safe_open_create_perms(
+        dest, O_WRONLY | O_CREAT | O_TRUNC | O_EXCL | O_BINARY, perms);
+    if (new_fd == -1)
+    {
+        Log(LOG_LEVEL_ERR,
+            "Failed to open/create destination file '%s': %s",
+            dest,
+            GetErrorStr());
+        ProtocolFlushStream(conn);
+        return false;
+    }
+
+    /* Sparse file specific */
+    bool last_write_made_hole = false;
+
+    bool eof = false;
+    while (!eof)
+    {
+        size_t len;
+        if (!ProtocolRecvMessage(conn, conn->in_buf, &len, &eof))
+        {
+            /* Error is already logged in ProtocolRecvMessage() */
+            close(new_fd);
+            unlink(dest);
+            return false;
+        }
+
+        if (len > 0 &&
+            !FileSparseWrite(new_fd, conn->in_buf, len, &last_write_made_hole))
+        {
+            /* Error is already logged */
+            if (!eof)
+            {
+                ProtocolFlushStream(conn);
+            }
+            close(new_fd);
+            unlink(dest);
+            return false;
+        }
+        bytes_in += len;
+    }
+
+    if (!FileSparseClose(new_fd, dest, false, bytes_in, last_write_made_hole))
+    {
+        /* Error is already logged */
+        unlink(dest);
+        return false;
+    }
+
+    const char *msg =
+        "Receive whole file statistics:\n"
+        "  %zu bytes in (received from server)\n"
+        "  %zu bytes out (written to '%s')\n";
+    Log(LOG_LEVEL_DEBUG, msg, bytes_in, bytes_in, dest);
+    if (print_stats)
+    {
+        fprintf(stderr, msg, bytes_in, bytes_in, dest);
+    }
+
+    return true;
+}
+
 bool FileStreamFetch(
     SSL *conn,
+    ProtocolVersion version,
     const char *basis,
     const char *dest,
     mode_t perms,
@@ -1069,23 +1897,84 @@ bool FileStreamFetch(
         fclose(file);
     }
 
+    StreamConn stream;
+    StreamConnInit(&stream, conn, version);
+
+    if (ProtocolSupportsBulkStream(version))
+    {
+        /* A delta against an empty basis is the whole file anyway, only
+         * wrapped in librsync's encoding, so skip the signature. */
+        struct stat sb;
+        const bool whole = (stat(basis, &sb) == -1 || sb.st_size == 0);
+        const char mode = whole ? STREAM_MODE_WHOLE : STREAM_MODE_DELTA;
+        if (!ProtocolSendMessage(&stream, &mode, 1, true))
+        {
+            /* Error is already logged */
+            StreamConnDestroy(&stream);
+            return false;
+        }
+
+        if (whole)
+        {
+            Log(LOG_LEVEL_VERBOSE, "Receiving whole file '%s'...", dest);
+            bool success = RecvWholeFile(&stream, dest, perms, print_stats);
+            StreamConnDestroy(&stream);
+            return success;
+        }
+    }
+
     Log(LOG_LEVEL_VERBOSE,
         "Computing- & sending signature of file '%s'...",
         basis);
-    if (!SendSignature(conn, basis, print_stats))
+    if (!SendSignature(&stream, basis, print_stats))
     {
         /* Error is already logged */
+        StreamConnDestroy(&stream);
         return false;
     }
 
     Log(LOG_LEVEL_VERBOSE,
         "Receiving delta & applying patch to file '%s'...",
         dest);
-    if (!RecvDelta(conn, basis, dest, perms, print_stats))
+    if (!RecvDelta(&stream, basis, dest, perms, print_stats))
     {
         /* Error is already logged */
+        StreamConnDestroy(&stream);
         return false;
     }
 
+    StreamConnDestroy(&stream);
     return true;
 }
+
+bool FileStreamAskWhole(SSL *conn, ProtocolVersion version)
+{
+    assert(conn != NULL);
+    assert(ProtocolSupportsBulkStream(version));
+
+    StreamConn stream;
+    StreamConnInit(&stream, conn, version);
+
+    const char mode = STREAM_MODE_WHOLE;
+    bool success = ProtocolSendMessage(&stream, &mode, 1, true);
+
+    StreamConnDestroy(&stream);
+    return success;
+}
+
+bool FileStreamRecvWhole(
+    SSL *conn, ProtocolVersion version, const char *dest, mode_t perms)
+{
+    assert(conn != NULL);
+    assert(dest != NULL);
+    assert(ProtocolSupportsBulkStream(version));
+
+    StreamConn stream;
+    StreamConnInit(&stream, conn, version);
+
+    Log(LOG_LEVEL_VERBOSE, "Receiving whole file '%s'...", dest);
+    bool success = RecvWholeFile(&stream, dest, perms, false);
+
+    StreamConnDestroy(&stream);
+    return success;
+}
@@ -56,9 +56,21 @@
  * 7. Client applies delta on contents of the basis file in order to create
  *    the destination file
  *
+ * From protocol version 6 (bulkstream) on, the client first tells whether
+ * it wants a delta (and sends its signature) or the whole file. It asks for
+ * the whole file when it has no basis to patch, and the server then streams
+ * the file as is, skipping librsync (and, with kernel TLS, user space).
+ *
+ * With the delta cache enabled, the server remembers the deltas it sent,
+ * keyed by the source file and the digest of the received signature, and
+ * serves clients that have the same basis without computing them again.
+ * It also keeps the signatures it loaded, so that a delta it doesn't have
+ * can be computed without loading the same signature again.
+ *
  */
 
 #include <tls_generic.h>
+#include <protocol_version.h>                              /* ProtocolVersion */
 #include <stdbool.h>
 #include <sys/types.h> /* mode_t */
 
@@ -70,26 +82,39 @@
  * denied. We don't disinguish between these two for security reasons.
  *
  * @param conn The SSL connection object
+ * @param version The protocol version of the connection
  * @return true on success, otherwise false
  */
-bool FileStreamRefuse(SSL *conn);
+bool FileStreamRefuse(SSL *conn, ProtocolVersion version);
+
+/**
+ * @brief Cache the deltas computed by FileStreamServe(), and the signatures
+ *        they were computed with
+ *
+ * @param max_bytes The total size of the deltas kept
+ * @param max_entry_bytes The size of the biggest delta kept
+ * @note Must be called before serving any file, later calls do nothing.
+ */
+void FileStreamEnableDeltaCache(size_t max_bytes, size_t max_entry_bytes);
 
 /**
  * @brief Serve a file using the stream API
  *
  * @param conn The SSL connection object
  * @param filename The name of the source file
+ * @param version The protocol version of the connection
  * @return true on success, otherwise false
  *
  * @note If the source file is a symlink, this function serves the contents of
  *       the symlink target.
  */
-bool FileStreamServe(SSL *conn, const char *filename);
+bool FileStreamServe(SSL *conn, const char *filename, ProtocolVersion version);
 
 /**
  * @brief Fetch a file using the stream API
  *
  * @param conn The SSL connection object
+ * @param version The protocol version of the connection
  * @param basis The name of the basis file
  * @param dest The name of the destination file
  * @param perms The desired permissions of the destination file
@@ -101,9 +126,37 @@ bool FileStreamServe(SSL *conn, const char *filename);
  */
 bool FileStreamFetch(
     SSL *conn,
+    ProtocolVersion version,
     const char *basis,
     const char *dest,
     mode_t perms,
     bool print_stats);
 
+/**
+ * @brief Ask for the whole file, without sending a signature
+ *
+ * Sent right after the GET request. The reply can be read later with
+ * FileStreamRecvWhole(), so that several requests can be on the wire at
+ * once.
+ *
+ * @param conn The SSL connection object
+ * @param version The protocol version of the connection (at least
+ *                bulkstream)
+ * @return true on success, otherwise false
+ */
+bool FileStreamAskWhole(SSL *conn, ProtocolVersion version);
+
+/**
+ * @brief Receive a whole file asked for with FileStreamAskWhole()
+ *
+ * @param conn The SSL connection object
+ * @param version The protocol version of the connection (at least
+ *                bulkstream)
+ * @param dest The name of the destination file
+ * @param perms The desired permissions of the destination file
+ * @return true on success, otherwise false
+ */
+bool FileStreamRecvWhole(
+    SSL *conn, ProtocolVersion version, const char *dest, mode_t perms);
+
 #endif // FILE_STREAM_H
@@ -0,0 +1,665 @@
+/*
+  Copyright 2024 Northern.tech AS
+
+  This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; version 3.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#include <file_stream_cache.h>
+
+#include <alloc.h>
+#include <logging.h>
+#include <map.h>
+#include <mutex.h>                                            /* ThreadLock */
+#include <string_lib.h>                              /* StringHash_untyped */
+
+
+typedef enum
+{
+    DELTA_ENTRY_PENDING,                                /* being computed */
+    DELTA_ENTRY_READY,
+    DELTA_ENTRY_FAILED,
+} DeltaEntryState;
+
+struct DeltaCacheEntry_
+{
+    char *key;
+    DeltaEntryState state;
+    bool cached;                        /* in the map, and in LRU if ready */
+    bool too_big;
+    size_t refs;
+
+    /* The source the delta was computed from. */
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    time_t ctime;
+
+    char *data;
+    size_t len;
+    size_t capacity;
+
+    /* LRU list of the ready entries, head is the most recently used. */
+    DeltaCacheEntry *prev;
+    DeltaCacheEntry *next;
+};
+
+/**
+   Define DeltaEntryMap.
+   Key:   "<filename>\n<basis digest>"
+   Value: the entry, not freed by the map since it may outlive its place
+          in it (see EntryUncache())
+*/
+TYPED_MAP_DECLARE(DeltaEntry, char *, DeltaCacheEntry *)
+
+static void DeltaEntryNoFree(ARG_UNUSED DeltaCacheEntry *entry)
+{
+}
+
+TYPED_MAP_DEFINE(DeltaEntry, char *, DeltaCacheEntry *,
+                 StringHash_untyped,
+                 StringEqual_untyped,
+                 free,
+                 DeltaEntryNoFree)
+
+struct DeltaCache_
+{
+    pthread_mutex_t lock;
+    pthread_cond_t done;                    /* some entry stopped pending */
+    DeltaEntryMap *entries;
+    DeltaCacheEntry *head;
+    DeltaCacheEntry *tail;
+    size_t max_bytes;
+    size_t max_entry_bytes;
+    time_t wait_timeout;
+    DeltaCacheStats stats;
+};
+
+
+DeltaCache *DeltaCacheNew(size_t max_bytes, size_t max_entry_bytes,
+                          time_t wait_timeout)
+{
+    DeltaCache *cache = xcalloc(1, sizeof(DeltaCache));
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->done, NULL);
+    cache->entries = DeltaEntryMapNew();
+    cache->max_bytes = max_bytes;
+    cache->max_entry_bytes = MIN(max_entry_bytes, max_bytes);
+    cache->wait_timeout = wait_timeout;
+    return cache;
+}
+
+static void EntryDestroy(DeltaCacheEntry *entry)
+{
+    free(entry->key);
+    free(entry->data);
+    free(entry);
+}
+
+void DeltaCacheDestroy(DeltaCache *cache)
+{
+    if (cache != NULL)
+    {
+        Log(LOG_LEVEL_VERBOSE,
+            "Delta cache: %zu entries, %zu bytes, %zu hits (%zu shared), "
+            "%zu misses (%zu timeouts), %zu evictions, %zu invalidations",
+            cache->stats.entries, cache->stats.bytes, cache->stats.hits,
+            cache->stats.shared, cache->stats.misses, cache->stats.timeouts,
+            cache->stats.evictions, cache->stats.invalidations);
+
+        /* Nobody may hold a reference any more. */
+        MapIterator it = MapIteratorInit(cache->entries->impl);
+        MapKeyValue *item;
+        while ((item = MapIteratorNext(&it)) != NULL)
+        {
+            DeltaCacheEntry *entry = item->value;
+            assert(entry->refs == 0);
+            EntryDestroy(entry);
+        }
+        DeltaEntryMapDestroy(cache->entries);
+        pthread_cond_destroy(&cache->done);
+        pthread_mutex_destroy(&cache->lock);
+        free(cache);
+    }
+}
+
+/* All the following must be called with cache->lock held. */
+
+static void LRUUnlink(DeltaCache *cache, DeltaCacheEntry *entry)
+{
+    if (entry->prev != NULL)
+    {
+        entry->prev->next = entry->next;
+    }
+    else
+    {
+        cache->head = entry->next;
+    }
+    if (entry->next != NULL)
+    {
+        entry->next->prev = entry->prev;
+    }
+    else
+    {
+        cache->tail = entry->prev;
+    }
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+static void LRUPushFront(DeltaCache *cache, DeltaCacheEntry *entry)
+{
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head != NULL)
+    {
+        cache->head->prev = entry;
+    }
+    else
+    {
+        cache->tail = entry;
+    }
+    cache->head = entry;
+}
+
+static void EntryUnref(DeltaCacheEntry *entry)
+{
+    assert(entry->refs > 0);
+    if (--entry->refs == 0 && !entry->cached)
+    {
+        EntryDestroy(entry);
+    }
+}
+
+/**
+ * Take the entry out of the cache. It's freed right away unless somebody
+ * still holds a reference to it, in which case the last one frees it.
+ */
+static void EntryUncache(DeltaCache *cache, DeltaCacheEntry *entry)
+{
+    assert(entry->cached);
+
+    if (entry->state == DELTA_ENTRY_READY)
+    {
+        LRUUnlink(cache, entry);
+        cache->stats.entries--;
+        cache->stats.bytes -= entry->len;
+    }
+    DeltaEntryMapRemove(cache->entries, entry->key);
+    entry->cached = false;
+
+    if (entry->refs == 0)
+    {
+        EntryDestroy(entry);
+    }
+}
+
+static bool EntryMatches(const DeltaCacheEntry *entry, const struct stat *sb)
+{
+    return (entry->dev   == sb->st_dev   &&
+            entry->ino   == sb->st_ino   &&
+            entry->size  == sb->st_size  &&
+            entry->mtime == sb->st_mtime &&
+            entry->ctime == sb->st_ctime);
+}
+
+static void EvictOverBudget(DeltaCache *cache)
+{
+    while (cache->stats.bytes > cache->max_bytes && cache->tail != NULL)
+    {
+        Log(LOG_LEVEL_DEBUG, "Evicting delta '%s' from cache",
+            cache->tail->key);
+        EntryUncache(cache, cache->tail);
+        cache->stats.evictions++;
+    }
+}
+
+/*******************************************************************/
+
+DeltaCacheEntry *DeltaCacheAcquire(DeltaCache *cache, const char *filename,
+                                   const struct stat *sb,
+                                   const char *basis_digest, bool *compute)
+{
+    assert(cache != NULL);
+    assert(filename != NULL);
+    assert(sb != NULL);
+    assert(basis_digest != NULL);
+    assert(compute != NULL);
+
+    char *key = StringFormat("%s\n%s", filename, basis_digest);
+
+    ThreadLock(&cache->lock);
+
+    DeltaCacheEntry *entry = DeltaEntryMapGet(cache->entries, key);
+    if (entry != NULL && !EntryMatches(entry, sb))
+    {
+        /* The source changed since (or while) computing it. A pending entry
+         * is left to its computer, who'll discard it. */
+        Log(LOG_LEVEL_DEBUG, "Source of cached delta '%s' changed", key);
+        EntryUncache(cache, entry);
+        cache->stats.invalidations++;
+        entry = NULL;
+    }
+
+    if (entry == NULL)
+    {
+        entry = xcalloc(1, sizeof(DeltaCacheEntry));
+        entry->key = key;
+        entry->state = DELTA_ENTRY_PENDING;
+        entry->cached = true;
+        entry->refs = 1;
+        entry->dev = sb->st_dev;
+        entry->ino = sb->st_ino;
+        entry->size = sb->st_size;
+        entry->mtime = sb->st_mtime;
+        entry->ctime = sb->st_ctime;
+        DeltaEntryMapInsert(cache->entries, xstrdup(key), entry);
+        cache->stats.misses++;
+
+        ThreadUnlock(&cache->lock);
+        *compute = true;
+        return entry;
+    }
+    free(key);
+
+    entry->refs++;
+    if (entry->state == DELTA_ENTRY_PENDING)
+    {
+        cache->stats.shared++;
+        const time_t deadline = time(NULL) + cache->wait_timeout;
+        while (entry->state == DELTA_ENTRY_PENDING)
+        {
+            const time_t now = time(NULL);
+            if (now >= deadline)
+            {
+                Log(LOG_LEVEL_VERBOSE,
+                    "Gave up waiting for delta '%s' computed for another client",
+                    entry->key);
+                cache->stats.timeouts++;
+                break;
+            }
+            ThreadWait(&cache->done, &cache->lock, deadline - now);
+        }
+    }
+
+    if (entry->state != DELTA_ENTRY_READY || !entry->cached)
+    {
+        /* Still pending, failed, too big, or already invalidated: don't
+         * trust it. */
+        EntryUnref(entry);
+        cache->stats.misses++;
+        ThreadUnlock(&cache->lock);
+        *compute = true;
+        return NULL;
+    }
+
+    LRUUnlink(cache, entry);
+    LRUPushFront(cache, entry);
+    cache->stats.hits++;
+
+    ThreadUnlock(&cache->lock);
+    *compute = false;
+    return entry;
+}
+
+bool DeltaCacheAppend(DeltaCache *cache, DeltaCacheEntry *entry,
+                      const void *data, size_t len)
+{
+    assert(cache != NULL);
+    assert(entry != NULL);
+    assert(entry->state == DELTA_ENTRY_PENDING);
+
+    /* Only the computing thread touches the data of a pending entry. */
+    if (entry->too_big || len == 0)
+    {
+        return !entry->too_big;
+    }
+    if (entry->len + len > cache->max_entry_bytes)
+    {
+        /* What it holds so far stays readable by the computing thread. */
+        entry->too_big = true;
+        return false;
+    }
+
+    if (entry->len + len > entry->capacity)
+    {
+        entry->capacity = MAX(entry->len + len, 2 * entry->capacity);
+        entry->capacity = MIN(entry->capacity, cache->max_entry_bytes);
+        entry->data = xrealloc(entry->data, entry->capacity);
+    }
+    memcpy(entry->data + entry->len, data, len);
+    entry->len += len;
+    return true;
+}
+
+void DeltaCacheComplete(DeltaCache *cache, DeltaCacheEntry *entry,
+                        bool success)
+{
+    assert(cache != NULL);
+    assert(entry != NULL);
+
+    ThreadLock(&cache->lock);
+    assert(entry->state == DELTA_ENTRY_PENDING);
+
+    if (success && !entry->too_big && entry->cached)
+    {
+        entry->state = DELTA_ENTRY_READY;
+        LRUPushFront(cache, entry);
+        cache->stats.entries++;
+        cache->stats.bytes += entry->len;
+        EvictOverBudget(cache);
+    }
+    else
+    {
+        entry->state = DELTA_ENTRY_FAILED;
+        if (entry->cached)
+        {
+            EntryUncache(cache, entry);
+        }
+    }
+
+    pthread_cond_broadcast(&cache->done);
+    ThreadUnlock(&cache->lock);
+}
+
+void DeltaCacheRelease(DeltaCache *cache, DeltaCacheEntry *entry)
+{
+    assert(cache != NULL);
+
+    if (entry != NULL)
+    {
+        ThreadLock(&cache->lock);
+        EntryUnref(entry);
+        ThreadUnlock(&cache->lock);
+    }
+}
+
+const char *DeltaCacheEntryData(const DeltaCacheEntry *entry, size_t *len)
+{
+    assert(entry != NULL);
+    assert(entry->state != DELTA_ENTRY_PENDING);
+    assert(len != NULL);
+
+    *len = entry->len;
+    return entry->data;
+}
+
+void DeltaCacheGetStats(DeltaCache *cache, DeltaCacheStats *stats)
+{
+    assert(cache != NULL);
+    assert(stats != NULL);
+
+    ThreadLock(&cache->lock);
+    *stats = cache->stats;
+    ThreadUnlock(&cache->lock);
+}
+
+/*******************************************************************/
+/* Signature cache                                                 */
+/*******************************************************************/
+
+struct SignatureCacheEntry_
+{
+    char *key;
+    void *signature;
+    size_t size;
+    bool cached;                                    /* in the map and LRU */
+    size_t refs;
+
+    /* LRU list, head is the most recently used. */
+    SignatureCacheEntry *prev;
+    SignatureCacheEntry *next;
+};
+
+/**
+   Define SignatureEntryMap.
+   Key:   the basis digest
+   Value: the entry, not freed by the map (see DeltaEntryMap)
+*/
+TYPED_MAP_DECLARE(SignatureEntry, char *, SignatureCacheEntry *)
+
+static void SignatureEntryNoFree(ARG_UNUSED SignatureCacheEntry *entry)
+{
+}
+
+TYPED_MAP_DEFINE(SignatureEntry, char *, SignatureCacheEntry *,
+                 StringHash_untyped,
+                 StringEqual_untyped,
+                 free,
+                 SignatureEntryNoFree)
+
+struct SignatureCache_
+{
+    pthread_mutex_t lock;
+    SignatureEntryMap *entries;
+    SignatureCacheEntry *head;
+    SignatureCacheEntry *tail;
+    size_t max_bytes;
+    void (*destroy)(void *signature);
+    SignatureCacheStats stats;
+};
+
+
+SignatureCache *SignatureCacheNew(size_t max_bytes,
+                                  void (*destroy)(void *signature))
+{
+    assert(destroy != NULL);
+
+    SignatureCache *cache = xcalloc(1, sizeof(SignatureCache));
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->entries = SignatureEntryMapNew();
+    cache->max_bytes = max_bytes;
+    cache->destroy = destroy;
+    return cache;
+}
+
+static void SignatureEntryDestroy(SignatureCache *cache,
+                                  SignatureCacheEntry *entry)
+{
+    cache->destroy(entry->signature);
+    free(entry->key);
+    free(entry);
+}
+
+void SignatureCacheDestroy(SignatureCache *cache)
+{
+    if (cache != NULL)
+    {
+        Log(LOG_LEVEL_VERBOSE,
+            "Signature cache: %zu entries, %zu bytes, %zu hits, "
+            "%zu misses, %zu evictions",
+            cache->stats.entries, cache->stats.bytes, cache->stats.hits,
+            cache->stats.misses, cache->stats.evictions);
+
+        /* Nobody may hold a reference any more. */
+        MapIterator it = MapIteratorInit(cache->entries->impl);
+        MapKeyValue *item;
+        while ((item = MapIteratorNext(&it)) != NULL)
+        {
+            SignatureCacheEntry *entry = item->value;
+            assert(entry->refs == 0);
+            SignatureEntryDestroy(cache, entry);
+        }
+        SignatureEntryMapDestroy(cache->entries);
+        pthread_mutex_destroy(&cache->lock);
+        free(cache);
+    }
+}
+
+/* All the following must be called with cache->lock held. */
+
+static void SignatureLRUUnlink(SignatureCache *cache,
+                               SignatureCacheEntry *entry)
+{
+    if (entry->prev != NULL)
+    {
+        entry->prev->next = entry->next;
+    }
+    else
+    {
+        cache->head = entry->next;
+    }
+    if (entry->next != NULL)
+    {
+        entry->next->prev = entry->prev;
+    }
+    else
+    {
+        cache->tail = entry->prev;
+    }
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+static void SignatureLRUPushFront(SignatureCache *cache,
+                                  SignatureCacheEntry *entry)
+{
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head != NULL)
+    {
+        cache->head->prev = entry;
+    }
+    else
+    {
+        cache->tail = entry;
+    }
+    cache->head = entry;
+}
+
+static void SignatureEvictOverBudget(SignatureCache *cache)
+{
+    while (cache->stats.bytes > cache->max_bytes && cache->tail != NULL)
+    {
+        SignatureCacheEntry *entry = cache->tail;
+        Log(LOG_LEVEL_DEBUG, "Evicting signature '%s' from cache",
+            entry->key);
+
+        SignatureLRUUnlink(cache, entry);
+        SignatureEntryMapRemove(cache->entries, entry->key);
+        entry->cached = false;
+        cache->stats.entries--;
+        cache->stats.bytes -= entry->size;
+        cache->stats.evictions++;
+
+        if (entry->refs == 0)
+        {
+            SignatureEntryDestroy(cache, entry);
+        }
+    }
+}
+
+/*******************************************************************/
+
+SignatureCacheEntry *SignatureCacheAcquire(SignatureCache *cache,
+                                           const char *basis_digest)
+{
+    assert(cache != NULL);
+    assert(basis_digest != NULL);
+
+    ThreadLock(&cache->lock);
+    SignatureCacheEntry *entry =
+        SignatureEntryMapGet(cache->entries, basis_digest);
+    if (entry == NULL)
+    {
+        cache->stats.misses++;
+        ThreadUnlock(&cache->lock);
+        return NULL;
+    }
+
+    entry->refs++;
+    SignatureLRUUnlink(cache, entry);
+    SignatureLRUPushFront(cache, entry);
+    cache->stats.hits++;
+    ThreadUnlock(&cache->lock);
+    return entry;
+}
+
+SignatureCacheEntry *SignatureCacheInsert(SignatureCache *cache,
+                                          const char *basis_digest,
+                                          void *signature, size_t size)
+{
+    assert(cache != NULL);
+    assert(basis_digest != NULL);
+    assert(signature != NULL);
+
+    SignatureCacheEntry *entry = xcalloc(1, sizeof(SignatureCacheEntry));
+    entry->key = xstrdup(basis_digest);
+    entry->signature = signature;
+    entry->size = size;
+    entry->refs = 1;
+
+    ThreadLock(&cache->lock);
+    SignatureCacheEntry *existing =
+        SignatureEntryMapGet(cache->entries, basis_digest);
+    if (existing != NULL)
+    {
+        /* Another client loaded the same signature meanwhile. */
+        existing->refs++;
+        SignatureEntryDestroy(cache, entry);
+        ThreadUnlock(&cache->lock);
+        return existing;
+    }
+
+    if (size <= cache->max_bytes)
+    {
+        entry->cached = true;
+        SignatureEntryMapInsert(cache->entries, xstrdup(basis_digest), entry);
+        SignatureLRUPushFront(cache, entry);
+        cache->stats.entries++;
+        cache->stats.bytes += size;
+        SignatureEvictOverBudget(cache);
+    }
+    ThreadUnlock(&cache->lock);
+    return entry;
+}
+
+void SignatureCacheRelease(SignatureCache *cache, SignatureCacheEntry *entry)
+{
+    assert(cache != NULL);
+
+    if (entry != NULL)
+    {
+        ThreadLock(&cache->lock);
+        assert(entry->refs > 0);
+        if (--entry->refs == 0 && !entry->cached)
+        {
+            SignatureEntryDestroy(cache, entry);
+        }
+        ThreadUnlock(&cache->lock);
+    }
+}
+
+void *SignatureCacheEntrySignature(const SignatureCacheEntry *entry)
+{
+    assert(entry != NULL);
+    return entry->signature;
+}
+
+void SignatureCacheGetStats(SignatureCache *cache, SignatureCacheStats *stats)
+{
+    assert(cache != NULL);
+    assert(stats != NULL);
+
+    ThreadLock(&cache->lock);
+    *stats = cache->stats;
+    ThreadUnlock(&cache->lock);
+}
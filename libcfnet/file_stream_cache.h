@@ -0,0 +1,184 @@
+/*
+  Copyright 2024 Northern.tech AS
+
+  This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; version 3.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#ifndef CFENGINE_FILE_STREAM_CACHE_H
+#define CFENGINE_FILE_STREAM_CACHE_H
+
+
+#include <platform.h>
+
+
+/**
+ * Deltas recently computed by the file stream server, so that many clients
+ * fetching the same version of a file over the same basis (e.g. a whole
+ * fleet upgrading from yesterday's copy) cost a single librsync run.
+ *
+ * An entry is keyed by the source file name and the digest of the
+ * signature the client sent, which identifies the basis. It remembers the
+ * device, inode, size, mtime and ctime of the source it was computed from
+ * and is dropped as soon as a lookup sees any of those change.
+ *
+ * While an entry is being computed, other lookups for it block until it is
+ * ready and then share the result, instead of computing it again. The
+ * computing client fills the entry before sending any of it, so the wait
+ * doesn't depend on its connection. A lookup that still waits longer than
+ * the cache's wait timeout gives up and computes the delta itself.
+ *
+ * Entries are evicted least recently used first once the cache holds more
+ * than its byte budget. Deltas bigger than the per-entry limit are never
+ * cached.
+ *
+ * @note Thread-safe.
+ */
+typedef struct DeltaCache_ DeltaCache;
+typedef struct DeltaCacheEntry_ DeltaCacheEntry;
+
+typedef struct
+{
+    size_t entries;
+    size_t bytes;
+    size_t hits;
+    size_t misses;
+    size_t shared;                         /* hits that waited for a compute */
+    size_t evictions;
+    size_t invalidations;
+    size_t timeouts;                    /* waits given up, counted as misses */
+} DeltaCacheStats;
+
+#define DELTA_CACHE_MAX_BYTES       (64 * 1024 * 1024)
+#define DELTA_CACHE_MAX_ENTRY_BYTES (8 * 1024 * 1024)
+#define DELTA_CACHE_WAIT_TIMEOUT    30                           /* seconds */
+
+DeltaCache *DeltaCacheNew(size_t max_bytes, size_t max_entry_bytes,
+                          time_t wait_timeout);
+void DeltaCacheDestroy(DeltaCache *cache);
+
+/**
+ * Look up the delta of #filename against the basis with signature digest
+ * #basis_digest, #sb being the current stat of #filename.
+ *
+ * @param compute Set to true if the caller must compute the delta, feed it
+ *                to DeltaCacheAppend() and finish with DeltaCacheComplete().
+ *                Set to false if the returned entry holds the delta.
+ * @return the entry, to be released with DeltaCacheRelease(), or NULL if
+ *         the delta must be computed without caching it (another client
+ *         failed to, or took longer than the wait timeout).
+ */
+DeltaCacheEntry *DeltaCacheAcquire(DeltaCache *cache, const char *filename,
+                                   const struct stat *sb,
+                                   const char *basis_digest, bool *compute);
+
+/**
+ * Add delta data to an entry being computed. Once the entry outgrows the
+ * per-entry limit, further data is dropped and the entry won't be cached.
+ *
+ * @return false if #data didn't fit in the per-entry limit
+ */
+bool DeltaCacheAppend(DeltaCache *cache, DeltaCacheEntry *entry,
+                      const void *data, size_t len);
+
+/**
+ * Finish computing an entry and wake up the lookups waiting for it. The
+ * caller keeps its reference, on success the entry holds the delta.
+ *
+ * @param success false if the delta is incomplete or the source changed
+ *                while computing it, the entry is discarded then.
+ */
+void DeltaCacheComplete(DeltaCache *cache, DeltaCacheEntry *entry,
+                        bool success);
+
+void DeltaCacheRelease(DeltaCache *cache, DeltaCacheEntry *entry);
+
+/**
+ * @note The data stays valid until the entry is released, even if it's
+ *       evicted or invalidated meanwhile. The computing client can also
+ *       read what it appended after completing the entry unsuccessfully.
+ */
+const char *DeltaCacheEntryData(const DeltaCacheEntry *entry, size_t *len);
+
+void DeltaCacheGetStats(DeltaCache *cache, DeltaCacheStats *stats);
+
+
+/**
+ * Signatures received by the file stream server, loaded and indexed for
+ * computing deltas, so that clients holding the same basis don't cost a
+ * signature load each when their delta isn't in the delta cache (it's too
+ * big, was evicted, or the source changed since).
+ *
+ * An entry is keyed by the digest of the raw signature. The signature is
+ * opaque to the cache, it's only freed with the destroy function given to
+ * SignatureCacheNew() once it's evicted and no longer used.
+ *
+ * Entries are evicted least recently used first once the cache holds more
+ * than its byte budget.
+ *
+ * @note Thread-safe. The signatures are shared by the clients using them
+ *       at the same time, they must only be read.
+ */
+typedef struct SignatureCache_ SignatureCache;
+typedef struct SignatureCacheEntry_ SignatureCacheEntry;
+
+typedef struct
+{
+    size_t entries;
+    size_t bytes;
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+} SignatureCacheStats;
+
+#define SIGNATURE_CACHE_MAX_BYTES   (16 * 1024 * 1024)
+
+SignatureCache *SignatureCacheNew(size_t max_bytes,
+                                  void (*destroy)(void *signature));
+void SignatureCacheDestroy(SignatureCache *cache);
+
+/**
+ * @return the entry of the signature with digest #basis_digest, to be
+ *         released with SignatureCacheRelease(), or NULL if there's none
+ */
+SignatureCacheEntry *SignatureCacheAcquire(SignatureCache *cache,
+                                           const char *basis_digest);
+
+/**
+ * Cache a signature loaded after SignatureCacheAcquire() found none.
+ *
+ * @param signature Taken over by the cache. Destroyed right away if another
+ *                  client cached the same signature meanwhile.
+ * @param size Memory used by #signature
+ * @return the entry to use, to be released with SignatureCacheRelease(). If
+ *         #size is over the byte budget the entry isn't cached and is
+ *         destroyed when released.
+ */
+SignatureCacheEntry *SignatureCacheInsert(SignatureCache *cache,
+                                          const char *basis_digest,
+                                          void *signature, size_t size);
+
+void SignatureCacheRelease(SignatureCache *cache, SignatureCacheEntry *entry);
+
+void *SignatureCacheEntrySignature(const SignatureCacheEntry *entry);
+
+void SignatureCacheGetStats(SignatureCache *cache, SignatureCacheStats *stats);
+
+#endif
@@ -129,8 +129,8 @@ bool ProtocolGet(AgentConnection *conn, const char *remote_path,
     if (ProtocolSupportsFileStream(version))
     {
         /* Use file stream API if it is available */
-        if (!FileStreamFetch(conn->conn_info->ssl, local_path, dest, perms,
-                             print_stats))
+        if (!FileStreamFetch(conn->conn_info->ssl, version, local_path, dest,
+                             perms, print_stats))
         {
             /* Error is already logged */
             success = false;
@@ -37,6 +37,14 @@ ProtocolVersion ParseProtocolVersionPolicy(const char *const s)
     {
         return CF_PROTOCOL_FILESTREAM;
     }
+    else if (StringEqual(s, "5") || StringEqual(s, "stattree"))
+    {
+        return CF_PROTOCOL_STATTREE;
+    }
+    else if (StringEqual(s, "6") || StringEqual(s, "bulkstream"))
+    {
+        return CF_PROTOCOL_BULKSTREAM;
+    }
     else if (StringEqual(s, "latest"))
     {
         return CF_PROTOCOL_LATEST;
@@ -40,10 +40,12 @@ typedef enum
     CF_PROTOCOL_TLS = 2,
     CF_PROTOCOL_COOKIE = 3,
     CF_PROTOCOL_FILESTREAM = 4,
+    CF_PROTOCOL_STATTREE = 5,
+    CF_PROTOCOL_BULKSTREAM = 6,
 } ProtocolVersion;
 
 /* We use CF_PROTOCOL_LATEST as the default for new connections. */
-#define CF_PROTOCOL_LATEST CF_PROTOCOL_FILESTREAM
+#define CF_PROTOCOL_LATEST CF_PROTOCOL_BULKSTREAM
 
 static inline const char *ProtocolVersionString(const ProtocolVersion p)
 {
@@ -57,6 +59,10 @@ static inline const char *ProtocolVersionString(const ProtocolVersion p)
         return "classic";
     case CF_PROTOCOL_FILESTREAM:
         return "filestream";
+    case CF_PROTOCOL_STATTREE:
+        return "stattree";
+    case CF_PROTOCOL_BULKSTREAM:
+        return "bulkstream";
     default:
         return "undefined";
     }
@@ -92,6 +98,21 @@ static inline bool ProtocolSupportsFileStream(const ProtocolVersion p)
     return (p >= CF_PROTOCOL_FILESTREAM);
 }
 
+/* STATTREE request: stat (and digest) a whole directory tree at once. */
+static inline bool ProtocolSupportsStatTree(const ProtocolVersion p)
+{
+    return (p >= CF_PROTOCOL_STATTREE);
+}
+
+/* Most entries the server sends in one STATTREE reply. */
+#define STATTREE_MAX_ENTRIES 100000
+
+/* File stream with large messages, and whole files sent without librsync. */
+static inline bool ProtocolSupportsBulkStream(const ProtocolVersion p)
+{
+    return (p >= CF_PROTOCOL_BULKSTREAM);
+}
+
 static inline bool ProtocolTerminateCSV(const ProtocolVersion p)
 {
     return (p < CF_PROTOCOL_COOKIE);
@@ -33,13 +33,11 @@
 #include <logging.h>                          /* Log */
 #include <crypto.h>                           /* EncryptString */
 #include <misc_lib.h>                         /* ProgrammingError */
-
-static void NewStatCache(Stat *data, AgentConnection *conn)
-{
-    Stat *sp = xmemdup(data, sizeof(Stat));
-    sp->next = conn->cache;
-    conn->cache = sp;
-}
+#include <sequence.h>                         /* Seq */
+#include <protocol_version.h>                 /* ProtocolSupportsStatTree */
+#include <connection_info.h>                  /* CONNECTIONINFO_STATUS_* */
+#include <map.h>                              /* TYPED_MAP_* */
+#include <string_lib.h>                       /* StringHash_untyped */
 
 void DestroyStatCache(Stat *data)
 {
@@ -48,10 +46,232 @@ void DestroyStatCache(Stat *data)
         free(data->cf_readlink);
         free(data->cf_filename);
         free(data->cf_server);
+        free(data->cf_digest);
+        DeleteItemList(data->cf_entries);
         free(data);
     }
 }
 
+/*********************************************************************/
+
+typedef struct StatCacheEntry_ StatCacheEntry;
+struct StatCacheEntry_
+{
+    const char *key;                    /* owned by the map */
+    Stat *data;
+    StatCacheEntry *prev;               /* more recently used */
+    StatCacheEntry *next;               /* less recently used */
+};
+
+static void StatCacheEntryDestroy(StatCacheEntry *entry)
+{
+    if (entry != NULL)
+    {
+        DestroyStatCache(entry->data);
+        free(entry);
+    }
+}
+
+/**
+   Define StatEntryMap.
+   Key:   "<server> <port> <path>", neither of the first two contain spaces
+   Value: the entry, also linked in the LRU list
+*/
+TYPED_MAP_DECLARE(StatEntry, char *, StatCacheEntry *)
+
+TYPED_MAP_DEFINE(StatEntry, char *, StatCacheEntry *,
+                 StringHash_untyped,
+                 StringEqual_untyped,
+                 free,
+                 StatCacheEntryDestroy)
+
+struct StatCache_
+{
+    StatEntryMap *entries;
+    size_t count;
+    size_t max_entries;
+
+    /* LRU list, most recently used first. */
+    StatCacheEntry *head;
+    StatCacheEntry *tail;
+
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+};
+
+StatCache *StatCacheNew(size_t max_entries)
+{
+    assert(max_entries > 0);
+
+    StatCache *cache = xcalloc(1, sizeof(StatCache));
+    cache->entries = StatEntryMapNew();
+    cache->max_entries = max_entries;
+    return cache;
+}
+
+void StatCacheGetStats(const StatCache *cache, StatCacheStats *stats)
+{
+    assert(stats != NULL);
+
+    memset(stats, 0, sizeof(*stats));
+    if (cache != NULL)
+    {
+        stats->entries   = cache->count;
+        stats->hits      = cache->hits;
+        stats->misses    = cache->misses;
+        stats->evictions = cache->evictions;
+    }
+}
+
+void StatCacheDestroy(StatCache *cache)
+{
+    if (cache != NULL)
+    {
+        Log(LOG_LEVEL_VERBOSE,
+            "Stat cache: %zu entries, %zu hits, %zu misses, %zu evictions",
+            cache->count, cache->hits, cache->misses, cache->evictions);
+        StatEntryMapDestroy(cache->entries);
+        free(cache);
+    }
+}
+
+static bool StatCacheKey(char *key, size_t key_size, const char *server,
+                         const char *port, const char *file_name)
+{
+    int ret = snprintf(key, key_size, "%s %s %s",
+                       server, (port != NULL) ? port : "", file_name);
+    return (ret >= 0 && (size_t) ret < key_size);
+}
+
+static void StatCacheUnlink(StatCache *cache, StatCacheEntry *entry)
+{
+    if (entry->prev != NULL)
+    {
+        entry->prev->next = entry->next;
+    }
+    else
+    {
+        cache->head = entry->next;
+    }
+    if (entry->next != NULL)
+    {
+        entry->next->prev = entry->prev;
+    }
+    else
+    {
+        cache->tail = entry->prev;
+    }
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+static void StatCachePushFront(StatCache *cache, StatCacheEntry *entry)
+{
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head != NULL)
+    {
+        cache->head->prev = entry;
+    }
+    else
+    {
+        cache->tail = entry;
+    }
+    cache->head = entry;
+}
+
+/* Unlink it and let the map free it. */
+static void StatCacheRemove(StatCache *cache, StatCacheEntry *entry)
+{
+    StatCacheUnlink(cache, entry);
+    cache->count--;
+    StatEntryMapRemove(cache->entries, entry->key);
+}
+
+/**
+ * Add #data to the cache, replacing any entry for the same file and
+ * evicting the least recently used one if the cache is full.
+ *
+ * @param data taken over by the cache.
+ */
+void StatCacheInsert(StatCache *cache, const char *server, const char *port,
+                     Stat *data)
+{
+    assert(cache != NULL);
+    assert(data != NULL);
+    assert(data->cf_filename != NULL);
+
+    char key[CF_BUFSIZE + CF_MAXVARSIZE];
+    if (!StatCacheKey(key, sizeof(key), server, port, data->cf_filename))
+    {
+        DestroyStatCache(data);
+        return;
+    }
+
+    StatCacheEntry *old = StatEntryMapGet(cache->entries, key);
+    if (old != NULL)
+    {
+        StatCacheRemove(cache, old);
+    }
+    else if (cache->count >= cache->max_entries)
+    {
+        StatCacheRemove(cache, cache->tail);
+        cache->evictions++;
+    }
+
+    StatCacheEntry *entry = xcalloc(1, sizeof(StatCacheEntry));
+    char *map_key = xstrdup(key);
+    entry->key = map_key;
+    entry->data = data;
+    StatEntryMapInsert(cache->entries, map_key, entry);
+    StatCachePushFront(cache, entry);
+    cache->count++;
+}
+
+/**
+ * @return the cached information for #file_name, or NULL if there is none.
+ */
+const Stat *StatCacheGet(StatCache *cache, const char *server,
+                         const char *port, const char *file_name)
+{
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+
+    char key[CF_BUFSIZE + CF_MAXVARSIZE];
+    StatCacheEntry *entry = NULL;
+    if (StatCacheKey(key, sizeof(key), server, port, file_name))
+    {
+        entry = StatEntryMapGet(cache->entries, key);
+    }
+
+    if (entry == NULL)
+    {
+        cache->misses++;
+        return NULL;
+    }
+
+    cache->hits++;
+    if (entry != cache->head)
+    {
+        StatCacheUnlink(cache, entry);
+        StatCachePushFront(cache, entry);
+    }
+    return entry->data;
+}
+
+/* Takes over #data. */
+static void NewStatCache(Stat *data, AgentConnection *conn)
+{
+    if (conn->cache == NULL)
+    {
+        conn->cache = StatCacheNew(STAT_CACHE_MAX_ENTRIES);
+    }
+    StatCacheInsert(conn->cache, conn->this_server, conn->this_port, data);
+}
+
 /**
  * @brief Find remote stat information for #file in cache and
  *        return it in #statbuf.
@@ -60,40 +280,36 @@ void DestroyStatCache(Stat *data)
 static int StatFromCache(AgentConnection *conn, const char *file,
                          struct stat *statbuf, const char *stattype)
 {
-    for (Stat *sp = conn->cache; sp != NULL; sp = sp->next)
+    const Stat *sp = StatCacheGet(conn->cache, conn->this_server,
+                                  conn->this_port, file);
+    if (sp != NULL)
     {
-        /* TODO differentiate ports etc in this stat cache! */
-
-        if (strcmp(conn->this_server, sp->cf_server) == 0 &&
-            strcmp(file, sp->cf_filename) == 0)
+        if (sp->cf_failed)         /* cached failure from STAT */
         {
-            if (sp->cf_failed)  /* cached failure from cfopendir */
-            {
-                errno = EPERM;
-                return -1;
-            }
-
-            if ((strcmp(stattype, "link") == 0) && (sp->cf_lmode != 0))
-            {
-                statbuf->st_mode = sp->cf_lmode;
-            }
-            else
-            {
-                statbuf->st_mode = sp->cf_mode;
-            }
+            errno = EPERM;
+            return -1;
+        }
 
-            statbuf->st_uid = sp->cf_uid;
-            statbuf->st_gid = sp->cf_gid;
-            statbuf->st_size = sp->cf_size;
-            statbuf->st_atime = sp->cf_atime;
-            statbuf->st_mtime = sp->cf_mtime;
-            statbuf->st_ctime = sp->cf_ctime;
-            statbuf->st_ino = sp->cf_ino;
-            statbuf->st_dev = sp->cf_dev;
-            statbuf->st_nlink = sp->cf_nlink;
-
-            return 0;
+        if ((strcmp(stattype, "link") == 0) && (sp->cf_lmode != 0))
+        {
+            statbuf->st_mode = sp->cf_lmode;
+        }
+        else
+        {
+            statbuf->st_mode = sp->cf_mode;
         }
+
+        statbuf->st_uid = sp->cf_uid;
+        statbuf->st_gid = sp->cf_gid;
+        statbuf->st_size = sp->cf_size;
+        statbuf->st_atime = sp->cf_atime;
+        statbuf->st_mtime = sp->cf_mtime;
+        statbuf->st_ctime = sp->cf_ctime;
+        statbuf->st_ino = sp->cf_ino;
+        statbuf->st_dev = sp->cf_dev;
+        statbuf->st_nlink = sp->cf_nlink;
+
+        return 0;
     }
 
     return 1;                                                  /* not found */
@@ -211,6 +427,14 @@ int cf_remote_stat(AgentConnection *conn, bool encrypt, const char *file,
     {
         Log(LOG_LEVEL_VERBOSE, "Server returned error: %s",
             recvbuffer + strlen("BAD: "));
+
+        /* Remember it, so that the next promise doesn't ask again. */
+        Stat *failed = xcalloc(1, sizeof(Stat));
+        failed->cf_filename = xstrdup(file);
+        failed->cf_server = xstrdup(conn->this_server);
+        failed->cf_failed = true;
+        NewStatCache(failed, conn);
+
         errno = EPERM;
         return -1;
     }
@@ -274,7 +498,7 @@ int cf_remote_stat(AgentConnection *conn, bool encrypt, const char *file,
         cfst.cf_lmode |= (mode_t) S_IFLNK;
     }
 
-    NewStatCache(&cfst, conn);
+    NewStatCache(xmemdup(&cfst, sizeof(cfst)), conn);
 
     if ((cfst.cf_lmode != 0) && (strcmp(stattype, "link") == 0))
     {
@@ -300,20 +524,313 @@ int cf_remote_stat(AgentConnection *conn, bool encrypt, const char *file,
 
 /*********************************************************************/
 
-/* TODO only a server_name is not enough for stat'ing of files... */
-const Stat *StatCacheLookup(const AgentConnection *conn, const char *file_name,
-                            const char *server_name)
+/* Deepest directory nesting accepted in a STATTREE reply. */
+#define STATTREE_STACK_SIZE 64
+
+/* Parse state of a STATTREE reply, fed one transaction at a time. */
+typedef struct
+{
+    const char *server;
+    const char *dirname;
+    Seq *entries;                               /* Stat, in reply order */
+    /* Directories whose listing is being collected, innermost last. */
+    Stat *stack[STATTREE_STACK_SIZE];
+    size_t stack_len;
+    bool done;                                  /* CFD_TERMINATOR seen */
+} StatTreeParser;
+
+static void StatTreePath(char *dst, size_t dst_size, const char *dirname,
+                         const char *relpath, size_t relpath_len)
+{
+    size_t dirname_len = strlen(dirname);
+    if (relpath_len == 1 && relpath[0] == '.')
+    {
+        strlcpy(dst, dirname, dst_size);
+    }
+    else if (dirname_len > 0 && dirname[dirname_len - 1] == '/')
+    {
+        snprintf(dst, dst_size, "%s%.*s", dirname, (int) relpath_len, relpath);
+    }
+    else
+    {
+        snprintf(dst, dst_size, "%s/%.*s", dirname, (int) relpath_len, relpath);
+    }
+}
+
+/**
+ * Parse one record of a STATTREE reply (see CfStatTree() in cf-serverd).
+ *
+ * @return the new cache entry, or NULL if the entry could not be stat'ed
+ *         on the server.
+ */
+static Stat *StatTreeParseRecord(const char *server, const char *path,
+                                 const char *statline, const char *link,
+                                 const char *digest)
 {
-    for (const Stat *sp = conn->cache; sp != NULL; sp = sp->next)
+    Stat cfst;
+    memset(&cfst, 0, sizeof(cfst));
+
+    if (!OKProtoReply(statline) || !StatParseResponse(statline, &cfst))
     {
-        if (strcmp(server_name, sp->cf_server) == 0 &&
-            strcmp(file_name, sp->cf_filename) == 0)
+        /* Don't cache it, STAT will tell why. */
+        return NULL;
+    }
+
+    mode_t file_type = FileTypeToMode(cfst.cf_type);
+    if (file_type == 0)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Invalid file type identifier for file %s:%s, %u",
+            server, path, cfst.cf_type);
+        return NULL;
+    }
+    cfst.cf_mode |= file_type;
+    if (cfst.cf_lmode != 0)
+    {
+        cfst.cf_lmode |= (mode_t) S_IFLNK;
+    }
+
+    cfst.cf_readlink = (link[0] != '\0') ? xstrdup(link) : NULL;
+    cfst.cf_digest   = (digest[0] != '\0') ? xstrdup(digest) : NULL;
+    cfst.cf_filename = xstrdup(path);
+    cfst.cf_server   = xstrdup(server);
+    cfst.cf_failed   = false;
+
+    return xmemdup(&cfst, sizeof(cfst));
+}
+
+/**
+ * Parse the records in one transaction of a STATTREE reply into
+ * #parser->entries, setting #parser->done at CFD_TERMINATOR. Records never
+ * span transactions.
+ *
+ * @return false if the reply is malformed.
+ */
+static bool StatTreeParse(StatTreeParser *parser, const char *buf, size_t len)
+{
+    const char *p = buf;
+    const char *const buf_end = buf + len;
+
+    while (!parser->done && p < buf_end)
+    {
+        const char *fields[5];
+        size_t num_fields = 0;
+        for (; num_fields < 5 && p < buf_end; num_fields++)
+        {
+            fields[num_fields] = p;
+            p += strnlen(p, buf_end - p) + 1;
+            if (num_fields == 0 && strcmp(fields[0], CFD_TERMINATOR) == 0)
+            {
+                break;
+            }
+        }
+
+        if (num_fields == 0 && strcmp(fields[0], CFD_TERMINATOR) == 0)
+        {
+            parser->done = true;
+            break;
+        }
+        if (num_fields < 5 || p > buf_end)
+        {
+            Log(LOG_LEVEL_ERR, "Truncated STATTREE reply from '%s'",
+                parser->server);
+            return false;
+        }
+
+        const char *relpath = fields[0];
+        const char *slash = strrchr(relpath, '/');
+
+        char path[CF_BUFSIZE];
+        char parent[CF_BUFSIZE];
+        StatTreePath(path, sizeof(path), parser->dirname,
+                     relpath, strlen(relpath));
+        if (slash != NULL)
         {
-            return sp;
+            StatTreePath(parent, sizeof(parent), parser->dirname,
+                         relpath, slash - relpath);
+        }
+        else
+        {
+            StatTreePath(parent, sizeof(parent), parser->dirname, ".", 1);
+        }
+
+        /* Records are depth-first: close the directories we're done with. */
+        while (parser->stack_len > 0 &&
+               strcmp(parser->stack[parser->stack_len - 1]->cf_filename,
+                      parent) != 0)
+        {
+            parser->stack_len--;
+        }
+        if (parser->stack_len > 0)
+        {
+            PrependItem(&parser->stack[parser->stack_len - 1]->cf_entries,
+                        (slash != NULL) ? slash + 1 : relpath, NULL);
+        }
+        else if (SeqLength(parser->entries) > 0)
+        {
+            Log(LOG_LEVEL_ERR, "Unexpected entry '%s' in STATTREE reply from '%s'",
+                relpath, parser->server);
+            return false;
+        }
+
+        Stat *sp = StatTreeParseRecord(parser->server, path, fields[1],
+                                       fields[2], fields[3]);
+        if (sp == NULL)
+        {
+            if (SeqLength(parser->entries) == 0)
+            {
+                return false;                    /* the root itself failed */
+            }
+            continue;
+        }
+        SeqAppend(parser->entries, sp);
+
+        if (strcmp(fields[4], "1") == 0 && S_ISDIR(sp->cf_mode))
+        {
+            if (parser->stack_len == STATTREE_STACK_SIZE)
+            {
+                Log(LOG_LEVEL_ERR, "STATTREE reply from '%s' nested too deep",
+                    parser->server);
+                return false;
+            }
+            /* Mark it listed, even if empty. */
+            AppendItem(&sp->cf_entries, "..", NULL);
+            PrependItem(&sp->cf_entries, ".", NULL);
+            parser->stack[parser->stack_len++] = sp;
         }
     }
 
-    return NULL;
+    return true;
+}
+
+/**
+ * Fetch the stat information of everything under #dirname, #maxdepth
+ * directory levels deep, with a single STATTREE request, and put it in the
+ * stat cache. Directory listings are cached as well and used by
+ * RemoteDirList(), file digests (if #digests) by CompareHashNet().
+ *
+ * Nothing is cached unless the whole reply could be read, so on failure
+ * the caller just falls back to OPENDIR/STAT.
+ */
+bool cf_remote_stat_tree(AgentConnection *conn, const char *dirname,
+                         int maxdepth, bool digests)
+{
+    assert(conn != NULL);
+    assert(dirname != NULL);
+
+    if (!ProtocolSupportsStatTree(conn->conn_info->protocol))
+    {
+        return false;
+    }
+
+    if (strlen(dirname) > CF_BUFSIZE - 64)
+    {
+        Log(LOG_LEVEL_ERR, "Directory name too long");
+        return false;
+    }
+
+    time_t tloc = time(NULL);
+    if (tloc == (time_t) -1)
+    {
+        Log(LOG_LEVEL_ERR, "Couldn't read system clock (time: %s)",
+            GetErrorStr());
+        tloc = 0;
+    }
+
+    char sendbuffer[CF_BUFSIZE];
+    snprintf(sendbuffer, sizeof(sendbuffer), "STATTREE %jd %d %d %s",
+             (intmax_t) tloc, maxdepth, digests ? 1 : 0, dirname);
+
+    if (SendTransaction(conn->conn_info, sendbuffer, 0, CF_DONE) == -1)
+    {
+        Log(LOG_LEVEL_INFO,
+            "Transmission failed/refused talking to %.255s:%.255s. (stattree: %s)",
+            conn->this_server, dirname, GetErrorStr());
+        return false;
+    }
+
+    StatTreeParser parser = {
+        .server  = conn->this_server,
+        .dirname = dirname,
+        .entries = SeqNew(1024, DestroyStatCache),
+    };
+    bool first = true, ok = true;
+    int more = 1;
+
+    char recvbuffer[CF_BUFSIZE];
+    while (ok && !parser.done && more)
+    {
+        int nbytes = ReceiveTransaction(conn->conn_info, recvbuffer, &more);
+        if (nbytes <= 0)
+        {
+            /* TODO mark connection in the cache as closed. */
+            ok = false;
+            break;
+        }
+        recvbuffer[MIN(nbytes, CF_BUFSIZE - 1)] = '\0';
+
+        if (first && (BadProtoReply(recvbuffer) || FailedProtoReply(recvbuffer)))
+        {
+            if (strstr(recvbuffer, "unsynchronized") != NULL)
+            {
+                Log(LOG_LEVEL_ERR,
+                    "Clocks differ too much to do copy by date (security), server reported: %s",
+                    recvbuffer + strlen("BAD: "));
+            }
+            else
+            {
+                Log(LOG_LEVEL_VERBOSE, "Server returned error: %s",
+                    recvbuffer + strlen("BAD: "));
+            }
+            ok = false;
+            break;
+        }
+        first = false;
+
+        ok = StatTreeParse(&parser, recvbuffer, nbytes);
+    }
+
+    if (ok && !parser.done)
+    {
+        Log(LOG_LEVEL_ERR, "Incomplete STATTREE reply from '%s'",
+            conn->this_server);
+        ok = false;
+    }
+
+    if (ok)
+    {
+        const size_t length = SeqLength(parser.entries);
+        for (size_t i = 0; i < length; i++)
+        {
+            NewStatCache(SeqAt(parser.entries, i), conn);
+        }
+        SeqSoftDestroy(parser.entries);
+        Log(LOG_LEVEL_VERBOSE, "Cached %zu entries of '%s:%s' from STATTREE",
+            length, conn->this_server, dirname);
+    }
+    else
+    {
+        SeqDestroy(parser.entries);
+    }
+
+    /* The connection is unusable if we stopped in the middle of the reply. */
+    if (!parser.done && more)
+    {
+        conn->conn_info->status = CONNECTIONINFO_STATUS_BROKEN;
+    }
+
+    return ok;
+}
+
+/*********************************************************************/
+
+/**
+ * @note The returned entry may be evicted by the next insertion into the
+ *       cache, don't hold on to it.
+ */
+const Stat *StatCacheLookup(const AgentConnection *conn, const char *file_name,
+                            const char *server_name)
+{
+    return StatCacheGet(conn->cache, server_name, conn->this_port, file_name);
 }
 
 /*********************************************************************/
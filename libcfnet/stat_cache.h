@@ -26,6 +26,8 @@
 
 #include <platform.h>
 #include <cfnet.h>
+#include <item_lib.h>                                               /* Item */
+#include <protocol_version.h>                        /* STATTREE_MAX_ENTRIES */
 
 
 typedef enum
@@ -59,12 +61,46 @@ struct Stat_
     int cf_nlink;               /* Number of hard links */
     int cf_ino;                 /* inode number on server */
     dev_t cf_dev;               /* device number */
-    Stat *next;
+    char *cf_digest;            /* hex CF_DEFAULT_DIGEST from STATTREE, or NULL */
+    Item *cf_entries;           /* directory listing from STATTREE, or NULL */
 };
 
+/**
+ * Remote stat information of one connection, keyed by (server, port, path).
+ *
+ * Lookups are hashed, and the cache holds at most a fixed number of
+ * entries, evicting the least recently used one when full. Failed STATs
+ * are cached too (cf_failed), so they aren't retried for every promise.
+ */
+typedef struct StatCache_ StatCache;
+
+typedef struct
+{
+    size_t entries;
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+} StatCacheStats;
+
+/* Room for a whole STATTREE reply plus as much again of entries already
+ * cached: the reply is inserted in depth-first order, so a smaller cache
+ * would evict the first directory listings of the tree being fetched, and
+ * PrefetchRemoteTree() would then ask for them again. */
+#define STAT_CACHE_MAX_ENTRIES (2 * STATTREE_MAX_ENTRIES)
+
+StatCache *StatCacheNew(size_t max_entries);
+void StatCacheDestroy(StatCache *cache);
+void StatCacheInsert(StatCache *cache, const char *server, const char *port,
+                     Stat *data);
+const Stat *StatCacheGet(StatCache *cache, const char *server,
+                         const char *port, const char *file_name);
+void StatCacheGetStats(const StatCache *cache, StatCacheStats *stats);
+
 void DestroyStatCache(Stat *data);
 int cf_remote_stat(AgentConnection *conn, bool encrypt, const char *file,
                    struct stat *statbuf, const char *stattype);
+bool cf_remote_stat_tree(AgentConnection *conn, const char *dirname,
+                         int maxdepth, bool digests);
 const Stat *StatCacheLookup(const AgentConnection *conn, const char *file_name,
                             const char *server_name);
 mode_t FileTypeToMode(const FileType type);
@@ -453,6 +453,13 @@ DirectoryRecursion GetRecursionConstraints(const EvalContext *ctx, const Promise
     r.include_dirs = PromiseGetConstraintAsList(ctx, "include_dirs", pp);
     r.exclude_dirs = PromiseGetConstraintAsList(ctx, "exclude_dirs", pp);
     r.include_basedir = PromiseGetConstraintAsBoolean(ctx, "include_basedir", pp);
+    r.parallelism = PromiseGetConstraintAsInt(ctx, "parallelism", pp);
+
+    if (r.parallelism == CF_NOINT)
+    {
+        r.parallelism = 1;
+    }
+
     return r;
 }
 
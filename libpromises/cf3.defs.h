@@ -440,6 +440,8 @@ typedef enum
     COMMON_CONTROL_PACKAGE_INVENTORY,
     COMMON_CONTROL_PACKAGE_MODULE,
     COMMON_CONTROL_EVALUATION_ORDER,
+    COMMON_CONTROL_FUNCTION_CACHE_TTL,
+    COMMON_CONTROL_CONCURRENT_FUNCTION_CALLS,
     COMMON_CONTROL_MAX
 } CommonControl;
 
@@ -495,6 +497,8 @@ typedef enum
     AGENT_CONTROL_COPYFROM_RESTRICT_KEYS,
     AGENT_CONTROL_EVALUATION_ORDER,
     AGENT_CONTROL_DEFAULT_DIRECTORY_CREATE_MODE,
+    AGENT_CONTROL_LOCK_JOURNAL,
+    AGENT_CONTROL_SKIP_CONVERGED_PROMISES,
     AGENT_CONTROL_NONE
 } AgentControl;
 
@@ -901,6 +905,7 @@ typedef struct
     char *last;
     char *lock;
     bool is_dummy;
+    bool journal_last;          /* last.* may wait in the lock journal */
 } CfLock;
 
 /*************************************************************************/
@@ -923,6 +928,7 @@ typedef struct
     int depth;
     int xdev;
     int include_basedir;
+    int parallelism;
     Rlist *include_dirs;
     Rlist *exclude_dirs;
 } DirectoryRecursion;
@@ -1379,6 +1385,7 @@ typedef struct
     Rlist *options;
     char *interpreter;
     char *module_path;
+    bool persistent;
 } PackageModuleBody;
 
 
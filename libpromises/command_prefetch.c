@@ -0,0 +1,810 @@
+/*
+  Copyright 2024 Northern.tech AS
+
+  This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; version 3.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+#include <command_prefetch.h>
+
+#include <eval_context.h>
+#include <policy.h>
+#include <expand.h>                                          /* ExpandScalar */
+#include <vars.h>                                          /* IsCf3VarString */
+#include <exec_tools.h>                      /* OpenExecOutput, IsExecutable */
+#include <pipes.h>                                              /* PipeToPid */
+#include <process_lib.h>                                /* GracefulTerminate */
+#include <files_names.h>                               /* IsAbsoluteFileName */
+#include <conversion.h>                                       /* CommandArg0 */
+#include <logging.h>
+#include <logging_priv.h>                          /* LoggingPrivSetContext */
+#include <mutex.h>                                            /* ThreadLock */
+#include <sequence.h>
+#include <buffer.h>
+#include <string_lib.h>
+#include <set.h>                                                /* StringSet */
+
+
+typedef enum
+{
+    PREFETCH_KIND_OUTPUT,                     /* execresult(), execresult_as_data() */
+    PREFETCH_KIND_RETURNS_ZERO,               /* returnszero() */
+} PrefetchKind;
+
+typedef struct
+{
+    /* Set before the workers are started, never changed afterwards. */
+    PrefetchKind kind;
+    char *command;
+    ShellType shell;
+    OutputSelect output_select;
+
+    /* Set by the worker running the command, read once done is set. */
+    bool ran;
+    char *output;
+    int exit_code;
+    Seq *log_messages;                      /* PrefetchLogMessage, or NULL */
+
+    bool done;                                 /* protected by prefetch_lock */
+    bool taken;                                /* only used by the main thread */
+} PrefetchJob;
+
+/* A message logged while running a command, logged again by the function
+ * taking its result, in the evaluation order. */
+typedef struct
+{
+    LogLevel level;
+    char *message;
+} PrefetchLogMessage;
+
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;  /* GLOBAL_T */
+static pthread_cond_t prefetch_job_done = PTHREAD_COND_INITIALIZER; /* GLOBAL_T */
+
+/* The jobs of PREFETCH_SECTION, in the order of its promises. The sequence
+ * itself is only changed by the main thread while no worker is running. */
+static Seq *PREFETCH_JOBS = NULL;                               /* GLOBAL_X */
+static const BundleSection *PREFETCH_SECTION = NULL;            /* GLOBAL_X */
+static size_t PREFETCH_NEXT_JOB = 0;     /* GLOBAL_X, protected by prefetch_lock */
+
+static pthread_t *PREFETCH_WORKERS = NULL;                      /* GLOBAL_X */
+static size_t PREFETCH_WORKERS_COUNT = 0;                       /* GLOBAL_X */
+
+/* The command each worker is running, -1 if none. Written by the workers,
+ * read by CommandPrefetchTimeOut() from the SIGALRM handler. */
+static volatile pid_t *PREFETCH_PIDS = NULL;                    /* GLOBAL_X */
+
+/*******************************************************************/
+
+static void PrefetchLogMessageDestroy(void *p)
+{
+    PrefetchLogMessage *msg = p;
+    if (msg != NULL)
+    {
+        free(msg->message);
+        free(msg);
+    }
+}
+
+static void PrefetchJobDestroy(void *p)
+{
+    PrefetchJob *job = p;
+    if (job != NULL)
+    {
+        free(job->command);
+        free(job->output);
+        SeqDestroy(job->log_messages);
+        free(job);
+    }
+}
+
+/* Keeps the messages of the worker's current job instead of logging them. */
+static char *PrefetchLogHook(LoggingPrivContext *pctx, LogLevel level,
+                             const char *message)
+{
+    PrefetchJob *job = pctx->param;
+    if (job != NULL)
+    {
+        if (job->log_messages == NULL)
+        {
+            job->log_messages = SeqNew(2, PrefetchLogMessageDestroy);
+        }
+        PrefetchLogMessage *msg = xmalloc(sizeof(PrefetchLogMessage));
+        msg->level = level;
+        msg->message = xstrdup(message);
+        SeqAppend(job->log_messages, msg);
+    }
+    return xstrdup(message);
+}
+
+static void PrefetchJobRun(PrefetchJob *job, size_t worker)
+{
+    FILE *pp;
+    if (job->kind == PREFETCH_KIND_OUTPUT)
+    {
+        /* Like GetExecOutput(). */
+        pp = OpenExecOutput(job->command, job->shell, job->output_select);
+    }
+    else
+    {
+        /* Like ShellCommandReturnsZero(), which discards the output of the
+         * command at this log level. */
+        assert(job->kind == PREFETCH_KIND_RETURNS_ZERO);
+        pp = cf_popen_select(job->command, "r", OUTPUT_SELECT_BOTH);
+    }
+
+    if (pp == NULL)
+    {
+        job->ran = false;
+        return;
+    }
+
+    /* ALARM_PID is the main thread's, register the command with
+     * CommandPrefetchTimeOut() instead. */
+    pid_t pid;
+    if (PipeToPid(&pid, pp))
+    {
+        PREFETCH_PIDS[worker] = pid;
+    }
+
+    if (job->kind == PREFETCH_KIND_OUTPUT)
+    {
+        size_t output_size = CF_EXPANDSIZE;
+        job->output = xcalloc(1, output_size);
+        job->ran = ReadExecOutput(pp, job->command, &job->output, &output_size);
+    }
+    else
+    {
+        char discard[CF_BUFSIZE];
+        while (fread(discard, 1, sizeof(discard), pp) > 0)
+        {
+            /* just wait for the command to finish */
+        }
+        job->ran = true;
+    }
+
+    /* Same as cf_pclose() does with ALARM_PID, before waiting. */
+    PREFETCH_PIDS[worker] = -1;
+    job->exit_code = cf_pclose(pp);
+}
+
+static void *PrefetchWorker(void *arg)
+{
+    const size_t worker = (size_t) (intptr_t) arg;
+
+    /* Log nothing from this thread, only hand the messages to the hook. The
+     * debug level is never reached, see CommandPrefetchSection(). */
+    LoggingPrivContext log_ctx = {
+        .log_hook = PrefetchLogHook,
+        .param = NULL,
+        .force_hook_level = LOG_LEVEL_VERBOSE,
+    };
+    LoggingPrivSetContext(&log_ctx);
+    LoggingPrivSetLevels(LOG_LEVEL_NOTHING, LOG_LEVEL_NOTHING);
+
+    while (true)
+    {
+        PrefetchJob *job = NULL;
+
+        ThreadLock(&prefetch_lock);
+        if (PREFETCH_NEXT_JOB < SeqLength(PREFETCH_JOBS))
+        {
+            job = SeqAt(PREFETCH_JOBS, PREFETCH_NEXT_JOB++);
+        }
+        ThreadUnlock(&prefetch_lock);
+
+        if (job == NULL)
+        {
+            break;
+        }
+
+        log_ctx.param = job;
+        PrefetchJobRun(job, worker);
+        log_ctx.param = NULL;
+
+        ThreadLock(&prefetch_lock);
+        job->done = true;
+        pthread_cond_broadcast(&prefetch_job_done);
+        ThreadUnlock(&prefetch_lock);
+    }
+
+    LoggingPrivSetContext(NULL);
+    LoggingFreeCurrentThreadContext();
+    return NULL;
+}
+
+/*******************************************************************/
+
+/**
+ * Whether the promise is sure to be evaluated now, so that running its
+ * commands ahead of time does not run anything the policy would not.
+ *
+ * @param promisers canonified promisers of the classes promises seen so far
+ *                  in the section, #pp's is added
+ */
+static bool PromiseMayPrefetch(EvalContext *ctx, const Promise *pp,
+                               StringSet *promisers, Buffer *buf)
+{
+    /* Classes promises are skipped when their class is already set, see
+     * ExpandDeRefPromise(). Also leave alone the ones that follow a promise
+     * for the same class, which may well set it first. */
+    if (StringEqual(PromiseGetPromiseType(pp), "classes"))
+    {
+        const Bundle *bundle = PromiseGetBundle(pp);
+        BufferClear(buf);
+        ExpandScalar(ctx, bundle->ns, bundle->name, pp->promiser, buf);
+        if (IsCf3VarString(BufferData(buf)))
+        {
+            return false;
+        }
+
+        const char *class_name = CanonifyName(BufferData(buf));
+        if (StringSetContains(promisers, class_name))
+        {
+            return false;
+        }
+        StringSetAdd(promisers, xstrdup(class_name));
+
+        if (IsDefinedClass(ctx, class_name))
+        {
+            return false;
+        }
+    }
+
+    if (!IsDefinedClass(ctx, pp->classes))
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < SeqLength(pp->conlist); i++)
+    {
+        const Constraint *cp = SeqAt(pp->conlist, i);
+        if (StringEqual(cp->lval, "if") ||
+            StringEqual(cp->lval, "ifvarclass") ||
+            StringEqual(cp->lval, "unless") ||
+            StringEqual(cp->lval, "depends_on"))
+        {
+            return false;
+        }
+
+        /* Results kept across runs are looked up before running anything. */
+        if (StringEqual(cp->lval, "meta") && cp->rval.type == RVAL_TYPE_LIST)
+        {
+            for (const Rlist *rp = RvalRlistValue(cp->rval); rp != NULL; rp = rp->next)
+            {
+                if (rp->val.type == RVAL_TYPE_SCALAR &&
+                    StringStartsWith(RlistScalarValue(rp), "function_cache_ttl="))
+                {
+                    return false;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+/* Functions defining variables named by their arguments, or by the module
+ * they run. */
+static const char *const ASSIGNING_FUNCTIONS[] =
+{
+    "getfields",
+    "parseintarray", "parserealarray", "parsestringarray", "parsestringarrayidx",
+    "readintarray", "readrealarray", "readstringarray", "readstringarrayidx",
+    "regextract",
+    "selectservers",
+    "usemodule",
+    NULL
+};
+
+static bool RvalMayAssignVariables(Rval rval)
+{
+    const Rlist *args = NULL;
+    if (rval.type == RVAL_TYPE_FNCALL)
+    {
+        const FnCall *fp = RvalFnCallValue(rval);
+        for (size_t i = 0; ASSIGNING_FUNCTIONS[i] != NULL; i++)
+        {
+            if (StringEqual(fp->name, ASSIGNING_FUNCTIONS[i]))
+            {
+                return true;
+            }
+        }
+        args = fp->args;
+    }
+    else if (rval.type == RVAL_TYPE_LIST)
+    {
+        args = RvalRlistValue(rval);
+    }
+
+    for (const Rlist *rp = args; rp != NULL; rp = rp->next)
+    {
+        if (RvalMayAssignVariables(rp->val))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* "ns:scope.name[index]" -> "name" */
+static char *VariableBareName(const char *name, size_t len)
+{
+    const char *index = memchr(name, '[', len);
+    if (index != NULL)
+    {
+        len = index - name;
+    }
+
+    const char *start = name;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (name[i] == '.' || name[i] == ':')
+        {
+            start = name + i + 1;
+        }
+    }
+    return xstrndup(start, len - (start - name));
+}
+
+/**
+ * Collect in #assigned the names of the variables the promises of #section
+ * may define, without their scope or index.
+ *
+ * @return false if they are not all known before evaluating the section: a
+ *         promiser made of variables, or a function defining variables
+ */
+static bool SectionAssignedVariables(const BundleSection *section,
+                                     StringSet *assigned)
+{
+    const bool vars = StringEqual(section->promise_type, "vars");
+
+    for (size_t i = 0; i < SeqLength(section->promises); i++)
+    {
+        const Promise *pp = SeqAt(section->promises, i);
+        if (vars)
+        {
+            if (IsCf3VarString(pp->promiser))
+            {
+                return false;
+            }
+            StringSetAdd(assigned,
+                         VariableBareName(pp->promiser, strlen(pp->promiser)));
+        }
+
+        for (size_t j = 0; j < SeqLength(pp->conlist); j++)
+        {
+            const Constraint *cp = SeqAt(pp->conlist, j);
+            if (RvalMayAssignVariables(cp->rval))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Whether #str refers to a variable the section may define, see
+ * SectionAssignedVariables(), to a variable whose name is made of other
+ * variables, or to the "this" and "match" scopes, which are set from
+ * promise to promise. Expanding such a reference at the start of the
+ * section may not give the value the function sees.
+ *
+ * @param assigned NULL if the section may define any variable
+ */
+static bool RefersToAssignedVariables(const char *str,
+                                      const StringSet *assigned)
+{
+    static const char name_chars[] =
+        "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_.:";
+
+    for (const char *p = strchr(str, '$'); p != NULL; p = strchr(p + 1, '$'))
+    {
+        if (p[1] != '(' && p[1] != '{')
+        {
+            continue;
+        }
+
+        const char *name = p + 2;
+        const size_t len = strspn(name, name_chars);
+        if (assigned == NULL || len == 0 || name[len] == '$' ||
+            StringStartsWith(name, "this.") ||
+            StringStartsWith(name, "match."))
+        {
+            return true;
+        }
+
+        char *bare_name = VariableBareName(name, len);
+        const bool found = StringSetContains(assigned, bare_name);
+        free(bare_name);
+        if (found)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @param assigned see RefersToAssignedVariables()
+ * @return the job running the command of #fp, NULL if it has none or its
+ *         arguments are not known yet
+ */
+static PrefetchJob *PrefetchJobFromCall(EvalContext *ctx, const Bundle *bundle,
+                                        const FnCall *fp,
+                                        const StringSet *assigned, Buffer *buf)
+{
+    PrefetchKind kind;
+    if (StringEqual(fp->name, "execresult") ||
+        StringEqual(fp->name, "execresult_as_data"))
+    {
+        kind = PREFETCH_KIND_OUTPUT;
+    }
+    else if (StringEqual(fp->name, "returnszero") &&
+             LogGetGlobalLevel() < LOG_LEVEL_INFO)
+    {
+        kind = PREFETCH_KIND_RETURNS_ZERO;
+    }
+    else
+    {
+        return NULL;
+    }
+
+    Rlist *args = NULL;
+    for (const Rlist *rp = fp->args; rp != NULL; rp = rp->next)
+    {
+        if (rp->val.type != RVAL_TYPE_SCALAR ||
+            RefersToAssignedVariables(RlistScalarValue(rp), assigned))
+        {
+            RlistDestroy(args);
+            return NULL;
+        }
+
+        BufferClear(buf);
+        ExpandScalar(ctx, bundle->ns, bundle->name, RlistScalarValue(rp), buf);
+        RlistAppendScalar(&args, BufferData(buf));
+    }
+
+    const size_t nargs = RlistLen(args);
+    if (nargs < 2 || nargs > ((kind == PREFETCH_KIND_OUTPUT) ? 3 : 2) ||
+        RlistIsUnresolved(args) ||
+        EvalContextFunctionCacheGet(ctx, fp, args, NULL))
+    {
+        RlistDestroy(args);
+        return NULL;
+    }
+
+    const char *command = RlistScalarValue(args);
+    const char *shell_option = RlistScalarValue(args->next);
+
+    ShellType shell = SHELL_TYPE_NONE;
+    if (StringEqual(shell_option, "useshell"))
+    {
+        shell = SHELL_TYPE_USE;
+    }
+    else if (!StringEqual(shell_option, "noshell"))
+    {
+        RlistDestroy(args);
+        return NULL;
+    }
+
+    OutputSelect output_select = OUTPUT_SELECT_BOTH;
+    if (nargs == 3)
+    {
+        const char *output = RlistScalarValue(args->next->next);
+        if (StringEqual(output, "stdout"))
+        {
+            output_select = OUTPUT_SELECT_STDOUT;
+        }
+        else if (StringEqual(output, "stderr"))
+        {
+            output_select = OUTPUT_SELECT_STDERR;
+        }
+    }
+
+    /* Leave the calls the functions refuse to run to them, as well as the
+     * ones which may print the output of the command. */
+    const bool absolute = IsAbsoluteFileName(command);
+    if ((!absolute && shell == SHELL_TYPE_NONE) ||
+        (absolute && !IsExecutable(CommandArg0(command))) ||
+        (kind == PREFETCH_KIND_RETURNS_ZERO &&
+         (shell != SHELL_TYPE_NONE || strlen(command) >= CF_BUFSIZE)))
+    {
+        RlistDestroy(args);
+        return NULL;
+    }
+
+    PrefetchJob *job = xcalloc(1, sizeof(PrefetchJob));
+    job->kind = kind;
+    job->command = xstrdup(command);
+    job->shell = shell;
+    job->output_select = output_select;
+
+    RlistDestroy(args);
+    return job;
+}
+
+static PrefetchJob *PrefetchJobFind(PrefetchKind kind, const char *command,
+                                    ShellType shell, OutputSelect output_select)
+{
+    if (PREFETCH_JOBS == NULL)
+    {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < SeqLength(PREFETCH_JOBS); i++)
+    {
+        PrefetchJob *job = SeqAt(PREFETCH_JOBS, i);
+        if (!job->taken &&
+            job->kind == kind &&
+            job->shell == shell &&
+            job->output_select == output_select &&
+            StringEqual(job->command, command))
+        {
+            return job;
+        }
+    }
+
+    return NULL;
+}
+
+void CommandPrefetchSection(EvalContext *ctx, const BundleSection *section)
+{
+    assert(ctx != NULL);
+    assert(section != NULL);
+
+    /* The debug logging of the commands could not be kept in order. */
+    const int max_workers = EvalContextGetConcurrentFunctionCalls(ctx);
+    if (max_workers <= 0 ||
+        PREFETCH_JOBS != NULL ||
+        EVAL_MODE != EVAL_MODE_NORMAL ||
+        LogGetGlobalLevel() >= LOG_LEVEL_DEBUG ||
+        !EvalContextGetEvalOption(ctx, EVAL_OPTION_CACHE_SYSTEM_FUNCTIONS) ||
+        EvalContextGetFunctionCacheTTL(ctx) > 0 ||
+        !(StringEqual(section->promise_type, "vars") ||
+          StringEqual(section->promise_type, "classes")))
+    {
+        return;
+    }
+
+    const Bundle *bundle = section->parent_bundle;
+    Seq *jobs = SeqNew(8, PrefetchJobDestroy);
+    Buffer *buf = BufferNew();
+    StringSet *promisers = StringSetNew();
+
+    /* Arguments are expanded now, the functions expand them after the
+     * promises before theirs. Only the ones no promise can change are the
+     * same; a function whose command still differs doesn't find a job for
+     * it and runs it itself. */
+    StringSet *assigned = StringSetNew();
+    if (!SectionAssignedVariables(section, assigned))
+    {
+        StringSetDestroy(assigned);
+        assigned = NULL;
+    }
+
+    for (size_t i = 0; i < SeqLength(section->promises); i++)
+    {
+        const Promise *pp = SeqAt(section->promises, i);
+        if (!PromiseMayPrefetch(ctx, pp, promisers, buf))
+        {
+            continue;
+        }
+
+        for (size_t j = 0; j < SeqLength(pp->conlist); j++)
+        {
+            const Constraint *cp = SeqAt(pp->conlist, j);
+            if (cp->rval.type != RVAL_TYPE_FNCALL)
+            {
+                continue;
+            }
+
+            PrefetchJob *job = PrefetchJobFromCall(ctx, bundle, RvalFnCallValue(cp->rval),
+                                                   assigned, buf);
+            if (job == NULL)
+            {
+                continue;
+            }
+
+            /* The same call is only run once, the next ones hit the cache. */
+            bool duplicate = false;
+            for (size_t k = 0; k < SeqLength(jobs) && !duplicate; k++)
+            {
+                const PrefetchJob *other = SeqAt(jobs, k);
+                duplicate = (other->kind == job->kind &&
+                             other->shell == job->shell &&
+                             other->output_select == job->output_select &&
+                             StringEqual(other->command, job->command));
+            }
+
+            if (duplicate)
+            {
+                PrefetchJobDestroy(job);
+            }
+            else
+            {
+                SeqAppend(jobs, job);
+            }
+        }
+    }
+    StringSetDestroy(assigned);
+    StringSetDestroy(promisers);
+    BufferDestroy(buf);
+
+    const size_t n_jobs = SeqLength(jobs);
+    if (n_jobs == 0)
+    {
+        SeqDestroy(jobs);
+        return;
+    }
+
+    PREFETCH_JOBS = jobs;
+    PREFETCH_SECTION = section;
+    PREFETCH_NEXT_JOB = 0;
+
+    const size_t n_workers = MIN((size_t) max_workers, n_jobs);
+    PREFETCH_WORKERS = xcalloc(n_workers, sizeof(pthread_t));
+    PREFETCH_WORKERS_COUNT = 0;
+
+    pid_t *pids = xmalloc(n_workers * sizeof(pid_t));
+    for (size_t i = 0; i < n_workers; i++)
+    {
+        pids[i] = -1;
+    }
+    PREFETCH_PIDS = pids;
+
+    for (size_t i = 0; i < n_workers; i++)
+    {
+        int ret = pthread_create(&PREFETCH_WORKERS[i], NULL, PrefetchWorker,
+                                 (void *) (intptr_t) i);
+        if (ret != 0)
+        {
+            Log(LOG_LEVEL_VERBOSE, "Failed to create thread to run commands (pthread_create: %s)",
+                GetErrorStrFromCode(ret));
+            break;
+        }
+        PREFETCH_WORKERS_COUNT++;
+    }
+
+    if (PREFETCH_WORKERS_COUNT == 0)
+    {
+        /* Nothing would ever run the commands, leave them to the functions. */
+        CommandPrefetchClear(section);
+        return;
+    }
+
+    Log(LOG_LEVEL_VERBOSE,
+        "Running %zu commands of '%s' promises in bundle '%s' in %zu threads",
+        n_jobs, section->promise_type, bundle->name, PREFETCH_WORKERS_COUNT);
+}
+
+void CommandPrefetchClear(const BundleSection *section)
+{
+    if (PREFETCH_JOBS == NULL || section != PREFETCH_SECTION)
+    {
+        return;
+    }
+
+    /* Don't start the commands nobody is going to wait for. */
+    ThreadLock(&prefetch_lock);
+    PREFETCH_NEXT_JOB = SeqLength(PREFETCH_JOBS);
+    ThreadUnlock(&prefetch_lock);
+
+    for (size_t i = 0; i < PREFETCH_WORKERS_COUNT; i++)
+    {
+        pthread_join(PREFETCH_WORKERS[i], NULL);
+    }
+    free(PREFETCH_WORKERS);
+    PREFETCH_WORKERS = NULL;
+    PREFETCH_WORKERS_COUNT = 0;
+
+    /* Detach it before freeing, for CommandPrefetchTimeOut(). */
+    volatile pid_t *pids = PREFETCH_PIDS;
+    PREFETCH_PIDS = NULL;
+    free((void *) pids);
+
+    SeqDestroy(PREFETCH_JOBS);
+    PREFETCH_JOBS = NULL;
+    PREFETCH_SECTION = NULL;
+}
+
+/**
+ * Wait for #job to be done, mark it as taken and log what running its
+ * command logged. The workers only stop once all the jobs are started, so
+ * every job gets done.
+ */
+static void PrefetchJobTake(PrefetchJob *job)
+{
+    ThreadLock(&prefetch_lock);
+    while (!job->done)
+    {
+        pthread_cond_wait(&prefetch_job_done, &prefetch_lock);
+    }
+    ThreadUnlock(&prefetch_lock);
+
+    job->taken = true;
+
+    const size_t n_messages =
+        (job->log_messages != NULL) ? SeqLength(job->log_messages) : 0;
+    for (size_t i = 0; i < n_messages; i++)
+    {
+        const PrefetchLogMessage *msg = SeqAt(job->log_messages, i);
+        Log(msg->level, "%s", msg->message);
+    }
+}
+
+bool CommandPrefetchTakeOutput(const char *command, ShellType shell,
+                               OutputSelect output_select,
+                               bool *ran, char **output, int *exit_code)
+{
+    assert(command != NULL);
+    assert(ran != NULL);
+    assert(output != NULL);
+    assert(exit_code != NULL);
+
+    PrefetchJob *job = PrefetchJobFind(PREFETCH_KIND_OUTPUT, command, shell, output_select);
+    if (job == NULL)
+    {
+        return false;
+    }
+
+    PrefetchJobTake(job);
+    *ran = job->ran;
+    *exit_code = job->exit_code;
+    *output = job->output;
+    job->output = NULL;
+    return true;
+}
+
+bool CommandPrefetchTakeReturnsZero(const char *command, ShellType shell,
+                                    bool *returned_zero)
+{
+    assert(command != NULL);
+    assert(returned_zero != NULL);
+
+    PrefetchJob *job = PrefetchJobFind(PREFETCH_KIND_RETURNS_ZERO, command, shell,
+                                       OUTPUT_SELECT_BOTH);
+    if (job == NULL)
+    {
+        return false;
+    }
+
+    PrefetchJobTake(job);
+    *returned_zero = (job->ran && job->exit_code == 0);
+    return true;
+}
+
+void CommandPrefetchTimeOut(void)
+{
+    volatile pid_t *pids = PREFETCH_PIDS;
+    if (pids == NULL)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < PREFETCH_WORKERS_COUNT; i++)
+    {
+        const pid_t pid = pids[i];
+        if (pid > 0)
+        {
+            Log(LOG_LEVEL_VERBOSE, "Time out of process %jd", (intmax_t) pid);
+            GracefulTerminate(pid, PROCESS_START_TIME_UNKNOWN);
+        }
+    }
+}
@@ -0,0 +1,78 @@
+/*
+  Copyright 2024 Northern.tech AS
+
+  This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; version 3.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#ifndef CFENGINE_COMMAND_PREFETCH_H
+#define CFENGINE_COMMAND_PREFETCH_H
+
+
+#include <platform.h>
+#include <cf3.defs.h>                           /* ShellType, EvalContext */
+#include <pipes.h>                                             /* OutputSelect */
+
+
+/**
+ * Concurrent pre-evaluation of the commands run by execresult(),
+ * execresult_as_data() and returnszero() in a vars or classes section.
+ *
+ * Before the promises of a section are evaluated one by one, the calls to
+ * these functions whose arguments already fully expand, and refer to no
+ * variable a promise of the section may define, are started in up to
+ * 'concurrent_function_calls' (body common control) worker threads. When a
+ * function is then evaluated, it takes the result of its command, waiting
+ * for it if still running, instead of running it itself. The messages
+ * logged while running a command are kept and logged by the function
+ * taking its result, in the evaluation order.
+ */
+
+void CommandPrefetchSection(EvalContext *ctx, const BundleSection *section);
+
+/**
+ * Wait for the commands started for #section, if any, and forget the
+ * results nobody took. Commands not started yet are not run any more.
+ */
+void CommandPrefetchClear(const BundleSection *section);
+
+/**
+ * @param output set to the output of the command, to be freed by the caller
+ * @return whether the command was pre-evaluated, with #ran set to whether it
+ *         could be run at all
+ */
+bool CommandPrefetchTakeOutput(const char *command, ShellType shell,
+                               OutputSelect output_select,
+                               bool *ran, char **output, int *exit_code);
+
+/**
+ * @return whether the command was pre-evaluated, with #returned_zero set to
+ *         whether its exit status was zero
+ */
+bool CommandPrefetchTakeReturnsZero(const char *command, ShellType shell,
+                                    bool *returned_zero);
+
+/**
+ * Terminate the commands running ahead of time, the way TimeOut() does with
+ * the one in ALARM_PID.
+ */
+void CommandPrefetchTimeOut(void);
+
+#endif
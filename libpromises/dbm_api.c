@@ -120,6 +120,8 @@ static const char *const DB_PATHS_STATEDIR[] = {
     [dbid_packages_installed] = "packages_installed",
     [dbid_packages_updates] = "packages_updates",
     [dbid_cookies] = "nova_cookies",
+    [dbid_hashes] = "cf_hashes",
+    [dbid_functions] = "cf_functions",
 };
 
 /*
@@ -504,6 +506,22 @@ time_t GetDBOpenTimestamp(const DBHandle *handle)
     return handle->open_tstamp;
 }
 
+/**
+ * Commit what was written through #handle so far, without closing it.
+ * Backends may otherwise keep the writes in a transaction until CloseDB().
+ */
+void CommitDB(DBHandle *handle)
+{
+    assert(handle != NULL);
+
+    ThreadLock(&handle->lock);
+    if (!handle->frozen)
+    {
+        DBPrivCommit(handle->priv);
+    }
+    ThreadUnlock(&handle->lock);
+}
+
 void CloseDB(DBHandle *handle)
 {
     assert(handle != NULL);
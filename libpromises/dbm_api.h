@@ -59,6 +59,8 @@ typedef enum
     dbid_packages_installed = 21, // new package promise installed packages list
     dbid_packages_updates   = 22, // new package promise list of available updates
     dbid_cookies            = 23, // Enterprise reporting cookies for duplicate host detection
+    dbid_hashes             = 24, // file digests indexed by inode and timestamps
+    dbid_functions          = 25, // results of functions kept across agent runs
 
     dbid_max
 } dbid;
@@ -75,6 +77,7 @@ bool OpenDB(CF_DB **dbp, dbid db);
 bool OpenSubDB(DBHandle **dbp, dbid id, const char *sub_name);
 bool CleanDB(DBHandle *handle);
 void CloseDB(CF_DB *dbp);
+void CommitDB(CF_DB *dbp);
 
 DBHandle *GetDBHandleFromFilename(const char *db_file_name);
 time_t GetDBOpenTimestamp(const DBHandle *handle);
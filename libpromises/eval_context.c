@@ -29,7 +29,7 @@
 #include <syntax.h>
 #include <item_lib.h>
 #include <ornaments.h>
-#include <expand.h>                                    /* ExpandPrivateRval */
+#include <expand.h>               /* ExpandPrivateRval,ScalarTemplatesClear */
 #include <matching.h>
 #include <string_lib.h>
 #include <misc_lib.h>
@@ -68,11 +68,50 @@ static const char *STACK_FRAME_TYPE_STR[STACK_FRAME_TYPE_MAX] = {
 
 /**
    Define FuncCacheMap.
-   Key:   an Rlist (which is linked list of Rvals)
-          listing all the argument of the function
+   Key:   a FuncCacheKey, the function name and the Rlist (which is linked
+          list of Rvals) listing all the argument of the function
    Value: an Rval, the result of the function
  */
 
+typedef struct
+{
+    char *name;
+    Rlist *args;
+    unsigned int hash;
+} FuncCacheKey;
+
+static FuncCacheKey FuncCacheKeyConst(const char *name, const Rlist *args)
+{
+    return (FuncCacheKey) {
+        .name = (char *) name,
+        .args = (Rlist *) args,
+        .hash = RlistHash(args, StringHash(name, 0)),
+    };
+}
+
+static unsigned int FuncCacheKeyHash(const void *p, ARG_UNUSED unsigned int seed)
+{
+    const FuncCacheKey *key = p;
+    return key->hash;
+}
+
+static bool FuncCacheKeyEqual(const void *a, const void *b)
+{
+    const FuncCacheKey *key_a = a;
+    const FuncCacheKey *key_b = b;
+    return (key_a->hash == key_b->hash &&
+            StringEqual(key_a->name, key_b->name) &&
+            RlistEqual(key_a->args, key_b->args));
+}
+
+static void FuncCacheKeyDestroy(void *p)
+{
+    FuncCacheKey *key = p;
+    free(key->name);
+    RlistDestroy(key->args);
+    free(key);
+}
+
 static void RvalDestroy2(void *p)
 {
     Rval *rv = p;
@@ -80,12 +119,12 @@ static void RvalDestroy2(void *p)
     free(rv);
 }
 
-TYPED_MAP_DECLARE(FuncCache, Rlist *, Rval *)
+TYPED_MAP_DECLARE(FuncCache, FuncCacheKey *, Rval *)
 
-TYPED_MAP_DEFINE(FuncCache, Rlist *, Rval *,
-                 RlistHash_untyped,
-                 RlistEqual_untyped,
-                 RlistDestroy_untyped,
+TYPED_MAP_DEFINE(FuncCache, FuncCacheKey *, Rval *,
+                 FuncCacheKeyHash,
+                 FuncCacheKeyEqual,
+                 FuncCacheKeyDestroy,
                  RvalDestroy2)
 
 /**
@@ -109,6 +148,132 @@ TYPED_MAP_DEFINE(RemoteVarPromises, char *, Seq *,
                  free,
                  SeqDestroy_untyped)
 
+/**
+   Define ChangeGenerationMap.
+   Key:   name of a class or variable (char *)
+   Value: the generation of its last change (uint64_t *)
+ */
+
+TYPED_MAP_DECLARE(ChangeGeneration, char *, uint64_t *)
+
+TYPED_MAP_DEFINE(ChangeGeneration, char *, uint64_t *,
+                 StringHash_untyped,
+                 StringEqual_untyped,
+                 free,
+                 free)
+
+/**
+ * Changes of the classes and variables, by name only: a class or variable
+ * with the same name in a different namespace or scope is conservatively
+ * treated as the same. See EvalContextPromiseInputsBegin().
+ */
+typedef struct
+{
+    uint64_t generation;                 /* incremented on every change */
+    uint64_t cleared;                    /* generation of the last EvalContextClear() */
+    ChangeGenerationMap *classes;
+    ChangeGenerationMap *variables;
+    PromiseInputs *current;              /* the evaluation being recorded */
+} InputTracker;
+
+struct PromiseInputs_
+{
+    uint64_t start;                      /* generation when the evaluation started */
+    StringSet *classes;                  /* names of the classes read */
+    StringSet *variables;                /* names of the variables read */
+    size_t locks;                        /* promise locks taken or found taken */
+    bool untracked;                      /* read something that is not tracked */
+    PromiseInputs *previous;             /* evaluation being recorded before */
+};
+
+static void InputTrackerDestroy(InputTracker *tracker)
+{
+    if (tracker != NULL)
+    {
+        ChangeGenerationMapDestroy(tracker->classes);
+        ChangeGenerationMapDestroy(tracker->variables);
+        free(tracker);
+    }
+}
+
+static void TrackChange(InputTracker *tracker, ChangeGenerationMap *map, const char *name)
+{
+    tracker->generation++;
+
+    uint64_t *generation = ChangeGenerationMapGet(map, name);
+    if (generation != NULL)
+    {
+        *generation = tracker->generation;
+    }
+    else
+    {
+        generation = xmalloc(sizeof(uint64_t));
+        *generation = tracker->generation;
+        ChangeGenerationMapInsert(map, xstrdup(name), generation);
+    }
+}
+
+static void TrackClassChange(const EvalContext *ctx, const char *name);
+static void TrackClassRead(const EvalContext *ctx, const char *name);
+static void TrackVariableChange(const EvalContext *ctx, const VarRef *ref);
+static void TrackVariableRead(const EvalContext *ctx, const VarRef *ref);
+static bool RvalsEqual(Rval a, Rval b);
+
+/**
+   Define ClassExpressionMap.
+   Key:   class expression as written in policy (char *)
+   Value: the parsed expression (ClassExpression *)
+ */
+
+typedef enum
+{
+    FOLDED_FALSE,
+    FOLDED_TRUE,
+    FOLDED_EXPRESSION,                   /* depends on more than hard classes */
+} FoldedKind;
+
+typedef struct
+{
+    Expression *parsed;
+    bool literal;                        /* see ExpressionIsLiteral() */
+    FoldedKind folded_kind;
+    Expression *folded;                  /* shares the leaves of parsed */
+    uint64_t folded_generation;          /* of the hard classes when folded */
+} ClassExpression;
+
+static void FreeFoldedExpression(Expression *expr);
+
+static void ClassExpressionDestroy(void *p)
+{
+    ClassExpression *expression = p;
+    if (expression != NULL)
+    {
+        FreeFoldedExpression(expression->folded);
+        FreeExpression(expression->parsed);
+        free(expression);
+    }
+}
+
+TYPED_MAP_DECLARE(ClassExpression, char *, ClassExpression *)
+
+TYPED_MAP_DEFINE(ClassExpression, char *, ClassExpression *,
+                 StringHash_untyped,
+                 StringEqual_untyped,
+                 free,
+                 ClassExpressionDestroy)
+
+/* Expressions with variables in them can make up an unbounded number of
+ * distinct strings, parse the rest every time. */
+#define CLASS_EXPRESSION_CACHE_MAX_SIZE 10000
+
+typedef struct
+{
+    ClassExpressionMap *expressions;
+    uint64_t hard_classes_generation;    /* incremented when hard classes change */
+    size_t hits;
+    size_t misses;
+    size_t folds;
+} ClassExpressionCache;
 
 static Regex *context_expression_whitespace_rx = NULL;
 
@@ -161,6 +326,13 @@ struct EvalContext_
     StringSet *promise_lock_cache;
     StringSet *dependency_handles;
     FuncCacheMap *function_cache;
+    int function_cache_ttl;             /* minutes, 0 unless kept across runs */
+    int concurrent_function_calls;      /* commands pre-evaluated at a time */
+
+    /* NULL unless promise inputs are tracked */
+    InputTracker *input_tracker;
+
+    ClassExpressionCache *class_expressions;
 
     uid_t uid;
     uid_t gid;
@@ -513,6 +685,7 @@ static void EvalContextStackFrameAddSoft(EvalContext *ctx, const char *context,
         return;
     }
 
+    TrackClassChange(ctx, context);
     ClassTablePut(frame.classes, frame.owner->ns, context, true,
                   CONTEXT_SCOPE_BUNDLE,
                   NULL_OR_EMPTY(tags) ? NULL : StringSetFromString(tags, ','),
@@ -536,6 +709,7 @@ static ExpressionValue EvalTokenAsClass(const char *classname, void *param)
 {
     const EvalContext *ctx = param;
     ClassRef ref = ClassRefParse(classname);
+    TrackClassRead(ctx, ref.name);
     if (ClassRefIsQualified(ref))
     {
         if (strcmp(ref.ns, NamespaceDefault()) == 0)
@@ -594,17 +768,172 @@ bool ClassCharIsWhitespace(char ch)
     return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r';
 }
 
-ExpressionValue CheckClassExpression(const EvalContext *ctx, const char *context)
+static void FreeFoldedExpression(Expression *expr)
 {
-    assert(context != NULL);
-    ParseResult res;
+    if (expr == NULL)
+    {
+        return;
+    }
 
-    if (!context)
+    switch (expr->op)
     {
-        // TODO: Remove this, seems like a hack
-        return EXPRESSION_VALUE_TRUE;
+    case LOGICAL_OP_OR:
+    case LOGICAL_OP_AND:
+        FreeFoldedExpression(expr->val.andor.lhs);
+        FreeFoldedExpression(expr->val.andor.rhs);
+        free(expr);
+        break;
+    case LOGICAL_OP_NOT:
+        FreeFoldedExpression(expr->val.not.arg);
+        free(expr);
+        break;
+    case LOGICAL_OP_EVAL:
+        /* shared with the parsed expression */
+        break;
+    }
+}
+
+/**
+ * @return false if #expr has names with variables in them, which can fail
+ *         to evaluate and must not be folded away
+ */
+static bool ExpressionIsLiteral(const Expression *expr)
+{
+    switch (expr->op)
+    {
+    case LOGICAL_OP_OR:
+    case LOGICAL_OP_AND:
+        return (ExpressionIsLiteral(expr->val.andor.lhs) &&
+                ExpressionIsLiteral(expr->val.andor.rhs));
+    case LOGICAL_OP_NOT:
+        return ExpressionIsLiteral(expr->val.not.arg);
+    case LOGICAL_OP_EVAL:
+        return expr->val.eval.name->op == LITERAL;
+    }
+    return false;
+}
+
+static FoldedKind FoldName(const EvalContext *ctx, const char *name)
+{
+    if (strcmp(name, "true") == 0)
+    {
+        return FOLDED_TRUE;
+    }
+    if (strcmp(name, "false") == 0)
+    {
+        return FOLDED_FALSE;
     }
 
+    /* Same as EvalTokenAsClass(), for the classes that are always set. */
+    ClassRef ref = ClassRefParse(name);
+    bool always = (strcmp("any", ref.name) == 0 ||
+                   ((!ClassRefIsQualified(ref) || strcmp(ref.ns, NamespaceDefault()) == 0) &&
+                    EvalContextHeapContainsHard(ctx, ref.name)));
+    ClassRefDestroy(ref);
+
+    return always ? FOLDED_TRUE : FOLDED_EXPRESSION;
+}
+
+static Expression *NewFoldedExpression(LogicalOp op, Expression *lhs, Expression *rhs)
+{
+    Expression *expr = xcalloc(1, sizeof(Expression));
+    expr->op = op;
+    if (op == LOGICAL_OP_NOT)
+    {
+        expr->val.not.arg = lhs;
+    }
+    else
+    {
+        expr->val.andor.lhs = lhs;
+        expr->val.andor.rhs = rhs;
+    }
+    return expr;
+}
+
+/**
+ * Evaluates the hard classes in a literal #expr.
+ *
+ * @param folded what is left to evaluate, if FOLDED_EXPRESSION is returned
+ */
+static FoldedKind FoldExpression(const EvalContext *ctx, const Expression *expr,
+                                 Expression **folded)
+{
+    *folded = NULL;
+
+    switch (expr->op)
+    {
+    case LOGICAL_OP_OR:
+    case LOGICAL_OP_AND:
+    {
+        Expression *lhs, *rhs;
+        FoldedKind lhs_kind = FoldExpression(ctx, expr->val.andor.lhs, &lhs);
+        FoldedKind rhs_kind = FoldExpression(ctx, expr->val.andor.rhs, &rhs);
+
+        /* the value that decides the outcome */
+        const FoldedKind absorbing = (expr->op == LOGICAL_OP_OR) ? FOLDED_TRUE : FOLDED_FALSE;
+        if (lhs_kind == absorbing || rhs_kind == absorbing)
+        {
+            FreeFoldedExpression(lhs);
+            FreeFoldedExpression(rhs);
+            return absorbing;
+        }
+        if (lhs_kind != FOLDED_EXPRESSION)
+        {
+            *folded = rhs;
+            return rhs_kind;
+        }
+        if (rhs_kind != FOLDED_EXPRESSION)
+        {
+            *folded = lhs;
+            return lhs_kind;
+        }
+
+        *folded = NewFoldedExpression(expr->op, lhs, rhs);
+        return FOLDED_EXPRESSION;
+    }
+
+    case LOGICAL_OP_NOT:
+    {
+        Expression *arg;
+        switch (FoldExpression(ctx, expr->val.not.arg, &arg))
+        {
+        case FOLDED_TRUE:
+            return FOLDED_FALSE;
+        case FOLDED_FALSE:
+            return FOLDED_TRUE;
+        case FOLDED_EXPRESSION:
+            *folded = NewFoldedExpression(LOGICAL_OP_NOT, arg, NULL);
+            return FOLDED_EXPRESSION;
+        }
+        break;
+    }
+
+    case LOGICAL_OP_EVAL:
+    {
+        FoldedKind kind = FoldName(ctx, expr->val.eval.name->val.literal.literal);
+        if (kind == FOLDED_EXPRESSION)
+        {
+            *folded = (Expression *) expr;
+        }
+        return kind;
+    }
+    }
+
+    ProgrammingError("Unknown logical operator %d in class expression", expr->op);
+}
+
+static ExpressionValue EvalClassExpression(const EvalContext *ctx, const Expression *expr)
+{
+    return EvalExpression(expr, &EvalTokenAsClass, &EvalVarRef,
+                          (void *)ctx); // controlled cast. None of these should modify EvalContext
+}
+
+/**
+ * Parses #context, or returns NULL after logging why it is not a valid
+ * class expression.
+ */
+static Expression *ParseClassExpression(const char *context)
+{
     if (context_expression_whitespace_rx == NULL)
     {
         context_expression_whitespace_rx = CompileRegex(CFENGINE_REGEX_WHITESPACE_IN_CONTEXTS);
@@ -613,36 +942,104 @@ ExpressionValue CheckClassExpression(const EvalContext *ctx, const char *context
     if (context_expression_whitespace_rx == NULL)
     {
         Log(LOG_LEVEL_ERR, "The context expression whitespace regular expression could not be compiled, aborting.");
-        return EXPRESSION_VALUE_ERROR;
+        return NULL;
     }
 
     if (StringMatchFullWithPrecompiledRegex(context_expression_whitespace_rx, context))
     {
         Log(LOG_LEVEL_ERR, "class expressions can't be separated by whitespace without an intervening operator in expression '%s'", context);
-        return EXPRESSION_VALUE_ERROR;
+        return NULL;
     }
 
     Buffer *condensed = BufferNewFrom(context, strlen(context));
     BufferRewrite(condensed, &ClassCharIsWhitespace, true);
-    res = ParseExpression(BufferData(condensed), 0, BufferSize(condensed));
+    ParseResult res = ParseExpression(BufferData(condensed), 0, BufferSize(condensed));
     BufferDestroy(condensed);
 
     if (!res.result)
     {
         Log(LOG_LEVEL_ERR, "Couldn't find any class matching '%s'", context);
-        return EXPRESSION_VALUE_ERROR;
+    }
+    return res.result;
+}
+
+/**
+ * Class expressions are parsed once and kept for the life of the context,
+ * with the hard classes in them folded until hard classes change.
+ */
+ExpressionValue CheckClassExpression(const EvalContext *ctx, const char *context)
+{
+    assert(context != NULL);
+
+    if (!context)
+    {
+        // TODO: Remove this, seems like a hack
+        return EXPRESSION_VALUE_TRUE;
+    }
+
+    ClassExpressionCache *cache = ctx->class_expressions;
+    ClassExpression *expression = ClassExpressionMapGet(cache->expressions, context);
+    if (expression != NULL)
+    {
+        cache->hits++;
     }
     else
     {
-        ExpressionValue r = EvalExpression(res.result,
-                                           &EvalTokenAsClass, &EvalVarRef,
-                                           (void *)ctx); // controlled cast. None of these should modify EvalContext
+        cache->misses++;
 
-        FreeExpression(res.result);
-        return r;
+        Expression *parsed = ParseClassExpression(context);
+        if (parsed == NULL)
+        {
+            return EXPRESSION_VALUE_ERROR;
+        }
+
+        if (ClassExpressionMapSize(cache->expressions) >= CLASS_EXPRESSION_CACHE_MAX_SIZE)
+        {
+            ExpressionValue r = EvalClassExpression(ctx, parsed);
+            FreeExpression(parsed);
+            return r;
+        }
+
+        expression = xcalloc(1, sizeof(ClassExpression));
+        expression->parsed = parsed;
+        expression->literal = ExpressionIsLiteral(parsed);
+        expression->folded_kind = FOLDED_EXPRESSION;
+        expression->folded_generation = cache->hard_classes_generation - 1;
+        ClassExpressionMapInsert(cache->expressions, xstrdup(context), expression);
+    }
+
+    if (!expression->literal)
+    {
+        return EvalClassExpression(ctx, expression->parsed);
+    }
+
+    if (expression->folded_generation != cache->hard_classes_generation)
+    {
+        FreeFoldedExpression(expression->folded);
+        expression->folded_kind = FoldExpression(ctx, expression->parsed, &expression->folded);
+        expression->folded_generation = cache->hard_classes_generation;
+        cache->folds++;
+    }
+
+    switch (expression->folded_kind)
+    {
+    case FOLDED_TRUE:
+        return EXPRESSION_VALUE_TRUE;
+    case FOLDED_FALSE:
+        return EXPRESSION_VALUE_FALSE;
+    case FOLDED_EXPRESSION:
+    default:
+        return EvalClassExpression(ctx, expression->folded);
     }
 }
 
+void EvalContextLogClassExpressionCacheStats(const EvalContext *ctx)
+{
+    const ClassExpressionCache *cache = ctx->class_expressions;
+    Log(LOG_LEVEL_VERBOSE, "T: Class expression cache: %zu expressions, %zu hits, %zu misses, %zu folds",
+        ClassExpressionMapSize(cache->expressions), cache->hits, cache->misses, cache->folds);
+}
+
 /**********************************************************************/
 
 static ExpressionValue EvalTokenFromList(const char *token, void *param)
@@ -953,6 +1350,9 @@ bool MissingDependencies(EvalContext *ctx, const Promise *pp)
         return false;
     }
 
+    /* Promise outcomes are not tracked. */
+    EvalContextPromiseInputsUntracked(ctx);
+
     for (const Rlist *rp = PromiseGetConstraintAsList(ctx, "depends_on", pp); rp; rp = rp->next)
     {
         if (rp->val.type != RVAL_TYPE_SCALAR)
@@ -1104,6 +1504,8 @@ EvalContext *EvalContextNew(void)
 
     ctx->promise_lock_cache = StringSetNew();
     ctx->function_cache = FuncCacheMapNew();
+    ctx->class_expressions = xcalloc(1, sizeof(ClassExpressionCache));
+    ctx->class_expressions->expressions = ClassExpressionMapNew();
 
     EvalContextSetupMissionPortalLogHook(ctx);
 
@@ -1160,6 +1562,9 @@ void EvalContextDestroy(EvalContext *ctx)
         StringSetDestroy(ctx->promise_lock_cache);
 
         FuncCacheMapDestroy(ctx->function_cache);
+        InputTrackerDestroy(ctx->input_tracker);
+        ClassExpressionMapDestroy(ctx->class_expressions->expressions);
+        free(ctx->class_expressions);
 
         FreePackagePromiseContext(ctx->package_promise_context);
 
@@ -1217,25 +1622,56 @@ static bool EvalContextStackFrameContainsSoft(const EvalContext *ctx, const char
     return StackFrameContainsSoftRecursive(ctx, context, stack_index);
 }
 
+/**
+ * Hard classes are folded into the cached class expressions and are not
+ * tracked as inputs of promises, see CheckClassExpression().
+ */
+static void HardClassesChanged(EvalContext *ctx)
+{
+    ctx->class_expressions->hard_classes_generation++;
+
+    if (ctx->input_tracker != NULL)
+    {
+        ctx->input_tracker->generation++;
+        ctx->input_tracker->cleared = ctx->input_tracker->generation;
+    }
+}
+
 bool EvalContextHeapRemoveSoft(EvalContext *ctx, const char *ns, const char *name)
 {
+    TrackClassChange(ctx, name);
+    const Class *cls = ClassTableGet(ctx->global_classes, ns, name);
+    if (cls != NULL && !cls->is_soft)
+    {
+        HardClassesChanged(ctx);
+    }
     return ClassTableRemove(ctx->global_classes, ns, name);
 }
 
 bool EvalContextHeapRemoveHard(EvalContext *ctx, const char *name)
 {
+    TrackClassChange(ctx, name);
+    HardClassesChanged(ctx);
     return ClassTableRemove(ctx->global_classes, NULL, name);
 }
 
 void EvalContextClear(EvalContext *ctx)
 {
     ClassTableClear(ctx->global_classes);
+    HardClassesChanged(ctx);
     EvalContextDeleteIpAddresses(ctx);
     VariableTableClear(ctx->global_variables, NULL, NULL, NULL);
     VariableTableClear(ctx->match_variables, NULL, NULL, NULL);
     StringSetClear(ctx->promise_lock_cache);
     SeqClear(ctx->stack);
     FuncCacheMapClear(ctx->function_cache);
+    ScalarTemplatesClear();
+
+    if (ctx->input_tracker != NULL)
+    {
+        ctx->input_tracker->generation++;
+        ctx->input_tracker->cleared = ctx->input_tracker->generation;
+    }
 }
 
 Rlist *EvalContextGetPromiseCallerMethods(EvalContext *ctx) {
@@ -1420,6 +1856,7 @@ void EvalContextStackFrameRemoveSoft(EvalContext *ctx, const char *context)
     StackFrame *frame = LastStackFrameByType(ctx, STACK_FRAME_TYPE_BUNDLE);
     assert(frame);
 
+    TrackClassChange(ctx, context);
     ClassTableRemove(frame->data.bundle.classes, frame->data.bundle.owner->ns, context);
 }
 
@@ -1692,11 +2129,19 @@ bool EvalContextClassRemove(EvalContext *ctx, const char *ns, const char *name)
         ClassTableRemove(frame->data.bundle.classes, ns, name);
     }
 
+    TrackClassChange(ctx, name);
+    const Class *cls = ClassTableGet(ctx->global_classes, ns, name);
+    if (cls != NULL && !cls->is_soft)
+    {
+        HardClassesChanged(ctx);
+    }
     return ClassTableRemove(ctx->global_classes, ns, name);
 }
 
 Class *EvalContextClassGet(const EvalContext *ctx, const char *ns, const char *name)
 {
+    TrackClassRead(ctx, name);
+
     StackFrame *frame = LastStackFrameByType(ctx, STACK_FRAME_TYPE_BUNDLE);
     if (frame)
     {
@@ -1712,6 +2157,8 @@ Class *EvalContextClassGet(const EvalContext *ctx, const char *ns, const char *n
 
 Class *EvalContextClassMatch(const EvalContext *ctx, const char *regex)
 {
+    EvalContextPromiseInputsUntracked(ctx);
+
     StackFrame *frame = LastStackFrameByType(ctx, STACK_FRAME_TYPE_BUNDLE);
     if (frame)
     {
@@ -1792,6 +2239,7 @@ static bool EvalContextClassPutTagsSet(EvalContext *ctx, const char *ns, const c
     }
 
     Nova_ClassHistoryAddContextName(ctx->all_classes, name);
+    TrackClassChange(ctx, name);
 
     switch (scope)
     {
@@ -1808,6 +2256,10 @@ static bool EvalContextClassPutTagsSet(EvalContext *ctx, const char *ns, const c
 
     case CONTEXT_SCOPE_NAMESPACE:
         ClassTablePut(ctx->global_classes, ns, name, is_soft, scope, tags, comment);
+        if (!is_soft)
+        {
+            HardClassesChanged(ctx);
+        }
         break;
 
     case CONTEXT_SCOPE_NONE:
@@ -1927,11 +2379,13 @@ bool EvalContextClassPutSoftNSTagsSetWithComment(EvalContext *ctx, const char *n
 
 ClassTableIterator *EvalContextClassTableIteratorNewGlobal(const EvalContext *ctx, const char *ns, bool is_hard, bool is_soft)
 {
+    EvalContextPromiseInputsUntracked(ctx);
     return ClassTableIteratorNew(ctx->global_classes, ns, is_hard, is_soft);
 }
 
 ClassTableIterator *EvalContextClassTableIteratorNewLocal(const EvalContext *ctx)
 {
+    EvalContextPromiseInputsUntracked(ctx);
     StackFrame *frame = LastStackFrameByType(ctx, STACK_FRAME_TYPE_BUNDLE);
     if (!frame)
     {
@@ -2270,13 +2724,13 @@ bool EvalContextVariableRemoveSpecial(const EvalContext *ctx, SpecialScope scope
     }
 }
 
-static VariableTable *GetVariableTableForScope(const EvalContext *ctx,
-                                               NDEBUG_UNUSED const char *ns, /* only used in assertions ... */
-                                               const char *scope)
+static VariableTable *GetVariableTableForSpecialScope(const EvalContext *ctx,
+                                                      NDEBUG_UNUSED const char *ns, /* only used in assertions ... */
+                                                      SpecialScope scope)
 {
     assert(ctx != NULL);
 
-    switch (SpecialScopeFromString(scope))
+    switch (scope)
     {
     case SPECIAL_SCOPE_DEF:
         /* 'def.' is not as special as the other scopes below. (CFE-3668) */
@@ -2324,8 +2778,16 @@ static VariableTable *GetVariableTableForScope(const EvalContext *ctx,
     }
 }
 
+static VariableTable *GetVariableTableForScope(const EvalContext *ctx,
+                                               const char *ns,
+                                               const char *scope)
+{
+    return GetVariableTableForSpecialScope(ctx, ns, SpecialScopeFromString(scope));
+}
+
 bool EvalContextVariableRemove(const EvalContext *ctx, const VarRef *ref)
 {
+    TrackVariableChange(ctx, ref);
     VariableTable *table = GetVariableTableForScope(ctx, ref->ns, ref->scope);
     return VariableTableRemove(table, ref);
 }
@@ -2371,15 +2833,21 @@ static bool IsVariableSelfReferential(const VarRef *ref, const void *value, Rval
     return false;
 }
 
-static void VarRefStackQualify(const EvalContext *ctx, VarRef *ref)
+/**
+ * @return #ref qualified to the current scope, sharing the strings of #ref
+ *         and of the stack, not to be destroyed
+ */
+static VarRef VarRefStackQualified(const EvalContext *ctx, const VarRef *ref)
 {
     StackFrame *last_frame = LastStackFrame(ctx, 0);
     assert(last_frame);
 
+    VarRef qualified = *ref;
     switch (last_frame->type)
     {
     case STACK_FRAME_TYPE_BODY:
-        VarRefQualify(ref, NULL, SpecialScopeToString(SPECIAL_SCOPE_BODY));
+        qualified.ns = NULL;
+        qualified.scope = (char *) SpecialScopeToString(SPECIAL_SCOPE_BODY);
         break;
 
     case STACK_FRAME_TYPE_BUNDLE_SECTION:
@@ -2387,27 +2855,28 @@ static void VarRefStackQualify(const EvalContext *ctx, VarRef *ref)
             StackFrame *last_last_frame = LastStackFrame(ctx, 1);
             assert(last_last_frame);
             assert(last_last_frame->type == STACK_FRAME_TYPE_BUNDLE);
-            VarRefQualify(ref,
-                          last_last_frame->data.bundle.owner->ns,
-                          last_last_frame->data.bundle.owner->name);
+            qualified.ns = last_last_frame->data.bundle.owner->ns;
+            qualified.scope = last_last_frame->data.bundle.owner->name;
         }
         break;
 
     case STACK_FRAME_TYPE_BUNDLE:
-        VarRefQualify(ref,
-                      last_frame->data.bundle.owner->ns,
-                      last_frame->data.bundle.owner->name);
+        qualified.ns = last_frame->data.bundle.owner->ns;
+        qualified.scope = last_frame->data.bundle.owner->name;
         break;
 
     case STACK_FRAME_TYPE_PROMISE:
     case STACK_FRAME_TYPE_PROMISE_ITERATION:
         // Allow special "this" variables to work when used without "this"
-        VarRefQualify(ref, NULL, SpecialScopeToString(SPECIAL_SCOPE_THIS));
+        qualified.ns = NULL;
+        qualified.scope = (char *) SpecialScopeToString(SPECIAL_SCOPE_THIS);
         break;
 
     default:
         ProgrammingError("Unhandled stack frame type");
     }
+
+    return qualified;
 }
 
 /*
@@ -2468,36 +2937,56 @@ bool EvalContextVariablePutTagsSetWithComment(EvalContext *ctx,
 
     Rval rval = (Rval) { (void *)value, DataTypeToRvalType(type) };
     VariableTable *table = GetVariableTableForScope(ctx, ref->ns, ref->scope);
+    if (ctx->input_tracker != NULL)
+    {
+        /* Re-evaluations mostly put the same values again. */
+        const Variable *existing = VariableTableGet(table, ref);
+        if (existing == NULL || VariableGetType(existing) != type ||
+            !RvalsEqual(VariableGetRval(existing, true), rval))
+        {
+            TrackVariableChange(ctx, ref);
+        }
+    }
     const Promise *pp = EvalContextStackCurrentPromise(ctx);
     VariableTablePut(table, ref, &rval, type, tags, SafeStringDuplicate(comment), pp ? pp->org_pp : pp);
     return true;
 }
 
+/*
+ * The lookups below use refs on the stack sharing the strings of the ref
+ * being resolved, variable resolution is too frequent to copy refs.
+ */
+
 /**
- * Change ref for e.g. 'config.var1' to 'this.config___var1'
+ * Looks up e.g. 'config.var1' as 'this.config___var1'
  *
  * @see MangleScopedVarNameIntoSpecialScopeName()
  */
-static inline VarRef *MangledThisScopedRef(const VarRef *ref)
+static Variable *VariableTableGetMangledThisScoped(const VariableTable *this_table,
+                                                  const VarRef *ref)
 {
-    VarRef *mangled_this_ref = VarRefCopy(ref);
-    char *scope_underscores_lval = StringConcatenate(3, mangled_this_ref->scope,
-                                                     NESTED_SCOPE_SEP,
-                                                     mangled_this_ref->lval);
-    free(mangled_this_ref->lval);
-    mangled_this_ref->lval = scope_underscores_lval;
-    free(mangled_this_ref->scope);
-    mangled_this_ref->scope = xstrdup("this");
+    char mangled_lval[CF_BUFSIZE];
+    int len = snprintf(mangled_lval, sizeof(mangled_lval), "%s" NESTED_SCOPE_SEP "%s",
+                       ref->scope, ref->lval);
+    if (len < 0 || (size_t) len >= sizeof(mangled_lval))
+    {
+        /* longer than any variable name can be */
+        return NULL;
+    }
 
-    return mangled_this_ref;
+    VarRef mangled_this_ref = *ref;
+    mangled_this_ref.scope = (char *) SpecialScopeToString(SPECIAL_SCOPE_THIS);
+    mangled_this_ref.lval = mangled_lval;
+    return VariableTableGet(this_table, &mangled_this_ref);
 }
 
-static Variable *VariableResolve2(const EvalContext *ctx, const VarRef *ref)
+static Variable *VariableResolve2(const EvalContext *ctx, const VarRef *ref,
+                                  SpecialScope special_scope)
 {
     assert(ref != NULL);
 
     // Get the variable table associated to the scope
-    VariableTable *table = GetVariableTableForScope(ctx, ref->ns, ref->scope);
+    VariableTable *table = GetVariableTableForSpecialScope(ctx, ref->ns, special_scope);
 
     Variable *var;
     if (table)
@@ -2507,15 +2996,13 @@ static Variable *VariableResolve2(const EvalContext *ctx, const VarRef *ref)
          *       string and so VariableTableGet() would fail to find them with
          *       the namespace. And similar logic applies to other special
          *       scopes except for 'def.' which is actually not so special. */
-        if ((SpecialScopeFromString(ref->scope) != SPECIAL_SCOPE_NONE) &&
-            (SpecialScopeFromString(ref->scope) != SPECIAL_SCOPE_DEF) &&
+        if ((special_scope != SPECIAL_SCOPE_NONE) &&
+            (special_scope != SPECIAL_SCOPE_DEF) &&
             (ref->ns != NULL))
         {
-            VarRef *ref2 = VarRefCopy(ref);
-            free(ref2->ns);
-            ref2->ns = NULL;
-            var = VariableTableGet(table, ref2);
-            VarRefDestroy(ref2);
+            VarRef ref2 = *ref;
+            ref2.ns = NULL;
+            var = VariableTableGet(table, &ref2);
         }
         else
         {
@@ -2541,13 +3028,11 @@ static Variable *VariableResolve2(const EvalContext *ctx, const VarRef *ref)
              * (which will not have the list-iteration variables expanded). */
             if (ref->scope != NULL)
             {
-                VariableTable *this_table = GetVariableTableForScope(ctx, ref->ns,
-                                                                     SpecialScopeToString(SPECIAL_SCOPE_THIS));
+                VariableTable *this_table = GetVariableTableForSpecialScope(ctx, ref->ns,
+                                                                            SPECIAL_SCOPE_THIS);
                 if (this_table != NULL)
                 {
-                    VarRef *mangled_this_ref = MangledThisScopedRef(ref);
-                    var = VariableTableGet(this_table, mangled_this_ref);
-                    VarRefDestroy(mangled_this_ref);
+                    var = VariableTableGetMangledThisScoped(this_table, ref);
                     if (var != NULL)
                     {
                         return var;
@@ -2559,9 +3044,10 @@ static Variable *VariableResolve2(const EvalContext *ctx, const VarRef *ref)
              * variable reference) fails, there might still be a container
              * variable where the indices actually refer to child objects inside
              * the container structure. */
-            VarRef *base_ref = VarRefCopyIndexless(ref);
-            var = VariableTableGet(table, base_ref);
-            VarRefDestroy(base_ref);
+            VarRef base_ref = *ref;
+            base_ref.indices = NULL;
+            base_ref.num_indices = 0;
+            var = VariableTableGet(table, &base_ref);
 
             if (var && (VariableGetType(var) == CF_DATA_TYPE_CONTAINER))
             {
@@ -2586,10 +3072,13 @@ static Variable *VariableResolve(const EvalContext *ctx, const VarRef *ref)
 {
     assert(ref->lval);
 
+    TrackVariableRead(ctx, ref);
+
     /* We will make a first lookup that works in almost all cases: will look
      * for local or global variables, depending of the current scope. */
 
-    Variable *ret_var = VariableResolve2(ctx, ref);
+    SpecialScope special_scope = SpecialScopeFromString(ref->scope);
+    Variable *ret_var = VariableResolve2(ctx, ref, special_scope);
     if (ret_var != NULL)
     {
         return ret_var;
@@ -2597,18 +3086,17 @@ static Variable *VariableResolve(const EvalContext *ctx, const VarRef *ref)
 
     /* Try to qualify non-scoped vars to the scope:
        "this" for promises, "body" for bodies, current bundle for bundles. */
-    VarRef *scoped_ref = NULL;
+    VarRef scoped_ref;
     if (!VarRefIsQualified(ref))
     {
-        scoped_ref = VarRefCopy(ref);
-        VarRefStackQualify(ctx, scoped_ref);
-        ret_var = VariableResolve2(ctx, scoped_ref);
+        scoped_ref = VarRefStackQualified(ctx, ref);
+        special_scope = SpecialScopeFromString(scoped_ref.scope);
+        ret_var = VariableResolve2(ctx, &scoped_ref, special_scope);
         if (ret_var != NULL)
         {
-            VarRefDestroy(scoped_ref);
             return ret_var;
         }
-        ref = scoped_ref;              /* continue with the scoped variable */
+        ref = &scoped_ref;             /* continue with the scoped variable */
     }
 
     const Bundle *last_bundle = EvalContextStackCurrentBundle(ctx);
@@ -2617,19 +3105,15 @@ static Variable *VariableResolve(const EvalContext *ctx, const VarRef *ref)
      * last bundle. So try a last lookup with "this" or "body" special scopes
      * replaced with the last bundle. */
 
-    if ((SpecialScopeFromString(ref->scope) == SPECIAL_SCOPE_THIS  ||
-         SpecialScopeFromString(ref->scope) == SPECIAL_SCOPE_BODY)
+    if ((special_scope == SPECIAL_SCOPE_THIS  ||
+         special_scope == SPECIAL_SCOPE_BODY)
         &&  last_bundle != NULL)
     {
-        VarRef *ref2 = VarRefCopy(ref);
-        VarRefQualify(ref2, last_bundle->ns, last_bundle->name);
-        ret_var = VariableResolve2(ctx, ref2);
-
-        VarRefDestroy(scoped_ref);
-        VarRefDestroy(ref2);
-        return ret_var;
+        VarRef ref2 = *ref;
+        ref2.ns = last_bundle->ns;
+        ref2.scope = last_bundle->name;
+        return VariableResolve2(ctx, &ref2, SpecialScopeFromString(ref2.scope));
     }
-    VarRefDestroy(scoped_ref);
 
     return NULL;
 }
@@ -2718,6 +3202,7 @@ bool EvalContextVariableClearMatch(EvalContext *ctx)
 
 VariableTableIterator *EvalContextVariableTableIteratorNew(const EvalContext *ctx, const char *ns, const char *scope, const char *lval)
 {
+    EvalContextPromiseInputsUntracked(ctx);
     VariableTable *table = scope ? GetVariableTableForScope(ctx, ns, scope) : ctx->global_variables;
     return table ? VariableTableIteratorNew(table, ns, scope, lval) : NULL;
 }
@@ -2725,6 +3210,7 @@ VariableTableIterator *EvalContextVariableTableIteratorNew(const EvalContext *ct
 
 VariableTableIterator *EvalContextVariableTableFromRefIteratorNew(const EvalContext *ctx, const VarRef *ref)
 {
+    EvalContextPromiseInputsUntracked(ctx);
     assert(ref);
     VariableTable *table = ref->scope ? GetVariableTableForScope(ctx, ref->ns, ref->scope) : ctx->global_variables;
     return table ? VariableTableIteratorNewFromVarRef(table, ref) : NULL;
@@ -2868,23 +3354,236 @@ Seq *EvalContextResolveBodyExpression(const EvalContext *ctx, const Policy *poli
     return bodies;
 }
 
+/* Whether putting #b in place of #a changes nothing. Conservatively false
+ * for what is expensive to compare. */
+static bool RvalsEqual(Rval a, Rval b)
+{
+    if (a.type != b.type)
+    {
+        return false;
+    }
+
+    switch (a.type)
+    {
+    case RVAL_TYPE_SCALAR:
+        return StringEqual(RvalScalarValue(a), RvalScalarValue(b));
+    case RVAL_TYPE_LIST:
+        return RlistEqual(RvalRlistValue(a), RvalRlistValue(b));
+    default:
+        return false;
+    }
+}
+
+static void TrackClassChange(const EvalContext *ctx, const char *name)
+{
+    InputTracker *tracker = ctx->input_tracker;
+    if (tracker != NULL)
+    {
+        TrackChange(tracker, tracker->classes, name);
+    }
+}
+
+static void TrackVariableChange(const EvalContext *ctx, const VarRef *ref)
+{
+    InputTracker *tracker = ctx->input_tracker;
+    if (tracker == NULL || ref->scope == NULL)
+    {
+        return;
+    }
+
+    /* These only live during the evaluation of one promise or body and are
+     * derived from its other inputs. */
+    const SpecialScope scope = SpecialScopeFromString(ref->scope);
+    if (scope == SPECIAL_SCOPE_THIS || scope == SPECIAL_SCOPE_BODY)
+    {
+        return;
+    }
+
+    TrackChange(tracker, tracker->variables, ref->lval);
+}
+
+static void TrackClassRead(const EvalContext *ctx, const char *name)
+{
+    PromiseInputs *inputs = (ctx->input_tracker != NULL) ? ctx->input_tracker->current : NULL;
+    if (inputs != NULL && !inputs->untracked && !StringSetContains(inputs->classes, name))
+    {
+        StringSetAdd(inputs->classes, xstrdup(name));
+    }
+}
+
+static void TrackVariableRead(const EvalContext *ctx, const VarRef *ref)
+{
+    PromiseInputs *inputs = (ctx->input_tracker != NULL) ? ctx->input_tracker->current : NULL;
+    if (inputs == NULL || inputs->untracked)
+    {
+        return;
+    }
+
+    /* Match variables are replaced without being put one by one. */
+    if (ref->scope != NULL && SpecialScopeFromString(ref->scope) == SPECIAL_SCOPE_MATCH)
+    {
+        inputs->untracked = true;
+        return;
+    }
+
+    if (!StringSetContains(inputs->variables, ref->lval))
+    {
+        StringSetAdd(inputs->variables, xstrdup(ref->lval));
+    }
+}
+
+void EvalContextPromiseInputsTrackingEnable(EvalContext *ctx, bool enable)
+{
+    assert(ctx != NULL);
+
+    if (enable && ctx->input_tracker == NULL)
+    {
+        ctx->input_tracker = xcalloc(1, sizeof(InputTracker));
+        ctx->input_tracker->classes = ChangeGenerationMapNew();
+        ctx->input_tracker->variables = ChangeGenerationMapNew();
+    }
+    else if (!enable)
+    {
+        assert(ctx->input_tracker == NULL || ctx->input_tracker->current == NULL);
+        InputTrackerDestroy(ctx->input_tracker);
+        ctx->input_tracker = NULL;
+    }
+}
+
+PromiseInputs *EvalContextPromiseInputsBegin(EvalContext *ctx)
+{
+    assert(ctx != NULL);
+
+    InputTracker *tracker = ctx->input_tracker;
+    if (tracker == NULL)
+    {
+        return NULL;
+    }
+
+    PromiseInputs *inputs = xcalloc(1, sizeof(PromiseInputs));
+    inputs->start = tracker->generation;
+    inputs->classes = StringSetNew();
+    inputs->variables = StringSetNew();
+    inputs->previous = tracker->current;
+    tracker->current = inputs;
+    return inputs;
+}
+
+void EvalContextPromiseInputsEnd(EvalContext *ctx, PromiseInputs *inputs)
+{
+    assert(ctx != NULL);
+
+    if (inputs != NULL)
+    {
+        assert(ctx->input_tracker != NULL);
+        assert(ctx->input_tracker->current == inputs);
+        ctx->input_tracker->current = inputs->previous;
+        inputs->previous = NULL;
+    }
+}
+
+void EvalContextPromiseInputsUntracked(const EvalContext *ctx)
+{
+    assert(ctx != NULL);
+
+    if (ctx->input_tracker != NULL && ctx->input_tracker->current != NULL)
+    {
+        ctx->input_tracker->current->untracked = true;
+    }
+}
+
+static bool ChangedSince(const ChangeGenerationMap *map, const StringSet *names,
+                         uint64_t generation)
+{
+    StringSetIterator it = StringSetIteratorInit((StringSet *) names);
+    const char *name;
+    while ((name = StringSetIteratorNext(&it)) != NULL)
+    {
+        const uint64_t *changed = ChangeGenerationMapGet((ChangeGenerationMap *) map, name);
+        if (changed != NULL && *changed > generation)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool EvalContextPromiseInputsChanged(const EvalContext *ctx, const PromiseInputs *inputs)
+{
+    assert(ctx != NULL);
+    assert(inputs != NULL);
+
+    const InputTracker *tracker = ctx->input_tracker;
+    if (tracker == NULL || inputs->untracked || tracker->cleared > inputs->start)
+    {
+        return true;
+    }
+
+    return (ChangedSince(tracker->classes, inputs->classes, inputs->start) ||
+            ChangedSince(tracker->variables, inputs->variables, inputs->start));
+}
+
+bool PromiseInputsAreTracked(const PromiseInputs *inputs)
+{
+    assert(inputs != NULL);
+    return !inputs->untracked;
+}
+
+size_t PromiseInputsLockCount(const PromiseInputs *inputs)
+{
+    assert(inputs != NULL);
+    return inputs->locks;
+}
+
+void PromiseInputsSetUntracked(PromiseInputs *inputs)
+{
+    assert(inputs != NULL);
+    inputs->untracked = true;
+}
+
+void PromiseInputsDestroy(PromiseInputs *inputs)
+{
+    if (inputs != NULL)
+    {
+        assert(inputs->previous == NULL);
+        StringSetDestroy(inputs->classes);
+        StringSetDestroy(inputs->variables);
+        free(inputs);
+    }
+}
+
 bool EvalContextPromiseLockCacheContains(const EvalContext *ctx, const char *key)
 {
-    return StringSetContains(ctx->promise_lock_cache, key);
+    bool contains = StringSetContains(ctx->promise_lock_cache, key);
+    if (contains && ctx->input_tracker != NULL && ctx->input_tracker->current != NULL)
+    {
+        ctx->input_tracker->current->locks++;
+    }
+    return contains;
 }
 
 void EvalContextPromiseLockCachePut(EvalContext *ctx, const char *key)
 {
     StringSetAdd(ctx->promise_lock_cache, xstrdup(key));
+    if (ctx->input_tracker != NULL && ctx->input_tracker->current != NULL)
+    {
+        ctx->input_tracker->current->locks++;
+    }
 }
 
 void EvalContextPromiseLockCacheRemove(EvalContext *ctx, const char *key)
 {
     StringSetRemove(ctx->promise_lock_cache, key);
+    if (ctx->input_tracker != NULL)
+    {
+        /* The promise is to be verified again, whatever its inputs are. */
+        ctx->input_tracker->generation++;
+        ctx->input_tracker->cleared = ctx->input_tracker->generation;
+    }
 }
 
 bool EvalContextFunctionCacheGet(const EvalContext *ctx,
-                                 const FnCall *fp ARG_UNUSED,
+                                 const FnCall *fp,
                                  const Rlist *args, Rval *rval_out)
 {
     assert(fp != NULL);
@@ -2897,10 +3596,8 @@ bool EvalContextFunctionCacheGet(const EvalContext *ctx,
     }
 
     // The cache key is made of the function name and all args values
-    Rlist *args_copy = RlistCopy(args);
-    Rlist *key = RlistPrepend(&args_copy, fp->name, RVAL_TYPE_SCALAR);
-    Rval *rval = FuncCacheMapGet(ctx->function_cache, key);
-    RlistDestroy(key);
+    FuncCacheKey key = FuncCacheKeyConst(fp->name, args);
+    Rval *rval = FuncCacheMapGet(ctx->function_cache, &key);
     if (rval)
     {
         if (rval_out)
@@ -2931,12 +3628,38 @@ void EvalContextFunctionCachePut(EvalContext *ctx,
     Rval *rval_copy = xmalloc(sizeof(Rval));
     *rval_copy = RvalCopy(*rval);
 
-    Rlist *args_copy = RlistCopy(args);
-    Rlist *key = RlistPrepend(&args_copy, fp->name, RVAL_TYPE_SCALAR);
+    FuncCacheKey *key = xmalloc(sizeof(FuncCacheKey));
+    *key = FuncCacheKeyConst(fp->name, args);
+    key->name = xstrdup(fp->name);
+    key->args = RlistCopy(args);
 
     FuncCacheMapInsert(ctx->function_cache, key, rval_copy);
 }
 
+void EvalContextSetFunctionCacheTTL(EvalContext *ctx, int ttl)
+{
+    assert(ctx != NULL);
+    ctx->function_cache_ttl = ttl;
+}
+
+int EvalContextGetFunctionCacheTTL(const EvalContext *ctx)
+{
+    assert(ctx != NULL);
+    return ctx->function_cache_ttl;
+}
+
+void EvalContextSetConcurrentFunctionCalls(EvalContext *ctx, int calls)
+{
+    assert(ctx != NULL);
+    ctx->concurrent_function_calls = calls;
+}
+
+int EvalContextGetConcurrentFunctionCalls(const EvalContext *ctx)
+{
+    assert(ctx != NULL);
+    return ctx->concurrent_function_calls;
+}
+
 /* cfPS and associated machinery */
 
 
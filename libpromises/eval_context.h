@@ -233,11 +233,33 @@ bool EvalContextVariableClearMatch(EvalContext *ctx);
 VariableTableIterator *EvalContextVariableTableIteratorNew(const EvalContext *ctx, const char *ns, const char *scope, const char *lval);
 VariableTableIterator *EvalContextVariableTableFromRefIteratorNew(const EvalContext *ctx, const VarRef *ref);
 
+/* Recording of what a promise evaluation read, to tell whether evaluating
+ * it again can give a different outcome. Only names are recorded. */
+typedef struct PromiseInputs_ PromiseInputs;
+
+void EvalContextPromiseInputsTrackingEnable(EvalContext *ctx, bool enable);
+/* NULL when tracking is not enabled, pair with EvalContextPromiseInputsEnd() */
+PromiseInputs *EvalContextPromiseInputsBegin(EvalContext *ctx);
+void EvalContextPromiseInputsEnd(EvalContext *ctx, PromiseInputs *inputs);
+/* Mark the evaluation being recorded as depending on untracked state */
+void EvalContextPromiseInputsUntracked(const EvalContext *ctx);
+bool EvalContextPromiseInputsChanged(const EvalContext *ctx, const PromiseInputs *inputs);
+bool PromiseInputsAreTracked(const PromiseInputs *inputs);
+size_t PromiseInputsLockCount(const PromiseInputs *inputs);
+void PromiseInputsSetUntracked(PromiseInputs *inputs);
+void PromiseInputsDestroy(PromiseInputs *inputs);
+
 bool EvalContextPromiseLockCacheContains(const EvalContext *ctx, const char *key);
 void EvalContextPromiseLockCachePut(EvalContext *ctx, const char *key);
 void EvalContextPromiseLockCacheRemove(EvalContext *ctx, const char *key);
 bool EvalContextFunctionCacheGet(const EvalContext *ctx, const FnCall *fp, const Rlist *args, Rval *rval_out);
 void EvalContextFunctionCachePut(EvalContext *ctx, const FnCall *fp, const Rlist *args, const Rval *rval);
+/* Minutes the results of cached functions are kept across agent runs */
+void EvalContextSetFunctionCacheTTL(EvalContext *ctx, int ttl);
+int EvalContextGetFunctionCacheTTL(const EvalContext *ctx);
+/* Commands of execresult() and returnszero() calls run at a time, see command_prefetch.h */
+void EvalContextSetConcurrentFunctionCalls(EvalContext *ctx, int calls);
+int EvalContextGetConcurrentFunctionCalls(const EvalContext *ctx);
 
 const void  *EvalContextVariableControlCommonGet(const EvalContext *ctx, CommonControl lval);
 
@@ -268,6 +290,8 @@ static inline bool IsDefinedClass(const EvalContext *ctx, const char *context)
 {
     return (CheckClassExpression(ctx, context) == EXPRESSION_VALUE_TRUE);
 }
+/* Reports the use of the cache of parsed class expressions, for --timing */
+void EvalContextLogClassExpressionCacheStats(const EvalContext *ctx);
 StringSet *ClassesMatching(const EvalContext *ctx, ClassTableIterator *iter, const char* regex, const Rlist *tags, bool first_only);
 StringSet *ClassesMatchingGlobal(const EvalContext *ctx, const char* regex, const Rlist *tags, bool first_only);
 StringSet *ClassesMatchingLocal(const EvalContext *ctx, const char* regex, const Rlist *tags, bool first_only);
@@ -62,6 +62,7 @@
 #include <classic.h>                                    /* SendSocketStream */
 #include <pipes.h>
 #include <exec_tools.h>
+#include <command_prefetch.h>
 #include <policy.h>
 #include <misc_lib.h>
 #include <fncall.h>
@@ -3050,7 +3051,13 @@ static FnCallResult FnCallReturnsZero(ARG_UNUSED EvalContext *ctx, ARG_UNUSED co
 
     snprintf(comm, CF_BUFSIZE, "%s", RlistScalarValue(finalargs));
 
-    if (ShellCommandReturnsZero(comm, shelltype))
+    bool returned_zero;
+    if (!CommandPrefetchTakeReturnsZero(comm, shelltype, &returned_zero))
+    {
+        returned_zero = ShellCommandReturnsZero(comm, shelltype);
+    }
+
+    if (returned_zero)
     {
         Log(LOG_LEVEL_VERBOSE, "%s ran '%s' successfully and it returned zero", fp->name, RlistScalarValue(finalargs));
         return FnReturnContext(true);
@@ -3136,8 +3143,21 @@ static FnCallResult FnCallExecResult(ARG_UNUSED EvalContext *ctx, ARG_UNUSED con
     }
 
     int exit_code;
+    bool ran;
+
+    char *prefetched_output;
+    if (CommandPrefetchTakeOutput(command, shelltype, output_select,
+                                  &ran, &prefetched_output, &exit_code))
+    {
+        free(buffer);
+        buffer = prefetched_output;
+    }
+    else
+    {
+        ran = GetExecOutput(command, &buffer, &buffer_size, shelltype, output_select, &exit_code);
+    }
 
-    if (GetExecOutput(command, &buffer, &buffer_size, shelltype, output_select, &exit_code))
+    if (ran)
     {
         Log(LOG_LEVEL_VERBOSE, "%s ran '%s' successfully", fp->name, command);
         if (StringEqual(function, "execresult"))
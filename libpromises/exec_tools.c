@@ -34,8 +34,11 @@
 
 /********************************************************************/
 
-bool GetExecOutput(const char *command, char **buffer, size_t *buffer_size, ShellType shell, OutputSelect output_select, int *ret_out)
-/* Buffer initially contains whole exec string */
+/**
+ * Start #command with its output piped to the returned stream, to be read
+ * with ReadExecOutput() and closed with cf_pclose().
+ */
+FILE *OpenExecOutput(const char *command, ShellType shell, OutputSelect output_select)
 {
     FILE *pp;
 
@@ -49,7 +52,7 @@ bool GetExecOutput(const char *command, char **buffer, size_t *buffer_size, Shel
         pp = cf_popen_powershell_select(command, "rt", output_select);
 #else // !__MINGW32__
         Log(LOG_LEVEL_ERR, "Powershell is only supported on Windows");
-        return false;
+        return NULL;
 #endif // __MINGW32__
     }
     else
@@ -60,9 +63,16 @@ bool GetExecOutput(const char *command, char **buffer, size_t *buffer_size, Shel
     if (pp == NULL)
     {
         Log(LOG_LEVEL_ERR, "Couldn't open pipe to command '%s'. (cf_popen: %s)", command, GetErrorStr());
-        return false;
     }
 
+    return pp;
+}
+
+/**
+ * Read the whole output of #command from #pp, without closing it.
+ */
+bool ReadExecOutput(FILE *pp, const char *command, char **buffer, size_t *buffer_size)
+{
     size_t offset = 0;
     size_t line_size = CF_EXPANDSIZE;
     size_t attempted_size = 0;
@@ -76,7 +86,6 @@ bool GetExecOutput(const char *command, char **buffer, size_t *buffer_size, Shel
             if (!feof(pp))
             {
                 Log(LOG_LEVEL_ERR, "Unable to read output of command '%s'. (fread: %s)", command, GetErrorStr());
-                cf_pclose(pp);
                 free(line);
                 return false;
             }
@@ -106,6 +115,25 @@ bool GetExecOutput(const char *command, char **buffer, size_t *buffer_size, Shel
 
     Log(LOG_LEVEL_DEBUG, "GetExecOutput got '%s'", *buffer);
 
+    free(line);
+    return true;
+}
+
+bool GetExecOutput(const char *command, char **buffer, size_t *buffer_size, ShellType shell, OutputSelect output_select, int *ret_out)
+/* Buffer initially contains whole exec string */
+{
+    FILE *pp = OpenExecOutput(command, shell, output_select);
+    if (pp == NULL)
+    {
+        return false;
+    }
+
+    if (!ReadExecOutput(pp, command, buffer, buffer_size))
+    {
+        cf_pclose(pp);
+        return false;
+    }
+
     if (ret_out != NULL)
     {
         *ret_out = cf_pclose(pp);
@@ -115,7 +143,6 @@ bool GetExecOutput(const char *command, char **buffer, size_t *buffer_size, Shel
         cf_pclose(pp);
     }
 
-    free(line);
     return true;
 }
 
@@ -32,6 +32,8 @@
 bool IsExecutable(const char *file);
 bool ShellCommandReturnsZero(const char *command, ShellType shell);
 bool GetExecOutput(const char *command, char **buffer, size_t *buffer_size, ShellType shell, OutputSelect output_select, int *ret_out);
+FILE *OpenExecOutput(const char *command, ShellType shell, OutputSelect output_select);
+bool ReadExecOutput(FILE *pp, const char *command, char **buffer, size_t *buffer_size);
 void ActAsDaemon();
 void ArgGetExecutableAndArgs(const char *comm, char **exec, char **args);
 
@@ -42,6 +42,9 @@
 #include <string_lib.h>
 #include <conversion.h>
 #include <verify_classes.h>
+#include <command_prefetch.h>
+#include <map.h>
+#include <mutex.h>
 
 /**
  * VARIABLES AND PROMISE EXPANSION
@@ -515,25 +518,441 @@ Rval ExpandBundleReference(EvalContext *ctx,
 }
 
 /**
- * Expand a #string into Buffer #out, returning the pointer to the string
- * itself, inside the Buffer #out. If #out is NULL then the buffer will be
- * created and destroyed internally.
+ * Scalar templates: a string cut into the literal spans and the variable
+ * references of ExpandScalar(), with the references parsed, so that the
+ * strings expanded for every iteration and pass are only scanned once.
+ */
+
+typedef struct ScalarTemplate_ ScalarTemplate;
+
+typedef struct
+{
+    const char *literal;        /* NULL for a reference, points in the template string */
+    size_t literal_len;
+
+    char *name;                 /* the reference without the dollar-paren */
+    char bracket;               /* '(' or '{' */
+    ScalarTemplate *nested;     /* to expand name with, if it has references */
+    VarRef *ref;                /* parsed name, if it has no references */
+    bool ref_ns_from_caller;    /* ref takes the namespace of the expansion */
+} ScalarToken;
+
+struct ScalarTemplate_
+{
+    char *string;
+    ScalarToken *tokens;        /* NULL if the string could not be compiled */
+    size_t num_tokens;
+
+    /* Only used for the top-level templates, see GetScalarTemplate(). */
+    size_t size;                /* memory used, see ScalarTemplateSize() */
+    size_t refs;                /* expansions using it */
+    bool cached;                /* in SCALAR_TEMPLATES and its LRU list */
+    ScalarTemplate *prev;       /* LRU list, head is the most recently used */
+    ScalarTemplate *next;
+};
+
+static void ScalarTemplateDestroy(ScalarTemplate *template)
+{
+    if (template != NULL)
+    {
+        for (size_t i = 0; i < template->num_tokens; i++)
+        {
+            free(template->tokens[i].name);
+            ScalarTemplateDestroy(template->tokens[i].nested);
+            VarRefDestroy(template->tokens[i].ref);
+        }
+        free(template->tokens);
+        free(template->string);
+        free(template);
+    }
+}
+
+static size_t ScalarTemplateSize(const ScalarTemplate *template)
+{
+    size_t size = sizeof(ScalarTemplate) + strlen(template->string) + 1 +
+                  template->num_tokens * sizeof(ScalarToken);
+    for (size_t i = 0; i < template->num_tokens; i++)
+    {
+        const ScalarToken *token = template->tokens + i;
+        if (token->name != NULL)
+        {
+            size += strlen(token->name) + 1;
+        }
+        if (token->nested != NULL)
+        {
+            size += ScalarTemplateSize(token->nested);
+        }
+        if (token->ref != NULL)
+        {
+            /* Roughly, the parsed parts of the name. */
+            size += sizeof(VarRef) + strlen(token->name) + 1;
+        }
+    }
+    return size;
+}
+
+/* The map doesn't own the templates, they are destroyed when evicted and
+ * no longer used (see SignatureEntryMap). */
+static void ScalarTemplateNoFree(ARG_UNUSED ScalarTemplate *template)
+{
+}
+
+TYPED_MAP_DECLARE(ScalarTemplate, char *, ScalarTemplate *)
+
+TYPED_MAP_DEFINE(ScalarTemplate, char *, ScalarTemplate *,
+                 StringHash_untyped,
+                 StringEqual_untyped,
+                 free,
+                 ScalarTemplateNoFree)
+
+/* Strings made up during iteration are distinct each time, so the least
+ * recently used templates are evicted past this many bytes. */
+#define SCALAR_TEMPLATES_MAX_BYTES (8 * 1024 * 1024)
+
+static pthread_mutex_t scalar_templates_lock = PTHREAD_MUTEX_INITIALIZER; /* GLOBAL_T */
+
+/* Protected by scalar_templates_lock. Templates are never changed once
+ * compiled, an evicted one is destroyed by the last expansion using it. */
+static struct
+{
+    ScalarTemplateMap *map;
+    ScalarTemplate *head;
+    ScalarTemplate *tail;
+    size_t bytes;                               /* including the map keys */
+} SCALAR_TEMPLATES = { 0 };                                               /* GLOBAL_X */
+
+static ScalarToken *ScalarTemplateAddToken(ScalarTemplate *template)
+{
+    template->tokens = xrealloc(template->tokens,
+                                (template->num_tokens + 1) * sizeof(ScalarToken));
+    ScalarToken *token = template->tokens + template->num_tokens;
+    template->num_tokens++;
+    memset(token, 0, sizeof(ScalarToken));
+    return token;
+}
+
+/**
+ * Cuts #string the same way the loop of ExpandScalarUncompiled() does.
  *
- * @retval NULL something went wrong
+ * @return NULL if the string has broken references, to be expanded by
+ *         ExpandScalarUncompiled() which logs about them
  */
-char *ExpandScalar(const EvalContext *ctx, const char *ns, const char *scope,
-                   const char *string, Buffer *out)
+static ScalarTemplate *ScalarTemplateCompile(const char *string)
 {
-    bool out_belongs_to_us = false;
+    ScalarTemplate *template = xcalloc(1, sizeof(ScalarTemplate));
+    template->string = xstrdup(string);
 
-    if (out == NULL)
+    Buffer *current_item = BufferNew();
+    for (const char *sp = template->string; *sp != '\0'; sp++)
     {
-        out               = BufferNew();
-        out_belongs_to_us = true;
+        BufferClear(current_item);
+        size_t prefix_len = ExtractScalarPrefix(current_item, sp, strlen(sp));
+        if (prefix_len > 0)
+        {
+            ScalarToken *token = ScalarTemplateAddToken(template);
+            token->literal = sp;
+            token->literal_len = prefix_len;
+        }
+
+        sp += prefix_len;
+        if (*sp == '\0')
+        {
+            break;
+        }
+
+        BufferClear(current_item);
+        char bracket = sp[1];
+        if (!ExtractScalarReference(current_item, sp, strlen(sp), true))
+        {
+            BufferDestroy(current_item);
+            ScalarTemplateDestroy(template);
+            return NULL;
+        }
+        sp += BufferSize(current_item) + 2;
+
+        ScalarToken *token = ScalarTemplateAddToken(template);
+        token->name = xstrdup(BufferData(current_item));
+        token->bracket = bracket;
+
+        if (IsCf3VarString(token->name))
+        {
+            token->nested = ScalarTemplateCompile(token->name);
+            if (token->nested == NULL)
+            {
+                BufferDestroy(current_item);
+                ScalarTemplateDestroy(template);
+                return NULL;
+            }
+        }
+        else if (!IsExpandable(token->name))
+        {
+            token->ref = VarRefParseFromNamespaceAndScope(token->name, NULL, NULL, CF_NS, '.');
+
+            /* The namespace of the expansion is not used with special scopes,
+             * see VarRefParseFromNamespaceAndScope(). */
+            if (token->ref->ns == NULL)
+            {
+                VarRef *probe = VarRefParseFromNamespaceAndScope(token->name, "default", NULL,
+                                                                 CF_NS, '.');
+                token->ref_ns_from_caller = (probe->ns != NULL);
+                VarRefDestroy(probe);
+            }
+        }
     }
+    BufferDestroy(current_item);
 
-    assert(string != NULL);
-    assert(out != NULL);
+    return template;
+}
+
+/* All the following must be called with scalar_templates_lock held. */
+
+static void ScalarTemplatesUnlink(ScalarTemplate *template)
+{
+    if (template->prev != NULL)
+    {
+        template->prev->next = template->next;
+    }
+    else
+    {
+        SCALAR_TEMPLATES.head = template->next;
+    }
+    if (template->next != NULL)
+    {
+        template->next->prev = template->prev;
+    }
+    else
+    {
+        SCALAR_TEMPLATES.tail = template->prev;
+    }
+    template->prev = NULL;
+    template->next = NULL;
+}
+
+static void ScalarTemplatesPushFront(ScalarTemplate *template)
+{
+    template->prev = NULL;
+    template->next = SCALAR_TEMPLATES.head;
+    if (SCALAR_TEMPLATES.head != NULL)
+    {
+        SCALAR_TEMPLATES.head->prev = template;
+    }
+    else
+    {
+        SCALAR_TEMPLATES.tail = template;
+    }
+    SCALAR_TEMPLATES.head = template;
+}
+
+static void ScalarTemplatesEvict(size_t max_bytes)
+{
+    while (SCALAR_TEMPLATES.bytes > max_bytes && SCALAR_TEMPLATES.tail != NULL)
+    {
+        ScalarTemplate *template = SCALAR_TEMPLATES.tail;
+        ScalarTemplatesUnlink(template);
+        ScalarTemplateMapRemove(SCALAR_TEMPLATES.map, template->string);
+        template->cached = false;
+        SCALAR_TEMPLATES.bytes -= template->size;
+
+        if (template->refs == 0)
+        {
+            ScalarTemplateDestroy(template);
+        }
+    }
+}
+
+/*********************************************************************/
+
+/**
+ * @return the template of #string, to be released with
+ *         ReleaseScalarTemplate(), or NULL if #string is to be expanded
+ *         without template
+ */
+static ScalarTemplate *GetScalarTemplate(const char *string)
+{
+    ThreadLock(&scalar_templates_lock);
+
+    if (SCALAR_TEMPLATES.map == NULL)
+    {
+        SCALAR_TEMPLATES.map = ScalarTemplateMapNew();
+    }
+
+    ScalarTemplate *template = ScalarTemplateMapGet(SCALAR_TEMPLATES.map, string);
+    if (template != NULL)
+    {
+        ScalarTemplatesUnlink(template);
+        ScalarTemplatesPushFront(template);
+    }
+    else
+    {
+        template = ScalarTemplateCompile(string);
+        if (template == NULL)
+        {
+            /* remember that it cannot be compiled */
+            template = xcalloc(1, sizeof(ScalarTemplate));
+            template->string = xstrdup(string);
+        }
+        template->size = ScalarTemplateSize(template) + strlen(string) + 1;
+
+        if (template->size <= SCALAR_TEMPLATES_MAX_BYTES)
+        {
+            template->cached = true;
+            ScalarTemplateMapInsert(SCALAR_TEMPLATES.map, xstrdup(string), template);
+            ScalarTemplatesPushFront(template);
+            SCALAR_TEMPLATES.bytes += template->size;
+            ScalarTemplatesEvict(SCALAR_TEMPLATES_MAX_BYTES);
+        }
+        else if (template->tokens == NULL)
+        {
+            ScalarTemplateDestroy(template);
+            ThreadUnlock(&scalar_templates_lock);
+            return NULL;
+        }
+    }
+
+    if (template->tokens == NULL)
+    {
+        template = NULL;
+    }
+    else
+    {
+        template->refs++;
+    }
+
+    ThreadUnlock(&scalar_templates_lock);
+    return template;
+}
+
+static void ReleaseScalarTemplate(ScalarTemplate *template)
+{
+    ThreadLock(&scalar_templates_lock);
+    assert(template->refs > 0);
+    if (--template->refs == 0 && !template->cached)
+    {
+        ScalarTemplateDestroy(template);
+    }
+    ThreadUnlock(&scalar_templates_lock);
+}
+
+/**
+ * Drop all scalar templates, when policy is reloaded and its strings are
+ * gone. Templates still in use are destroyed once released.
+ */
+void ScalarTemplatesClear(void)
+{
+    ThreadLock(&scalar_templates_lock);
+    ScalarTemplatesEvict(0);
+    ThreadUnlock(&scalar_templates_lock);
+}
+
+/**
+ * Appends the value of the variable #ref refers to if it is a scalar.
+ *
+ * @return false if #ref is not a scalar variable, and nothing was appended
+ */
+static bool AppendScalarVariable(const EvalContext *ctx, const VarRef *ref, Buffer *out)
+{
+    DataType value_type;
+    const void *value = EvalContextVariableGet(ctx, ref, &value_type);
+
+    switch (DataTypeToRvalType(value_type))
+    {
+    case RVAL_TYPE_SCALAR:
+        assert(value != NULL);
+        BufferAppendString(out, value);
+        return true;
+
+    case RVAL_TYPE_CONTAINER:
+    {
+        assert(value != NULL);
+        const JsonElement *jvalue = value;      /* instead of casts */
+        if (JsonGetElementType(jvalue) == JSON_ELEMENT_TYPE_PRIMITIVE)
+        {
+            BufferAppendString(out, JsonPrimitiveGetAsString(jvalue));
+            return true;
+        }
+        return false;
+    }
+    default:
+        /* TODO Log() */
+        return false;
+    }
+}
+
+static bool AppendScalarReference(const EvalContext *ctx, const char *ns, const char *scope,
+                                  const char *name, Buffer *out)
+{
+    if (IsExpandable(name))
+    {
+        return false;
+    }
+
+    VarRef *ref = VarRefParseFromNamespaceAndScope(name, ns, scope, CF_NS, '.');
+    bool appended = AppendScalarVariable(ctx, ref, out);
+    VarRefDestroy(ref);
+    return appended;
+}
+
+static void AppendUnexpandedReference(char bracket, const char *name, Buffer *out)
+{
+    if (bracket == '{')
+    {
+        BufferAppendF(out, "${%s}", name);
+    }
+    else
+    {
+        BufferAppendF(out, "$(%s)", name);
+    }
+}
+
+static void ExpandScalarTemplate(const EvalContext *ctx, const char *ns, const char *scope,
+                                 const ScalarTemplate *template, Buffer *out)
+{
+    for (size_t i = 0; i < template->num_tokens; i++)
+    {
+        const ScalarToken *token = template->tokens + i;
+        if (token->literal != NULL)
+        {
+            BufferAppend(out, token->literal, token->literal_len);
+        }
+        else if (token->ref != NULL)
+        {
+            /* Qualify the parsed ref like VarRefParseFromNamespaceAndScope()
+             * would, without copying it. */
+            VarRef ref = *token->ref;
+            if (token->ref_ns_from_caller)
+            {
+                ref.ns = (char *) ns;
+            }
+            if (ref.scope == NULL)
+            {
+                ref.scope = (char *) scope;
+            }
+
+            if (!AppendScalarVariable(ctx, &ref, out))
+            {
+                AppendUnexpandedReference(token->bracket, token->name, out);
+            }
+        }
+        else if (token->nested != NULL)
+        {
+            Buffer *name = BufferNew();
+            ExpandScalarTemplate(ctx, ns, scope, token->nested, name);
+            if (!AppendScalarReference(ctx, ns, scope, BufferData(name), out))
+            {
+                AppendUnexpandedReference(token->bracket, BufferData(name), out);
+            }
+            BufferDestroy(name);
+        }
+        else
+        {
+            AppendUnexpandedReference(token->bracket, token->name, out);
+        }
+    }
+}
+
+static void ExpandScalarUncompiled(const EvalContext *ctx, const char *ns, const char *scope,
+                                   const char *string, Buffer *out)
+{
     Buffer *current_item = BufferNew();
 
     for (const char *sp = string; *sp != '\0'; sp++)
@@ -561,52 +980,55 @@ char *ExpandScalar(const EvalContext *ctx, const char *ns, const char *scope,
             BufferDestroy(temp);
         }
 
-        if (!IsExpandable(BufferData(current_item)))
+        if (!AppendScalarReference(ctx, ns, scope, BufferData(current_item), out))
         {
-            VarRef *ref = VarRefParseFromNamespaceAndScope(
-                BufferData(current_item),
-                ns, scope, CF_NS, '.');
-            DataType value_type;
-            const void *value = EvalContextVariableGet(ctx, ref, &value_type);
-            VarRefDestroy(ref);
+            AppendUnexpandedReference(varstring, BufferData(current_item), out);
+        }
+    }
 
-            switch (DataTypeToRvalType(value_type))
-            {
-            case RVAL_TYPE_SCALAR:
-                assert(value != NULL);
-                BufferAppendString(out, value);
-                continue;
-                break;
+    BufferDestroy(current_item);
+}
 
-            case RVAL_TYPE_CONTAINER:
-            {
-                assert(value != NULL);
-                const JsonElement *jvalue = value;      /* instead of casts */
-                if (JsonGetElementType(jvalue) == JSON_ELEMENT_TYPE_PRIMITIVE)
-                {
-                    BufferAppendString(out, JsonPrimitiveGetAsString(jvalue));
-                    continue;
-                }
-                break;
-            }
-            default:
-                /* TODO Log() */
-                break;
-            }
-        }
+/**
+ * Expand a #string into Buffer #out, returning the pointer to the string
+ * itself, inside the Buffer #out. If #out is NULL then the buffer will be
+ * created and destroyed internally.
+ *
+ * @retval NULL something went wrong
+ */
+char *ExpandScalar(const EvalContext *ctx, const char *ns, const char *scope,
+                   const char *string, Buffer *out)
+{
+    bool out_belongs_to_us = false;
+
+    if (out == NULL)
+    {
+        out               = BufferNew();
+        out_belongs_to_us = true;
+    }
+
+    assert(string != NULL);
+    assert(out != NULL);
 
-        if (varstring == '{')
+    if (strchr(string, '$') == NULL)
+    {
+        /* nothing to expand, not worth a template */
+        BufferAppendString(out, string);
+    }
+    else
+    {
+        ScalarTemplate *template = GetScalarTemplate(string);
+        if (template != NULL)
         {
-            BufferAppendF(out, "${%s}", BufferData(current_item));
+            ExpandScalarTemplate(ctx, ns, scope, template, out);
+            ReleaseScalarTemplate(template);
         }
         else
         {
-            BufferAppendF(out, "$(%s)", BufferData(current_item));
+            ExpandScalarUncompiled(ctx, ns, scope, string, out);
         }
     }
 
-    BufferDestroy(current_item);
-
     LogDebug(LOG_MOD_EXPAND,
              "Expanded scalar '%s' to '%s' using %s namespace and %s scope.",
              string, BufferData(out), (ns == NULL) ? "current" : ns,
@@ -731,11 +1153,13 @@ void BundleResolvePromiseType(EvalContext *ctx, const Bundle *bundle, const char
         if (strcmp(section->promise_type, type) == 0)
         {
             EvalContextStackPushBundleSectionFrame(ctx, section);
+            CommandPrefetchSection(ctx, section);
             for (size_t i = 0; i < SeqLength(section->promises); i++)
             {
                 Promise *pp = SeqAt(section->promises, i);
                 ExpandPromise(ctx, pp, actuator, NULL);
             }
+            CommandPrefetchClear(section);
             EvalContextStackPopFrame(ctx);
         }
     }
@@ -1042,6 +1466,22 @@ static void ResolveControlBody(EvalContext *ctx, GenericAgentConfig *config,
             }
         }
 
+        if (StringEqual(lval, CFG_CONTROLBODY[COMMON_CONTROL_FUNCTION_CACHE_TTL].lval))
+        {
+            Log(LOG_LEVEL_VERBOSE, "SET function_cache_ttl %s",
+                RvalScalarValue(evaluated_rval));
+            long ttl = IntFromString(RvalScalarValue(evaluated_rval));
+            EvalContextSetFunctionCacheTTL(ctx, (ttl == CF_NOINT || ttl < 0) ? 0 : (int) ttl);
+        }
+
+        if (StringEqual(lval, CFG_CONTROLBODY[COMMON_CONTROL_CONCURRENT_FUNCTION_CALLS].lval))
+        {
+            Log(LOG_LEVEL_VERBOSE, "SET concurrent_function_calls %s",
+                RvalScalarValue(evaluated_rval));
+            long calls = IntFromString(RvalScalarValue(evaluated_rval));
+            EvalContextSetConcurrentFunctionCalls(ctx, (calls == CF_NOINT || calls < 0) ? 0 : (int) calls);
+        }
+
         RvalDestroy(evaluated_rval);
     }
 
@@ -1099,6 +1539,10 @@ static void ResolvePackageManagerBody(EvalContext *ctx, const Body *pm_body)
             assert(new_manager->module_path == NULL);
             new_manager->module_path = SafeStringDuplicate(RvalScalarValue(returnval));
         }
+        else if (strcmp(cp->lval, "persistent") == 0)
+        {
+            new_manager->persistent = BooleanFromString(RvalScalarValue(returnval));
+        }
         else
         {
             /* This should be handled by the parser. */
@@ -35,6 +35,8 @@
 #include <syntax.h>
 #include <audit.h>
 #include <cleanup.h>
+#include <function_cache.h>
+#include <conversion.h>                                        /* IntFromString */
 
 #define SIMULATE_SAFE_META_TAG "simulate_safe"
 
@@ -305,6 +307,35 @@ static FnCallResult CallFunction(EvalContext *ctx, const Policy *policy, const F
     return (*fncall_type->impl) (ctx, policy, fp, expargs);
 }
 
+/**
+ * @return minutes the result of #fp_type may be kept across agent runs, 0 if
+ *         it may not. The 'function_cache_ttl' of body common control is
+ *         overridden by a 'function_cache_ttl=<minutes>' meta tag.
+ */
+static int PersistentFunctionCacheTTL(EvalContext *ctx, const Policy *policy,
+                                      const FnCallType *fp_type, const Rlist *caller_meta)
+{
+    if (!(fp_type->options & FNCALL_OPTION_CACHED) ||
+        !EvalContextGetEvalOption(ctx, EVAL_OPTION_CACHE_SYSTEM_FUNCTIONS) ||
+        policy == NULL || policy->release_id == NULL)
+    {
+        return 0;
+    }
+
+    int ttl = EvalContextGetFunctionCacheTTL(ctx);
+    for (const Rlist *rp = caller_meta; rp != NULL; rp = rp->next)
+    {
+        if (rp->val.type == RVAL_TYPE_SCALAR &&
+            StringStartsWith(RlistScalarValue(rp), "function_cache_ttl="))
+        {
+            long value = IntFromString(RlistScalarValue(rp) + strlen("function_cache_ttl="));
+            ttl = (value == CF_NOINT || value < 0) ? 0 : (int) value;
+        }
+    }
+
+    return ttl;
+}
+
 FnCallResult FnCallEvaluate(EvalContext *ctx, const Policy *policy, FnCall *fp, const Promise *caller)
 {
     assert(ctx != NULL);
@@ -312,6 +343,9 @@ FnCallResult FnCallEvaluate(EvalContext *ctx, const Policy *policy, FnCall *fp,
     assert(fp != NULL);
     fp->caller = caller;
 
+    /* Functions read files, the system and other state that is not tracked */
+    EvalContextPromiseInputsUntracked(ctx);
+
     if (!EvalContextGetEvalOption(ctx, EVAL_OPTION_EVAL_FUNCTIONS))
     {
         Log(LOG_LEVEL_VERBOSE, "Skipping function '%s', because evaluation was turned off in the evaluator",
@@ -388,6 +422,10 @@ FnCallResult FnCallEvaluate(EvalContext *ctx, const Policy *policy, FnCall *fp,
         }
     }
 
+    /* Results of cached functions may also be kept across agent runs for
+     * 'function_cache_ttl' minutes, as long as the policy stays the same. */
+    const int persistent_ttl = PersistentFunctionCacheTTL(ctx, policy, fp_type, caller_meta);
+
     /* Call functions in promises with 'ifelapsed => "0"' (e.g. with
      * 'action => immediate') [ENT-7478] */
     const int if_elapsed = PromiseGetConstraintAsInt(ctx, "ifelapsed", caller);
@@ -410,6 +448,22 @@ FnCallResult FnCallEvaluate(EvalContext *ctx, const Policy *policy, FnCall *fp,
 
             return (FnCallResult) { FNCALL_SUCCESS, RvalCopy(cached_rval) };
         }
+
+        if (persistent_ttl > 0 &&
+            FunctionCacheGet(policy->release_id, fp->name, expargs, &cached_rval))
+        {
+            Log(LOG_LEVEL_VERBOSE,
+                "Using result of function '%s' cached by a previous run",
+                fp->name);
+            if (fncall_writer != NULL)
+            {
+                WriterClose(fncall_writer);
+            }
+            EvalContextFunctionCachePut(ctx, fp, expargs, &cached_rval);
+            RlistDestroy(expargs);
+
+            return (FnCallResult) { FNCALL_SUCCESS, cached_rval };
+        }
     }
 
     if (LogGetGlobalLevel() >= LOG_LEVEL_DEBUG)
@@ -441,6 +495,12 @@ FnCallResult FnCallEvaluate(EvalContext *ctx, const Policy *policy, FnCall *fp,
         WriterClose(w);
 
         EvalContextFunctionCachePut(ctx, fp, expargs, &result.rval);
+
+        if (persistent_ttl > 0)
+        {
+            FunctionCachePut(policy->release_id, fp->name, expargs,
+                             result.rval, (time_t) persistent_ttl * 60);
+        }
     }
 
     RlistDestroy(expargs);
@@ -0,0 +1,311 @@
+/*
+  Copyright 2024 Northern.tech AS
+
+  This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; version 3.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+#include <function_cache.h>
+
+#include <dbm_api.h>
+#include <cleanup.h>                              /* RegisterCleanupFunction */
+#include <logging.h>
+#include <mutex.h>                                            /* ThreadLock */
+#include <hash.h>
+#include <writer.h>
+#include <json.h>
+#include <string_lib.h>
+
+
+#define FUNCTION_CACHE_RELEASE_ID_MAX 256
+
+/*
+  The format of the function cache database is as follows:
+
+         Key:                    |  Value:
+  "<function>:<args digest>"     |  FunctionCacheEntry, followed by the
+                                 |  NUL-terminated result: a string for
+                                 |  scalars, JSON for lists and containers
+*/
+typedef struct
+{
+    int64_t expires;
+    int32_t rval_type;                                          /* RvalType */
+    char release_id[FUNCTION_CACHE_RELEASE_ID_MAX];
+} FunctionCacheEntry;
+
+static pthread_mutex_t function_cache_lock = PTHREAD_MUTEX_INITIALIZER; /* GLOBAL_T */
+
+/* All the following are protected by function_cache_lock. */
+static CF_DB *FUNCTION_CACHE_DB = NULL;                         /* GLOBAL_X */
+static bool FUNCTION_CACHE_DISABLED = false;                    /* GLOBAL_X */
+static FunctionCacheStats FUNCTION_CACHE_STATS = { 0 };         /* GLOBAL_X */
+
+/*******************************************************************/
+
+static void FunctionCacheCleanup(void)
+{
+    ThreadLock(&function_cache_lock);
+
+    if (FUNCTION_CACHE_STATS.hits + FUNCTION_CACHE_STATS.misses > 0)
+    {
+        Log(LOG_LEVEL_VERBOSE,
+            "Function cache: %zu hits, %zu misses (%zu expired)",
+            FUNCTION_CACHE_STATS.hits, FUNCTION_CACHE_STATS.misses,
+            FUNCTION_CACHE_STATS.expired);
+    }
+
+    if (FUNCTION_CACHE_DB != NULL)
+    {
+        CloseDB(FUNCTION_CACHE_DB);
+        FUNCTION_CACHE_DB = NULL;
+    }
+    /* Don't reopen it while exiting. */
+    FUNCTION_CACHE_DISABLED = true;
+
+    ThreadUnlock(&function_cache_lock);
+}
+
+/**
+ * @note Must be called with function_cache_lock held.
+ */
+static CF_DB *FunctionCacheDB(void)
+{
+    if (FUNCTION_CACHE_DB == NULL && !FUNCTION_CACHE_DISABLED)
+    {
+        if (OpenDB(&FUNCTION_CACHE_DB, dbid_functions))
+        {
+            RegisterCleanupFunction(&FunctionCacheCleanup);
+        }
+        else
+        {
+            Log(LOG_LEVEL_VERBOSE,
+                "Unable to open the function cache, functions will be called every time");
+            FUNCTION_CACHE_DB = NULL;
+            FUNCTION_CACHE_DISABLED = true;
+        }
+    }
+    return FUNCTION_CACHE_DB;
+}
+
+/**
+ * The arguments are digested as they are written, with their lengths so
+ * that different argument lists cannot write the same.
+ */
+static char *FunctionCacheKey(const char *name, const Rlist *args)
+{
+    Writer *w = StringWriter();
+    for (const Rlist *rp = args; rp != NULL; rp = rp->next)
+    {
+        if (rp->val.type == RVAL_TYPE_SCALAR)
+        {
+            const char *value = RvalScalarValue(rp->val);
+            WriterWriteF(w, "s%zu:%s", strlen(value), value);
+        }
+        else
+        {
+            char *value = RvalToString(rp->val);
+            WriterWriteF(w, "%c%zu:%s", (char) rp->val.type, strlen(value), value);
+            free(value);
+        }
+    }
+
+    unsigned char digest[EVP_MAX_MD_SIZE + 1] = { 0 };
+    HashString(StringWriterData(w), StringWriterLength(w), digest, HASH_METHOD_SHA256);
+    WriterClose(w);
+
+    char digest_str[CF_HOSTKEY_STRING_SIZE];
+    HashPrintSafe(digest_str, sizeof(digest_str), digest, HASH_METHOD_SHA256, false);
+
+    return StringFormat("%s:%s", name, digest_str);
+}
+
+static char *RvalSerialize(Rval rval)
+{
+    switch (rval.type)
+    {
+    case RVAL_TYPE_SCALAR:
+        return xstrdup(RvalScalarValue(rval));
+
+    case RVAL_TYPE_LIST:
+    case RVAL_TYPE_CONTAINER:
+    {
+        JsonElement *json = RvalToJson(rval);
+        Writer *w = StringWriter();
+        JsonWriteCompact(w, json);
+        JsonDestroy(json);
+        return StringWriterClose(w);
+    }
+
+    default:
+        return NULL;
+    }
+}
+
+static bool RvalDeserialize(RvalType type, const char *data, Rval *rval_out)
+{
+    if (type == RVAL_TYPE_SCALAR)
+    {
+        *rval_out = RvalNew(data, RVAL_TYPE_SCALAR);
+        return true;
+    }
+
+    JsonElement *json = NULL;
+    if (JsonParse(&data, &json) != JSON_PARSE_OK)
+    {
+        return false;
+    }
+
+    if (type == RVAL_TYPE_LIST)
+    {
+        *rval_out = (Rval) { RlistFromContainer(json), RVAL_TYPE_LIST };
+        JsonDestroy(json);
+    }
+    else
+    {
+        *rval_out = (Rval) { json, RVAL_TYPE_CONTAINER };
+    }
+    return true;
+}
+
+/*******************************************************************/
+
+bool FunctionCacheGet(const char *release_id, const char *name, const Rlist *args,
+                      Rval *rval_out)
+{
+    assert(release_id != NULL);
+    assert(name != NULL);
+    assert(rval_out != NULL);
+
+    char *key = FunctionCacheKey(name, args);
+    char *value = NULL;
+    bool expired = false;
+
+    ThreadLock(&function_cache_lock);
+    CF_DB *db = FunctionCacheDB();
+    if (db != NULL)
+    {
+        const int size = ValueSizeDB(db, key, strlen(key) + 1);
+        if (size > (int) sizeof(FunctionCacheEntry))
+        {
+            value = xmalloc(size);
+            if (!ReadDB(db, key, value, size) || value[size - 1] != '\0')
+            {
+                free(value);
+                value = NULL;
+            }
+        }
+
+        if (value != NULL)
+        {
+            FunctionCacheEntry entry;
+            memcpy(&entry, value, sizeof(entry));
+            entry.release_id[sizeof(entry.release_id) - 1] = '\0';
+
+            expired = (entry.expires <= (int64_t) time(NULL) ||
+                       !StringEqual(entry.release_id, release_id));
+            if (expired)
+            {
+                DeleteDB(db, key);
+                free(value);
+                value = NULL;
+            }
+        }
+    }
+
+    if (value != NULL)
+    {
+        FUNCTION_CACHE_STATS.hits++;
+    }
+    else
+    {
+        FUNCTION_CACHE_STATS.misses++;
+        if (expired)
+        {
+            FUNCTION_CACHE_STATS.expired++;
+        }
+    }
+    ThreadUnlock(&function_cache_lock);
+    free(key);
+
+    if (value == NULL)
+    {
+        return false;
+    }
+
+    FunctionCacheEntry entry;
+    memcpy(&entry, value, sizeof(entry));
+    bool found = RvalDeserialize(entry.rval_type, value + sizeof(entry), rval_out);
+    free(value);
+    return found;
+}
+
+void FunctionCachePut(const char *release_id, const char *name, const Rlist *args,
+                      Rval rval, time_t ttl)
+{
+    assert(release_id != NULL);
+    assert(name != NULL);
+
+    if (strlen(release_id) >= FUNCTION_CACHE_RELEASE_ID_MAX)
+    {
+        return;
+    }
+
+    char *data = RvalSerialize(rval);
+    if (data == NULL)
+    {
+        return;
+    }
+
+    FunctionCacheEntry entry = {
+        .expires = (int64_t) time(NULL) + ttl,
+        .rval_type = rval.type,
+    };
+    strlcpy(entry.release_id, release_id, sizeof(entry.release_id));
+
+    const size_t data_size = strlen(data) + 1;
+    const size_t size = sizeof(entry) + data_size;
+    char *value = xmalloc(size);
+    memcpy(value, &entry, sizeof(entry));
+    memcpy(value + sizeof(entry), data, data_size);
+    free(data);
+
+    char *key = FunctionCacheKey(name, args);
+
+    ThreadLock(&function_cache_lock);
+    CF_DB *db = FunctionCacheDB();
+    if (db != NULL && !WriteDB(db, key, value, size))
+    {
+        Log(LOG_LEVEL_VERBOSE, "Unable to store the result of function '%s' in the function cache",
+            name);
+    }
+    ThreadUnlock(&function_cache_lock);
+
+    free(key);
+    free(value);
+}
+
+void FunctionCacheGetStats(FunctionCacheStats *stats)
+{
+    assert(stats != NULL);
+
+    ThreadLock(&function_cache_lock);
+    *stats = FUNCTION_CACHE_STATS;
+    ThreadUnlock(&function_cache_lock);
+}
@@ -0,0 +1,66 @@
+/*
+  Copyright 2024 Northern.tech AS
+
+  This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; version 3.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#ifndef CFENGINE_FUNCTION_CACHE_H
+#define CFENGINE_FUNCTION_CACHE_H
+
+
+#include <platform.h>
+#include <rlist.h>                                           /* Rlist, Rval */
+
+
+/**
+ * Persistent cache of function results, in the "cf_functions" database of
+ * the state directory, so that the results of slow functions (execresult(),
+ * returnszero(), url_get(), ...) can be reused by later agent runs.
+ *
+ * An entry is keyed by the function name and a digest of its arguments,
+ * and holds the result, when it expires and the release ID of the policy
+ * that stored it. Entries stored by a different policy release or past
+ * their expiry are not returned.
+ */
+
+typedef struct
+{
+    size_t hits;
+    size_t misses;
+    size_t expired;                     /* found, but expired or stale */
+} FunctionCacheStats;
+
+/**
+ * @param rval_out set to a copy of the cached result, to be destroyed by
+ *                 the caller
+ */
+bool FunctionCacheGet(const char *release_id, const char *name, const Rlist *args,
+                      Rval *rval_out);
+
+/**
+ * @param ttl time to keep the result, in seconds
+ */
+void FunctionCachePut(const char *release_id, const char *name, const Rlist *args,
+                      Rval rval, time_t ttl);
+
+void FunctionCacheGetStats(FunctionCacheStats *stats);
+
+#endif
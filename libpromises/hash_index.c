@@ -0,0 +1,341 @@
+/*
+  Copyright 2024 Northern.tech AS
+
+  This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; version 3.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#include <hash_index.h>
+
+#include <cf3.defs.h>                                   /* SECONDS_PER_DAY */
+#include <dbm_api.h>
+#include <cleanup.h>                              /* RegisterCleanupFunction */
+#include <logging.h>
+#include <mutex.h>                                            /* ThreadLock */
+#include <string_lib.h>                                        /* StringEqual */
+
+
+/* Files changed more recently than that are not indexed. */
+#define HASH_INDEX_SETTLE_TIME 2                                   /* seconds */
+#define HASH_INDEX_MAX_AGE (7 * SECONDS_PER_DAY)   /* entries not hit, kept */
+#define HASH_INDEX_TOUCH_INTERVAL SECONDS_PER_DAY /* last_used granularity */
+#define HASH_INDEX_PRUNE_INTERVAL SECONDS_PER_DAY
+
+#define HASH_INDEX_PRUNE_HORIZON_KEY "prune_horizon"
+
+/*
+  The format of the hash index database is as follows:
+
+         Key:                    |  Value:
+  "<dev>:<inode>:<hash method>"  |  HashIndexEntry
+  "prune_horizon"                |  time_t, when the index was last pruned
+*/
+typedef struct
+{
+    int64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    int64_t last_used;                              /* seconds, last hit */
+    uint32_t digest_len;
+    unsigned char digest[EVP_MAX_MD_SIZE];
+} HashIndexEntry;
+
+/* Only replaced by tests, before any file is hashed. */
+static time_t (*HASH_INDEX_CLOCK)(time_t *) = time;              /* GLOBAL_P */
+
+static pthread_mutex_t hash_index_lock = PTHREAD_MUTEX_INITIALIZER; /* GLOBAL_T */
+
+/* All the following are protected by hash_index_lock. */
+static CF_DB *HASH_INDEX_DB = NULL;                             /* GLOBAL_X */
+static bool HASH_INDEX_DISABLED = false;                        /* GLOBAL_X */
+static HashIndexStats HASH_INDEX_STATS = { 0 };                 /* GLOBAL_X */
+
+/*******************************************************************/
+
+static int64_t MtimeNs(const struct stat *sb)
+{
+#if defined(HAVE_STRUCT_STAT_ST_MTIM)
+    return (int64_t) sb->st_mtim.tv_sec * 1000000000 + sb->st_mtim.tv_nsec;
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC)
+    return (int64_t) sb->st_mtimespec.tv_sec * 1000000000 +
+        sb->st_mtimespec.tv_nsec;
+#else
+    return (int64_t) sb->st_mtime * 1000000000;
+#endif
+}
+
+static int64_t CtimeNs(const struct stat *sb)
+{
+#if defined(HAVE_STRUCT_STAT_ST_MTIM)
+    return (int64_t) sb->st_ctim.tv_sec * 1000000000 + sb->st_ctim.tv_nsec;
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC)
+    return (int64_t) sb->st_ctimespec.tv_sec * 1000000000 +
+        sb->st_ctimespec.tv_nsec;
+#else
+    return (int64_t) sb->st_ctime * 1000000000;
+#endif
+}
+
+static bool SameFileVersion(const struct stat *a, const struct stat *b)
+{
+    return (a->st_dev == b->st_dev &&
+            a->st_ino == b->st_ino &&
+            a->st_size == b->st_size &&
+            MtimeNs(a) == MtimeNs(b) &&
+            CtimeNs(a) == CtimeNs(b));
+}
+
+static void HashIndexCleanup(void)
+{
+    ThreadLock(&hash_index_lock);
+
+    const size_t total = HASH_INDEX_STATS.hits + HASH_INDEX_STATS.misses;
+    if (total > 0)
+    {
+        Log(LOG_LEVEL_VERBOSE,
+            "Hash index: %zu hits, %zu misses (%.1f%% hit ratio)",
+            HASH_INDEX_STATS.hits, HASH_INDEX_STATS.misses,
+            100.0 * HASH_INDEX_STATS.hits / total);
+    }
+
+    if (HASH_INDEX_DB != NULL)
+    {
+        CloseDB(HASH_INDEX_DB);
+        HASH_INDEX_DB = NULL;
+    }
+    /* Don't reopen it while exiting. */
+    HASH_INDEX_DISABLED = true;
+
+    ThreadUnlock(&hash_index_lock);
+}
+
+/**
+ * Remove the entries not hit for HASH_INDEX_MAX_AGE: files that were
+ * deleted, replaced or just not hashed anymore. At most once per
+ * HASH_INDEX_PRUNE_INTERVAL, by whichever agent opens the index first.
+ *
+ * @note Must be called with hash_index_lock held.
+ */
+static void HashIndexPrune(CF_DB *db)
+{
+    const time_t now = HASH_INDEX_CLOCK(NULL);
+
+    time_t horizon = 0;
+    if (ReadDB(db, HASH_INDEX_PRUNE_HORIZON_KEY, &horizon, sizeof(horizon)) &&
+        now - horizon < HASH_INDEX_PRUNE_INTERVAL)
+    {
+        return;
+    }
+
+    DBCursor *cursor;
+    if (!NewDBCursor(db, &cursor))
+    {
+        Log(LOG_LEVEL_VERBOSE, "Unable to get cursor to prune the hash index");
+        return;
+    }
+
+    size_t pruned = 0;
+    char *key;
+    int ksize, vsize;
+    void *value;
+    while (NextDB(cursor, &key, &ksize, &value, &vsize))
+    {
+        if (StringEqual(key, HASH_INDEX_PRUNE_HORIZON_KEY))
+        {
+            continue;
+        }
+
+        /* Entries of another size were written by another version. */
+        HashIndexEntry entry;
+        if (vsize != sizeof(entry))
+        {
+            DBCursorDeleteEntry(cursor);
+            pruned++;
+            continue;
+        }
+
+        memcpy(&entry, value, sizeof(entry));
+        if (entry.last_used < (int64_t) now - HASH_INDEX_MAX_AGE)
+        {
+            DBCursorDeleteEntry(cursor);
+            pruned++;
+        }
+    }
+    DeleteDBCursor(cursor);
+
+    Log(LOG_LEVEL_VERBOSE, "Pruned %zu unused entries from the hash index",
+        pruned);
+
+    horizon = now;
+    WriteDB(db, HASH_INDEX_PRUNE_HORIZON_KEY, &horizon, sizeof(horizon));
+}
+
+/**
+ * The database is opened on first use and kept open, closing it on every
+ * lookup would cost more than hashing most files.
+ *
+ * @note Must be called with hash_index_lock held.
+ */
+static CF_DB *HashIndexDB(void)
+{
+    if (HASH_INDEX_DB == NULL && !HASH_INDEX_DISABLED)
+    {
+        if (OpenDB(&HASH_INDEX_DB, dbid_hashes))
+        {
+            RegisterCleanupFunction(&HashIndexCleanup);
+            HashIndexPrune(HASH_INDEX_DB);
+        }
+        else
+        {
+            Log(LOG_LEVEL_VERBOSE,
+                "Unable to open the hash index, files will be hashed every time");
+            HASH_INDEX_DB = NULL;
+            HASH_INDEX_DISABLED = true;
+        }
+    }
+    return HASH_INDEX_DB;
+}
+
+static void IndexKey(char *key, size_t key_size, const struct stat *sb,
+                     HashMethod type)
+{
+    xsnprintf(key, key_size, "%ju:%ju:%s",
+              (uintmax_t) sb->st_dev, (uintmax_t) sb->st_ino,
+              HashNameFromId(type));
+}
+
+static bool IndexLookup(const struct stat *sb, HashMethod type,
+                        unsigned char digest[EVP_MAX_MD_SIZE + 1])
+{
+    char key[128];
+    IndexKey(key, sizeof(key), sb, type);
+
+    HashIndexEntry entry = { 0 };
+    bool found = false;
+
+    ThreadLock(&hash_index_lock);
+    CF_DB *db = HashIndexDB();
+    if (db != NULL && ReadDB(db, key, &entry, sizeof(entry)))
+    {
+        found = (entry.size == (int64_t) sb->st_size &&
+                 entry.mtime_ns == MtimeNs(sb) &&
+                 entry.ctime_ns == CtimeNs(sb) &&
+                 entry.digest_len == (uint32_t) HashSizeFromId(type));
+    }
+    if (found)
+    {
+        HASH_INDEX_STATS.hits++;
+
+        /* Keep it from being pruned, without a write on every hit. */
+        const time_t now = HASH_INDEX_CLOCK(NULL);
+        if (entry.last_used < (int64_t) now - HASH_INDEX_TOUCH_INTERVAL)
+        {
+            entry.last_used = now;
+            WriteDB(db, key, &entry, sizeof(entry));
+        }
+    }
+    else
+    {
+        HASH_INDEX_STATS.misses++;
+    }
+    ThreadUnlock(&hash_index_lock);
+
+    if (found)
+    {
+        memcpy(digest, entry.digest, entry.digest_len);
+    }
+    return found;
+}
+
+static void IndexStore(const struct stat *sb, HashMethod type,
+                       const unsigned char digest[EVP_MAX_MD_SIZE + 1])
+{
+    char key[128];
+    IndexKey(key, sizeof(key), sb, type);
+
+    HashIndexEntry entry = {
+        .size = sb->st_size,
+        .mtime_ns = MtimeNs(sb),
+        .ctime_ns = CtimeNs(sb),
+        .last_used = HASH_INDEX_CLOCK(NULL),
+        .digest_len = HashSizeFromId(type),
+    };
+    memcpy(entry.digest, digest, entry.digest_len);
+
+    ThreadLock(&hash_index_lock);
+    CF_DB *db = HashIndexDB();
+    if (db != NULL && !WriteDB(db, key, &entry, sizeof(entry)))
+    {
+        Log(LOG_LEVEL_VERBOSE, "Unable to store digest in the hash index");
+    }
+    ThreadUnlock(&hash_index_lock);
+}
+
+/*******************************************************************/
+
+void HashFileIndexed(const char *filename,
+                     unsigned char digest[EVP_MAX_MD_SIZE + 1],
+                     HashMethod type)
+{
+    assert(filename != NULL);
+    assert(digest != NULL);
+
+    struct stat before;
+    if (stat(filename, &before) == -1 || !S_ISREG(before.st_mode))
+    {
+        HashFile(filename, digest, type, false);
+        return;
+    }
+
+    if (IndexLookup(&before, type, digest))
+    {
+        Log(LOG_LEVEL_DEBUG, "Digest of '%s' found in the hash index",
+            filename);
+        return;
+    }
+
+    HashFile(filename, digest, type, false);
+
+    /* Only index what we're sure we hashed: a file that didn't change
+     * while we read it, and that is not going to change within the same
+     * timestamp tick. */
+    struct stat after;
+    const time_t changed = MAX(before.st_mtime, before.st_ctime);
+    if (stat(filename, &after) == 0 && SameFileVersion(&before, &after) &&
+        HASH_INDEX_CLOCK(NULL) >= changed + HASH_INDEX_SETTLE_TIME)
+    {
+        IndexStore(&after, type, digest);
+    }
+}
+
+void HashIndexGetStats(HashIndexStats *stats)
+{
+    assert(stats != NULL);
+
+    ThreadLock(&hash_index_lock);
+    *stats = HASH_INDEX_STATS;
+    ThreadUnlock(&hash_index_lock);
+}
+
+void HashIndexSetClock(time_t (*clock)(time_t *))
+{
+    assert(clock != NULL);
+    HASH_INDEX_CLOCK = clock;
+}
@@ -0,0 +1,71 @@
+/*
+  Copyright 2024 Northern.tech AS
+
+  This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; version 3.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#ifndef CFENGINE_HASH_INDEX_H
+#define CFENGINE_HASH_INDEX_H
+
+
+#include <platform.h>
+#include <hash.h>                                           /* HashMethod */
+
+
+/**
+ * Persistent index of file content digests, in the "cf_hashes" database of
+ * the state directory, shared by all the agents of the host.
+ *
+ * An entry is keyed by device, inode and hash method, and holds the size,
+ * mtime and ctime (with nanoseconds where available) the file had when it
+ * was hashed. If the file still has them, the stored digest is returned
+ * without reading the file.
+ *
+ * Files modified less than two seconds ago are hashed but not indexed,
+ * since they may change again without their timestamps moving.
+ *
+ * Entries not hit for a week are pruned, at most once a day, when an agent
+ * first opens the index.
+ */
+
+typedef struct
+{
+    size_t hits;
+    size_t misses;                                  /* file had to be read */
+} HashIndexStats;
+
+/**
+ * Like HashFile(filename, digest, type, false), using the index for regular
+ * files.
+ */
+void HashFileIndexed(const char *filename,
+                     unsigned char digest[EVP_MAX_MD_SIZE + 1],
+                     HashMethod type);
+
+void HashIndexGetStats(HashIndexStats *stats);
+
+/**
+ * For tests: the clock deciding whether a file is settled and how old
+ * entries are, time() by default. Must be set before hashing any file.
+ */
+void HashIndexSetClock(time_t (*clock)(time_t *));
+
+#endif
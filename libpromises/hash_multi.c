@@ -0,0 +1,112 @@
+/*
+  Copyright 2024 Northern.tech AS
+
+  This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; version 3.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#include <hash_multi.h>
+
+#include <alloc.h>
+#include <file_lib.h>                                          /* safe_open */
+#include <logging.h>
+
+
+#define HASH_MULTI_BUFSIZE (128 * 1024)
+
+bool HashFileMulti(const char *filename, size_t count,
+                   const HashMethod types[],
+                   unsigned char digests[][EVP_MAX_MD_SIZE + 1])
+{
+    assert(filename != NULL);
+    assert(count > 0 && count <= HASH_MULTI_MAX_METHODS);
+    assert(types != NULL);
+    assert(digests != NULL);
+
+    EVP_MD_CTX *contexts[HASH_MULTI_MAX_METHODS] = { NULL };
+    for (size_t i = 0; i < count; i++)
+    {
+        const EVP_MD *md = HashDigestFromId(types[i]);
+        contexts[i] = EVP_MD_CTX_new();
+        if (md == NULL || contexts[i] == NULL ||
+            EVP_DigestInit(contexts[i], md) != 1)
+        {
+            Log(LOG_LEVEL_ERR, "Could not initialize %s hash context",
+                HashNameFromId(types[i]));
+            for (size_t j = 0; j <= i; j++)
+            {
+                EVP_MD_CTX_free(contexts[j]);
+            }
+            return false;
+        }
+    }
+
+    int fd = safe_open(filename, O_RDONLY | O_BINARY);
+    if (fd == -1)
+    {
+        Log(LOG_LEVEL_ERR, "Cannot open file for hashing '%s'. (open: %s)",
+            filename, GetErrorStr());
+        for (size_t i = 0; i < count; i++)
+        {
+            EVP_MD_CTX_free(contexts[i]);
+        }
+        return false;
+    }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    char *buffer = xmalloc(HASH_MULTI_BUFSIZE);
+    bool success = true;
+    ssize_t n_read;
+    while ((n_read = read(fd, buffer, HASH_MULTI_BUFSIZE)) != 0)
+    {
+        if (n_read == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            Log(LOG_LEVEL_ERR, "Cannot read file for hashing '%s'. (read: %s)",
+                filename, GetErrorStr());
+            success = false;
+            break;
+        }
+
+        for (size_t i = 0; i < count; i++)
+        {
+            EVP_DigestUpdate(contexts[i], buffer, n_read);
+        }
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (success)
+        {
+            EVP_DigestFinal(contexts[i], digests[i], NULL);
+        }
+        EVP_MD_CTX_free(contexts[i]);
+    }
+
+    free(buffer);
+    close(fd);
+    return success;
+}
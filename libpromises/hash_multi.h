@@ -0,0 +1,50 @@
+/*
+  Copyright 2024 Northern.tech AS
+
+  This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; version 3.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#ifndef CFENGINE_HASH_MULTI_H
+#define CFENGINE_HASH_MULTI_H
+
+
+#include <platform.h>
+#include <hash.h>                                           /* HashMethod */
+
+
+#define HASH_MULTI_MAX_METHODS 4
+
+/**
+ * Compute several digests of a file in a single pass, every block read
+ * being fed to all the hash functions.
+ *
+ * Gives the same digests as calling HashFile(filename, digests[i],
+ * types[i], false) for each method, reading the file once.
+ *
+ * @param count Number of methods, at most HASH_MULTI_MAX_METHODS
+ * @return false if the file could not be read, in which case #digests are
+ *         left untouched
+ */
+bool HashFileMulti(const char *filename, size_t count,
+                   const HashMethod types[],
+                   unsigned char digests[][EVP_MAX_MD_SIZE + 1]);
+
+#endif
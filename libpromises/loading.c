@@ -39,6 +39,7 @@
 #include <ornaments.h>
 #include <policy.h>
 #include <cleanup.h>
+#include <policy_cache.h>
 
 // TODO: remove
 #include <vars.h>                                         /* IsCf3VarString */
@@ -52,11 +53,43 @@ static Policy *LoadPolicyFile(EvalContext *ctx, GenericAgentConfig *config, cons
 
 
 
-/*
- * The difference between filename and input_input file is that the latter is the file specified by -f or
- * equivalently the file containing body common control. This will hopefully be squashed in later refactoring.
+static void HashPolicyFile(const char *policy_file, char hashbuffer[CF_HOSTKEY_STRING_SIZE])
+{
+    unsigned char digest[EVP_MAX_MD_SIZE + 1] = { 0 };
+
+    HashFile(policy_file, digest, CF_DEFAULT_DIGEST, false);
+    HashPrintSafe(hashbuffer, CF_HOSTKEY_STRING_SIZE, digest,
+                  CF_DEFAULT_DIGEST, true);
+}
+
+/**
+ * Store #policy parsed from #input_path in the policy cache, unless the file
+ * changed since #hash was computed, as the parser may then have read other
+ * contents than the ones hashed.
  */
-Policy *Cf3ParseFile(const GenericAgentConfig *config, const char *input_path)
+static void StoreParsedPolicy(const GenericAgentConfig *config, const char *input_path,
+                              const char *hash, const Policy *policy)
+{
+    char hash_after[CF_HOSTKEY_STRING_SIZE] = { 0 };
+    HashPolicyFile(input_path, hash_after);
+
+    if (StringEqual(hash, hash_after))
+    {
+        PolicyCacheStore(hash, config->agent_type, policy);
+    }
+    else
+    {
+        Log(LOG_LEVEL_VERBOSE, "Not caching policy file '%s', it changed while being parsed",
+            input_path);
+    }
+}
+
+/**
+ * @param hash digest of the contents of #input_path, to look up and store
+ *             the parsed policy in the policy cache, or %NULL
+ */
+static Policy *ParsePolicyFile(const GenericAgentConfig *config, const char *input_path,
+                               const char *hash)
 {
     struct stat statbuf;
 
@@ -129,15 +162,27 @@ Policy *Cf3ParseFile(const GenericAgentConfig *config, const char *input_path)
         JsonDestroy(json_policy);
         WriterClose(contents);
     }
+    else if (config->agent_type == AGENT_TYPE_COMMON)
+    {
+        /* Always parsed, for the parser warnings. */
+        policy = ParserParseFile(config->agent_type, input_path, config->agent_specific.common.parser_warnings, config->agent_specific.common.parser_warnings_error);
+    }
     else
     {
-        if (config->agent_type == AGENT_TYPE_COMMON)
+        if (hash != NULL)
         {
-            policy = ParserParseFile(config->agent_type, input_path, config->agent_specific.common.parser_warnings, config->agent_specific.common.parser_warnings_error);
+            policy = PolicyCacheLoad(hash, config->agent_type, input_path);
+            if (policy != NULL)
+            {
+                Log(LOG_LEVEL_VERBOSE, "END   parsing file: %s (unchanged, loaded from the policy cache)", input_path);
+                return policy;
+            }
         }
-        else
+
+        policy = ParserParseFile(config->agent_type, input_path, 0, 0);
+        if (policy != NULL && hash != NULL)
         {
-            policy = ParserParseFile(config->agent_type, input_path, 0, 0);
+            StoreParsedPolicy(config, input_path, hash, policy);
         }
     }
 
@@ -145,6 +190,15 @@ Policy *Cf3ParseFile(const GenericAgentConfig *config, const char *input_path)
     return policy;
 }
 
+/*
+ * The difference between filename and input_input file is that the latter is the file specified by -f or
+ * equivalently the file containing body common control. This will hopefully be squashed in later refactoring.
+ */
+Policy *Cf3ParseFile(const GenericAgentConfig *config, const char *input_path)
+{
+    return ParsePolicyFile(config, input_path, NULL);
+}
+
 static Policy *LoadPolicyInputFiles(EvalContext *ctx, GenericAgentConfig *config, const Rlist *inputs,
                                     StringMap *policy_files_hashes, StringSet *parsed_files_checksums,
                                     StringSet *failed_files)
@@ -315,12 +369,8 @@ static Policy *LoadPolicyFile(EvalContext *ctx, GenericAgentConfig *config, cons
                               StringMap *policy_files_hashes, StringSet *parsed_files_checksums,
                               StringSet *failed_files)
 {
-    unsigned char digest[EVP_MAX_MD_SIZE + 1] = { 0 };
     char hashbuffer[CF_HOSTKEY_STRING_SIZE] = { 0 };
-
-    HashFile(policy_file, digest, CF_DEFAULT_DIGEST, false);
-    HashPrintSafe(hashbuffer, sizeof(hashbuffer), digest,
-                  CF_DEFAULT_DIGEST, true);
+    HashPolicyFile(policy_file, hashbuffer);
 
     Log(LOG_LEVEL_DEBUG, "Hashed policy file %s to %s", policy_file, hashbuffer);
 
@@ -340,7 +390,7 @@ static Policy *LoadPolicyFile(EvalContext *ctx, GenericAgentConfig *config, cons
         Log(LOG_LEVEL_DEBUG, "Loading policy file %s", policy_file);
     }
 
-    Policy *policy = Cf3ParseFile(config, policy_file);
+    Policy *policy = ParsePolicyFile(config, policy_file, hashbuffer);
 
     StringMapInsert(policy_files_hashes, xstrdup(policy_file), xstrdup(hashbuffer));
     StringSetAdd(parsed_files_checksums, xstrdup(hashbuffer));
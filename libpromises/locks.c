@@ -40,6 +40,7 @@
 #include <misc_lib.h>
 #include <known_dirs.h>
 #include <sysinfo.h>
+#include <map.h>
 #include <openssl/evp.h>
 
 #ifdef LMDB
@@ -195,8 +196,197 @@ static bool WriteLockDataCurrent(CF_DB *dbp, const char *lock_id)
     return WriteLockData(dbp, lock_id, &lock_data);
 }
 
-static int WriteLock(const char *name)
+static void DeleteLockData(CF_DB *dbp, const char *lock_id)
 {
+#ifdef LMDB
+    unsigned char digest2[LMDB_MAX_KEY_SIZE];
+
+    HashLockKeyIfNecessary(lock_id, digest2);
+
+    LOG_LOCK_ENTRY(lock_id, digest2, NULL);
+    DeleteDB(dbp, digest2);
+    LOG_LOCK_EXIT(lock_id, digest2, NULL);
+#else
+    DeleteDB(dbp, lock_id);
+#endif
+}
+
+/*
+ * Lock journal (body agent control lock_journal).
+ *
+ * While a top-level bundle is evaluated, the last.* entries written for
+ * its promises with ifelapsed => "0" are kept in memory and applied to the
+ * database in a single transaction when the bundle ends, instead of one
+ * transaction each. They are lost if the agent dies before the bundle ends,
+ * which doesn't matter since such promises are run regardless of when they
+ * were last run. The last.* entries of all other promises, and the lock.*
+ * entries, which keep other agents from running the same promises at the
+ * same time, are still written right away.
+ */
+
+typedef struct
+{
+    LockData data;
+} LockJournalEntry;
+
+TYPED_MAP_DECLARE(LockJournal, char *, LockJournalEntry *)
+
+TYPED_MAP_DEFINE(LockJournal, char *, LockJournalEntry *,
+                 StringHash_untyped,
+                 StringEqual_untyped,
+                 free,
+                 free)
+
+static bool LOCK_JOURNAL_ENABLED = false;                         /* GLOBAL_X */
+static int LOCK_JOURNAL_DEPTH = 0;                                /* GLOBAL_X */
+static LockJournalMap *LOCK_JOURNAL = NULL;                       /* GLOBAL_X */
+static time_t LOCK_JOURNAL_START_TIME = PROCESS_START_TIME_UNKNOWN; /* GLOBAL_X */
+static pthread_once_t lock_journal_cleanup_once = PTHREAD_ONCE_INIT; /* GLOBAL_X */
+
+static void LockJournalFlush(void);
+
+static void LockJournalCleanup(void)
+{
+    /* Locks yielded by later cleanup functions go straight to the DB. */
+    LockJournalFlush();
+    LOCK_JOURNAL_ENABLED = false;
+}
+
+static void RegisterLockJournalCleanup(void)
+{
+    RegisterCleanupFunction(&LockJournalCleanup);
+}
+
+/**
+ * @return the entry kept for @lock_id, or NULL if the journal is not in use
+ *         or has nothing about it
+ * @note Called with cft_lock held.
+ */
+static LockJournalEntry *LockJournalGet(const char *lock_id)
+{
+    if (LOCK_JOURNAL == NULL)
+    {
+        return NULL;
+    }
+    return LockJournalMapGet(LOCK_JOURNAL, lock_id);
+}
+
+/**
+ * Keep a write of the last.* entry @lock_id in the journal.
+ *
+ * @return false if the journal is not in use
+ */
+static bool LockJournalKeep(const char *lock_id, const LockData *data)
+{
+    assert(data != NULL);
+    assert(StringStartsWith(lock_id, "last."));
+
+    if (!LOCK_JOURNAL_ENABLED || (LOCK_JOURNAL_DEPTH == 0))
+    {
+        return false;
+    }
+
+    ThreadLock(cft_lock);
+    if (LOCK_JOURNAL == NULL)
+    {
+        LOCK_JOURNAL = LockJournalMapNew();
+        pthread_once(&lock_journal_cleanup_once, &RegisterLockJournalCleanup);
+    }
+
+    LockJournalEntry *entry = LockJournalGet(lock_id);
+    if (entry == NULL)
+    {
+        entry = xcalloc(1, sizeof(LockJournalEntry));
+        LockJournalMapInsert(LOCK_JOURNAL, xstrdup(lock_id), entry);
+    }
+    entry->data = *data;
+    ThreadUnlock(cft_lock);
+
+    return true;
+}
+
+/**
+ * Apply everything kept in the journal in one transaction.
+ */
+static void LockJournalFlush(void)
+{
+    if (LOCK_JOURNAL == NULL)
+    {
+        return;
+    }
+
+    CF_DB *dbp = OpenLock();
+    if (dbp == NULL)
+    {
+        Log(LOG_LEVEL_ERR, "Failed to open lock database to write the lock journal");
+        return;
+    }
+
+    ThreadLock(cft_lock);
+    size_t count = 0;
+    MapIterator it = MapIteratorInit(LOCK_JOURNAL->impl);
+    MapKeyValue *item;
+    while ((item = MapIteratorNext(&it)) != NULL)
+    {
+        LockJournalEntry *entry = item->value;
+        WriteLockData(dbp, item->key, &(entry->data));
+        count++;
+    }
+
+    LockJournalMapDestroy(LOCK_JOURNAL);
+    LOCK_JOURNAL = NULL;
+    CloseLock(dbp);
+    ThreadUnlock(cft_lock);
+
+    Log(LOG_LEVEL_DEBUG, "Wrote %zu lock journal entries", count);
+}
+
+void LocksSetJournal(bool enabled)
+{
+    if (!enabled)
+    {
+        LockJournalFlush();
+    }
+    else if (LOCK_JOURNAL_START_TIME == PROCESS_START_TIME_UNKNOWN)
+    {
+        LOCK_JOURNAL_START_TIME = GetProcessStartTime(getpid());
+    }
+    LOCK_JOURNAL_ENABLED = enabled;
+}
+
+void LocksJournalBegin(void)
+{
+    LOCK_JOURNAL_DEPTH++;
+}
+
+void LocksJournalEnd(void)
+{
+    assert(LOCK_JOURNAL_DEPTH > 0);
+    LOCK_JOURNAL_DEPTH--;
+    if (LOCK_JOURNAL_DEPTH == 0)
+    {
+        LockJournalFlush();
+    }
+}
+
+/**
+ * @param journal whether the write may be kept in the lock journal, only
+ *                for last.* entries whose loss in a crash doesn't matter
+ */
+static int WriteLock(const char *name, bool journal)
+{
+    if (journal)
+    {
+        LockData lock_data = { 0 };
+        lock_data.pid = getpid();
+        lock_data.time = time(NULL);
+        lock_data.process_start_time = LOCK_JOURNAL_START_TIME;
+        if (LockJournalKeep(name, &lock_data))
+        {
+            return 0;
+        }
+    }
+
     CF_DB *dbp = OpenLock();
 
     if (dbp == NULL)
@@ -206,6 +396,11 @@ static int WriteLock(const char *name)
 
     ThreadLock(cft_lock);
     WriteLockDataCurrent(dbp, name);
+    if (LOCK_JOURNAL != NULL)
+    {
+        /* An older time kept for it would hide this one. */
+        LockJournalMapRemove(LOCK_JOURNAL, name);
+    }
 
     CloseLock(dbp);
     ThreadUnlock(cft_lock);
@@ -216,6 +411,17 @@ static int WriteLock(const char *name)
 static time_t FindLockTime(const char *name)
 {
     bool ret;
+
+    ThreadLock(cft_lock);
+    const LockJournalEntry *kept = LockJournalGet(name);
+    if (kept != NULL)
+    {
+        time_t kept_time = kept->data.time;
+        ThreadUnlock(cft_lock);
+        return kept_time;
+    }
+    ThreadUnlock(cft_lock);
+
     CF_DB *dbp = OpenLock();
     if (dbp == NULL)
     {
@@ -324,23 +530,219 @@ static int RemoveLock(const char *name)
     }
 
     ThreadLock(cft_lock);
-#ifdef LMDB
-    unsigned char digest2[LMDB_MAX_KEY_SIZE];
-
-    HashLockKeyIfNecessary(name, digest2);
-
-    LOG_LOCK_ENTRY(name, digest2, NULL);
-    DeleteDB(dbp, digest2);
-    LOG_LOCK_EXIT(name, digest2, NULL);
-#else
-    DeleteDB(dbp, name);
-#endif
+    DeleteLockData(dbp, name);
     ThreadUnlock(cft_lock);
 
     CloseLock(dbp);
     return 0;
 }
 
+#ifndef __MINGW32__
+
+/* A critical section is an exclusive lock on a file in the state
+ * directory, which the kernel drops when the holder exits, however it
+ * exits. Such locks belong to the whole process, so the threads of one
+ * process are kept apart by the CRITICAL_SECTIONS list. */
+
+/* If the holder has been in the section for more than a minute, it is
+ * likely stuck, so we take our chances after that long. */
+#define CRITICAL_SECTION_MAX_WAIT 60
+
+typedef struct CriticalSection_
+{
+    char *id;
+    FileLock lock;                             /* fd -1 if entered forcibly */
+    struct CriticalSection_ *next;
+} CriticalSection;
+
+/* Waits for a file lock in a thread of its own, cancelled if it takes too
+ * long, so that the section is entered as soon as the holder leaves it. */
+typedef struct
+{
+    FileLock *lock;
+    bool done;                        /* protected by CRITICAL_SECTIONS_LOCK */
+    bool locked;
+} CriticalSectionWaiter;
+
+static pthread_mutex_t CRITICAL_SECTIONS_LOCK = PTHREAD_MUTEX_INITIALIZER; /* GLOBAL_T */
+static pthread_cond_t CRITICAL_SECTION_LEFT = PTHREAD_COND_INITIALIZER;   /* GLOBAL_T */
+static pthread_cond_t CRITICAL_SECTION_LOCKED = PTHREAD_COND_INITIALIZER; /* GLOBAL_T */
+static CriticalSection *CRITICAL_SECTIONS = NULL;                         /* GLOBAL_X */
+
+/**
+ * @return the link to the section entered by this process, or to the
+ *         terminating NULL if there is none
+ * @note Called with CRITICAL_SECTIONS_LOCK held.
+ */
+static CriticalSection **FindCriticalSection(const char *section_id)
+{
+    CriticalSection **cs = &CRITICAL_SECTIONS;
+    while (*cs != NULL && strcmp((*cs)->id, section_id) != 0)
+    {
+        cs = &((*cs)->next);
+    }
+    return cs;
+}
+
+/* Named after a digest of the exact id: sections sharing a file would share
+ * the lock, and leaving one of them would release the other. */
+static int OpenCriticalSectionFile(const char *section_id)
+{
+    unsigned char digest[EVP_MAX_MD_SIZE + 1] = { 0 };
+    HashString(section_id, strlen(section_id), digest, HASH_METHOD_SHA256);
+
+    char digest_str[CF_HOSTKEY_STRING_SIZE];
+    HashPrintSafe(digest_str, sizeof(digest_str), digest, HASH_METHOD_SHA256, false);
+
+    char name[CF_HOSTKEY_STRING_SIZE + sizeof("critical_section_.lock")];
+    xsnprintf(name, sizeof(name), "critical_section_%s.lock", digest_str);
+
+    char path[PATH_MAX];
+    NDEBUG_UNUSED size_t ret = StringCopy(GetStateDir(), path, sizeof(path));
+    assert(ret < sizeof(path));
+    if (JoinPaths(path, sizeof(path), name) == NULL)
+    {
+        Log(LOG_LEVEL_CRIT, "Path to critical section lock '%s' too long", section_id);
+        return -1;
+    }
+
+    int fd = safe_open(path, O_CREAT | O_RDWR);
+    if (fd == -1)
+    {
+        Log(LOG_LEVEL_CRIT, "Failed to open critical section lock file '%s' (open: %s)",
+            path, GetErrorStr());
+    }
+    return fd;
+}
+
+static void *CriticalSectionWaiterRoutine(void *arg)
+{
+    CriticalSectionWaiter *waiter = arg;
+
+    /* Blocks in fcntl(F_SETLKW), where the thread is cancelled on timeout. */
+    const bool locked = (ExclusiveFileLock(waiter->lock, true) == 0);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    ThreadLock(&CRITICAL_SECTIONS_LOCK);
+    waiter->locked = locked;
+    waiter->done = true;
+    pthread_cond_broadcast(&CRITICAL_SECTION_LOCKED);
+    ThreadUnlock(&CRITICAL_SECTIONS_LOCK);
+
+    return NULL;
+}
+
+/**
+ * Take #lock, waiting for at most CRITICAL_SECTION_MAX_WAIT seconds.
+ */
+static bool LockCriticalSectionFile(FileLock *lock)
+{
+    if (ExclusiveFileLock(lock, false) == 0)
+    {
+        return true;
+    }
+
+    CriticalSectionWaiter waiter = { .lock = lock, .done = false, .locked = false };
+    pthread_t thread;
+    int ret = pthread_create(&thread, NULL, CriticalSectionWaiterRoutine, &waiter);
+    if (ret != 0)
+    {
+        Log(LOG_LEVEL_ERR,
+            "Failed to create thread to wait for critical section lock (pthread_create: %s)",
+            GetErrorStrFromCode(ret));
+        return false;
+    }
+
+    const time_t deadline = time(NULL) + CRITICAL_SECTION_MAX_WAIT;
+    ThreadLock(&CRITICAL_SECTIONS_LOCK);
+    while (!waiter.done)
+    {
+        const time_t now = time(NULL);
+        if (now >= deadline ||
+            ThreadWait(&CRITICAL_SECTION_LOCKED, &CRITICAL_SECTIONS_LOCK,
+                       deadline - now) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+    const bool done = waiter.done;
+    ThreadUnlock(&CRITICAL_SECTIONS_LOCK);
+
+    if (!done)
+    {
+        pthread_cancel(thread);
+    }
+    pthread_join(thread, NULL);
+
+    /* Set if the lock was taken before the thread could be cancelled. */
+    return waiter.locked;
+}
+
+void WaitForCriticalSection(const char *section_id)
+{
+    ThreadLock(&CRITICAL_SECTIONS_LOCK);
+    while (*FindCriticalSection(section_id) != NULL)
+    {
+        pthread_cond_wait(&CRITICAL_SECTION_LEFT, &CRITICAL_SECTIONS_LOCK);
+    }
+
+    CriticalSection *cs = xcalloc(1, sizeof(CriticalSection));
+    cs->id = xstrdup(section_id);
+    cs->lock.fd = -1;
+    cs->next = CRITICAL_SECTIONS;
+    CRITICAL_SECTIONS = cs;
+    ThreadUnlock(&CRITICAL_SECTIONS_LOCK);
+
+    cs->lock.fd = OpenCriticalSectionFile(section_id);
+    if (cs->lock.fd == -1)
+    {
+        return;
+    }
+
+    Log(LOG_LEVEL_DEBUG, "Acquiring critical section lock '%s'", section_id);
+    if (!LockCriticalSectionFile(&(cs->lock)))
+    {
+        Log(LOG_LEVEL_NOTICE,
+            "Failed to wait for critical section lock '%s', entering it anyway",
+            section_id);
+        close(cs->lock.fd);
+        cs->lock.fd = -1;
+        return;
+    }
+    Log(LOG_LEVEL_DEBUG, "Acquired critical section lock '%s'", section_id);
+}
+
+void ReleaseCriticalSection(const char *section_id)
+{
+    Log(LOG_LEVEL_DEBUG, "Releasing critical section lock '%s'", section_id);
+
+    ThreadLock(&CRITICAL_SECTIONS_LOCK);
+    CriticalSection **link = FindCriticalSection(section_id);
+    CriticalSection *cs = *link;
+    if (cs == NULL)
+    {
+        ThreadUnlock(&CRITICAL_SECTIONS_LOCK);
+        Log(LOG_LEVEL_DEBUG, "Failed to release critical section lock '%s'", section_id);
+        return;
+    }
+
+    /* Drop the file lock first, or another thread could take it over
+     * (same process) just before we release it. */
+    if (cs->lock.fd != -1)
+    {
+        ExclusiveFileUnlock(&(cs->lock), true);
+    }
+    *link = cs->next;
+    pthread_cond_broadcast(&CRITICAL_SECTION_LEFT);
+    ThreadUnlock(&CRITICAL_SECTIONS_LOCK);
+
+    free(cs->id);
+    free(cs);
+    Log(LOG_LEVEL_DEBUG, "Released critical section lock '%s'", section_id);
+}
+
+#else  /* __MINGW32__ */
+
 static bool NoOrObsoleteLock(LockData *entry, ARG_UNUSED size_t entry_size, size_t *max_old)
 {
     assert((entry == NULL) || (entry_size == sizeof(LockData)));
@@ -433,6 +835,8 @@ void ReleaseCriticalSection(const char *section_id)
     }
 }
 
+#endif /* __MINGW32__ */
+
 static time_t FindLock(char *last)
 {
     time_t mtime;
@@ -441,7 +845,7 @@ static time_t FindLock(char *last)
     {
         /* Do this to prevent deadlock loops from surviving if IfElapsed > T_sched */
 
-        if (WriteLock(last) == -1)
+        if (WriteLock(last, false) == -1)
         {
             Log(LOG_LEVEL_ERR, "Unable to lock %s", last);
             return 0;
@@ -653,6 +1057,25 @@ static bool KillLockHolder(const char *lock)
     }
 }
 
+/* Values of these change without the promise changing (e.g. times). */
+static const char *const LOCK_HASH_IGNORED_RVALS[] =
+{
+    "mtime", "atime", "ctime", "stime_range", "ttime_range", "log_string",
+    "template_data", NULL
+};
+
+static bool LockHashIgnoresRval(const char *lval)
+{
+    for (size_t i = 0; LOCK_HASH_IGNORED_RVALS[i] != NULL; i++)
+    {
+        if (StringEqual(lval, LOCK_HASH_IGNORED_RVALS[i]))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
 static void RvalDigestUpdate(EVP_MD_CTX *context, Rlist *rp)
 {
     assert(context != NULL);
@@ -688,9 +1111,6 @@ void PromiseRuntimeHash(const Promise *pp, const char *salt,
     Rlist *rp;
     FnCall *fp;
 
-    char *noRvalHash[] = { "mtime", "atime", "ctime", "stime_range", "ttime_range", "log_string", "template_data", NULL };
-    int doHash;
-
     md = HashDigestFromId(type);
     if (md == NULL)
     {
@@ -753,18 +1173,7 @@ void PromiseRuntimeHash(const Promise *pp, const char *salt,
             EVP_DigestUpdate(context, cp->lval, strlen(cp->lval));
 
             // don't hash rvals that change (e.g. times)
-            doHash = true;
-
-            for (int j = 0; noRvalHash[j] != NULL; j++)
-            {
-                if (strcmp(cp->lval, noRvalHash[j]) == 0)
-                {
-                    doHash = false;
-                    break;
-                }
-            }
-
-            if (!doHash)
+            if (LockHashIgnoresRval(cp->lval))
             {
                 continue;
             }
@@ -818,6 +1227,231 @@ void PromiseRuntimeHash(const Promise *pp, const char *salt,
 /* Digest length stored in md_len */
 }
 
+/*
+ * Promise lock identity.
+ *
+ * Most of what identifies a promise does not change from one iteration to
+ * the next: its bundle, and the constraints without variables or function
+ * calls. These are hashed once per unexpanded promise and kept with it,
+ * every iteration only mixes in the promiser, the comment, the salt and the
+ * expanded values of the remaining constraints. FNV-1a is plenty for
+ * telling promises apart, this is no security boundary.
+ */
+
+#define LOCK_HASH_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define LOCK_HASH_PRIME 0x100000001b3ULL
+
+struct PromiseLockStatic_
+{
+    uint64_t hash;
+    size_t dynamic_count;
+    /* Constraints to hash on every iteration, point into the unexpanded
+     * promise. */
+    const char *dynamic_lvals[];
+};
+
+static uint64_t LockHashBytes(uint64_t hash, const void *data, size_t len)
+{
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= bytes[i];
+        hash *= LOCK_HASH_PRIME;
+    }
+    return hash;
+}
+
+static uint64_t LockHashString(uint64_t hash, const char *s)
+{
+    /* With the terminator, so that "ab","c" and "a","bc" differ. */
+    return LockHashBytes(hash, s, strlen(s) + 1);
+}
+
+static uint64_t LockHashRval(uint64_t hash, Rval rval)
+{
+    switch (rval.type)
+    {
+    case RVAL_TYPE_SCALAR:
+        return LockHashString(hash, RvalScalarValue(rval));
+
+    case RVAL_TYPE_LIST:
+        for (const Rlist *rp = RvalRlistValue(rval); rp != NULL; rp = rp->next)
+        {
+            hash = LockHashRval(hash, rp->val);
+        }
+        return LockHashBytes(hash, "", 1);
+
+    case RVAL_TYPE_FNCALL:
+    {
+        const FnCall *fp = RvalFnCallValue(rval);
+        hash = LockHashString(hash, fp->name);
+        for (const Rlist *rp = fp->args; rp != NULL; rp = rp->next)
+        {
+            hash = LockHashRval(hash, rp->val);
+        }
+        return LockHashBytes(hash, "", 1);
+    }
+
+    case RVAL_TYPE_CONTAINER:
+    {
+        Writer *writer = StringWriter();
+        JsonWriteCompact(writer, RvalContainerValue(rval)); /* canonical form */
+        hash = LockHashBytes(hash, StringWriterData(writer),
+                             StringWriterLength(writer) + 1);
+        WriterClose(writer);
+        return hash;
+    }
+
+    case RVAL_TYPE_NOPROMISEE:
+        return hash;
+    }
+
+    ProgrammingError("Unhandled case in switch: %d", rval.type);
+}
+
+/**
+ * @return whether expanding @rval gives @rval itself. Errs on the side of
+ *         false, anything with a '$' or '@' might reference a variable.
+ */
+static bool RvalIsStatic(Rval rval, bool references_body)
+{
+    switch (rval.type)
+    {
+    case RVAL_TYPE_SCALAR:
+        return (strpbrk(RvalScalarValue(rval), "$@") == NULL);
+
+    case RVAL_TYPE_LIST:
+        for (const Rlist *rp = RvalRlistValue(rval); rp != NULL; rp = rp->next)
+        {
+            if (rp->val.type != RVAL_TYPE_SCALAR || !RvalIsStatic(rp->val, false))
+            {
+                return false;
+            }
+        }
+        return true;
+
+    case RVAL_TYPE_FNCALL:
+        /* Body references stay as they are, function calls are evaluated. */
+        if (!references_body)
+        {
+            return false;
+        }
+        for (const Rlist *rp = RvalFnCallValue(rval)->args; rp != NULL; rp = rp->next)
+        {
+            if (rp->val.type != RVAL_TYPE_SCALAR || !RvalIsStatic(rp->val, false))
+            {
+                return false;
+            }
+        }
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+static struct PromiseLockStatic_ *PromiseLockStaticNew(const Promise *pp)
+{
+    size_t dynamic_count = 0;
+    for (size_t i = 0; i < SeqLength(pp->conlist); i++)
+    {
+        const Constraint *cp = SeqAt(pp->conlist, i);
+        if (!LockHashIgnoresRval(cp->lval) &&
+            !RvalIsStatic(cp->rval, cp->references_body))
+        {
+            dynamic_count++;
+        }
+    }
+
+    struct PromiseLockStatic_ *lock_static =
+        xcalloc(1, sizeof(struct PromiseLockStatic_) +
+                   dynamic_count * sizeof(const char *));
+
+    uint64_t hash = LOCK_HASH_OFFSET_BASIS;
+    const Bundle *bp = PromiseGetBundle(pp);
+    hash = LockHashString(hash, (bp->ns != NULL) ? bp->ns : "");
+    hash = LockHashString(hash, (bp->name != NULL) ? bp->name : "");
+
+    for (size_t i = 0; i < SeqLength(pp->conlist); i++)
+    {
+        const Constraint *cp = SeqAt(pp->conlist, i);
+        if (LockHashIgnoresRval(cp->lval))
+        {
+            hash = LockHashString(hash, cp->lval);
+        }
+        else if (RvalIsStatic(cp->rval, cp->references_body))
+        {
+            hash = LockHashString(hash, cp->lval);
+            hash = LockHashRval(hash, cp->rval);
+        }
+        else
+        {
+            lock_static->dynamic_lvals[lock_static->dynamic_count++] = cp->lval;
+        }
+    }
+
+    lock_static->hash = hash;
+    return lock_static;
+}
+
+/**
+ * Identity of a promise iteration for locking, a cheaper replacement for
+ * PromiseRuntimeHash().
+ *
+ * @param pp expanded promise, its unexpanded promise keeps the static part
+ * @param salt the lock operand, may be NULL
+ */
+uint64_t PromiseLockHash(const Promise *pp, const char *salt)
+{
+    assert(pp != NULL);
+
+    static const char PACK_UPIFELAPSED_SALT[] = "packageuplist";
+
+    /* The cache is not part of the policy, hence the cast. */
+    Promise *org_pp = (Promise *) ((pp->org_pp != NULL) ? pp->org_pp : pp);
+    if (org_pp->lock_static == NULL)
+    {
+        org_pp->lock_static = PromiseLockStaticNew(org_pp);
+    }
+    const struct PromiseLockStatic_ *lock_static = org_pp->lock_static;
+
+    uint64_t hash = lock_static->hash;
+
+    // multiple packages (promisers) may share same package_list_update_ifelapsed lock
+    if ((salt == NULL) || !StringEqual(salt, PACK_UPIFELAPSED_SALT))
+    {
+        hash = LockHashString(hash, pp->promiser);
+    }
+    hash = LockHashString(hash, (pp->comment != NULL) ? pp->comment : "");
+    hash = LockHashString(hash, (salt != NULL) ? salt : "");
+
+    if (lock_static->dynamic_count > 0)
+    {
+        for (size_t i = 0; i < SeqLength(pp->conlist); i++)
+        {
+            const Constraint *cp = SeqAt(pp->conlist, i);
+            for (size_t j = 0; j < lock_static->dynamic_count; j++)
+            {
+                if (StringEqual(cp->lval, lock_static->dynamic_lvals[j]))
+                {
+                    hash = LockHashString(hash, cp->lval);
+                    hash = LockHashRval(hash, cp->rval);
+                    break;
+                }
+            }
+        }
+    }
+
+    return hash;
+}
+
+static void PromiseLockHashPrint(const Promise *pp, const char *salt,
+                                 char dst[PROMISE_LOCK_HASH_SIZE])
+{
+    snprintf(dst, PROMISE_LOCK_HASH_SIZE, "%016" PRIx64,
+             PromiseLockHash(pp, salt));
+}
+
 static CfLock CfLockNew(const char *last, const char *lock, bool is_dummy)
 {
     return (CfLock) {
@@ -845,13 +1479,8 @@ CfLock AcquireLock(EvalContext *ctx, const char *operand, const char *host,
         return CfLockNull();
     }
 
-    char str_digest[CF_HOSTKEY_STRING_SIZE];
-    {
-        unsigned char digest[EVP_MAX_MD_SIZE + 1];
-        PromiseRuntimeHash(pp, operand, digest, CF_DEFAULT_DIGEST);
-        HashPrintSafe(str_digest, sizeof(str_digest), digest,
-                      CF_DEFAULT_DIGEST, true);
-    }
+    char str_digest[PROMISE_LOCK_HASH_SIZE];
+    PromiseLockHashPrint(pp, operand, str_digest);
 
     if (EvalContextPromiseLockCacheContains(ctx, str_digest))
     {
@@ -897,13 +1526,15 @@ CfLock AcquireLock(EvalContext *ctx, const char *operand, const char *host,
 
     const char *bundle_name = PromiseGetBundle(pp)->name;
 
-    char cflock[CF_BUFSIZE] = "";
-    snprintf(cflock, CF_BUFSIZE, "lock.%.100s.%s.%.100s_%d_%s",
-             bundle_name, cc_operator, cc_operand, sum, str_digest);
+    char cflock[CF_BUFSIZE];
+    int len = snprintf(cflock, CF_BUFSIZE, "lock.%.100s.%s.%.100s_%d_%s",
+                       bundle_name, cc_operator, cc_operand, sum, str_digest);
+    assert(len > 0 && len < CF_BUFSIZE);
 
-    char cflast[CF_BUFSIZE] = "";
-    snprintf(cflast, CF_BUFSIZE, "last.%.100s.%s.%.100s_%d_%s",
-             bundle_name, cc_operator, cc_operand, sum, str_digest);
+    /* Same name with "last." instead of "lock.". */
+    char cflast[CF_BUFSIZE];
+    memcpy(cflast, cflock, len + 1);
+    memcpy(cflast, "last", 4);
 
     Log(LOG_LEVEL_DEBUG, "Locking bundle '%s' with lock '%s'",
         bundle_name, cflock);
@@ -974,7 +1605,7 @@ CfLock AcquireLock(EvalContext *ctx, const char *operand, const char *host,
             }
         }
 
-        int ret = WriteLock(cflock);
+        int ret = WriteLock(cflock, false);
         if (ret != -1)
         {
             /* Register a cleanup handler *after* having opened the DB, so that
@@ -992,7 +1623,10 @@ CfLock AcquireLock(EvalContext *ctx, const char *operand, const char *host,
     // Keep this as a global for signal handling
     PushLock(cflock, cflast);
 
-    return CfLockNew(cflast, cflock, false);
+    CfLock lock = CfLockNew(cflast, cflock, false);
+    /* Losing its last-run time doesn't change when it runs next. */
+    lock.journal_last = (ifelapsed == 0);
+    return lock;
 }
 
 void YieldCurrentLock(CfLock lock)
@@ -1018,7 +1652,7 @@ void YieldCurrentLock(CfLock lock)
         return;
     }
 
-    if (WriteLock(lock.last) == -1)
+    if (WriteLock(lock.last, lock.journal_last) == -1)
     {
         Log(LOG_LEVEL_ERR, "Unable to create '%s'. (create: %s)",
             lock.last, GetErrorStr());
@@ -1060,11 +1694,8 @@ void YieldCurrentLock(CfLock lock)
 void YieldCurrentLockAndRemoveFromCache(EvalContext *ctx, CfLock lock,
                                         const char *operand, const Promise *pp)
 {
-    unsigned char digest[EVP_MAX_MD_SIZE + 1];
-    PromiseRuntimeHash(pp, operand, digest, CF_DEFAULT_DIGEST);
-    char str_digest[CF_HOSTKEY_STRING_SIZE];
-    HashPrintSafe(str_digest, sizeof(str_digest), digest,
-                  CF_DEFAULT_DIGEST, true);
+    char str_digest[PROMISE_LOCK_HASH_SIZE];
+    PromiseLockHashPrint(pp, operand, str_digest);
 
     YieldCurrentLock(lock);
     EvalContextPromiseLockCacheRemove(ctx, str_digest);
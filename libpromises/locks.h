@@ -34,9 +34,15 @@ CfLock AcquireLock(EvalContext *ctx, const char *operand, const char *host,
 void YieldCurrentLock(CfLock lock);
 void YieldCurrentLockAndRemoveFromCache(EvalContext *ctx, CfLock lock,
                                         const char *operand, const Promise *pp);
+/* 16 hex digits and the terminator */
+#define PROMISE_LOCK_HASH_SIZE 17
+uint64_t PromiseLockHash(const Promise *pp, const char *salt);
 void GetLockName(char *lockname, const char *locktype,
                  const char *base, const Rlist *params);
 void PurgeLocks(void);
+void LocksSetJournal(bool enabled);
+void LocksJournalBegin(void);
+void LocksJournalEnd(void);
 void BackupLockDatabase(void);
 void RestoreLockDatabase(void);
 
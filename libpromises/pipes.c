@@ -132,6 +132,98 @@ Rlist *PipeReadData(const IOData *io, int pipe_timeout_secs, int pipe_terminatio
     return response_lines;
 }
 
+/* Whether #data ends with an empty line, or is one. */
+static bool EndsWithEmptyLine(const char *data, size_t len)
+{
+    return ((len == 1 && data[0] == '\n') ||
+            (len == 2 && data[0] == '\r' && data[1] == '\n') ||
+            (len >= 2 && data[len - 2] == '\n' && data[len - 1] == '\n') ||
+            (len >= 3 && data[len - 3] == '\n' && data[len - 2] == '\r' &&
+             data[len - 1] == '\n'));
+}
+
+/**
+ * Like PipeReadData(), but for an application that keeps running: read one
+ * message, terminated by an empty line, instead of everything until EOF.
+ *
+ * @param message the lines of the message, without the empty line, NULL if
+ *                there are none
+ * @return false on error, timeout, or EOF before the end of the message
+ */
+bool PipeReadMessage(const IOData *io, int pipe_timeout_secs,
+                     int pipe_termination_check_secs, Rlist **message)
+{
+    assert(message != NULL);
+
+    char buff[CF_BUFSIZE];
+    Buffer *data = BufferNew();
+    bool complete = false;
+
+    int timeout_seconds_left = pipe_timeout_secs;
+
+    while (!complete && !IsPendingTermination() && timeout_seconds_left > 0)
+    {
+        int fd = PipeIsReadWriteReady(io, pipe_termination_check_secs);
+
+        if (fd < 0)
+        {
+            Log(LOG_LEVEL_DEBUG,
+                "Error reading data from application pipe %d", fd);
+            break;
+        }
+        else if (fd == io->read_fd)
+        {
+            ssize_t res = read(fd, buff, sizeof(buff));
+            if (res == -1)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                Log(LOG_LEVEL_ERR,
+                    "Unable to read output from application pipe: %s",
+                    GetErrorStr());
+                break;
+            }
+            else if (res == 0)
+            {
+                Log(LOG_LEVEL_VERBOSE,
+                    "Application closed its pipe in the middle of a message");
+                break;
+            }
+
+            BufferAppend(data, buff, res);
+            complete = EndsWithEmptyLine(BufferData(data), BufferSize(data));
+        }
+        else if (fd == 0) /* timeout */
+        {
+            timeout_seconds_left -= pipe_termination_check_secs;
+        }
+    }
+
+    char *read_string = BufferClose(data);
+    if (!complete)
+    {
+        free(read_string);
+        return false;
+    }
+
+    /* The end of the message is recognised after CRLF too, so the lines may
+     * end with CRLF on any platform. */
+    NDEBUG_UNUSED const ssize_t num_repl =
+        StringReplace(read_string, strlen(read_string) + 1, "\r\n", "\n");
+    assert(num_repl >= 0);
+
+    /* Drop the terminating empty line. */
+    const size_t len = strlen(read_string);
+    assert(len > 0 && read_string[len - 1] == '\n');
+    read_string[len - 1] = '\0';
+
+    *message = RlistFromSplitString(read_string, '\n');
+    free(read_string);
+    return true;
+}
+
 ssize_t PipeWrite(IOData *io, const char *data)
 {
     /* If there is nothing to write close writing end of pipe. */
@@ -1520,6 +1520,7 @@ void PromiseDestroy(Promise *pp)
         free(pp->comment);
 
         SeqDestroy(pp->conlist);
+        free(pp->lock_static);
 
         free(pp);
     }
@@ -124,6 +124,10 @@ struct Promise_
 
     const Promise *org_pp;            /* A ptr to the unexpanded raw promise */
 
+    /* Parts of the lock identity that are the same for every expansion,
+     * computed on first use, see PromiseLockHash() */
+    struct PromiseLockStatic_ *lock_static;
+
     SourceOffset offset;
 };
 
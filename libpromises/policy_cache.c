@@ -0,0 +1,815 @@
+/*
+  Copyright 2024 Northern.tech AS
+
+  This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; version 3.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+#include <policy_cache.h>
+
+#include <known_dirs.h>                                       /* GetStateDir */
+#include <file_lib.h>                        /* safe_open_create_perms, FullWrite */
+#include <dir.h>                                /* DirOpen, DirRead, DirClose */
+#include <logging.h>
+#include <map.h>
+#include <json.h>
+#include <writer.h>
+#include <rlist.h>
+#include <fncall.h>
+#include <string_lib.h>
+#include <misc_lib.h>                                          /* xsnprintf */
+#include <prototypes3.h>                                          /* Version */
+
+#ifndef __MINGW32__
+# include <sys/mman.h>                                       /* mmap, munmap */
+# include <utime.h>
+#endif
+
+
+#define POLICY_CACHE_MAGIC 0x43504643                           /* "CFPC" */
+#define POLICY_CACHE_FORMAT 2
+#define POLICY_CACHE_MAX_AGE (7 * SECONDS_PER_DAY)  /* unused entries kept */
+#define POLICY_CACHE_MAX_DEPTH 64                  /* nesting of lists, calls */
+
+static bool POLICY_CACHE_PRUNED = false;                        /* GLOBAL_X */
+
+/*
+  The format of a policy cache entry is as follows, all integers in the
+  native byte order:
+
+  PolicyCacheHeader
+  string table           | NUL-terminated strings, each stored once and
+                         | referred to by offset + 1 (0 being NULL), padded
+                         | with NULs to a multiple of 4 bytes
+  words                  | uint32_t's:
+                         |   bundles:  count, then for each: ns, name, type,
+                         |             evaluation order, args, offset,
+                         |             sections (count, then promise type and
+                         |             offset of each), promises (count, then
+                         |             for each: section index, promiser,
+                         |             classes, comment, promisee, offset,
+                         |             constraints)
+                         |   bodies:   count, then for each: ns, name, type,
+                         |             is_custom, args, offset, constraints
+                         |   promise blocks: the same as bodies
+
+  An Rval is its type followed by a string for scalars and JSON containers,
+  an Rlist (count, then the Rvals) for lists, or the name and the arguments
+  Rlist for function calls. A SourceOffset is 4 words, constraints are a
+  count then the lval, classes, references_body, rval and offset of each.
+*/
+typedef struct
+{
+    uint32_t magic;
+    uint32_t format;
+    uint32_t agent_type;                     /* AgentType parsed for */
+    char version[32];                        /* Version() of the writer */
+    uint32_t strings_size;                   /* bytes, multiple of 4 */
+    uint32_t words;
+} PolicyCacheHeader;
+
+/*******************************************************************/
+
+typedef struct
+{
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+} CacheBytes;
+
+typedef struct
+{
+    CacheBytes strings;
+    CacheBytes words;
+    Map *string_refs;                        /* string -> offset + 1 */
+} CacheWriter;
+
+static void CacheBytesAppend(CacheBytes *bytes, const void *data, size_t size)
+{
+    if (bytes->size + size > bytes->capacity)
+    {
+        bytes->capacity = MAX(bytes->capacity * 2, bytes->size + size + 4096);
+        bytes->data = xrealloc(bytes->data, bytes->capacity);
+    }
+    memcpy(bytes->data + bytes->size, data, size);
+    bytes->size += size;
+}
+
+static void WriteWord(CacheWriter *w, uint32_t word)
+{
+    CacheBytesAppend(&w->words, &word, sizeof(word));
+}
+
+static void WriteString(CacheWriter *w, const char *str)
+{
+    if (str == NULL)
+    {
+        WriteWord(w, 0);
+        return;
+    }
+
+    void *ref = MapGet(w->string_refs, str);
+    if (ref == NULL)
+    {
+        ref = (void *) (uintptr_t) (w->strings.size + 1);
+        CacheBytesAppend(&w->strings, str, strlen(str) + 1);
+        MapInsert(w->string_refs, xstrdup(str), ref);
+    }
+    WriteWord(w, (uint32_t) (uintptr_t) ref);
+}
+
+static void WriteOffset(CacheWriter *w, const SourceOffset *offset)
+{
+    WriteWord(w, offset->start);
+    WriteWord(w, offset->end);
+    WriteWord(w, offset->line);
+    WriteWord(w, offset->context);
+}
+
+static void WriteRlist(CacheWriter *w, const Rlist *list);
+
+static void WriteRval(CacheWriter *w, Rval rval)
+{
+    WriteWord(w, rval.type);
+
+    switch (rval.type)
+    {
+    case RVAL_TYPE_SCALAR:
+        WriteString(w, RvalScalarValue(rval));
+        break;
+
+    case RVAL_TYPE_LIST:
+        WriteRlist(w, RvalRlistValue(rval));
+        break;
+
+    case RVAL_TYPE_FNCALL:
+    {
+        const FnCall *fp = RvalFnCallValue(rval);
+        WriteString(w, fp->name);
+        WriteRlist(w, fp->args);
+        break;
+    }
+
+    case RVAL_TYPE_CONTAINER:
+    {
+        Writer *json = StringWriter();
+        JsonWriteCompact(json, RvalContainerValue(rval));
+        WriteString(w, StringWriterData(json));
+        WriterClose(json);
+        break;
+    }
+
+    case RVAL_TYPE_NOPROMISEE:
+        break;
+    }
+}
+
+static void WriteRlist(CacheWriter *w, const Rlist *list)
+{
+    WriteWord(w, RlistLen(list));
+    for (const Rlist *rp = list; rp != NULL; rp = rp->next)
+    {
+        WriteRval(w, rp->val);
+    }
+}
+
+static void WriteConstraints(CacheWriter *w, const Seq *conlist)
+{
+    WriteWord(w, SeqLength(conlist));
+    for (size_t i = 0; i < SeqLength(conlist); i++)
+    {
+        const Constraint *cp = SeqAt(conlist, i);
+        WriteString(w, cp->lval);
+        WriteString(w, cp->classes);
+        WriteWord(w, cp->references_body);
+        WriteRval(w, cp->rval);
+        WriteOffset(w, &cp->offset);
+    }
+}
+
+static void WriteBundle(CacheWriter *w, const Bundle *bundle)
+{
+    WriteString(w, bundle->ns);
+    WriteString(w, bundle->name);
+    WriteString(w, bundle->type);
+    WriteWord(w, bundle->evaluation_order);
+    WriteRlist(w, bundle->args);
+    WriteOffset(w, &bundle->offset);
+
+    /* Built-in sections first, re-creating them keeps both orders. */
+    Seq *sections = SeqNew(SeqLength(bundle->sections) + SeqLength(bundle->custom_sections), NULL);
+    for (size_t i = 0; i < SeqLength(bundle->sections); i++)
+    {
+        SeqAppend(sections, SeqAt(bundle->sections, i));
+    }
+    for (size_t i = 0; i < SeqLength(bundle->custom_sections); i++)
+    {
+        SeqAppend(sections, SeqAt(bundle->custom_sections, i));
+    }
+
+    WriteWord(w, SeqLength(sections));
+    for (size_t i = 0; i < SeqLength(sections); i++)
+    {
+        const BundleSection *section = SeqAt(sections, i);
+        WriteString(w, section->promise_type);
+        WriteOffset(w, &section->offset);
+    }
+
+    /* Promises in the order of the policy file, for the top-down order. */
+    WriteWord(w, SeqLength(bundle->all_promises));
+    for (size_t i = 0; i < SeqLength(bundle->all_promises); i++)
+    {
+        const Promise *pp = SeqAt(bundle->all_promises, i);
+
+        size_t index = 0;
+        while (SeqAt(sections, index) != pp->parent_section)
+        {
+            index++;
+        }
+
+        WriteWord(w, index);
+        WriteString(w, pp->promiser);
+        WriteString(w, pp->classes);
+        WriteString(w, pp->comment);
+        WriteRval(w, pp->promisee);
+        WriteOffset(w, &pp->offset);
+        WriteConstraints(w, pp->conlist);
+    }
+
+    SeqDestroy(sections);
+}
+
+static void WriteBody(CacheWriter *w, const Body *body)
+{
+    WriteString(w, body->ns);
+    WriteString(w, body->name);
+    WriteString(w, body->type);
+    WriteWord(w, body->is_custom);
+    WriteRlist(w, body->args);
+    WriteOffset(w, &body->offset);
+    WriteConstraints(w, body->conlist);
+}
+
+/*******************************************************************/
+
+typedef struct
+{
+    const char *strings;
+    size_t strings_size;
+    const unsigned char *words;
+    size_t n_words;
+    size_t next;
+    bool failed;
+} CacheReader;
+
+static uint32_t ReadWord(CacheReader *r)
+{
+    if (r->failed || r->next >= r->n_words)
+    {
+        r->failed = true;
+        return 0;
+    }
+
+    uint32_t word;
+    memcpy(&word, r->words + r->next * sizeof(word), sizeof(word));
+    r->next++;
+    return word;
+}
+
+/**
+ * A count of items, each taking at least a word, so that a broken entry
+ * can't make us allocate much.
+ */
+static uint32_t ReadCount(CacheReader *r)
+{
+    uint32_t count = ReadWord(r);
+    if (count > r->n_words - r->next)
+    {
+        r->failed = true;
+        return 0;
+    }
+    return count;
+}
+
+static const char *ReadString(CacheReader *r)
+{
+    uint32_t ref = ReadWord(r);
+    if (ref == 0)
+    {
+        return NULL;
+    }
+    if (ref > r->strings_size)
+    {
+        r->failed = true;
+        return NULL;
+    }
+    return r->strings + ref - 1;
+}
+
+static const char *ReadRequiredString(CacheReader *r)
+{
+    const char *str = ReadString(r);
+    if (str == NULL)
+    {
+        r->failed = true;
+    }
+    return str;
+}
+
+static void ReadOffset(CacheReader *r, SourceOffset *offset)
+{
+    offset->start = ReadWord(r);
+    offset->end = ReadWord(r);
+    offset->line = ReadWord(r);
+    offset->context = ReadWord(r);
+}
+
+static Rlist *ReadRlist(CacheReader *r, int depth);
+
+static Rval ReadRval(CacheReader *r, int depth)
+{
+    const Rval none = { NULL, RVAL_TYPE_NOPROMISEE };
+
+    const uint32_t type = ReadWord(r);
+    if (r->failed || depth > POLICY_CACHE_MAX_DEPTH)
+    {
+        r->failed = true;
+        return none;
+    }
+
+    switch (type)
+    {
+    case RVAL_TYPE_SCALAR:
+    {
+        const char *scalar = ReadRequiredString(r);
+        return r->failed ? none : (Rval) { xstrdup(scalar), RVAL_TYPE_SCALAR };
+    }
+
+    case RVAL_TYPE_LIST:
+    {
+        Rlist *list = ReadRlist(r, depth + 1);
+        if (r->failed)
+        {
+            RlistDestroy(list);
+            return none;
+        }
+        return (Rval) { list, RVAL_TYPE_LIST };
+    }
+
+    case RVAL_TYPE_FNCALL:
+    {
+        const char *name = ReadRequiredString(r);
+        Rlist *args = ReadRlist(r, depth + 1);
+        if (r->failed)
+        {
+            RlistDestroy(args);
+            return none;
+        }
+        return (Rval) { FnCallNew(name, args), RVAL_TYPE_FNCALL };
+    }
+
+    case RVAL_TYPE_CONTAINER:
+    {
+        const char *data = ReadRequiredString(r);
+        JsonElement *json = NULL;
+        if (r->failed || JsonParse(&data, &json) != JSON_PARSE_OK)
+        {
+            r->failed = true;
+            return none;
+        }
+        return (Rval) { json, RVAL_TYPE_CONTAINER };
+    }
+
+    case RVAL_TYPE_NOPROMISEE:
+        return none;
+
+    default:
+        r->failed = true;
+        return none;
+    }
+}
+
+static Rlist *ReadRlist(CacheReader *r, int depth)
+{
+    Rlist *list = NULL;
+
+    const uint32_t count = ReadCount(r);
+    for (uint32_t i = 0; i < count && !r->failed; i++)
+    {
+        Rval rval = ReadRval(r, depth);
+        if (!r->failed)
+        {
+            RlistAppendRval(&list, rval);
+        }
+    }
+
+    return list;
+}
+
+static bool ReadPromiseConstraints(CacheReader *r, Promise *pp)
+{
+    const uint32_t count = ReadCount(r);
+    for (uint32_t i = 0; i < count && !r->failed; i++)
+    {
+        const char *lval = ReadRequiredString(r);
+        ReadString(r);                               /* always "any" */
+        const bool references_body = (ReadWord(r) != 0);
+        Rval rval = ReadRval(r, 0);
+        if (r->failed)
+        {
+            break;
+        }
+
+        Constraint *cp = PromiseAppendConstraint(pp, lval, rval, references_body);
+        ReadOffset(r, &cp->offset);
+    }
+
+    return !r->failed;
+}
+
+static bool ReadBodyConstraints(CacheReader *r, Body *body)
+{
+    const uint32_t count = ReadCount(r);
+    for (uint32_t i = 0; i < count && !r->failed; i++)
+    {
+        const char *lval = ReadRequiredString(r);
+        const char *classes = ReadRequiredString(r);
+        const bool references_body = (ReadWord(r) != 0);
+        Rval rval = ReadRval(r, 0);
+        if (r->failed)
+        {
+            break;
+        }
+
+        Constraint *cp = BodyAppendConstraint(body, lval, rval, classes, references_body);
+        ReadOffset(r, &cp->offset);
+    }
+
+    return !r->failed;
+}
+
+static bool ReadBundle(CacheReader *r, Policy *policy, const char *source_path)
+{
+    const char *ns = ReadRequiredString(r);
+    const char *name = ReadRequiredString(r);
+    const char *type = ReadRequiredString(r);
+    const EvalOrder evaluation_order = ReadWord(r);
+    Rlist *args = ReadRlist(r, 0);
+    if (r->failed)
+    {
+        RlistDestroy(args);
+        return false;
+    }
+
+    Bundle *bundle = PolicyAppendBundle(policy, ns, name, type, args, source_path,
+                                        evaluation_order);
+    RlistDestroy(args);
+    ReadOffset(r, &bundle->offset);
+
+    const uint32_t n_sections = ReadCount(r);
+    Seq *sections = SeqNew(n_sections, NULL);
+    for (uint32_t i = 0; i < n_sections && !r->failed; i++)
+    {
+        const char *promise_type = ReadRequiredString(r);
+        if (r->failed)
+        {
+            break;
+        }
+
+        BundleSection *section = BundleAppendSection(bundle, promise_type);
+        ReadOffset(r, &section->offset);
+        SeqAppend(sections, section);
+    }
+
+    const uint32_t n_promises = ReadCount(r);
+    for (uint32_t i = 0; i < n_promises && !r->failed; i++)
+    {
+        const uint32_t index = ReadWord(r);
+        const char *promiser = ReadRequiredString(r);
+        const char *classes = ReadRequiredString(r);
+        const char *comment = ReadString(r);
+        Rval promisee = ReadRval(r, 0);
+        if (r->failed || index >= SeqLength(sections))
+        {
+            RvalDestroy(promisee);
+            r->failed = true;
+            break;
+        }
+
+        Promise *pp = BundleSectionAppendPromise(SeqAt(sections, index), promiser,
+                                                 promisee, classes, NULL);
+        pp->comment = SafeStringDuplicate(comment);
+        ReadOffset(r, &pp->offset);
+        ReadPromiseConstraints(r, pp);
+    }
+
+    SeqDestroy(sections);
+    return !r->failed;
+}
+
+static bool ReadBody(CacheReader *r, Policy *policy, const char *source_path,
+                     bool promise_block)
+{
+    const char *ns = ReadRequiredString(r);
+    const char *name = ReadRequiredString(r);
+    const char *type = ReadRequiredString(r);
+    const bool is_custom = (ReadWord(r) != 0);
+    Rlist *args = ReadRlist(r, 0);
+    if (r->failed)
+    {
+        RlistDestroy(args);
+        return false;
+    }
+
+    Body *body = promise_block ?
+        PolicyAppendPromiseBlock(policy, ns, name, type, args, source_path) :
+        PolicyAppendBody(policy, ns, name, type, args, source_path, is_custom);
+    RlistDestroy(args);
+    ReadOffset(r, &body->offset);
+
+    return ReadBodyConstraints(r, body);
+}
+
+/*******************************************************************/
+
+static void PolicyCacheDir(char *dir, size_t dir_size)
+{
+    xsnprintf(dir, dir_size, "%s%cpolicy_cache", GetStateDir(), FILE_SEPARATOR);
+}
+
+static void PolicyCacheEntryPath(char *path, size_t path_size, const char *hash,
+                                 AgentType agent_type)
+{
+    char dir[PATH_MAX];
+    PolicyCacheDir(dir, sizeof(dir));
+    xsnprintf(path, path_size, "%s%c%s.%s", dir, FILE_SEPARATOR, hash,
+              CF_AGENTTYPES[agent_type]);
+}
+
+static Policy *PolicyFromCacheEntry(const unsigned char *data, size_t size,
+                                    AgentType agent_type, const char *source_path)
+{
+    PolicyCacheHeader header;
+    if (size < sizeof(header))
+    {
+        return NULL;
+    }
+    memcpy(&header, data, sizeof(header));
+    header.version[sizeof(header.version) - 1] = '\0';
+
+    if (header.magic != POLICY_CACHE_MAGIC ||
+        header.format != POLICY_CACHE_FORMAT ||
+        header.agent_type != (uint32_t) agent_type ||
+        !StringEqual(header.version, Version()) ||
+        header.strings_size % sizeof(uint32_t) != 0 ||
+        size != sizeof(header) + header.strings_size +
+                (size_t) header.words * sizeof(uint32_t) ||
+        (header.strings_size > 0 && data[sizeof(header) + header.strings_size - 1] != '\0'))
+    {
+        return NULL;
+    }
+
+    CacheReader r = {
+        .strings = (const char *) data + sizeof(header),
+        .strings_size = header.strings_size,
+        .words = data + sizeof(header) + header.strings_size,
+        .n_words = header.words,
+        .next = 0,
+        .failed = false,
+    };
+
+    Policy *policy = PolicyNew();
+
+    const uint32_t n_bundles = ReadCount(&r);
+    for (uint32_t i = 0; i < n_bundles && !r.failed; i++)
+    {
+        ReadBundle(&r, policy, source_path);
+    }
+
+    const uint32_t n_bodies = ReadCount(&r);
+    for (uint32_t i = 0; i < n_bodies && !r.failed; i++)
+    {
+        ReadBody(&r, policy, source_path, false);
+    }
+
+    const uint32_t n_blocks = ReadCount(&r);
+    for (uint32_t i = 0; i < n_blocks && !r.failed; i++)
+    {
+        ReadBody(&r, policy, source_path, true);
+    }
+
+    if (r.failed || r.next != r.n_words)
+    {
+        PolicyDestroy(policy);
+        return NULL;
+    }
+
+    return policy;
+}
+
+Policy *PolicyCacheLoad(const char *hash, AgentType agent_type, const char *source_path)
+{
+    assert(hash != NULL);
+    assert(source_path != NULL);
+
+#ifdef __MINGW32__
+    return NULL;
+#else
+    char path[PATH_MAX];
+    PolicyCacheEntryPath(path, sizeof(path), hash, agent_type);
+
+    int fd = safe_open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        Log(LOG_LEVEL_DEBUG, "No cached policy for '%s'", source_path);
+        return NULL;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) == -1 || sb.st_size < (off_t) sizeof(PolicyCacheHeader))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    void *data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Failed to map policy cache entry '%s' (mmap: %s)",
+            path, GetErrorStr());
+        return NULL;
+    }
+
+    Policy *policy = PolicyFromCacheEntry(data, sb.st_size, agent_type, source_path);
+    munmap(data, sb.st_size);
+
+    if (policy == NULL)
+    {
+        /* Written by another version, or broken. */
+        Log(LOG_LEVEL_VERBOSE, "Removing unusable policy cache entry '%s'", path);
+        unlink(path);
+        return NULL;
+    }
+
+    /* Keep entries still in use from being pruned. */
+    if (sb.st_mtime + SECONDS_PER_DAY < time(NULL))
+    {
+        utime(path, NULL);
+    }
+
+    return policy;
+#endif
+}
+
+/**
+ * Remove the entries not used for POLICY_CACHE_MAX_AGE, left behind by
+ * policy updates. Entries are only stored when the policy changed, and age
+ * by days, so once per process is plenty: a scan per entry stored would
+ * make storing many entries quadratic.
+ */
+static void PolicyCachePrune(const char *dir)
+{
+    if (POLICY_CACHE_PRUNED)
+    {
+        return;
+    }
+    POLICY_CACHE_PRUNED = true;
+
+    Dir *dirh = DirOpen(dir);
+    if (dirh == NULL)
+    {
+        return;
+    }
+
+    const time_t oldest = time(NULL) - POLICY_CACHE_MAX_AGE;
+    const struct dirent *dirp;
+    while ((dirp = DirRead(dirh)) != NULL)
+    {
+        if (dirp->d_name[0] == '.')
+        {
+            continue;
+        }
+
+        char path[PATH_MAX];
+        xsnprintf(path, sizeof(path), "%s%c%s", dir, FILE_SEPARATOR, dirp->d_name);
+
+        struct stat sb;
+        if (stat(path, &sb) == 0 && sb.st_mtime < oldest)
+        {
+            Log(LOG_LEVEL_DEBUG, "Removing old policy cache entry '%s'", path);
+            unlink(path);
+        }
+    }
+    DirClose(dirh);
+}
+
+bool PolicyCacheStore(const char *hash, AgentType agent_type, const Policy *policy)
+{
+    assert(hash != NULL);
+    assert(policy != NULL);
+
+#ifdef __MINGW32__
+    return false;
+#else
+    char dir[PATH_MAX];
+    PolicyCacheDir(dir, sizeof(dir));
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Failed to create policy cache directory '%s' (mkdir: %s)",
+            dir, GetErrorStr());
+        return false;
+    }
+
+    CacheWriter w = {
+        .strings = { 0 },
+        .words = { 0 },
+        .string_refs = MapNew(StringHash_untyped, StringEqual_untyped, free, NULL),
+    };
+
+    WriteWord(&w, SeqLength(policy->bundles));
+    for (size_t i = 0; i < SeqLength(policy->bundles); i++)
+    {
+        WriteBundle(&w, SeqAt(policy->bundles, i));
+    }
+
+    WriteWord(&w, SeqLength(policy->bodies));
+    for (size_t i = 0; i < SeqLength(policy->bodies); i++)
+    {
+        WriteBody(&w, SeqAt(policy->bodies, i));
+    }
+
+    WriteWord(&w, SeqLength(policy->custom_promise_types));
+    for (size_t i = 0; i < SeqLength(policy->custom_promise_types); i++)
+    {
+        WriteBody(&w, SeqAt(policy->custom_promise_types, i));
+    }
+
+    MapDestroy(w.string_refs);
+
+    const char padding[sizeof(uint32_t)] = { 0 };
+    CacheBytesAppend(&w.strings, padding,
+                     (sizeof(uint32_t) - w.strings.size % sizeof(uint32_t)) % sizeof(uint32_t));
+
+    PolicyCacheHeader header = {
+        .magic = POLICY_CACHE_MAGIC,
+        .format = POLICY_CACHE_FORMAT,
+        .agent_type = agent_type,
+        .strings_size = w.strings.size,
+        .words = w.words.size / sizeof(uint32_t),
+    };
+    strlcpy(header.version, Version(), sizeof(header.version));
+
+    /* Written aside and renamed, so that readers never see a partial
+     * entry. */
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    PolicyCacheEntryPath(path, sizeof(path), hash, agent_type);
+    xsnprintf(tmp_path, sizeof(tmp_path), "%s.%ju", path, (uintmax_t) getpid());
+
+    bool success = false;
+    int fd = safe_open_create_perms(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd != -1)
+    {
+        success = (FullWrite(fd, (const char *) &header, sizeof(header)) >= 0 &&
+                   FullWrite(fd, (const char *) w.strings.data, w.strings.size) >= 0 &&
+                   FullWrite(fd, (const char *) w.words.data, w.words.size) >= 0);
+        success = (close(fd) == 0) && success;
+        success = success && (rename(tmp_path, path) == 0);
+        if (!success)
+        {
+            unlink(tmp_path);
+        }
+    }
+
+    free(w.strings.data);
+    free(w.words.data);
+
+    if (!success)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Failed to store policy cache entry '%s' (%s)",
+            path, GetErrorStr());
+        return false;
+    }
+
+    Log(LOG_LEVEL_DEBUG, "Stored policy cache entry '%s'", path);
+    PolicyCachePrune(dir);
+    return true;
+#endif
+}
@@ -0,0 +1,63 @@
+/*
+  Copyright 2024 Northern.tech AS
+
+  This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; version 3.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#ifndef CFENGINE_POLICY_CACHE_H
+#define CFENGINE_POLICY_CACHE_H
+
+
+#include <platform.h>
+#include <policy.h>
+
+
+/**
+ * Cache of parsed policy files, in the "policy_cache" directory of the
+ * state directory, so that unchanged policy files don't need to be lexed
+ * and parsed by every agent run.
+ *
+ * An entry is named after the digest of the contents of the policy file and
+ * the agent type it was parsed for, since the parser leaves out the bundles
+ * other agents would not run. It holds a compact binary serialization of
+ * the policy parsed from the file: a table
+ * of the interned strings, followed by the bundles, bodies and promise
+ * blocks as 32-bit words, strings being referred to by their offset in the
+ * table. Entries are mapped into memory to be read and are only used by the
+ * same version of CFEngine which wrote them.
+ */
+
+/**
+ * @param hash digest of the contents of the policy file, as printed by
+ *             HashPrintSafe()
+ * @param source_path path of the policy file, set as the source path of the
+ *                    loaded bundles and bodies
+ * @return the policy cached for #hash, NULL if none
+ */
+Policy *PolicyCacheLoad(const char *hash, AgentType agent_type, const char *source_path);
+
+/**
+ * @param policy policy parsed for #agent_type from a single file, whose
+ *               contents hash to #hash
+ */
+bool PolicyCacheStore(const char *hash, AgentType agent_type, const Policy *policy);
+
+#endif
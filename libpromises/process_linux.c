@@ -27,6 +27,9 @@
 #include <process_lib.h>
 #include <process_unix_priv.h>
 #include <files_lib.h>
+#include <file_lib.h>                                          /* FullRead */
+#include <alloc.h>
+#include <string_lib.h>                                       /* StringEqual */
 
 
 typedef struct
@@ -158,3 +161,525 @@ ProcessState GetProcessState(pid_t pid)
         return PROCESS_STATE_DOES_NOT_EXIST;
     }
 }
+
+/* Process table */
+
+/**
+ * Read a whole /proc file into a '\0'-terminated, allocated buffer.
+ *
+ * @return NULL if it cannot be read, e.g. because the process is gone
+ */
+static char *ReadProcFile(const char *filename, size_t *length)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+    {
+        return NULL;
+    }
+
+    size_t size = 4096, len = 0;
+    char *buf = xmalloc(size);
+    for (;;)
+    {
+        int res = FullRead(fd, buf + len, size - len - 1); /* -1 for the '\0' */
+        if (res < 0)
+        {
+            close(fd);
+            free(buf);
+            return NULL;
+        }
+        len += res;
+        if (len < size - 1)
+        {
+            break;              /* FullRead() only stops short at EOF */
+        }
+        size *= 2;
+        buf = xrealloc(buf, size);
+    }
+    close(fd);
+
+    buf[len] = '\0';
+    if (length != NULL)
+    {
+        *length = len;
+    }
+    return buf;
+}
+
+/**
+ * @return the value of the first line starting with #key in #filename
+ */
+static bool ReadProcKeyValue(const char *filename, const char *key,
+                             unsigned long long *value)
+{
+    char *contents = ReadProcFile(filename, NULL);
+    if (contents == NULL)
+    {
+        return false;
+    }
+
+    const size_t key_len = strlen(key);
+    bool found = false;
+    for (const char *line = contents; line != NULL && *line != '\0';)
+    {
+        if (strncmp(line, key, key_len) == 0)
+        {
+            found = (sscanf(line + key_len, "%llu", value) == 1);
+            break;
+        }
+        line = strchr(line, '\n');
+        if (line != NULL)
+        {
+            line++;
+        }
+    }
+
+    free(contents);
+    return found;
+}
+
+typedef struct
+{
+    uid_t uid;
+    char *name;
+} UserName;
+
+static void UserNameDestroy(void *p)
+{
+    UserName *user = p;
+    free(user->name);
+    free(user);
+}
+
+/* Processes are owned by few users, don't ask NSS for every one. */
+static const char *GetUserName(Seq *users, uid_t uid)
+{
+    for (size_t i = 0; i < SeqLength(users); i++)
+    {
+        const UserName *user = SeqAt(users, i);
+        if (user->uid == uid)
+        {
+            return user->name;
+        }
+    }
+
+    UserName *user = xmalloc(sizeof(UserName));
+    user->uid = uid;
+    struct passwd *pw = getpwuid(uid);
+    if (pw != NULL)
+    {
+        user->name = xstrdup(pw->pw_name);
+    }
+    else
+    {
+        xasprintf(&user->name, "%ju", (uintmax_t) uid);
+    }
+    SeqAppend(users, user);
+    return user->name;
+}
+
+/* Name of the terminal like ps' tname, for the usual kinds of terminals. */
+static char *TtyName(unsigned int tty_nr)
+{
+    const unsigned int major = (tty_nr >> 8) & 0xfff;
+    const unsigned int minor = (tty_nr & 0xff) | ((tty_nr >> 12) & 0xfff00);
+
+    char *name;
+    if (tty_nr == 0)
+    {
+        name = xstrdup("?");
+    }
+    else if (major >= 136 && major <= 143)
+    {
+        xasprintf(&name, "pts/%u", (major - 136) * 256 + minor);
+    }
+    else if (major == 4 && minor < 64)
+    {
+        xasprintf(&name, "tty%u", minor);
+    }
+    else if (major == 4)
+    {
+        xasprintf(&name, "ttyS%u", minor - 64);
+    }
+    else
+    {
+        xasprintf(&name, "%u,%u", major, minor);
+    }
+    return name;
+}
+
+/* The command line with spaces between arguments, like ps' args. */
+static char *CommandLine(const char *cmdline, size_t len, const char *comm,
+                         char state)
+{
+    while (len > 0 && cmdline[len - 1] == '\0')
+    {
+        len--;
+    }
+
+    if (len == 0)
+    {
+        /* Kernel threads and zombies have none. */
+        char *command;
+        xasprintf(&command, "[%s]%s", comm,
+                  (state == 'Z') ? " <defunct>" : "");
+        return command;
+    }
+
+    char *command = xmalloc(len + 1);
+    for (size_t i = 0; i < len; i++)
+    {
+        const unsigned char c = cmdline[i];
+        if (c == '\0')
+        {
+            command[i] = ' ';
+        }
+        else if (c < ' ' || c == 0x7f)
+        {
+            command[i] = '?';
+        }
+        else
+        {
+            command[i] = c;
+        }
+    }
+    command[len] = '\0';
+    return command;
+}
+
+/* The usage relative to the lifetime of the process, which goes on. */
+static void UpdateProcessUsage(ProcessInfo *info, unsigned long long mem_total,
+                               time_t now)
+{
+    const long ticks = sysconf(_SC_CLK_TCK);
+    const time_t lifetime = now - info->start_time;
+
+    info->pcpu = 0;
+    if (lifetime > 0)
+    {
+        info->pcpu = ((double) info->cpu_ticks / ticks) * 100 / lifetime;
+    }
+    info->pmem = 0;
+    if (mem_total > 0)
+    {
+        info->pmem = (double) info->rss * 100 / mem_total;
+    }
+}
+
+/**
+ * Find the command name in /proc/<pid>/stat: <pid> (<comm>) <state> ...,
+ * and comm may contain anything.
+ *
+ * @return what follows the command name, or NULL if the contents are bad
+ */
+static const char *StatComm(const char *stat, size_t len,
+                            const char **comm, size_t *comm_len)
+{
+    const char *start = strchr(stat, '(');
+    const char *end = memrchr(stat, ')', len);
+    if (start == NULL || end == NULL || end < start)
+    {
+        return NULL;
+    }
+    *comm = start + 1;
+    *comm_len = end - (start + 1);
+    return end + 1;
+}
+
+/**
+ * The effective uid of a process, from /proc/<pid>/status.
+ */
+static bool ReadProcessUid(const char *proc_dir, pid_t pid, uintmax_t *uid)
+{
+    char filename[PATH_MAX];
+    xsnprintf(filename, sizeof(filename), "%s/%jd/status", proc_dir, (intmax_t) pid);
+    char *status = ReadProcFile(filename, NULL);
+    if (status == NULL)
+    {
+        return false;
+    }
+    const char *uid_line = (strncmp(status, "Uid:", 4) == 0) ?
+        status : strstr(status, "\nUid:");
+    if (uid_line == NULL ||
+        sscanf(uid_line + ((*uid_line == '\n') ? 5 : 4), "%*u %ju", uid) != 1)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Unexpected contents of '%s'", filename);
+        free(status);
+        return false;
+    }
+    free(status);
+    return true;
+}
+
+/**
+ * The command line of a process as ps shows it, from /proc/<pid>/cmdline.
+ */
+static char *ReadProcessCommand(const char *proc_dir, pid_t pid,
+                                const char *comm, size_t comm_len, char state)
+{
+    char filename[PATH_MAX];
+    xsnprintf(filename, sizeof(filename), "%s/%jd/cmdline", proc_dir, (intmax_t) pid);
+    size_t cmdline_len;
+    char *cmdline = ReadProcFile(filename, &cmdline_len);
+    if (cmdline == NULL)
+    {
+        return NULL;
+    }
+
+    char *comm_copy = xstrndup(comm, comm_len);
+    char *command = CommandLine(cmdline, cmdline_len, comm_copy, state);
+    free(comm_copy);
+    free(cmdline);
+    return command;
+}
+
+/**
+ * Whether an entry of the previous table, whose /proc/<pid>/stat didn't
+ * change, still describes the process. A process can change its euid and
+ * its arguments without that showing in stat.
+ */
+static bool ProcessInfoStillValid(const char *proc_dir, const ProcessInfo *info)
+{
+    uintmax_t uid;
+    if (!ReadProcessUid(proc_dir, info->pid, &uid) || uid != info->uid)
+    {
+        return false;
+    }
+
+    const char *comm;
+    size_t comm_len;
+    if (StatComm(info->stat, strlen(info->stat), &comm, &comm_len) == NULL)
+    {
+        return false;
+    }
+
+    char *command = ReadProcessCommand(proc_dir, info->pid, comm, comm_len,
+                                       info->state);
+    const bool same = (command != NULL && StringEqual(command, info->command));
+    free(command);
+    return same;
+}
+
+/**
+ * @param stat contents of /proc/<pid>/stat, eaten
+ */
+static ProcessInfo *ReadProcessInfo(const char *proc_dir, pid_t pid,
+                                    char *stat, size_t len,
+                                    Seq *users, time_t boot_time,
+                                    unsigned long long mem_total, time_t now)
+{
+    const char *comm;
+    size_t comm_len;
+    const char *p = StatComm(stat, len, &comm, &comm_len);
+    if (p == NULL)
+    {
+        free(stat);
+        return NULL;
+    }
+
+    char state;
+    int ppid, pgid, tty_nr, nice;
+    long threads;
+    unsigned long long utime, stime, starttime, vsize;
+    long long rss;
+    if (sscanf(p,
+               " %c"   /* state */
+               " %d"   /* ppid */
+               " %d"   /* pgrp */
+               " %*s"  /* session */
+               " %d"   /* tty_nr */
+               " %*s"  /* tpgid */
+               " %*s"  /* flags */
+               " %*s"  /* minflt */
+               " %*s"  /* cminflt */
+               " %*s"  /* majflt */
+               " %*s"  /* cmajflt */
+               " %llu" /* utime */
+               " %llu" /* stime */
+               " %*s"  /* cutime */
+               " %*s"  /* cstime */
+               " %*s"  /* priority */
+               " %d"   /* nice */
+               " %ld"  /* num_threads */
+               " %*s"  /* itrealvalue */
+               " %llu" /* starttime */
+               " %llu" /* vsize */
+               " %lld" /* rss */,
+               &state, &ppid, &pgid, &tty_nr, &utime, &stime, &nice,
+               &threads, &starttime, &vsize, &rss) != 11)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Unexpected contents of '%s/%jd/stat'",
+            proc_dir, (intmax_t) pid);
+        free(stat);
+        return NULL;
+    }
+
+    uintmax_t uid;
+    if (!ReadProcessUid(proc_dir, pid, &uid))
+    {
+        free(stat);
+        return NULL;
+    }
+
+    char *command = ReadProcessCommand(proc_dir, pid, comm, comm_len, state);
+    if (command == NULL)
+    {
+        free(stat);
+        return NULL;
+    }
+
+    const long ticks = sysconf(_SC_CLK_TCK);
+    const long page_kib = sysconf(_SC_PAGESIZE) / 1024;
+
+    ProcessInfo *info = xcalloc(1, sizeof(ProcessInfo));
+    info->pid = pid;
+    info->ppid = ppid;
+    info->pgid = pgid;
+    info->uid = uid;
+    info->user = xstrdup(GetUserName(users, info->uid));
+    info->state = state;
+    info->nice = nice;
+    info->threads = threads;
+    info->vsize = vsize / 1024;
+    info->rss = (rss > 0) ? (unsigned long long) rss * page_kib : 0;
+    info->start_time = boot_time + (time_t) (starttime / ticks);
+    info->cpu_time = (time_t) ((utime + stime) / ticks);
+    info->tty = TtyName(tty_nr);
+    info->command = command;
+    info->stat = stat;
+    info->cpu_ticks = utime + stime;
+    UpdateProcessUsage(info, mem_total, now);
+
+    return info;
+}
+
+void ProcessInfoDestroy(ProcessInfo *info)
+{
+    if (info != NULL)
+    {
+        free(info->user);
+        free(info->tty);
+        free(info->command);
+        free(info->stat);
+        free(info);
+    }
+}
+
+static void ProcessInfoDestroy_untyped(void *info)
+{
+    ProcessInfoDestroy(info);
+}
+
+static int ProcessInfoComparePid(const void *a, const void *b,
+                                 ARG_UNUSED void *user_data)
+{
+    const ProcessInfo *info_a = a, *info_b = b;
+    return (info_a->pid > info_b->pid) - (info_a->pid < info_b->pid);
+}
+
+Seq *RefreshProcessInfoTable(const char *proc_dir, Seq *previous)
+{
+    DIR *dir = opendir(proc_dir);
+    if (dir == NULL)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Could not open '%s' (opendir: %s)",
+            proc_dir, GetErrorStr());
+        SeqDestroy(previous);
+        return NULL;
+    }
+
+    char filename[PATH_MAX];
+    unsigned long long boot_time = 0, mem_total = 0;
+    xsnprintf(filename, sizeof(filename), "%s/stat", proc_dir);
+    if (!ReadProcKeyValue(filename, "btime", &boot_time))
+    {
+        Log(LOG_LEVEL_VERBOSE, "Could not find boot time in '%s'", filename);
+        closedir(dir);
+        SeqDestroy(previous);
+        return NULL;
+    }
+    xsnprintf(filename, sizeof(filename), "%s/meminfo", proc_dir);
+    ReadProcKeyValue(filename, "MemTotal:", &mem_total);
+
+    const time_t now = time(NULL);
+    Seq *users = SeqNew(8, UserNameDestroy);
+    Seq *table = SeqNew(512, ProcessInfoDestroy_untyped);
+    const size_t previous_len = (previous != NULL) ? SeqLength(previous) : 0;
+    bool *reused = xcalloc(previous_len + 1, sizeof(bool));
+    size_t n_reused = 0;
+
+    const struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        char *end;
+        long pid = strtol(entry->d_name, &end, 10);
+        if (*end != '\0' || pid <= 0)
+        {
+            continue;           /* not a process */
+        }
+
+        /* Processes come and go while we read, skip the gone ones. */
+        xsnprintf(filename, sizeof(filename), "%s/%ld/stat", proc_dir, pid);
+        size_t len;
+        char *stat = ReadProcFile(filename, &len);
+        if (stat == NULL)
+        {
+            continue;
+        }
+
+        /* The start time is in there too, so the same contents mean the
+         * same process, and nothing to parse again. Only its owner and
+         * arguments, which stat doesn't show, need checking. */
+        if (previous != NULL)
+        {
+            const ProcessInfo key = { .pid = pid };
+            ssize_t i = SeqBinaryIndexOf(previous, &key, ProcessInfoComparePid);
+            ProcessInfo *info = (i != -1) ? SeqAt(previous, i) : NULL;
+            if (info != NULL && StringEqual(info->stat, stat) &&
+                ProcessInfoStillValid(proc_dir, info))
+            {
+                free(stat);
+                reused[i] = true;
+                n_reused++;
+                UpdateProcessUsage(info, mem_total, now);
+                SeqAppend(table, info);
+                continue;
+            }
+        }
+
+        ProcessInfo *info = ReadProcessInfo(proc_dir, (pid_t) pid, stat, len,
+                                            users, (time_t) boot_time,
+                                            mem_total, now);
+        if (info != NULL)
+        {
+            SeqAppend(table, info);
+        }
+    }
+
+    closedir(dir);
+    SeqDestroy(users);
+
+    if (previous != NULL)
+    {
+        for (size_t i = 0; i < previous_len; i++)
+        {
+            if (!reused[i])
+            {
+                ProcessInfoDestroy(SeqAt(previous, i));
+            }
+        }
+        SeqSoftDestroy(previous);
+
+        Log(LOG_LEVEL_DEBUG, "Reused %zu of %zu processes in the process table",
+            n_reused, SeqLength(table));
+    }
+    free(reused);
+
+    SeqSort(table, ProcessInfoComparePid, NULL);
+    return table;
+}
+
+Seq *ReadProcessInfoTable(const char *proc_dir)
+{
+    return RefreshProcessInfoTable(proc_dir, NULL);
+}
@@ -51,4 +51,56 @@ typedef enum
  */
 ProcessState GetProcessState(pid_t pid);
 
+#ifdef __linux__
+/*
+ * Linux only, the process table read from /proc rather than from ps.
+ */
+
+#include <platform.h>
+#include <sequence.h>
+
+typedef struct
+{
+    pid_t pid;
+    pid_t ppid;
+    pid_t pgid;
+    uid_t uid;                  /* effective */
+    char *user;                 /* name of uid, or uid itself if it has none */
+    char state;                 /* as in /proc/<pid>/stat */
+    int nice;
+    long threads;
+    unsigned long long vsize;   /* KiB */
+    unsigned long long rss;     /* KiB */
+    time_t start_time;          /* Unix time */
+    time_t cpu_time;            /* user and system, seconds */
+    double pcpu;                /* cpu_time over lifetime, in percent */
+    double pmem;                /* rss over total memory, in percent */
+    char *tty;                  /* like ps' tname, "?" if none */
+    char *command;              /* like ps' args */
+
+    /* For RefreshProcessInfoTable() */
+    char *stat;                 /* contents of /proc/<pid>/stat */
+    unsigned long long cpu_ticks;
+} ProcessInfo;
+
+/*
+ * Read all processes from procfs.
+ *
+ * @param proc_dir where procfs is mounted, "/proc" but for tests
+ * @return Seq of ProcessInfo, sorted by PID
+ * @return NULL if proc_dir cannot be read
+ */
+Seq *ReadProcessInfoTable(const char *proc_dir);
+
+/*
+ * Like ReadProcessInfoTable(), but only read /proc/<pid>/stat of the
+ * processes in #previous, and reuse their entries if it did not change.
+ *
+ * @param previous table to reuse, eaten, may be NULL
+ */
+Seq *RefreshProcessInfoTable(const char *proc_dir, Seq *previous);
+
+void ProcessInfoDestroy(ProcessInfo *info);
+#endif
+
 #endif
@@ -55,6 +55,17 @@
 #endif
 TABLE_STORAGE Item *PROCESSTABLE = NULL;
 
+#ifdef __linux__
+#include <process_unix_priv.h>
+
+/* The processes of PROCESSTABLE (after its header line) in the same order,
+ * when it was read from /proc rather than from ps. */
+static Seq *PROCESSINFO = NULL; /* GLOBAL_X */
+
+/* PROCESSINFO before ClearProcessTable(), to refresh rather than reread. */
+static Seq *PREVIOUS_PROCESSINFO = NULL; /* GLOBAL_X */
+#endif
+
 typedef enum
 {
     /*
@@ -134,6 +145,108 @@ static void ApplyPlatformExtraTable(char **names, char **columns);
 
 /***************************************************************************/
 
+/* The process_select attributes a process matched. */
+typedef struct
+{
+    bool owner;
+    bool pid;
+    bool ppid;
+    bool pgid;
+    bool vsize;
+    bool rsize;
+    bool ttime;
+    bool stime;
+    bool priority;
+    bool threads;
+    bool status;
+    bool command;
+    bool tty;
+} ProcessSelectMatches;
+
+static void AddProcessSelectAttribute(StringSet *attributes, bool *unmatched,
+                                      const char *name, bool matched,
+                                      bool specified)
+{
+    if (matched)
+    {
+        StringSetAdd(attributes, xstrdup(name));
+    }
+    else if (specified)
+    {
+        *unmatched = true;
+    }
+}
+
+static bool EvalProcessSelect(const ProcessSelect *a,
+                              const ProcessSelectMatches *m)
+{
+    StringSet *process_select_attributes = StringSetNew();
+    bool unmatched_attribute = false;
+
+    AddProcessSelectAttribute(process_select_attributes, &unmatched_attribute,
+                              "process_owner", m->owner, a->owner != NULL);
+    AddProcessSelectAttribute(process_select_attributes, &unmatched_attribute,
+                              "pid", m->pid, a->min_pid != CF_NOINT);
+    AddProcessSelectAttribute(process_select_attributes, &unmatched_attribute,
+                              "ppid", m->ppid, a->min_ppid != CF_NOINT);
+    AddProcessSelectAttribute(process_select_attributes, &unmatched_attribute,
+                              "pgid", m->pgid, a->min_pgid != CF_NOINT);
+    AddProcessSelectAttribute(process_select_attributes, &unmatched_attribute,
+                              "vsize", m->vsize, a->min_vsize != CF_NOINT);
+    AddProcessSelectAttribute(process_select_attributes, &unmatched_attribute,
+                              "rsize", m->rsize, a->min_rsize != CF_NOINT);
+    AddProcessSelectAttribute(process_select_attributes, &unmatched_attribute,
+                              "ttime", m->ttime, a->min_ttime != CF_NOINT);
+    AddProcessSelectAttribute(process_select_attributes, &unmatched_attribute,
+                              "stime", m->stime, a->min_stime != CF_NOINT);
+    AddProcessSelectAttribute(process_select_attributes, &unmatched_attribute,
+                              "priority", m->priority, a->min_pri != CF_NOINT);
+    AddProcessSelectAttribute(process_select_attributes, &unmatched_attribute,
+                              "threads", m->threads, a->min_thread != CF_NOINT);
+    AddProcessSelectAttribute(process_select_attributes, &unmatched_attribute,
+                              "status", m->status, a->status != NULL);
+    AddProcessSelectAttribute(process_select_attributes, &unmatched_attribute,
+                              "command", m->command, a->command != NULL);
+    AddProcessSelectAttribute(process_select_attributes, &unmatched_attribute,
+                              "tty", m->tty, a->tty != NULL);
+
+    bool result;
+    if (!a->process_result)
+    {
+        if (StringSetSize(process_select_attributes) == 0)
+        {
+            result = EvalProcessResult("", process_select_attributes);
+        }
+        else if (unmatched_attribute)
+        {
+            result = EvalProcessResult("", process_select_attributes);
+        }
+        else
+        {
+            Writer *w = StringWriter();
+            StringSetIterator iter = StringSetIteratorInit(process_select_attributes);
+            char *attr = StringSetIteratorNext(&iter);
+            WriterWrite(w, attr);
+
+            while ((attr = StringSetIteratorNext(&iter)))
+            {
+                WriterWriteChar(w, '.');
+                WriterWrite(w, attr);
+            }
+
+            result = EvalProcessResult(StringWriterData(w), process_select_attributes);
+            WriterClose(w);
+        }
+    }
+    else
+    {
+        result = EvalProcessResult(a->process_result, process_select_attributes);
+    }
+
+    StringSetDestroy(process_select_attributes);
+    return result;
+}
+
 static bool SelectProcess(const char *procentry,
                           time_t pstime,
                           char **names,
@@ -150,9 +263,6 @@ static bool SelectProcess(const char *procentry,
     assert(process_regex);
     assert(a != NULL);
 
-    StringSet *process_select_attributes = StringSetNew();
-    bool unmatched_attribute = false;
-
     memset(column, 0, sizeof(column));
 
     if (!SplitProcLine(procentry, pstime, names, start, end,
@@ -182,6 +292,8 @@ static bool SelectProcess(const char *procentry,
         goto cleanup;
     }
 
+    ProcessSelectMatches m = { 0 };
+
     for (rp = a->owner; rp != NULL; rp = rp->next)
     {
         if (rp->val.type == RVAL_TYPE_FNCALL)
@@ -192,167 +304,108 @@ static bool SelectProcess(const char *procentry,
         }
         else if (SelectProcRegexMatch("USER", "UID", RlistScalarValue(rp), true, names, column))
         {
-            StringSetAdd(process_select_attributes, xstrdup("process_owner"));
+            m.owner = true;
             break;
         }
     }
 
-    if (a->owner && !StringSetContains(process_select_attributes, "process_owner"))
-    {
-        unmatched_attribute = true;
-    }
-
-    if (SelectProcRangeMatch("PID", "PID", a->min_pid, a->max_pid, names, column))
-    {
-        StringSetAdd(process_select_attributes, xstrdup("pid"));
-    }
-    else if (a->min_pid != CF_NOINT)
-    {
-        unmatched_attribute = true;
-    }
-
-    if (SelectProcRangeMatch("PPID", "PPID", a->min_ppid, a->max_ppid, names, column))
-    {
-        StringSetAdd(process_select_attributes, xstrdup("ppid"));
-    }
-    else if (a->min_ppid != CF_NOINT)
-    {
-        unmatched_attribute = true;
-    }
-
-    if (SelectProcRangeMatch("PGID", "PGID", a->min_pgid, a->max_pgid, names, column))
-    {
-        StringSetAdd(process_select_attributes, xstrdup("pgid"));
-    }
-    else if (a->min_pgid != CF_NOINT)
-    {
-        unmatched_attribute = true;
-    }
+    m.pid = SelectProcRangeMatch("PID", "PID", a->min_pid, a->max_pid, names, column);
+    m.ppid = SelectProcRangeMatch("PPID", "PPID", a->min_ppid, a->max_ppid, names, column);
+    m.pgid = SelectProcRangeMatch("PGID", "PGID", a->min_pgid, a->max_pgid, names, column);
+    m.vsize = SelectProcRangeMatch("VSZ", "SZ", a->min_vsize, a->max_vsize, names, column);
+    m.rsize = SelectProcRangeMatch("RSS", "RSS", a->min_rsize, a->max_rsize, names, column);
+    m.ttime = SelectProcTimeCounterRangeMatch("TIME", "TIME", a->min_ttime, a->max_ttime, names, column);
+    m.stime = SelectProcTimeAbsRangeMatch("STIME", "START", a->min_stime, a->max_stime, names, column);
+    m.priority = SelectProcRangeMatch("NI", "PRI", a->min_pri, a->max_pri, names, column);
+    m.threads = SelectProcRangeMatch("NLWP", "NLWP", a->min_thread, a->max_thread, names, column);
+    m.status = SelectProcRegexMatch("S", "STAT", a->status, true, names, column);
+    m.command = SelectProcRegexMatch("CMD", "COMMAND", a->command, true, names, column);
+    m.tty = SelectProcRegexMatch("TTY", "TTY", a->tty, true, names, column);
 
-    if (SelectProcRangeMatch("VSZ", "SZ", a->min_vsize, a->max_vsize, names, column))
-    {
-        StringSetAdd(process_select_attributes, xstrdup("vsize"));
-    }
-    else if (a->min_vsize != CF_NOINT)
-    {
-        unmatched_attribute = true;
-    }
+    result = EvalProcessSelect(a, &m);
 
-    if (SelectProcRangeMatch("RSS", "RSS", a->min_rsize, a->max_rsize, names, column))
-    {
-        StringSetAdd(process_select_attributes, xstrdup("rsize"));
-    }
-    else if (a->min_rsize != CF_NOINT)
+cleanup:
+    for (int i = 0; column[i] != NULL; i++)
     {
-        unmatched_attribute = true;
+        free(column[i]);
     }
 
-    if (SelectProcTimeCounterRangeMatch("TIME", "TIME", a->min_ttime, a->max_ttime, names, column))
-    {
-        StringSetAdd(process_select_attributes, xstrdup("ttime"));
-    }
-    else if (a->min_ttime != CF_NOINT)
-    {
-        unmatched_attribute = true;
-    }
+    return result;
+}
 
-    if (SelectProcTimeAbsRangeMatch
-        ("STIME", "START", a->min_stime, a->max_stime, names, column))
-    {
-        StringSetAdd(process_select_attributes, xstrdup("stime"));
-    }
-    else if (a->min_stime != CF_NOINT)
+#ifdef __linux__
+static bool SelectProcessInfoRange(const char *name, intmax_t value,
+                                   intmax_t min, intmax_t max)
+{
+    if ((min == CF_NOINT) || (max == CF_NOINT))
     {
-        unmatched_attribute = true;
+        return false;
     }
 
-    if (SelectProcRangeMatch("NI", "PRI", a->min_pri, a->max_pri, names, column))
+    if ((min <= value) && (value <= max))
     {
-        StringSetAdd(process_select_attributes, xstrdup("priority"));
-    }
-    else if (a->min_pri != CF_NOINT)
-    {
-        unmatched_attribute = true;
+        Log(LOG_LEVEL_VERBOSE, "Selection filter matched '%s' = %jd in [%jd,%jd]",
+            name, value, min, max);
+        return true;
     }
+    return false;
+}
 
-    if (SelectProcRangeMatch("NLWP", "NLWP", a->min_thread, a->max_thread, names, column))
-    {
-        StringSetAdd(process_select_attributes, xstrdup("threads"));
-    }
-    else if (a->min_thread != CF_NOINT)
-    {
-        unmatched_attribute = true;
-    }
+/* SelectProcess() on a process read from /proc, no columns to split. */
+static bool SelectProcessInfo(const ProcessInfo *info,
+                              const char *process_regex,
+                              const ProcessSelect *a,
+                              bool attrselect)
+{
+    assert(info != NULL);
+    assert(process_regex);
+    assert(a != NULL);
 
-    if (SelectProcRegexMatch("S", "STAT", a->status, true, names, column))
-    {
-        StringSetAdd(process_select_attributes, xstrdup("status"));
-    }
-    else if (a->status)
+    size_t s, e;
+    if (!StringMatch(process_regex, info->command, &s, &e))
     {
-        unmatched_attribute = true;
+        return false;
     }
 
-    if (SelectProcRegexMatch("CMD", "COMMAND", a->command, true, names, column))
-    {
-        StringSetAdd(process_select_attributes, xstrdup("command"));
-    }
-    else if (a->command)
+    if (!attrselect)
     {
-        unmatched_attribute = true;
+        return true;
     }
 
-    if (SelectProcRegexMatch("TTY", "TTY", a->tty, true, names, column))
-    {
-        StringSetAdd(process_select_attributes, xstrdup("tty"));
-    }
-    else if (a->tty)
-    {
-        unmatched_attribute = true;
-    }
+    ProcessSelectMatches m = { 0 };
 
-    if (!a->process_result)
+    for (const Rlist *rp = a->owner; rp != NULL; rp = rp->next)
     {
-        if (StringSetSize(process_select_attributes) == 0)
-        {
-            result = EvalProcessResult("", process_select_attributes);
-        }
-        else if (unmatched_attribute)
+        if (rp->val.type == RVAL_TYPE_FNCALL)
         {
-            result = EvalProcessResult("", process_select_attributes);
+            Log(LOG_LEVEL_VERBOSE,
+                "Function call '%s' in process_select body was not resolved, skipping",
+                RlistFnCallValue(rp)->name);
         }
-        else
+        else if (StringMatchFull(RlistScalarValue(rp), info->user))
         {
-            Writer *w = StringWriter();
-            StringSetIterator iter = StringSetIteratorInit(process_select_attributes);
-            char *attr = StringSetIteratorNext(&iter);
-            WriterWrite(w, attr);
-
-            while ((attr = StringSetIteratorNext(&iter)))
-            {
-                WriterWriteChar(w, '.');
-                WriterWrite(w, attr);
-            }
-
-            result = EvalProcessResult(StringWriterData(w), process_select_attributes);
-            WriterClose(w);
+            m.owner = true;
+            break;
         }
     }
-    else
-    {
-        result = EvalProcessResult(a->process_result, process_select_attributes);
-    }
-
-cleanup:
-    StringSetDestroy(process_select_attributes);
 
-    for (int i = 0; column[i] != NULL; i++)
-    {
-        free(column[i]);
-    }
+    m.pid = SelectProcessInfoRange("pid", info->pid, a->min_pid, a->max_pid);
+    m.ppid = SelectProcessInfoRange("ppid", info->ppid, a->min_ppid, a->max_ppid);
+    m.pgid = SelectProcessInfoRange("pgid", info->pgid, a->min_pgid, a->max_pgid);
+    m.vsize = SelectProcessInfoRange("vsize", info->vsize, a->min_vsize, a->max_vsize);
+    m.rsize = SelectProcessInfoRange("rsize", info->rss, a->min_rsize, a->max_rsize);
+    m.ttime = SelectProcessInfoRange("ttime", info->cpu_time, a->min_ttime, a->max_ttime);
+    m.stime = SelectProcessInfoRange("stime", info->start_time, a->min_stime, a->max_stime);
+    m.priority = SelectProcessInfoRange("priority", info->nice, a->min_pri, a->max_pri);
+    m.threads = SelectProcessInfoRange("threads", info->threads, a->min_thread, a->max_thread);
+    /* Linux ps is not asked for the state either, so status never matches. */
+    m.status = false;
+    m.command = (a->command != NULL && StringMatchFull(a->command, info->command));
+    m.tty = (a->tty != NULL && StringMatchFull(a->tty, info->tty));
 
-    return result;
+    return EvalProcessSelect(a, &m);
 }
+#endif
 
 Item *SelectProcesses(const char *process_name, const ProcessSelect *a, bool attrselect)
 {
@@ -369,6 +422,23 @@ Item *SelectProcesses(const char *process_name, const ProcessSelect *a, bool att
     int start[CF_PROCCOLS];
     int end[CF_PROCCOLS];
 
+#ifdef __linux__
+    if (PROCESSINFO != NULL)
+    {
+        const Item *ip = processes->next;
+        for (size_t i = 0; i < SeqLength(PROCESSINFO); i++, ip = ip->next)
+        {
+            const ProcessInfo *info = SeqAt(PROCESSINFO, i);
+            if (SelectProcessInfo(info, process_name, a, attrselect))
+            {
+                PrependItem(&result, ip->name, "");
+                result->counter = (int) info->pid;
+            }
+        }
+        return result;
+    }
+#endif
+
     GetProcessColumnNames(processes->name, names, start, end);
 
     /* TODO: use actual time of ps-run, as time(NULL) may be later. */
@@ -1089,6 +1159,19 @@ bool IsProcessNameRunning(char *procNameRegex)
         Log(LOG_LEVEL_ERR, "IsProcessNameRunning: PROCESSTABLE is empty");
         return false;
     }
+
+#ifdef __linux__
+    if (PROCESSINFO != NULL)
+    {
+        for (size_t i = 0; !matched && i < SeqLength(PROCESSINFO); i++)
+        {
+            const ProcessInfo *info = SeqAt(PROCESSINFO, i);
+            matched = StringMatchFull(procNameRegex, info->command);
+        }
+        return matched;
+    }
+#endif
+
     /* TODO: use actual time of ps-run, not time(NULL), which may be later. */
     time_t pstime = time(NULL);
 
@@ -1664,6 +1747,149 @@ static inline void ApplyPlatformExtraTable(ARG_UNUSED char **names, ARG_UNUSED c
 #endif
 
 #ifndef _WIN32
+/**
+ * Save the process table in the state directory, and the processes of root
+ * and of other users separately. Eats #rootprocs and #otherprocs.
+ */
+static void SaveProcessTable(Item *rootprocs, Item *otherprocs)
+{
+    char filename[CF_MAXVARSIZE];
+    const char* const statedir = GetStateDir();
+
+    snprintf(filename, sizeof(filename), "%s%ccf_procs", statedir, FILE_SEPARATOR);
+    RawSaveItemList(PROCESSTABLE, filename, NewLineMode_Unix);
+
+    if (otherprocs)
+    {
+        PrependItem(&rootprocs, otherprocs->name, NULL);
+    }
+
+    // TODO: Change safe_fopen() to default to 0600, then remove this.
+    const mode_t old_umask = SetUmask(0077);
+
+    snprintf(filename, sizeof(filename), "%s%ccf_rootprocs", statedir, FILE_SEPARATOR);
+    RawSaveItemList(rootprocs, filename, NewLineMode_Unix);
+    DeleteItemList(rootprocs);
+
+    snprintf(filename, sizeof(filename), "%s%ccf_otherprocs", statedir, FILE_SEPARATOR);
+    RawSaveItemList(otherprocs, filename, NewLineMode_Unix);
+    DeleteItemList(otherprocs);
+
+    RestoreUmask(old_umask);
+}
+
+static void SplitRootProcesses(Item **rootprocs, Item **otherprocs)
+{
+    Item *root = NULL, *other = NULL;
+    for (const Item *ip = PROCESSTABLE; ip != NULL; ip = ip->next)
+    {
+        PrependItem((strstr(ip->name, "root") != NULL) ? &root : &other,
+                    ip->name, NULL);
+    }
+
+    *rootprocs = ReverseItemList(root);
+    *otherprocs = ReverseItemList(other);
+}
+
+# ifdef __linux__
+/* Start time like ps' stime: time of day, day of the year or year. */
+static void FormatProcessStartTime(char *buf, size_t size,
+                                   time_t start_time, time_t now)
+{
+    struct tm start, today;
+    localtime_r(&start_time, &start);
+    localtime_r(&now, &today);
+
+    if (now - start_time < 24 * 3600)
+    {
+        strftime(buf, size, "%H:%M", &start);
+    }
+    else if (start.tm_year == today.tm_year)
+    {
+        strftime(buf, size, "%b%d", &start);
+    }
+    else
+    {
+        strftime(buf, size, "%Y", &start);
+    }
+}
+
+/* Duration like ps' time, [dd-]hh:mm:ss, or like etime, [[dd-]hh:]mm:ss. */
+static void FormatProcessDuration(char *buf, size_t size, time_t duration,
+                                  bool elapsed)
+{
+    const intmax_t secs = MAX(duration, 0);
+    const intmax_t days = secs / (24 * 3600);
+    const intmax_t hours = secs / 3600 % 24;
+    const intmax_t minutes = secs / 60 % 60;
+
+    if (days > 0)
+    {
+        snprintf(buf, size, "%jd-%02jd:%02jd:%02jd", days, hours, minutes, secs % 60);
+    }
+    else if (hours > 0 || !elapsed)
+    {
+        snprintf(buf, size, "%02jd:%02jd:%02jd", hours, minutes, secs % 60);
+    }
+    else
+    {
+        snprintf(buf, size, "%02jd:%02jd", minutes, secs % 60);
+    }
+}
+
+#define PROC_TABLE_LINE_FORMAT(d, f, llu, ld) \
+    "%-30s %7" d " %7" d " %7" d " %5" f " %5" f " %9" llu " %3" d \
+    " %9" llu " %-8s %4" ld " %5s %11s %11s %s"
+
+/**
+ * Read the process table from /proc instead of running ps, and keep the
+ * parsed processes in PROCESSINFO for SelectProcesses(). The lines have the
+ * same columns as the ones of ps on Linux. Only the processes that changed
+ * since the previous table are read in full again.
+ */
+static bool LoadProcessTableFromProc(void)
+{
+    Seq *table = RefreshProcessInfoTable("/proc", PREVIOUS_PROCESSINFO);
+    PREVIOUS_PROCESSINFO = NULL;
+    if (table == NULL)
+    {
+        return false;
+    }
+
+    Log(LOG_LEVEL_VERBOSE, "Observe process table from /proc");
+
+    Item *lines = NULL;
+    char *line;
+    xasprintf(&line, PROC_TABLE_LINE_FORMAT("s", "s", "s", "s"),
+              "USER", "PID", "PPID", "PGID", "%CPU", "%MEM", "VSZ", "NI",
+              "RSS", "TTY", "NLWP", "STIME", "ELAPSED", "TIME", "COMMAND");
+    PrependItem(&lines, line, NULL);
+    free(line);
+
+    const time_t now = time(NULL);
+    for (size_t i = 0; i < SeqLength(table); i++)
+    {
+        const ProcessInfo *info = SeqAt(table, i);
+        char stime[16], elapsed[32], cpu_time[32];
+        FormatProcessStartTime(stime, sizeof(stime), info->start_time, now);
+        FormatProcessDuration(elapsed, sizeof(elapsed), now - info->start_time, true);
+        FormatProcessDuration(cpu_time, sizeof(cpu_time), info->cpu_time, false);
+
+        xasprintf(&line, PROC_TABLE_LINE_FORMAT("jd", ".1f", "llu", "ld"),
+                  info->user, (intmax_t) info->pid, (intmax_t) info->ppid,
+                  (intmax_t) info->pgid, info->pcpu, info->pmem, info->vsize,
+                  (intmax_t) info->nice, info->rss, info->tty, info->threads, stime,
+                  elapsed, cpu_time, info->command);
+        PrependItem(&lines, line, NULL);
+        free(line);
+    }
+
+    PROCESSTABLE = ReverseItemList(lines);
+    PROCESSINFO = table;
+    return true;
+}
+# endif /* __linux__ */
+
 bool LoadProcessTable()
 {
     FILE *prp;
@@ -1680,6 +1906,17 @@ bool LoadProcessTable()
 
     LoadPlatformExtraTable();
 
+# ifdef __linux__
+    /* Not for OpenVZ, vzps hides the processes of the containers. Not for
+     * BusyBox either, its ps shows the state, which /proc lines do not. */
+    if (VPSHARDCLASS == PLATFORM_CONTEXT_LINUX && LoadProcessTableFromProc())
+    {
+        SplitRootProcesses(&rootprocs, &otherprocs);
+        SaveProcessTable(rootprocs, otherprocs);
+        return true;
+    }
+# endif
+
     CheckPsLineLimitations();
 
     const char *psopts = GetProcessOptions();
@@ -1767,13 +2004,6 @@ bool LoadProcessTable()
 
     cf_pclose(prp);
 
-/* Now save the data */
-    const char* const statedir = GetStateDir();
-
-    snprintf(vbuff, CF_MAXVARSIZE, "%s%ccf_procs", statedir, FILE_SEPARATOR);
-
-    RawSaveItemList(PROCESSTABLE, vbuff, NewLineMode_Unix);
-
 # ifdef HAVE_GETZONEID
     if (global_zone) /* pidlist and rootpidlist are empty if we're not in the global zone */
     {
@@ -1795,34 +2025,11 @@ bool LoadProcessTable()
     else
 # endif
     {
-        CopyList(&rootprocs, PROCESSTABLE);
-        CopyList(&otherprocs, PROCESSTABLE);
-
-        while (DeleteItemNotContaining(&rootprocs, "root"))
-        {
-        }
-
-        while (DeleteItemContaining(&otherprocs, "root"))
-        {
-        }
+        SplitRootProcesses(&rootprocs, &otherprocs);
     }
-    if (otherprocs)
-    {
-        PrependItem(&rootprocs, otherprocs->name, NULL);
-    }
-
-    // TODO: Change safe_fopen() to default to 0600, then remove this.
-    const mode_t old_umask = SetUmask(0077);
-
-    snprintf(vbuff, CF_MAXVARSIZE, "%s%ccf_rootprocs", statedir, FILE_SEPARATOR);
-    RawSaveItemList(rootprocs, vbuff, NewLineMode_Unix);
-    DeleteItemList(rootprocs);
 
-    snprintf(vbuff, CF_MAXVARSIZE, "%s%ccf_otherprocs", statedir, FILE_SEPARATOR);
-    RawSaveItemList(otherprocs, vbuff, NewLineMode_Unix);
-    DeleteItemList(otherprocs);
-
-    RestoreUmask(old_umask);
+/* Now save the data */
+    SaveProcessTable(rootprocs, otherprocs);
 
     free(vbuff);
     return true;
@@ -1835,4 +2042,14 @@ void ClearProcessTable(void)
 
     DeleteItemList(PROCESSTABLE);
     PROCESSTABLE = NULL;
+
+#ifdef __linux__
+    /* Processes that did not change since are reused by the next load. */
+    if (PROCESSINFO != NULL)
+    {
+        SeqDestroy(PREVIOUS_PROCESSINFO);
+        PREVIOUS_PROCESSINFO = PROCESSINFO;
+        PROCESSINFO = NULL;
+    }
+#endif
 }
@@ -70,37 +70,59 @@ SpecialScope SpecialScopeFromString(const char *scope)
     {
         return SPECIAL_SCOPE_NONE;
     }
-    else if (strcmp("const", scope) == 0)
-    {
-        return SPECIAL_SCOPE_CONST;
-    }
-    else if (strcmp("edit", scope) == 0)
-    {
-        return SPECIAL_SCOPE_EDIT;
-    }
-    else if (strcmp("match", scope) == 0)
-    {
-        return SPECIAL_SCOPE_MATCH;
-    }
-    else if (strcmp("mon", scope) == 0)
-    {
-        return SPECIAL_SCOPE_MON;
-    }
-    else if (strcmp("sys", scope) == 0)
-    {
-        return SPECIAL_SCOPE_SYS;
-    }
-    else if (strcmp("def", scope) == 0)
-    {
-        return SPECIAL_SCOPE_DEF;
-    }
-    else if (strcmp("this", scope) == 0)
-    {
-        return SPECIAL_SCOPE_THIS;
-    }
-    else if (strcmp("body", scope) == 0)
+
+    /* Called for every variable lookup, so only compare the special scope
+     * names starting with the same character as #scope. */
+    switch (scope[0])
     {
-        return SPECIAL_SCOPE_BODY;
+    case 'b':
+        if (strcmp("body", scope) == 0)
+        {
+            return SPECIAL_SCOPE_BODY;
+        }
+        break;
+    case 'c':
+        if (strcmp("const", scope) == 0)
+        {
+            return SPECIAL_SCOPE_CONST;
+        }
+        break;
+    case 'd':
+        if (strcmp("def", scope) == 0)
+        {
+            return SPECIAL_SCOPE_DEF;
+        }
+        break;
+    case 'e':
+        if (strcmp("edit", scope) == 0)
+        {
+            return SPECIAL_SCOPE_EDIT;
+        }
+        break;
+    case 'm':
+        if (strcmp("match", scope) == 0)
+        {
+            return SPECIAL_SCOPE_MATCH;
+        }
+        else if (strcmp("mon", scope) == 0)
+        {
+            return SPECIAL_SCOPE_MON;
+        }
+        break;
+    case 's':
+        if (strcmp("sys", scope) == 0)
+        {
+            return SPECIAL_SCOPE_SYS;
+        }
+        break;
+    case 't':
+        if (strcmp("this", scope) == 0)
+        {
+            return SPECIAL_SCOPE_THIS;
+        }
+        break;
+    default:
+        break;
     }
 
     /* All other scopes fall here, for example all bundle names. It means that
@@ -25,6 +25,7 @@
 #include <cf3.defs.h>
 #include <timeout.h>
 #include <process_lib.h>
+#include <command_prefetch.h>                     /* CommandPrefetchTimeOut */
 
 void SetTimeOut(int timeout)
 {
@@ -48,6 +49,8 @@ void TimeOut()
     {
         Log(LOG_LEVEL_VERBOSE, "%s> Time out", VPREFIX);
     }
+
+    CommandPrefetchTimeOut();
 }
 
 /*************************************************************************/
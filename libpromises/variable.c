@@ -183,18 +183,19 @@ Variable *VariableTableGet(const VariableTable *table, const VarRef *ref)
 {
     Variable *v = VarMapGet(table->vars, ref);
 
-    char *ref_s = VarRefToString(ref, true);              /* TODO optimise */
-
     if (v != NULL)
     {
+        /* The ref is only turned into a string when it is going to be
+         * printed, this is the hottest path of variable resolution. */
         CF_ASSERT(v->rval.item != NULL || DataTypeIsIterable(v->type),
                   "VariableTableGet(%s): "
                   "Only iterables (Rlists) are allowed to be NULL",
-                  ref_s);
+                  VarRefToString(ref, true));
     }
 
     if (LogModuleEnabled(LOG_MOD_VARTABLE))
     {
+        char *ref_s = VarRefToString(ref, true);
         Buffer *buf = BufferNew();
         BufferPrintf(buf, "VariableTableGet(%s): %s", ref_s,
                      v ? DataTypeToString(v->type) : "NOT FOUND");
@@ -219,9 +220,9 @@ Variable *VariableTableGet(const VariableTable *table, const VarRef *ref)
         LogDebug(LOG_MOD_VARTABLE, "%s", BufferGet(buf));
 
         BufferDestroy(buf);
+        free(ref_s);
     }
 
-    free(ref_s);
     return v;
 }
 
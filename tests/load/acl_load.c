@@ -0,0 +1,248 @@
+#include <cf3.defs.h>
+#include <server_access.h>
+#include <strlist.h>
+#include <misc_lib.h>                                  /* xclock_gettime */
+#include <string_lib.h>                                /* StringStartsWith */
+
+
+/* Replays file requests against the path ACL of cf-serverd, first with the
+ * linear/binary-search engine and then with the compiled one, checking that
+ * both agree. The requests are either read from a cf-serverd verbose log
+ * ("Translated to:" lines), or generated. */
+
+#define NUM_DIRS        200                  /* directory entries in ACL */
+#define NUM_FILES       800                  /* file entries in ACL */
+#define RULES_PER_ENTRY 20                   /* admit_ips per entry */
+#define NUM_REQUESTS    100000               /* generated requests */
+#define ROUNDS          10                   /* times to replay the requests */
+
+typedef struct
+{
+    char *path;
+    char ipaddr[CF_MAX_IP_LEN];
+} Request;
+
+static Request *REQUESTS;
+static size_t NUM_LOADED;
+static size_t ALLOC_LOADED;
+
+
+static void AddRequest(const char *path, const char *ipaddr)
+{
+    if (NUM_LOADED == ALLOC_LOADED)
+    {
+        ALLOC_LOADED = (ALLOC_LOADED == 0) ? 1024 : ALLOC_LOADED * 2;
+        REQUESTS = xrealloc(REQUESTS, ALLOC_LOADED * sizeof(*REQUESTS));
+    }
+    REQUESTS[NUM_LOADED].path = xstrdup(path);
+    strlcpy(REQUESTS[NUM_LOADED].ipaddr, ipaddr,
+            sizeof(REQUESTS[NUM_LOADED].ipaddr));
+    NUM_LOADED++;
+}
+
+static struct acl *MakeACL(void)
+{
+    struct acl *acl = xcalloc(1, sizeof(*acl));
+    char path[PATH_MAX];
+
+    for (int i = 0; i < NUM_DIRS + NUM_FILES; i++)
+    {
+        if (i < NUM_DIRS)
+        {
+            xsnprintf(path, sizeof(path),
+                      "/var/cfengine/masterfiles/dir%03d/", i);
+        }
+        else
+        {
+            xsnprintf(path, sizeof(path),
+                      "/var/cfengine/masterfiles/dir%03d/sub/file%d.cf",
+                      i % NUM_DIRS, i);
+        }
+        size_t pos = acl_SortedInsert(&acl, path);
+        assert(pos != (size_t) -1);
+    }
+
+    for (size_t i = 0; i < acl->len; i++)
+    {
+        char rule[64];
+        for (int j = 0; j < RULES_PER_ENTRY; j++)
+        {
+            xsnprintf(rule, sizeof(rule), "10.%zu.%d.0/24",
+                      i % 256, j);
+            StrList_Append(&acl->acls[i].admit.ips, rule);
+        }
+        xsnprintf(rule, sizeof(rule), "10.%zu.0.13", i % 256);
+        StrList_Append(&acl->acls[i].deny.ips, rule);
+    }
+
+    return acl;
+}
+
+static void GenerateRequests(void)
+{
+    char path[PATH_MAX], ipaddr[CF_MAX_IP_LEN];
+    unsigned int seed = 42;
+
+    for (int i = 0; i < NUM_REQUESTS; i++)
+    {
+        int dir = rand_r(&seed) % (NUM_DIRS + 10);     /* some unlisted */
+        xsnprintf(path, sizeof(path),
+                  "/var/cfengine/masterfiles/dir%03d/sub/file%d.cf",
+                  dir, rand_r(&seed) % (NUM_FILES + NUM_DIRS));
+        xsnprintf(ipaddr, sizeof(ipaddr), "10.%d.%d.%d",
+                  dir % 256, rand_r(&seed) % (RULES_PER_ENTRY + 5),
+                  rand_r(&seed) % 32);
+        AddRequest(path, ipaddr);
+    }
+}
+
+/**
+ * Pick up lines like
+ *   "verbose: 10.1.2.3>        Translated to:     GET /var/cfengine/x"
+ */
+static bool LoadRequestLog(const char *filename)
+{
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL)
+    {
+        perror(filename);
+        return false;
+    }
+
+    char line[CF_BUFSIZE];
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        char *at = strstr(line, "Translated to:");
+        if (at == NULL)
+        {
+            continue;
+        }
+
+        /* The connection's log prefix "<ipaddr>>" precedes it. */
+        char ipaddr[CF_MAX_IP_LEN] = "10.0.0.1";
+        char *end = at;
+        while (end > line && isspace((unsigned char) end[-1]))
+        {
+            end--;
+        }
+        if (end > line && end[-1] == '>')
+        {
+            char *start = --end;
+            while (start > line && !isspace((unsigned char) start[-1]))
+            {
+                start--;
+            }
+            if (end > start && (size_t) (end - start) < sizeof(ipaddr))
+            {
+                memcpy(ipaddr, start, end - start);
+                ipaddr[end - start] = '\0';
+            }
+        }
+
+        char verb[16], path[CF_BUFSIZE];
+        if (sscanf(at + strlen("Translated to:"), "%15s %4095[^\n]",
+                   verb, path) == 2)
+        {
+            AddRequest(path, ipaddr);
+        }
+    }
+
+    fclose(fp);
+    return true;
+}
+
+static double Replay(const struct acl *acl, bool *results, size_t *admitted)
+{
+    struct timespec start, end;
+    xclock_gettime(CLOCK_MONOTONIC, &start);
+
+    *admitted = 0;
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        for (size_t i = 0; i < NUM_LOADED; i++)
+        {
+            results[i] = acl_CheckPath(acl, REQUESTS[i].path,
+                                       REQUESTS[i].ipaddr, "", "SHA=0");
+            *admitted += results[i];
+        }
+    }
+
+    xclock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 2)
+    {
+        fprintf(stderr, "Usage: %s [cf-serverd-verbose-log]\n", argv[0]);
+        return 1;
+    }
+
+    if (argc == 2)
+    {
+        if (!LoadRequestLog(argv[1]))
+        {
+            return 1;
+        }
+    }
+    else
+    {
+        GenerateRequests();
+    }
+
+    if (NUM_LOADED == 0)
+    {
+        fprintf(stderr, "No requests to replay\n");
+        return 1;
+    }
+
+    struct acl *acl = MakeACL();
+    bool *linear   = xcalloc(NUM_LOADED, sizeof(bool));
+    bool *compiled = xcalloc(NUM_LOADED, sizeof(bool));
+    size_t admitted_linear, admitted_compiled;
+
+    double ns_linear = Replay(acl, linear, &admitted_linear);
+    acl_Compile(acl);
+    double ns_compiled = Replay(acl, compiled, &admitted_compiled);
+
+    size_t checks = NUM_LOADED * ROUNDS;
+    printf("%zu ACL entries, %zu requests x %d rounds, %zu admitted\n",
+           acl->len, NUM_LOADED, ROUNDS, admitted_linear / ROUNDS);
+    printf("linear:   %8.1f ns/request\n", ns_linear / checks);
+    printf("compiled: %8.1f ns/request\n", ns_compiled / checks);
+
+    int ret = 0;
+    for (size_t i = 0; i < NUM_LOADED; i++)
+    {
+        if (linear[i] != compiled[i])
+        {
+            printf("MISMATCH: %s from %s: linear=%d compiled=%d\n",
+                   REQUESTS[i].path, REQUESTS[i].ipaddr,
+                   linear[i], compiled[i]);
+            ret = 1;
+        }
+    }
+
+    for (size_t i = 0; i < NUM_LOADED; i++)
+    {
+        free(REQUESTS[i].path);
+    }
+    free(REQUESTS);
+    free(linear);
+    free(compiled);
+    acl_Free(acl);
+
+    return ret;
+}
+
+/* STUBS */
+
+size_t ReplaceSpecialVariables(char *buf, size_t buf_size,
+                               const char *find1, const char *repl1,
+                               const char *find2, const char *repl2,
+                               const char *find3, const char *repl3)
+{
+    /* No "$(connection.*)" entries in the ACL, nothing to mangle. */
+    return 0;
+}
@@ -0,0 +1,179 @@
+#include <cf3.defs.h>
+#include <known_dirs.h>                                      /* GetStateDir */
+#include <locks.h>                      /* WaitForCriticalSection */
+#include <misc_lib.h>                                  /* xclock_gettime */
+#include <sys/wait.h>
+
+
+/* Runs several agents (processes) entering the same critical section, as
+ * AcquireLock() does for every promise, and prints how many sections per
+ * second they get through together and the worst wait. A counter in a file
+ * is incremented inside the section with a read and a write, so any
+ * overlap shows up as lost increments. */
+
+#define DEFAULT_PROCESSES 8
+#define DEFAULT_ITERATIONS 2000
+#define SECTION_ID "CF_CRITICAL_SECTION"
+
+static char CFWORKDIR[CF_BUFSIZE];
+
+
+static void Setup(void)
+{
+    static char env[] = /* Needs to be static for putenv() */
+        "CFENGINE_TEST_OVERRIDE_WORKDIR=/tmp/critical_section_load.XXXXXX";
+
+    char *workdir = strchr(env, '=') + 1; /* start of the path */
+    assert(workdir - 1 && workdir[0] == '/');
+
+    mkdtemp(workdir);
+    strlcpy(CFWORKDIR, workdir, CF_BUFSIZE);
+    putenv(env);
+    mkdir(GetStateDir(), (S_IRWXU | S_IRWXG | S_IRWXO));
+}
+
+static double Elapsed(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * @return the longest wait for the section in microseconds, or -1
+ */
+static long Contend(const char *counter_path, int iterations)
+{
+    int fd = open(counter_path, O_RDWR);
+    if (fd == -1)
+    {
+        perror("open");
+        return -1;
+    }
+
+    double max_wait = 0;
+    for (int i = 0; i < iterations; i++)
+    {
+        struct timespec start, entered;
+        xclock_gettime(CLOCK_MONOTONIC, &start);
+        WaitForCriticalSection(SECTION_ID);
+        xclock_gettime(CLOCK_MONOTONIC, &entered);
+        max_wait = MAX(max_wait, Elapsed(&start, &entered));
+
+        unsigned long counter = 0;
+        if (pread(fd, &counter, sizeof(counter), 0) < 0)
+        {
+            counter = 0;
+        }
+        counter++;
+        if (pwrite(fd, &counter, sizeof(counter), 0) != sizeof(counter))
+        {
+            perror("pwrite");
+        }
+
+        ReleaseCriticalSection(SECTION_ID);
+    }
+
+    close(fd);
+    return (long) (max_wait * 1e6);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 3)
+    {
+        fprintf(stderr, "Usage: %s [processes [iterations]]\n", argv[0]);
+        return 2;
+    }
+    const int processes = (argc > 1) ? atoi(argv[1]) : DEFAULT_PROCESSES;
+    const int iterations = (argc > 2) ? atoi(argv[2]) : DEFAULT_ITERATIONS;
+
+    Setup();
+
+    char counter_path[PATH_MAX];
+    xsnprintf(counter_path, sizeof(counter_path), "%s/counter", CFWORKDIR);
+    int fd = open(counter_path, O_CREAT | O_RDWR | O_TRUNC, 0600);
+    if (fd == -1)
+    {
+        perror("open");
+        return 1;
+    }
+    close(fd);
+
+    struct timespec start, end;
+    xclock_gettime(CLOCK_MONOTONIC, &start);
+
+    int pipes[2];
+    if (pipe(pipes) == -1)
+    {
+        perror("pipe");
+        return 1;
+    }
+    for (int i = 0; i < processes; i++)
+    {
+        pid_t pid = fork();
+        if (pid == -1)
+        {
+            perror("fork");
+            return 1;
+        }
+        if (pid == 0)
+        {
+            close(pipes[0]);
+            long max_wait = Contend(counter_path, iterations);
+            if (write(pipes[1], &max_wait, sizeof(max_wait)) != sizeof(max_wait))
+            {
+                _exit(1);
+            }
+            _exit(max_wait < 0);
+        }
+    }
+    close(pipes[1]);
+
+    int ret = 0;
+    long max_wait = 0;
+    for (int i = 0; i < processes; i++)
+    {
+        int status;
+        long child_wait;
+        if (read(pipes[0], &child_wait, sizeof(child_wait)) == sizeof(child_wait))
+        {
+            max_wait = MAX(max_wait, child_wait);
+        }
+        if (wait(&status) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            ret = 1;
+        }
+    }
+    close(pipes[0]);
+    xclock_gettime(CLOCK_MONOTONIC, &end);
+
+    unsigned long counter = 0;
+    fd = open(counter_path, O_RDONLY);
+    if (fd == -1 || read(fd, &counter, sizeof(counter)) != sizeof(counter))
+    {
+        perror("read");
+        ret = 1;
+    }
+    if (fd != -1)
+    {
+        close(fd);
+    }
+
+    const unsigned long expected = (unsigned long) processes * iterations;
+    const double secs = Elapsed(&start, &end);
+    printf("%d processes x %d sections: %.3f s, %.0f sections/s, longest wait %ld us\n",
+           processes, iterations, secs, expected / secs, max_wait);
+    if (counter != expected)
+    {
+        fprintf(stderr, "Critical section overlapped: counter %lu, expected %lu\n",
+                counter, expected);
+        ret = 1;
+    }
+
+    char command[CF_BUFSIZE];
+    xsnprintf(command, sizeof(command), "rm -rf '%s'", CFWORKDIR);
+    if (system(command) != 0)
+    {
+        ret = 1;
+    }
+    return ret;
+}
@@ -0,0 +1,312 @@
+#include <cf3.defs.h>
+#include <file_stream.h>
+#include <tls_generic.h>                 /* TLSGenericInitialize,TLSGenerate* */
+#include <misc_lib.h>                                  /* xclock_gettime */
+#include <file_lib.h>                                  /* safe_open */
+
+#include <openssl/err.h>
+#include <openssl/rsa.h>
+
+
+/* Copies a file over a loopback TLS connection with the file stream API,
+ * once with the "filestream" protocol (librsync delta, 4 KiB messages) and
+ * then with "bulkstream" (whole file as is, then a delta with 256 KiB
+ * messages), and prints the throughput of each. The file contents are
+ * checked after every transfer. */
+
+#define DEFAULT_SIZE_MB 256
+
+typedef struct
+{
+    SSL_CTX *ctx;
+    int sd;
+    const char *source;
+    ProtocolVersion version;
+    bool success;
+    bool ktls_send;
+} ServerArgs;
+
+static SSL_CTX *SERVER_CTX;
+static SSL_CTX *CLIENT_CTX;
+
+
+static void *ServeOne(void *arg)
+{
+    ServerArgs *args = arg;
+
+    SSL *ssl = SSL_new(args->ctx);
+    SSL_set_fd(ssl, args->sd);
+    if (SSL_accept(ssl) != 1)
+    {
+        fprintf(stderr, "SSL_accept: %s\n",
+                ERR_reason_error_string(ERR_get_error()));
+        args->success = false;
+    }
+    else
+    {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(OPENSSL_NO_KTLS)
+        args->ktls_send = (BIO_get_ktls_send(SSL_get_wbio(ssl)) != 0);
+#endif
+        args->success = FileStreamServe(ssl, args->source, args->version);
+    }
+
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    close(args->sd);
+    return NULL;
+}
+
+static bool SameContents(const char *a, const char *b)
+{
+    FILE *fa = fopen(a, "rb"), *fb = fopen(b, "rb");
+    bool same = (fa != NULL && fb != NULL);
+    char ba[65536], bb[65536];
+
+    while (same)
+    {
+        size_t na = fread(ba, 1, sizeof(ba), fa);
+        size_t nb = fread(bb, 1, sizeof(bb), fb);
+        same = (na == nb && memcmp(ba, bb, na) == 0);
+        if (na == 0)
+        {
+            break;
+        }
+    }
+
+    if (fa != NULL)
+    {
+        fclose(fa);
+    }
+    if (fb != NULL)
+    {
+        fclose(fb);
+    }
+    return same;
+}
+
+static bool WriteRandomFile(const char *path, size_t size, unsigned int seed)
+{
+    FILE *f = fopen(path, "wb");
+    if (f == NULL)
+    {
+        return false;
+    }
+
+    /* Not zeros, or the sparse file handling makes it look too good. */
+    srand(seed);
+    char buf[65536];
+    for (size_t done = 0; done < size; done += sizeof(buf))
+    {
+        for (size_t i = 0; i < sizeof(buf); i++)
+        {
+            buf[i] = rand() & 0xFF;
+        }
+        size_t len = MIN(sizeof(buf), size - done);
+        if (fwrite(buf, 1, len, f) != len)
+        {
+            fclose(f);
+            return false;
+        }
+    }
+
+    return (fclose(f) == 0);
+}
+
+/**
+ * @return the throughput in MB/s, or -1 on failure.
+ */
+static double Transfer(int listen_sd, const struct sockaddr_in *addr,
+                       ProtocolVersion version, const char *source,
+                       const char *basis, const char *dest, size_t size,
+                       bool *ktls_send)
+{
+    int client_sd = socket(AF_INET, SOCK_STREAM, 0);
+    if (client_sd == -1 ||
+        connect(client_sd, (const struct sockaddr *) addr, sizeof(*addr)) == -1)
+    {
+        perror("connect");
+        return -1;
+    }
+
+    ServerArgs args = {
+        .ctx = SERVER_CTX,
+        .sd = accept(listen_sd, NULL, NULL),
+        .source = source,
+        .version = version,
+    };
+    if (args.sd == -1)
+    {
+        perror("accept");
+        close(client_sd);
+        return -1;
+    }
+
+    pthread_t server;
+    pthread_create(&server, NULL, ServeOne, &args);
+
+    SSL *ssl = SSL_new(CLIENT_CTX);
+    SSL_set_fd(ssl, client_sd);
+    bool success = (SSL_connect(ssl) == 1);
+
+    struct timespec start, end;
+    xclock_gettime(CLOCK_MONOTONIC, &start);
+    if (success)
+    {
+        success = FileStreamFetch(ssl, version, basis, dest, 0600, false);
+    }
+    xclock_gettime(CLOCK_MONOTONIC, &end);
+
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    close(client_sd);
+    pthread_join(server, NULL);
+
+    if (!success || !args.success || !SameContents(source, dest))
+    {
+        fprintf(stderr, "Transfer with protocol '%s' failed\n",
+                ProtocolVersionString(version));
+        return -1;
+    }
+
+    *ktls_send = args.ktls_send;
+    double secs = (end.tv_sec - start.tv_sec) +
+                  (end.tv_nsec - start.tv_nsec) / 1e9;
+    return (size / 1e6) / secs;
+}
+
+static bool SetupTLS(void)
+{
+    if (!TLSGenericInitialize())
+    {
+        return false;
+    }
+
+    RSA *key = RSA_new();
+    BIGNUM *e = BN_new();
+    BN_set_word(e, RSA_F4);
+    if (RSA_generate_key_ex(key, 2048, e, NULL) != 1)
+    {
+        return false;
+    }
+    BN_free(e);
+
+    X509 *cert = TLSGenerateCertFromPrivKey(key);
+    if (cert == NULL)
+    {
+        return false;
+    }
+
+    SERVER_CTX = SSL_CTX_new(TLS_server_method());
+    CLIENT_CTX = SSL_CTX_new(TLS_client_method());
+    if (SERVER_CTX == NULL || CLIENT_CTX == NULL)
+    {
+        return false;
+    }
+
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options(SERVER_CTX, SSL_OP_ENABLE_KTLS);
+#endif
+    SSL_CTX_set_mode(SERVER_CTX, SSL_MODE_AUTO_RETRY);
+    SSL_CTX_set_mode(CLIENT_CTX, SSL_MODE_AUTO_RETRY);
+    SSL_CTX_set_verify(CLIENT_CTX, SSL_VERIFY_NONE, NULL);
+
+    return (SSL_CTX_use_certificate(SERVER_CTX, cert) == 1 &&
+            SSL_CTX_use_RSAPrivateKey(SERVER_CTX, key) == 1);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 2)
+    {
+        fprintf(stderr, "Usage: %s [size-in-MB]\n", argv[0]);
+        return 2;
+    }
+    size_t size = (size_t) ((argc == 2) ? atoi(argv[1]) : DEFAULT_SIZE_MB)
+        * 1000 * 1000;
+
+    if (!SetupTLS())
+    {
+        fprintf(stderr, "Failed to set up TLS: %s\n",
+                ERR_reason_error_string(ERR_get_error()));
+        return 1;
+    }
+
+    char dir[] = "/tmp/file_stream_load.XXXXXX";
+    if (mkdtemp(dir) == NULL)
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+    char source[PATH_MAX], basis[PATH_MAX], dest[PATH_MAX];
+    xsnprintf(source, sizeof(source), "%s/source", dir);
+    xsnprintf(basis, sizeof(basis), "%s/basis", dir);
+    xsnprintf(dest, sizeof(dest), "%s/dest", dir);
+
+    if (!WriteRandomFile(source, size, 1))
+    {
+        perror("Writing source file");
+        return 1;
+    }
+
+    int listen_sd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t addr_len = sizeof(addr);
+    if (listen_sd == -1 ||
+        bind(listen_sd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+        listen(listen_sd, 1) == -1 ||
+        getsockname(listen_sd, (struct sockaddr *) &addr, &addr_len) == -1)
+    {
+        perror("listen");
+        return 1;
+    }
+
+    const struct
+    {
+        const char *label;
+        ProtocolVersion version;
+        bool with_basis;
+    } runs[] =
+    {
+        { "filestream, no basis (delta, 4 KiB messages)",   CF_PROTOCOL_FILESTREAM, false },
+        { "bulkstream, no basis (whole file)",              CF_PROTOCOL_BULKSTREAM, false },
+        { "filestream, other basis (delta, 4 KiB messages)", CF_PROTOCOL_FILESTREAM, true },
+        { "bulkstream, other basis (delta, 256 KiB messages)", CF_PROTOCOL_BULKSTREAM, true },
+    };
+
+    int ret = 0;
+    printf("Copying %zu MB over loopback TLS\n", size / 1000 / 1000);
+    for (size_t i = 0; i < sizeof(runs) / sizeof(runs[0]); i++)
+    {
+        unlink(basis);
+        unlink(dest);
+        if (runs[i].with_basis && !WriteRandomFile(basis, size, 2))
+        {
+            perror("Writing basis file");
+            ret = 1;
+            break;
+        }
+
+        bool ktls_send = false;
+        double mbps = Transfer(listen_sd, &addr, runs[i].version,
+                               source, basis, dest, size, &ktls_send);
+        if (mbps < 0)
+        {
+            ret = 1;
+            continue;
+        }
+        printf("%-52s %8.1f MB/s%s\n", runs[i].label, mbps,
+               ktls_send ? " (kTLS)" : "");
+    }
+
+    close(listen_sd);
+    unlink(source);
+    unlink(basis);
+    unlink(dest);
+    rmdir(dir);
+    SSL_CTX_free(SERVER_CTX);
+    SSL_CTX_free(CLIENT_CTX);
+    return ret;
+}
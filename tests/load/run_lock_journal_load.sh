@@ -0,0 +1,63 @@
+#!/bin/sh -e
+#
+# Times cf-agent on a policy of many promises, with the promises' last-run
+# times written one transaction per promise and with the lock journal
+# (body agent control lock_journal) batching them into one transaction.
+#
+# Usage: run_lock_journal_load.sh [cf-agent] [number-of-promises]
+#
+# Not run by "make check", it needs an installed or built cf-agent and takes
+# a while.
+
+AGENT=${1:-../../cf-agent/cf-agent}
+PROMISES=${2:-10000}
+
+WORKDIR=$(mktemp -d /tmp/lock_journal_load.XXXXXX)
+trap 'rm -rf "$WORKDIR"' EXIT
+mkdir -p "$WORKDIR/inputs" "$WORKDIR/state" "$WORKDIR/outputs"
+
+POLICY="$WORKDIR/inputs/promises.cf"
+{
+    cat <<'POLICY'
+body common control
+{
+      bundlesequence => { "load" };
+}
+
+body agent control
+{
+      ifelapsed => "0";
+    journal::
+      lock_journal => "true";
+}
+
+bundle agent load
+{
+  reports:
+POLICY
+    i=0
+    while [ $i -lt "$PROMISES" ]
+    do
+        echo "      \"promise $i\" report_to_file => \"/dev/null\";"
+        i=$((i + 1))
+    done
+    echo "}"
+} > "$POLICY"
+
+export CFENGINE_TEST_OVERRIDE_WORKDIR="$WORKDIR"
+
+run()
+{
+    label=$1
+    shift
+    # Warm up the lock database, then time a run on top of existing locks.
+    "$AGENT" -f "$POLICY" "$@" > /dev/null
+    start=$(date +%s.%N)
+    "$AGENT" -f "$POLICY" "$@" > /dev/null
+    end=$(date +%s.%N)
+    awk -v l="$label" -v s="$start" -v e="$end" 'BEGIN { printf "%s: %.2f s\n", l, e - s }'
+}
+
+echo "cf-agent with $PROMISES promises"
+run "lock journal off" -D nojournal
+run "lock journal on " -D journal
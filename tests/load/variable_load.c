@@ -0,0 +1,76 @@
+#include <cf3.defs.h>
+#include <variable.h>
+#include <misc_lib.h>                       /* xsnprintf, xclock_gettime */
+
+
+/* Looks up variables in a VariableTable, half of them present and half
+ * missing, and prints the number of lookups per second. The results are
+ * checked, so it fails if a present variable isn't found. */
+
+#define NUM_VARS        1000
+#define DEFAULT_LOOKUPS 1000000
+
+int main(int argc, char *argv[])
+{
+    if (argc > 2)
+    {
+        fprintf(stderr, "Usage: %s [lookups]\n", argv[0]);
+        return 2;
+    }
+    const long lookups = (argc == 2) ? atol(argv[1]) : DEFAULT_LOOKUPS;
+    if (lookups <= 0)
+    {
+        fprintf(stderr, "Invalid number of lookups\n");
+        return 2;
+    }
+
+    VariableTable *t = VariableTableNew();
+    VarRef *refs[NUM_VARS];
+
+    for (int i = 0; i < NUM_VARS; i++)
+    {
+        char var_str[64];
+        xsnprintf(var_str, sizeof(var_str), "ns%d:scope%d.lval%d[index%d]",
+                  i % 3, i % 10, i, i % 7);
+        refs[i] = VarRefParse(var_str);
+        Rval rval = (Rval) { var_str, RVAL_TYPE_SCALAR };
+        VariableTablePut(t, refs[i], &rval, CF_DATA_TYPE_STRING, NULL, NULL, NULL);
+    }
+
+    VarRef *missing = VarRefParse("ns0:scope0.missing[index0]");
+
+    struct timespec start, end;
+    xclock_gettime(CLOCK_MONOTONIC, &start);
+    long found = 0;
+    for (long i = 0; i < lookups; i++)
+    {
+        if (VariableTableGet(t, refs[i % NUM_VARS]) != NULL)
+        {
+            found++;
+        }
+        if (VariableTableGet(t, missing) != NULL)
+        {
+            found++;
+        }
+    }
+    xclock_gettime(CLOCK_MONOTONIC, &end);
+
+    const double seconds = (end.tv_sec - start.tv_sec) +
+                           (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%ld lookups in %.3f s, %.0f lookups/s\n", 2 * lookups, seconds,
+           (seconds > 0) ? (2 * lookups / seconds) : 0);
+
+    VarRefDestroy(missing);
+    for (int i = 0; i < NUM_VARS; i++)
+    {
+        VarRefDestroy(refs[i]);
+    }
+    VariableTableDestroy(t);
+
+    if (found != lookups)
+    {
+        fprintf(stderr, "Found %ld variables, expected %ld\n", found, lookups);
+        return 1;
+    }
+    return 0;
+}
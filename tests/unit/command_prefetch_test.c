@@ -0,0 +1,116 @@
+#include <test.h>
+
+#include <cmockery.h>
+#include <policy.h>
+#include <fncall.h>
+#include <rlist.h>
+
+#include <command_prefetch.c>          /* RefersToAssignedVariables */
+
+
+static Promise *AppendVars(BundleSection *section, const char *promiser,
+                           const char *lval, Rval rval)
+{
+    Promise *pp = BundleSectionAppendPromise(section, promiser,
+                                             (Rval) { NULL, RVAL_TYPE_NOPROMISEE },
+                                             "any", NULL);
+    PromiseAppendConstraint(pp, lval, rval, false);
+    return pp;
+}
+
+static void test_refers_to_assigned(void)
+{
+    StringSet *assigned = StringSetNew();
+    StringSetAdd(assigned, xstrdup("dir"));
+    StringSetAdd(assigned, xstrdup("arr"));
+
+    assert_false(RefersToAssignedVariables("/bin/ls /tmp", assigned));
+    assert_false(RefersToAssignedVariables("/bin/ls $(sys.workdir)", assigned));
+    assert_false(RefersToAssignedVariables("/bin/ls ${other}", assigned));
+    assert_false(RefersToAssignedVariables("/bin/echo $$ $", assigned));
+
+    assert_true(RefersToAssignedVariables("/bin/ls $(dir)", assigned));
+    assert_true(RefersToAssignedVariables("/bin/ls ${dir}/x", assigned));
+    assert_true(RefersToAssignedVariables("/bin/ls $(bundle.dir)", assigned));
+    assert_true(RefersToAssignedVariables("/bin/ls $(ns:bundle.dir)", assigned));
+    assert_true(RefersToAssignedVariables("/bin/ls $(arr[key])", assigned));
+    assert_true(RefersToAssignedVariables("/bin/ls $(other[$(dir)])", assigned));
+
+    /* Names made of variables, and the scopes set from promise to promise. */
+    assert_true(RefersToAssignedVariables("/bin/ls $($(name))", assigned));
+    assert_true(RefersToAssignedVariables("/bin/ls $(x$(name))", assigned));
+    assert_true(RefersToAssignedVariables("/bin/ls $(this.promiser)", assigned));
+    assert_true(RefersToAssignedVariables("/bin/ls $(match.1)", assigned));
+
+    /* Any variable, if the section may define any. */
+    assert_false(RefersToAssignedVariables("/bin/ls /tmp", NULL));
+    assert_true(RefersToAssignedVariables("/bin/ls $(sys.workdir)", NULL));
+
+    StringSetDestroy(assigned);
+}
+
+static void test_section_assigned(void)
+{
+    Policy *policy = PolicyNew();
+    Bundle *bundle = PolicyAppendBundle(policy, NamespaceDefault(), "bundle",
+                                        "agent", NULL, NULL,
+                                        EVAL_ORDER_UNDEFINED);
+    BundleSection *section = BundleAppendSection(bundle, "vars");
+    AppendVars(section, "dir", "string", RvalNew("/tmp", RVAL_TYPE_SCALAR));
+    AppendVars(section, "arr[key]", "string", RvalNew("x", RVAL_TYPE_SCALAR));
+
+    Rlist *args = NULL;
+    RlistAppendScalar(&args, "/bin/ls $(dir)");
+    RlistAppendScalar(&args, "noshell");
+    AppendVars(section, "out", "string",
+               (Rval) { FnCallNew("execresult", args), RVAL_TYPE_FNCALL });
+
+    StringSet *assigned = StringSetNew();
+    assert_true(SectionAssignedVariables(section, assigned));
+    assert_int_equal(StringSetSize(assigned), 3);
+    assert_true(StringSetContains(assigned, "dir"));
+    assert_true(StringSetContains(assigned, "arr"));
+    assert_true(StringSetContains(assigned, "out"));
+    StringSetDestroy(assigned);
+
+    /* An array named by an argument, nested in another call. */
+    args = NULL;
+    RlistAppendScalar(&args, "(.*)");
+    RlistAppendScalar(&args, "abc");
+    RlistAppendScalar(&args, "parts");
+    Rlist *outer = NULL;
+    RlistAppendRval(&outer, (Rval) { FnCallNew("regextract", args), RVAL_TYPE_FNCALL });
+    AppendVars(section, "found", "string",
+               (Rval) { FnCallNew("not", outer), RVAL_TYPE_FNCALL });
+
+    assigned = StringSetNew();
+    assert_false(SectionAssignedVariables(section, assigned));
+    StringSetDestroy(assigned);
+
+    /* A promiser made of variables. */
+    Bundle *other_bundle = PolicyAppendBundle(policy, NamespaceDefault(), "other",
+                                              "agent", NULL, NULL,
+                                              EVAL_ORDER_UNDEFINED);
+    BundleSection *other = BundleAppendSection(other_bundle, "vars");
+    AppendVars(other, "$(name)", "string", RvalNew("x", RVAL_TYPE_SCALAR));
+
+    assigned = StringSetNew();
+    assert_false(SectionAssignedVariables(other, assigned));
+    StringSetDestroy(assigned);
+
+    PolicyDestroy(policy);
+}
+
+int main()
+{
+    PRINT_TEST_BANNER();
+    const UnitTest tests[] =
+    {
+        unit_test(test_refers_to_assigned),
+        unit_test(test_section_assigned),
+    };
+
+    int ret = run_tests(tests);
+
+    return ret;
+}
@@ -0,0 +1,139 @@
+#include <test.h>
+
+#include <cf3.defs.h>
+#include <locks.h>
+#include <known_dirs.h>                                      /* GetStateDir */
+#include <misc_lib.h>                                          /* xsnprintf */
+#include <sys/wait.h>
+#include <poll.h>
+
+
+static char CFWORKDIR[CF_BUFSIZE];
+
+static void tests_setup(void)
+{
+    static char env[] = /* Needs to be static for putenv() */
+        "CFENGINE_TEST_OVERRIDE_WORKDIR=/tmp/critical_section_test.XXXXXX";
+
+    char *workdir = strchr(env, '=') + 1; /* start of the path */
+    assert(workdir - 1 && workdir[0] == '/');
+
+    OpenSSL_add_all_digests();
+    mkdtemp(workdir);
+    strlcpy(CFWORKDIR, workdir, CF_BUFSIZE);
+    putenv(env);
+    mkdir(GetStateDir(), (S_IRWXU | S_IRWXG | S_IRWXO));
+}
+
+static void tests_teardown(void)
+{
+    char cmd[CF_BUFSIZE];
+    xsnprintf(cmd, CF_BUFSIZE, "rm -rf '%s'", CFWORKDIR);
+    system(cmd);
+}
+
+/* Whether a byte can be read from #fd within #timeout_ms. */
+static bool Readable(int fd, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    return (poll(&pfd, 1, timeout_ms) == 1);
+}
+
+/**
+ * Fork a process which enters #section_id once told to through the pipe
+ * and then tells so through the other pipe. Forked before the parent enters
+ * a section, which would be entered in the child too otherwise.
+ */
+static pid_t ForkEnterer(const char *section_id, int *go_fd, int *entered_fd)
+{
+    int go[2], entered[2];
+    assert_int_equal(pipe(go), 0);
+    assert_int_equal(pipe(entered), 0);
+
+    pid_t pid = fork();
+    assert_int_not_equal(pid, -1);
+    if (pid == 0)
+    {
+        close(go[1]);
+        close(entered[0]);
+
+        char c;
+        if (read(go[0], &c, 1) != 1)
+        {
+            _exit(1);
+        }
+
+        /* Killed if it has to wait for the whole timeout. */
+        alarm(10);
+        WaitForCriticalSection(section_id);
+        if (write(entered[1], "x", 1) != 1)
+        {
+            _exit(1);
+        }
+        ReleaseCriticalSection(section_id);
+        _exit(0);
+    }
+
+    close(go[0]);
+    close(entered[1]);
+    *go_fd = go[1];
+    *entered_fd = entered[0];
+    return pid;
+}
+
+static void WaitEnterer(pid_t pid, int go_fd, int entered_fd)
+{
+    int status;
+    assert_int_equal(waitpid(pid, &status, 0), pid);
+    assert_true(WIFEXITED(status));
+    assert_int_equal(WEXITSTATUS(status), 0);
+    close(go_fd);
+    close(entered_fd);
+}
+
+static void test_distinct_ids(void)
+{
+    int go_fd, entered_fd;
+    pid_t pid = ForkEnterer("a_b", &go_fd, &entered_fd);
+
+    /* These used to share a lock file. */
+    WaitForCriticalSection("A.b");
+    assert_int_equal(write(go_fd, "x", 1), 1);
+    assert_true(Readable(entered_fd, 5000));
+    ReleaseCriticalSection("A.b");
+
+    WaitEnterer(pid, go_fd, entered_fd);
+}
+
+static void test_wait_for_release(void)
+{
+    int go_fd, entered_fd;
+    pid_t pid = ForkEnterer("section", &go_fd, &entered_fd);
+
+    WaitForCriticalSection("section");
+    assert_int_equal(write(go_fd, "x", 1), 1);
+    assert_false(Readable(entered_fd, 200));
+
+    ReleaseCriticalSection("section");
+    assert_true(Readable(entered_fd, 5000));
+
+    WaitEnterer(pid, go_fd, entered_fd);
+}
+
+int main()
+{
+    PRINT_TEST_BANNER();
+    tests_setup();
+
+    const UnitTest tests[] =
+    {
+        unit_test(test_distinct_ids),
+        unit_test(test_wait_for_release),
+    };
+
+    int ret = run_tests(tests);
+
+    tests_teardown();
+
+    return ret;
+}
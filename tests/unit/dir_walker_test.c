@@ -0,0 +1,234 @@
+#include <test.h>
+
+#include <cmockery.h>
+#include <dir_walker.h>
+#include <alloc.h>
+#include <file_lib.h>
+
+
+/* Directories are FANOUT wide and LEVELS deep, with FILES files each. */
+#define FANOUT 4
+#define LEVELS 3
+#define FILES 3
+
+static char ROOT[64];
+static size_t DIRECTORIES;
+
+
+static void MakeTree(const char *path, int level)
+{
+    char child[PATH_MAX];
+
+    assert_int_equal(mkdir(path, 0700), 0);
+    DIRECTORIES++;
+
+    for (int i = 0; i < FILES; i++)
+    {
+        snprintf(child, sizeof(child), "%s/file%d", path, i);
+        int fd = open(child, O_CREAT | O_WRONLY, 0600);
+        assert_true(fd != -1);
+        close(fd);
+    }
+
+    if (level < LEVELS)
+    {
+        for (int i = 0; i < FANOUT; i++)
+        {
+            snprintf(child, sizeof(child), "%s/dir%d", path, i);
+            MakeTree(child, level + 1);
+        }
+    }
+}
+
+static void RemoveTree(const char *path)
+{
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+    {
+        return;
+    }
+
+    const struct dirent *dirp;
+    char child[PATH_MAX];
+    while ((dirp = readdir(dir)) != NULL)
+    {
+        if (strcmp(dirp->d_name, ".") == 0 || strcmp(dirp->d_name, "..") == 0)
+        {
+            continue;
+        }
+        snprintf(child, sizeof(child), "%s/%s", path, dirp->d_name);
+        struct stat sb;
+        if (lstat(child, &sb) == 0 && S_ISDIR(sb.st_mode))
+        {
+            RemoveTree(child);
+        }
+        else
+        {
+            unlink(child);
+        }
+    }
+    closedir(dir);
+    rmdir(path);
+}
+
+static void setup(void)
+{
+    strcpy(ROOT, "/tmp/dir_walker_test.XXXXXX");
+    assert_true(mkdtemp(ROOT) != NULL);
+    rmdir(ROOT);
+    DIRECTORIES = 0;
+    MakeTree(ROOT, 0);
+}
+
+static void teardown(void)
+{
+    RemoveTree(ROOT);
+}
+
+/**
+ * Walk like DepthSearch() does, checking every listing against readdir().
+ *
+ * @return number of directories entered
+ */
+static size_t Walk(DirWalker *walker, DirListing *parent, size_t index,
+                   const char *path, int rlevel, const struct stat *sb,
+                   int max_level)
+{
+    assert_int_equal(chdir(path), 0);
+    DirListing *listing = DirWalkerList(walker, parent, index, path, rlevel, sb);
+    assert_true(listing != NULL);
+
+    /* Same entries, in the same order. */
+    DIR *dir = opendir(".");
+    assert_true(dir != NULL);
+    size_t count = 0;
+    const struct dirent *dirp;
+    while ((dirp = readdir(dir)) != NULL)
+    {
+        assert_true(count < DirListingCount(listing));
+        assert_string_equal(DirListingName(listing, count), dirp->d_name);
+
+        struct stat lsb;
+        const struct stat *entry_sb = DirListingStat(listing, count);
+        assert_int_equal(lstat(dirp->d_name, &lsb), 0);
+        assert_true(entry_sb != NULL);
+        assert_int_equal(entry_sb->st_ino, lsb.st_ino);
+        count++;
+    }
+    closedir(dir);
+    assert_int_equal(count, DirListingCount(listing));
+
+    size_t entered = 1;
+    char child[PATH_MAX];
+    for (size_t i = 0; i < count; i++)
+    {
+        const char *name = DirListingName(listing, i);
+        const struct stat *entry_sb = DirListingStat(listing, i);
+        if (S_ISDIR(entry_sb->st_mode) &&
+            strcmp(name, ".") != 0 && strcmp(name, "..") != 0 &&
+            rlevel <= max_level)
+        {
+            snprintf(child, sizeof(child), "%s/%s", path, name);
+            entered += Walk(walker, listing, i, child, rlevel + 1, entry_sb,
+                            max_level);
+        }
+    }
+
+    DirWalkerRelease(walker, listing);
+    return entered;
+}
+
+static void test_walk(void)
+{
+    setup();
+    for (size_t threads = 1; threads <= 8; threads *= 2)
+    {
+        DirWalker *walker = DirWalkerNew(threads, LEVELS, false, 0);
+        assert_true(walker != NULL);
+
+        struct stat sb;
+        assert_int_equal(stat(ROOT, &sb), 0);
+        assert_int_equal(Walk(walker, NULL, 0, ROOT, 0, &sb, LEVELS), DIRECTORIES);
+
+        DirWalkerStats stats;
+        DirWalkerGetStats(walker, &stats);
+        assert_int_equal(stats.read_ahead + stats.waited + stats.read_inline,
+                         DIRECTORIES);
+        assert_int_equal(stats.discarded, 0);
+
+        DirWalkerDestroy(walker);
+    }
+    teardown();
+}
+
+static void test_partial_walk(void)
+{
+    /* Only the first level is entered, whatever was read ahead below it
+     * is dropped with the listings. */
+    setup();
+    DirWalker *walker = DirWalkerNew(4, LEVELS, false, 0);
+    assert_true(walker != NULL);
+
+    struct stat sb;
+    assert_int_equal(stat(ROOT, &sb), 0);
+    assert_int_equal(Walk(walker, NULL, 0, ROOT, 0, &sb, 0), 1 + FANOUT);
+
+    DirWalkerDestroy(walker);
+    teardown();
+}
+
+static void test_replaced_directory(void)
+{
+    setup();
+    DirWalker *walker = DirWalkerNew(2, LEVELS, false, 0);
+    assert_true(walker != NULL);
+
+    struct stat sb;
+    assert_int_equal(stat(ROOT, &sb), 0);
+    assert_int_equal(chdir(ROOT), 0);
+    DirListing *root = DirWalkerList(walker, NULL, 0, ROOT, 0, &sb);
+    assert_true(root != NULL);
+
+    size_t index = 0;
+    while (strcmp(DirListingName(root, index), "dir0") != 0)
+    {
+        index++;
+    }
+
+    /* Swap dir0 for another directory after it may have been read. */
+    char path[PATH_MAX], moved[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/dir0", ROOT);
+    snprintf(moved, sizeof(moved), "%s/moved", ROOT);
+    sleep(1);
+    assert_int_equal(rename(path, moved), 0);
+    assert_int_equal(mkdir(path, 0700), 0);
+
+    struct stat new_sb;
+    assert_int_equal(stat(path, &new_sb), 0);
+    assert_int_equal(chdir(path), 0);
+    DirListing *listing = DirWalkerList(walker, root, index, path, 1, &new_sb);
+    assert_true(listing != NULL);
+
+    /* Only "." and "..", not the files of the old dir0. */
+    assert_int_equal(DirListingCount(listing), 2);
+
+    DirWalkerRelease(walker, listing);
+    DirWalkerRelease(walker, root);
+    DirWalkerDestroy(walker);
+    teardown();
+}
+
+int main()
+{
+    PRINT_TEST_BANNER();
+    const UnitTest tests[] =
+    {
+        unit_test(test_walk),
+        unit_test(test_partial_walk),
+        unit_test(test_replaced_directory),
+    };
+
+    int ret = run_tests(tests);
+
+    return ret;
+}
@@ -152,6 +152,170 @@ void test_eval_with_token_from_list(void)
     StringSetDestroy(time_classes);
 }
 
+static void test_class_expression_cache(void)
+{
+    EvalContext *ctx = EvalContextNew();
+    EvalContextClassPutHard(ctx, "hard1", NULL);
+
+    /* evaluated twice to get the cached, folded expressions */
+    for (int i = 0; i < 2; i++)
+    {
+        assert_true(IsDefinedClass(ctx, "hard1"));
+        assert_true(IsDefinedClass(ctx, "default:hard1"));
+        assert_false(IsDefinedClass(ctx, "ns1:hard1"));
+        assert_false(IsDefinedClass(ctx, "!hard1"));
+        assert_true(IsDefinedClass(ctx, "hard1|soft1"));
+        assert_false(IsDefinedClass(ctx, "hard1.soft1"));
+        assert_true(IsDefinedClass(ctx, "!soft1.(hard1|false)"));
+        assert_int_equal(EXPRESSION_VALUE_ERROR, CheckClassExpression(ctx, "hard1 soft1"));
+    }
+
+    /* soft classes are not folded */
+    EvalContextClassPutSoft(ctx, "soft1", CONTEXT_SCOPE_NAMESPACE, NULL);
+    assert_true(IsDefinedClass(ctx, "hard1.soft1"));
+    assert_false(IsDefinedClass(ctx, "!soft1.(hard1|false)"));
+
+    /* hard classes are folded again when they change */
+    EvalContextHeapRemoveHard(ctx, "hard1");
+    assert_false(IsDefinedClass(ctx, "hard1"));
+    assert_false(IsDefinedClass(ctx, "hard1.soft1"));
+    assert_true(IsDefinedClass(ctx, "!hard1"));
+
+    /* also when removed the generic way, like the time classes are */
+    EvalContextClassPutHard(ctx, "hard2", NULL);
+    assert_true(IsDefinedClass(ctx, "hard2"));
+    EvalContextClassRemove(ctx, NULL, "hard2");
+    assert_false(IsDefinedClass(ctx, "hard2"));
+    assert_true(IsDefinedClass(ctx, "!hard2"));
+
+    EvalContextDestroy(ctx);
+}
+
+/* Record what evaluating a promise that reads #ref and class c1 and takes
+ * #lock does. */
+static PromiseInputs *EvaluatePromise(EvalContext *ctx, const VarRef *ref,
+                                      const char *lock)
+{
+    PromiseInputs *inputs = EvalContextPromiseInputsBegin(ctx);
+    assert_true(inputs != NULL);
+
+    EvalContextVariableGet(ctx, ref, NULL);
+    IsDefinedClass(ctx, "c1");
+    EvalContextPromiseLockCachePut(ctx, lock);
+
+    EvalContextPromiseInputsEnd(ctx, inputs);
+    return inputs;
+}
+
+static void test_promise_inputs_unchanged(void)
+{
+    EvalContext *ctx = EvalContextNew();
+    assert_true(EvalContextPromiseInputsBegin(ctx) == NULL);
+    EvalContextPromiseInputsTrackingEnable(ctx, true);
+
+    VarRef *x = VarRefParse("default:bundle1.x");
+    VarRef *y = VarRefParse("default:bundle1.y");
+    EvalContextVariablePut(ctx, x, "1", CF_DATA_TYPE_STRING, NULL);
+
+    PromiseInputs *inputs = EvaluatePromise(ctx, x, "lock1");
+    assert_true(PromiseInputsAreTracked(inputs));
+    assert_int_equal(PromiseInputsLockCount(inputs), 1);
+    assert_false(EvalContextPromiseInputsChanged(ctx, inputs));
+
+    /* Neither putting the same value again nor changing what the promise
+     * did not read is a change. */
+    EvalContextVariablePut(ctx, x, "1", CF_DATA_TYPE_STRING, NULL);
+    EvalContextVariablePut(ctx, y, "2", CF_DATA_TYPE_STRING, NULL);
+    EvalContextClassPutSoft(ctx, "c2", CONTEXT_SCOPE_NAMESPACE, NULL);
+    assert_false(EvalContextPromiseInputsChanged(ctx, inputs));
+
+    /* Finding the lock taken counts too. */
+    PromiseInputs *again = EvalContextPromiseInputsBegin(ctx);
+    assert_true(EvalContextPromiseLockCacheContains(ctx, "lock1"));
+    EvalContextPromiseInputsEnd(ctx, again);
+    assert_int_equal(PromiseInputsLockCount(again), 1);
+
+    PromiseInputsDestroy(again);
+    PromiseInputsDestroy(inputs);
+    VarRefDestroy(y);
+    VarRefDestroy(x);
+    EvalContextDestroy(ctx);
+}
+
+static void test_promise_inputs_variable_changed(void)
+{
+    EvalContext *ctx = EvalContextNew();
+    EvalContextPromiseInputsTrackingEnable(ctx, true);
+
+    VarRef *x = VarRefParse("default:bundle1.x");
+    EvalContextVariablePut(ctx, x, "1", CF_DATA_TYPE_STRING, NULL);
+
+    PromiseInputs *inputs = EvaluatePromise(ctx, x, "lock1");
+    assert_false(EvalContextPromiseInputsChanged(ctx, inputs));
+
+    EvalContextVariablePut(ctx, x, "2", CF_DATA_TYPE_STRING, NULL);
+    assert_true(EvalContextPromiseInputsChanged(ctx, inputs));
+    PromiseInputsDestroy(inputs);
+
+    /* A variable that did not exist yet when it was read. */
+    VarRef *z = VarRefParse("default:bundle1.z");
+    inputs = EvaluatePromise(ctx, z, "lock2");
+    assert_false(EvalContextPromiseInputsChanged(ctx, inputs));
+    EvalContextVariablePut(ctx, z, "3", CF_DATA_TYPE_STRING, NULL);
+    assert_true(EvalContextPromiseInputsChanged(ctx, inputs));
+    PromiseInputsDestroy(inputs);
+
+    /* Removing it is a change as well. */
+    inputs = EvaluatePromise(ctx, z, "lock3");
+    EvalContextVariableRemove(ctx, z);
+    assert_true(EvalContextPromiseInputsChanged(ctx, inputs));
+    PromiseInputsDestroy(inputs);
+
+    VarRefDestroy(z);
+    VarRefDestroy(x);
+    EvalContextDestroy(ctx);
+}
+
+static void test_promise_inputs_class_changed(void)
+{
+    EvalContext *ctx = EvalContextNew();
+    EvalContextPromiseInputsTrackingEnable(ctx, true);
+
+    VarRef *x = VarRefParse("default:bundle1.x");
+
+    /* Class c1 is read while undefined, then defined. */
+    PromiseInputs *inputs = EvaluatePromise(ctx, x, "lock1");
+    assert_false(EvalContextPromiseInputsChanged(ctx, inputs));
+    EvalContextClassPutSoft(ctx, "c1", CONTEXT_SCOPE_NAMESPACE, NULL);
+    assert_true(EvalContextPromiseInputsChanged(ctx, inputs));
+    PromiseInputsDestroy(inputs);
+
+    /* And undefined again. */
+    inputs = EvaluatePromise(ctx, x, "lock2");
+    assert_false(EvalContextPromiseInputsChanged(ctx, inputs));
+    EvalContextClassRemove(ctx, "default", "c1");
+    assert_true(EvalContextPromiseInputsChanged(ctx, inputs));
+    PromiseInputsDestroy(inputs);
+
+    /* Hard classes are folded into cached expressions without being read,
+     * changing any of them invalidates all the records. */
+    inputs = EvaluatePromise(ctx, x, "lock3");
+    EvalContextClassPutHard(ctx, "hard1", NULL);
+    assert_true(EvalContextPromiseInputsChanged(ctx, inputs));
+    PromiseInputsDestroy(inputs);
+
+    /* So does reading classes by regex, which isn't tracked. */
+    inputs = EvalContextPromiseInputsBegin(ctx);
+    EvalContextClassMatch(ctx, "c.*");
+    EvalContextPromiseInputsEnd(ctx, inputs);
+    assert_false(PromiseInputsAreTracked(inputs));
+    assert_true(EvalContextPromiseInputsChanged(ctx, inputs));
+    PromiseInputsDestroy(inputs);
+
+    VarRefDestroy(x);
+    EvalContextDestroy(ctx);
+}
+
 int main()
 {
     PRINT_TEST_BANNER();
@@ -162,6 +326,10 @@ int main()
         unit_test(test_class_persistence),
         unit_test(test_changes_chroot),
         unit_test(test_eval_with_token_from_list),
+        unit_test(test_class_expression_cache),
+        unit_test(test_promise_inputs_unchanged),
+        unit_test(test_promise_inputs_variable_changed),
+        unit_test(test_promise_inputs_class_changed),
     };
 
     int ret = run_tests(tests);
@@ -370,6 +370,52 @@ static void test_expand_scalar_nested_inner_undefined(void **state)
     BufferDestroy(res);
 }
 
+static void test_expand_scalar_template_reused(void **state)
+{
+    EvalContext *ctx = *state;
+    {
+        VarRef *lval = VarRefParse("default:bundle.one");
+        EvalContextVariablePut(ctx, lval, "first", CF_DATA_TYPE_STRING, NULL);
+        VarRefDestroy(lval);
+    }
+    {
+        VarRef *lval = VarRefParse("default:other.one");
+        EvalContextVariablePut(ctx, lval, "other", CF_DATA_TYPE_STRING, NULL);
+        VarRefDestroy(lval);
+    }
+
+    /* The same string is expanded from its template with different scopes
+     * and values. */
+    Buffer *res = BufferNew();
+    ExpandScalar(ctx, "default", "bundle", "a$(one)b${bundle.one}", res);
+    assert_string_equal("afirstbfirst", BufferData(res));
+
+    BufferClear(res);
+    ExpandScalar(ctx, "default", "other", "a$(one)b${bundle.one}", res);
+    assert_string_equal("aotherbfirst", BufferData(res));
+
+    {
+        VarRef *lval = VarRefParse("default:bundle.one");
+        EvalContextVariablePut(ctx, lval, "changed", CF_DATA_TYPE_STRING, NULL);
+        VarRefDestroy(lval);
+    }
+    BufferClear(res);
+    ExpandScalar(ctx, "default", "bundle", "a$(one)b${bundle.one}", res);
+    assert_string_equal("achangedbchanged", BufferData(res));
+
+    BufferClear(res);
+    ExpandScalar(ctx, "default", "bundle", "$ and $one but not $(/bin/true)", res);
+    assert_string_equal("$ and $one but not $(/bin/true)", BufferData(res));
+
+    /* Dropped on policy reload, and compiled again. */
+    ScalarTemplatesClear();
+    BufferClear(res);
+    ExpandScalar(ctx, "default", "bundle", "a$(one)b${bundle.one}", res);
+    assert_string_equal("achangedbchanged", BufferData(res));
+
+    BufferDestroy(res);
+}
+
 static void test_expand_list_nested(void **state)
 {
     EvalContext *ctx = *state;
@@ -590,6 +636,7 @@ int main()
         unit_test_setup_teardown(test_expand_scalar_array_with_scalar_arg, test_setup, test_teardown),
         unit_test_setup_teardown(test_expand_scalar_undefined, test_setup, test_teardown),
         unit_test_setup_teardown(test_expand_scalar_nested_inner_undefined, test_setup, test_teardown),
+        unit_test_setup_teardown(test_expand_scalar_template_reused, test_setup, test_teardown),
         unit_test_setup_teardown(test_expand_list_nested, test_setup, test_teardown),
         unit_test_setup_teardown(test_expand_promise_array_with_scalar_arg, test_setup, test_teardown),
         unit_test_setup_teardown(test_expand_promise_slist, test_setup, test_teardown),
@@ -0,0 +1,352 @@
+#include <test.h>
+
+#include <cmockery.h>
+#include <file_stream_cache.h>
+#include <alloc.h>
+
+
+static struct stat SourceStat(ino_t ino, time_t mtime, off_t size)
+{
+    struct stat sb = { 0 };
+    sb.st_dev = 1;
+    sb.st_ino = ino;
+    sb.st_mtime = mtime;
+    sb.st_ctime = mtime;
+    sb.st_size = size;
+    return sb;
+}
+
+/* Acquire a missing entry and fill it with #data. */
+static void Compute(DeltaCache *cache, const char *filename,
+                    const struct stat *sb, const char *basis,
+                    const char *data)
+{
+    bool compute = false;
+    DeltaCacheEntry *entry = DeltaCacheAcquire(cache, filename, sb, basis,
+                                               &compute);
+    assert_true(entry != NULL);
+    assert_true(compute);
+    DeltaCacheAppend(cache, entry, data, strlen(data));
+    DeltaCacheComplete(cache, entry, true);
+    DeltaCacheRelease(cache, entry);
+}
+
+static void assert_cached(DeltaCache *cache, const char *filename,
+                          const struct stat *sb, const char *basis,
+                          const char *data)
+{
+    bool compute = true;
+    DeltaCacheEntry *entry = DeltaCacheAcquire(cache, filename, sb, basis,
+                                               &compute);
+    assert_true(entry != NULL);
+    assert_false(compute);
+
+    size_t len;
+    const char *cached = DeltaCacheEntryData(entry, &len);
+    assert_int_equal(len, strlen(data));
+    if (len > 0)
+    {
+        assert_memory_equal(cached, data, len);
+    }
+    DeltaCacheRelease(cache, entry);
+}
+
+static void test_miss_then_hit(void)
+{
+    DeltaCache *cache = DeltaCacheNew(1024, 1024, 60);
+    struct stat sb = SourceStat(10, 1000, 100);
+
+    Compute(cache, "/src", &sb, "aaaa", "delta-a");
+    assert_cached(cache, "/src", &sb, "aaaa", "delta-a");
+
+    /* Another basis, or another file, is another delta. */
+    Compute(cache, "/src", &sb, "bbbb", "delta-b");
+    Compute(cache, "/other", &sb, "aaaa", "delta-other");
+    assert_cached(cache, "/src", &sb, "aaaa", "delta-a");
+    assert_cached(cache, "/src", &sb, "bbbb", "delta-b");
+
+    DeltaCacheStats stats;
+    DeltaCacheGetStats(cache, &stats);
+    assert_int_equal(stats.entries, 3);
+    assert_int_equal(stats.bytes, 7 + 7 + 11);
+    assert_int_equal(stats.hits, 3);
+    assert_int_equal(stats.misses, 3);
+
+    DeltaCacheDestroy(cache);
+}
+
+static void test_invalidation(void)
+{
+    DeltaCache *cache = DeltaCacheNew(1024, 1024, 60);
+    struct stat sb = SourceStat(10, 1000, 100);
+
+    Compute(cache, "/src", &sb, "aaaa", "old");
+
+    /* Modified in place, then replaced by another inode. */
+    struct stat modified = SourceStat(10, 1001, 100);
+    Compute(cache, "/src", &modified, "aaaa", "new");
+    assert_cached(cache, "/src", &modified, "aaaa", "new");
+
+    struct stat replaced = SourceStat(11, 1001, 100);
+    Compute(cache, "/src", &replaced, "aaaa", "newer");
+    assert_cached(cache, "/src", &replaced, "aaaa", "newer");
+
+    DeltaCacheStats stats;
+    DeltaCacheGetStats(cache, &stats);
+    assert_int_equal(stats.entries, 1);
+    assert_int_equal(stats.invalidations, 2);
+
+    DeltaCacheDestroy(cache);
+}
+
+static void test_failed_and_too_big(void)
+{
+    DeltaCache *cache = DeltaCacheNew(1024, 8, 60);
+    struct stat sb = SourceStat(10, 1000, 100);
+
+    bool compute;
+    DeltaCacheEntry *entry = DeltaCacheAcquire(cache, "/src", &sb, "aaaa",
+                                               &compute);
+    assert_true(compute);
+    DeltaCacheAppend(cache, entry, "part", 4);
+    DeltaCacheComplete(cache, entry, false);
+    DeltaCacheRelease(cache, entry);
+
+    entry = DeltaCacheAcquire(cache, "/src", &sb, "aaaa", &compute);
+    assert_true(compute);
+    assert_true(DeltaCacheAppend(cache, entry, "12345", 5));
+    assert_false(DeltaCacheAppend(cache, entry, "67890", 5));
+    DeltaCacheComplete(cache, entry, true);
+
+    /* What fitted is still there for the computing client to send. */
+    size_t len;
+    assert_memory_equal(DeltaCacheEntryData(entry, &len), "12345", 5);
+    assert_int_equal(len, 5);
+    DeltaCacheRelease(cache, entry);
+
+    entry = DeltaCacheAcquire(cache, "/src", &sb, "aaaa", &compute);
+    assert_true(compute);
+    DeltaCacheComplete(cache, entry, true);                   /* empty delta */
+    DeltaCacheRelease(cache, entry);
+    assert_cached(cache, "/src", &sb, "aaaa", "");
+
+    DeltaCacheStats stats;
+    DeltaCacheGetStats(cache, &stats);
+    assert_int_equal(stats.entries, 1);
+    assert_int_equal(stats.bytes, 0);
+
+    DeltaCacheDestroy(cache);
+}
+
+static void test_lru_eviction(void)
+{
+    DeltaCache *cache = DeltaCacheNew(30, 30, 60);
+    struct stat sb = SourceStat(10, 1000, 100);
+
+    Compute(cache, "/src", &sb, "1", "0123456789");
+    Compute(cache, "/src", &sb, "2", "0123456789");
+    Compute(cache, "/src", &sb, "3", "0123456789");
+
+    /* Touch 1, so that 2 is the least recently used. */
+    assert_cached(cache, "/src", &sb, "1", "0123456789");
+
+    Compute(cache, "/src", &sb, "4", "0123456789");
+    assert_cached(cache, "/src", &sb, "1", "0123456789");
+    assert_cached(cache, "/src", &sb, "3", "0123456789");
+    assert_cached(cache, "/src", &sb, "4", "0123456789");
+
+    bool compute;
+    DeltaCacheEntry *entry = DeltaCacheAcquire(cache, "/src", &sb, "2",
+                                               &compute);
+    assert_true(compute);
+
+    /* An entry being read survives its eviction. */
+    DeltaCacheEntry *reading = DeltaCacheAcquire(cache, "/src", &sb, "1",
+                                                 &compute);
+    assert_false(compute);
+    assert_cached(cache, "/src", &sb, "4", "0123456789");
+    assert_cached(cache, "/src", &sb, "3", "0123456789");
+    DeltaCacheAppend(cache, entry, "0123456789", 10);
+    DeltaCacheComplete(cache, entry, true);
+    DeltaCacheRelease(cache, entry);
+
+    size_t len;
+    assert_memory_equal(DeltaCacheEntryData(reading, &len), "0123456789", 10);
+    DeltaCacheRelease(cache, reading);
+
+    DeltaCacheStats stats;
+    DeltaCacheGetStats(cache, &stats);
+    assert_int_equal(stats.entries, 3);
+    assert_int_equal(stats.bytes, 30);
+    assert_int_equal(stats.evictions, 2);
+
+    DeltaCacheDestroy(cache);
+}
+
+typedef struct
+{
+    DeltaCache *cache;
+    const struct stat *sb;
+    bool compute;
+    char data[32];
+} WaiterArgs;
+
+static void *Waiter(void *arg)
+{
+    WaiterArgs *args = arg;
+    DeltaCacheEntry *entry = DeltaCacheAcquire(args->cache, "/src", args->sb,
+                                               "aaaa", &args->compute);
+    if (entry != NULL && !args->compute)
+    {
+        size_t len;
+        const char *data = DeltaCacheEntryData(entry, &len);
+        memcpy(args->data, data, MIN(len, sizeof(args->data) - 1));
+        DeltaCacheRelease(args->cache, entry);
+    }
+    return NULL;
+}
+
+static void test_concurrent_clients_share(void)
+{
+    DeltaCache *cache = DeltaCacheNew(1024, 1024, 60);
+    struct stat sb = SourceStat(10, 1000, 100);
+
+    bool compute;
+    DeltaCacheEntry *entry = DeltaCacheAcquire(cache, "/src", &sb, "aaaa",
+                                               &compute);
+    assert_true(compute);
+
+    WaiterArgs args = { .cache = cache, .sb = &sb, .compute = true };
+    pthread_t waiter;
+    assert_int_equal(pthread_create(&waiter, NULL, Waiter, &args), 0);
+
+    /* Wait until the other client blocks on our computation. */
+    DeltaCacheStats stats;
+    do
+    {
+        usleep(1000);
+        DeltaCacheGetStats(cache, &stats);
+    } while (stats.shared == 0);
+
+    DeltaCacheAppend(cache, entry, "shared", 6);
+    DeltaCacheComplete(cache, entry, true);
+    DeltaCacheRelease(cache, entry);
+    pthread_join(waiter, NULL);
+
+    assert_false(args.compute);
+    assert_string_equal(args.data, "shared");
+
+    DeltaCacheGetStats(cache, &stats);
+    assert_int_equal(stats.misses, 1);
+    assert_int_equal(stats.hits, 1);
+    assert_int_equal(stats.shared, 1);
+
+    DeltaCacheDestroy(cache);
+}
+
+static void test_wait_timeout(void)
+{
+    DeltaCache *cache = DeltaCacheNew(1024, 1024, 1);
+    struct stat sb = SourceStat(10, 1000, 100);
+
+    bool compute;
+    DeltaCacheEntry *entry = DeltaCacheAcquire(cache, "/src", &sb, "aaaa",
+                                               &compute);
+    assert_true(compute);
+
+    /* Nobody completes the entry, the waiter computes its own. */
+    WaiterArgs args = { .cache = cache, .sb = &sb, .compute = false };
+    Waiter(&args);
+    assert_true(args.compute);
+
+    DeltaCacheStats stats;
+    DeltaCacheGetStats(cache, &stats);
+    assert_int_equal(stats.timeouts, 1);
+    assert_int_equal(stats.misses, 2);
+
+    /* The slow computation still makes it to the cache. */
+    DeltaCacheAppend(cache, entry, "slow", 4);
+    DeltaCacheComplete(cache, entry, true);
+    DeltaCacheRelease(cache, entry);
+    assert_cached(cache, "/src", &sb, "aaaa", "slow");
+
+    DeltaCacheDestroy(cache);
+}
+
+static int DESTROYED_SIGNATURES = 0;
+
+static void DestroySignature(void *signature)
+{
+    DESTROYED_SIGNATURES++;
+    free(signature);
+}
+
+static void test_signature_cache(void)
+{
+    DESTROYED_SIGNATURES = 0;
+    SignatureCache *cache = SignatureCacheNew(20, DestroySignature);
+
+    assert_true(SignatureCacheAcquire(cache, "aaaa") == NULL);
+    SignatureCacheEntry *a =
+        SignatureCacheInsert(cache, "aaaa", xstrdup("sig-a"), 10);
+    assert_string_equal(SignatureCacheEntrySignature(a), "sig-a");
+
+    /* Another client loaded the same signature meanwhile. */
+    SignatureCacheEntry *again =
+        SignatureCacheInsert(cache, "aaaa", xstrdup("sig-a"), 10);
+    assert_true(again == a);
+    assert_int_equal(DESTROYED_SIGNATURES, 1);
+    SignatureCacheRelease(cache, again);
+    SignatureCacheRelease(cache, a);
+
+    SignatureCacheEntry *hit = SignatureCacheAcquire(cache, "aaaa");
+    assert_true(hit == a);
+
+    /* Evicted while in use, destroyed once released. */
+    SignatureCacheRelease(cache, SignatureCacheInsert(cache, "bbbb",
+                                                      xstrdup("sig-b"), 10));
+    SignatureCacheRelease(cache, SignatureCacheInsert(cache, "cccc",
+                                                      xstrdup("sig-c"), 10));
+    assert_int_equal(DESTROYED_SIGNATURES, 1);
+    assert_string_equal(SignatureCacheEntrySignature(hit), "sig-a");
+    SignatureCacheRelease(cache, hit);
+    assert_int_equal(DESTROYED_SIGNATURES, 2);
+    assert_true(SignatureCacheAcquire(cache, "aaaa") == NULL);
+
+    /* Over the budget on its own: used, but not cached. */
+    SignatureCacheEntry *big =
+        SignatureCacheInsert(cache, "dddd", xstrdup("sig-d"), 100);
+    assert_string_equal(SignatureCacheEntrySignature(big), "sig-d");
+    SignatureCacheRelease(cache, big);
+    assert_int_equal(DESTROYED_SIGNATURES, 3);
+
+    SignatureCacheStats stats;
+    SignatureCacheGetStats(cache, &stats);
+    assert_int_equal(stats.entries, 2);
+    assert_int_equal(stats.bytes, 20);
+    assert_int_equal(stats.hits, 1);
+    assert_int_equal(stats.misses, 2);
+    assert_int_equal(stats.evictions, 1);
+
+    SignatureCacheDestroy(cache);
+    assert_int_equal(DESTROYED_SIGNATURES, 5);
+}
+
+int main()
+{
+    PRINT_TEST_BANNER();
+    const UnitTest tests[] =
+    {
+        unit_test(test_miss_then_hit),
+        unit_test(test_invalidation),
+        unit_test(test_failed_and_too_big),
+        unit_test(test_lru_eviction),
+        unit_test(test_concurrent_clients_share),
+        unit_test(test_wait_timeout),
+        unit_test(test_signature_cache),
+    };
+
+    int ret = run_tests(tests);
+
+    return ret;
+}
@@ -0,0 +1,150 @@
+#include <test.h>
+
+#include <function_cache.h>
+#include <dbm_api.h>
+#include <known_dirs.h>                                        /* GetStateDir */
+#include <rlist.h>
+#include <json.h>
+
+
+static Rlist *Args(const char *first, const char *second)
+{
+    Rlist *args = NULL;
+    RlistAppendScalar(&args, first);
+    RlistAppendScalar(&args, second);
+    return args;
+}
+
+static void GetAndCount(const char *release_id, const char *name, const Rlist *args,
+                        bool expected_found, Rval *rval_out)
+{
+    FunctionCacheStats before, after;
+    FunctionCacheGetStats(&before);
+
+    Rval rval;
+    assert_int_equal(FunctionCacheGet(release_id, name, args, &rval),
+                     expected_found);
+    if (rval_out != NULL)
+    {
+        *rval_out = rval;
+    }
+    else if (expected_found)
+    {
+        RvalDestroy(rval);
+    }
+
+    FunctionCacheGetStats(&after);
+    assert_int_equal(after.hits - before.hits, expected_found ? 1 : 0);
+    assert_int_equal(after.misses - before.misses, expected_found ? 0 : 1);
+}
+
+static void test_scalar_is_kept(void)
+{
+    Rlist *args = Args("/bin/true", "noshell");
+    Rval rval;
+
+    GetAndCount("release1", "execresult", args, false, NULL);
+
+    FunctionCachePut("release1", "execresult", args,
+                     (Rval) { "output", RVAL_TYPE_SCALAR }, 60);
+    GetAndCount("release1", "execresult", args, true, &rval);
+    assert_int_equal(rval.type, RVAL_TYPE_SCALAR);
+    assert_string_equal(RvalScalarValue(rval), "output");
+    RvalDestroy(rval);
+
+    /* Other arguments, other function, no result. */
+    Rlist *other_args = Args("/bin/true", "useshell");
+    GetAndCount("release1", "execresult", other_args, false, NULL);
+    GetAndCount("release1", "returnszero", args, false, NULL);
+
+    RlistDestroy(other_args);
+    RlistDestroy(args);
+}
+
+static void test_other_release_is_not_used(void)
+{
+    Rlist *args = Args("a", "b");
+
+    FunctionCachePut("release1", "execresult", args,
+                     (Rval) { "output", RVAL_TYPE_SCALAR }, 60);
+    GetAndCount("release2", "execresult", args, false, NULL);
+
+    /* The stale entry is dropped on the way. */
+    GetAndCount("release1", "execresult", args, false, NULL);
+
+    RlistDestroy(args);
+}
+
+static void test_expired_is_not_used(void)
+{
+    Rlist *args = Args("c", "d");
+
+    FunctionCacheStats before, after;
+    FunctionCacheGetStats(&before);
+
+    FunctionCachePut("release1", "execresult", args,
+                     (Rval) { "output", RVAL_TYPE_SCALAR }, 0);
+    GetAndCount("release1", "execresult", args, false, NULL);
+
+    FunctionCacheGetStats(&after);
+    assert_int_equal(after.expired - before.expired, 1);
+
+    RlistDestroy(args);
+}
+
+static void test_list_and_container_are_kept(void)
+{
+    Rlist *args = Args("e", "f");
+    Rval rval;
+
+    Rlist *list = Args("one", "two");
+    FunctionCachePut("release1", "readstringlist", args,
+                     (Rval) { list, RVAL_TYPE_LIST }, 60);
+    GetAndCount("release1", "readstringlist", args, true, &rval);
+    assert_int_equal(rval.type, RVAL_TYPE_LIST);
+    assert_true(RlistEqual(RvalRlistValue(rval), list));
+    RvalDestroy(rval);
+    RlistDestroy(list);
+
+    JsonElement *json = NULL;
+    const char *data = "{\"a\":[1,2],\"b\":\"c\"}";
+    assert_int_equal(JsonParse(&data, &json), JSON_PARSE_OK);
+    FunctionCachePut("release1", "readjson", args,
+                     (Rval) { json, RVAL_TYPE_CONTAINER }, 60);
+    GetAndCount("release1", "readjson", args, true, &rval);
+    assert_int_equal(rval.type, RVAL_TYPE_CONTAINER);
+    assert_int_equal(JsonCompare(RvalContainerValue(rval), json), 0);
+    RvalDestroy(rval);
+    JsonDestroy(json);
+
+    RlistDestroy(args);
+}
+
+static void test_setup(void)
+{
+    static char env[] = /* Needs to be static for putenv() */
+        "CFENGINE_TEST_OVERRIDE_WORKDIR=/tmp/function_cache_test.XXXXXX";
+
+    char *workdir = strchr(env, '=') + 1; /* start of the path */
+    assert(workdir - 1 && workdir[0] == '/');
+
+    mkdtemp(workdir);
+    putenv(env);
+    mkdir(GetStateDir(), (S_IRWXU | S_IRWXG | S_IRWXO));
+}
+
+int main()
+{
+    PRINT_TEST_BANNER();
+    test_setup();
+
+    const UnitTest tests[] =
+    {
+        unit_test(test_scalar_is_kept),
+        unit_test(test_other_release_is_not_used),
+        unit_test(test_expired_is_not_used),
+        unit_test(test_list_and_container_are_kept),
+    };
+
+    return run_tests(tests);
+}
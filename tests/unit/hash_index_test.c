@@ -0,0 +1,174 @@
+#include <test.h>
+
+#include <cf3.defs.h>
+#include <hash_index.h>
+#include <dbm_api.h>
+#include <known_dirs.h>                                        /* GetStateDir */
+#include <misc_lib.h>                                          /* xsnprintf */
+#include <utime.h>
+
+
+static char WORKDIR[PATH_MAX];
+
+/* Written at setup, long enough ago to be indexed. */
+static char OLD_FILE[PATH_MAX];
+static char OLD_FILE_2[PATH_MAX];
+static char OLD_FILE_3[PATH_MAX];
+static char NEW_FILE[PATH_MAX];
+
+/* Added to the real time, for files to settle without waiting. */
+static time_t CLOCK_OFFSET = 0;
+
+static time_t TestClock(time_t *t)
+{
+    const time_t now = time(NULL) + CLOCK_OFFSET;
+    if (t != NULL)
+    {
+        *t = now;
+    }
+    return now;
+}
+
+static void WriteFile(const char *filename, const char *contents)
+{
+    FILE *f = fopen(filename, "w");
+    assert_true(f != NULL);
+    assert_true(fputs(contents, f) >= 0);
+    assert_int_equal(fclose(f), 0);
+
+    /* Like a copy preserving timestamps would. */
+    struct utimbuf times;
+    times.actime = times.modtime = time(NULL) - 100;
+    assert_int_equal(utime(filename, &times), 0);
+}
+
+static void HashAndCount(const char *filename, size_t *hits, size_t *misses)
+{
+    HashIndexStats before, after;
+    HashIndexGetStats(&before);
+
+    unsigned char digest[EVP_MAX_MD_SIZE + 1] = { 0 };
+    HashFileIndexed(filename, digest, CF_DEFAULT_DIGEST);
+
+    HashIndexGetStats(&after);
+    *hits = after.hits - before.hits;
+    *misses = after.misses - before.misses;
+
+    unsigned char expected[EVP_MAX_MD_SIZE + 1] = { 0 };
+    HashFile(filename, expected, CF_DEFAULT_DIGEST, false);
+    assert_true(HashesMatch(digest, expected, CF_DEFAULT_DIGEST));
+}
+
+/* Must run first, the index is only pruned when it is opened. */
+static void test_stale_entries_are_pruned(void)
+{
+    const char stale_key[] = "1:1:SHA256";
+    const char stale_value[] = "written by another version";
+
+    CF_DB *db;
+    assert_true(OpenDB(&db, dbid_hashes));
+    assert_true(WriteDB(db, stale_key, stale_value, sizeof(stale_value)));
+    CloseDB(db);
+
+    size_t hits, misses;
+    HashAndCount(OLD_FILE, &hits, &misses);
+
+    assert_true(OpenDB(&db, dbid_hashes));
+    assert_false(HasKeyDB(db, stale_key, sizeof(stale_key)));
+    CloseDB(db);
+}
+
+static void test_unchanged_file_is_not_read_again(void)
+{
+    size_t hits, misses;
+
+    HashAndCount(OLD_FILE_2, &hits, &misses);
+    assert_int_equal(hits, 0);
+    assert_int_equal(misses, 1);
+
+    HashAndCount(OLD_FILE_2, &hits, &misses);
+    assert_int_equal(hits, 1);
+    assert_int_equal(misses, 0);
+}
+
+static void test_changed_file_is_rehashed(void)
+{
+    size_t hits, misses;
+
+    HashAndCount(OLD_FILE_3, &hits, &misses);
+    HashAndCount(OLD_FILE_3, &hits, &misses);
+    assert_int_equal(hits, 1);
+
+    /* Same size and mtime, the ctime still gives it away. */
+    WriteFile(OLD_FILE_3, "other version\n");
+    HashAndCount(OLD_FILE_3, &hits, &misses);
+    assert_int_equal(hits, 0);
+    assert_int_equal(misses, 1);
+}
+
+static void test_recent_file_is_not_indexed(void)
+{
+    size_t hits, misses;
+    WriteFile(NEW_FILE, "fresh\n");
+    CLOCK_OFFSET = 0;
+
+    HashAndCount(NEW_FILE, &hits, &misses);
+    assert_int_equal(misses, 1);
+    HashAndCount(NEW_FILE, &hits, &misses);
+    assert_int_equal(hits, 0);
+    assert_int_equal(misses, 1);
+}
+
+static void test_setup(void)
+{
+    static char env[] = /* Needs to be static for putenv() */
+        "CFENGINE_TEST_OVERRIDE_WORKDIR=/tmp/hash_index_test.XXXXXX";
+
+    char *workdir = strchr(env, '=') + 1; /* start of the path */
+    assert(workdir - 1 && workdir[0] == '/');
+
+    mkdtemp(workdir);
+    strlcpy(WORKDIR, workdir, sizeof(WORKDIR));
+    putenv(env);
+    mkdir(GetStateDir(), (S_IRWXU | S_IRWXG | S_IRWXO));
+
+    xsnprintf(OLD_FILE, sizeof(OLD_FILE), "%s/old", workdir);
+    xsnprintf(OLD_FILE_2, sizeof(OLD_FILE_2), "%s/old2", workdir);
+    xsnprintf(OLD_FILE_3, sizeof(OLD_FILE_3), "%s/old3", workdir);
+    xsnprintf(NEW_FILE, sizeof(NEW_FILE), "%s/new", workdir);
+
+    WriteFile(OLD_FILE, "first version\n");
+    WriteFile(OLD_FILE_2, "first version\n");
+    WriteFile(OLD_FILE_3, "first version\n");
+
+    /* Files whose ctime is this recent are never indexed, pretend they
+     * were written a while ago. */
+    CLOCK_OFFSET = 10;
+    HashIndexSetClock(TestClock);
+}
+
+static void test_teardown(void)
+{
+    char cmd[CF_BUFSIZE];
+    xsnprintf(cmd, CF_BUFSIZE, "rm -rf '%s'", WORKDIR);
+    system(cmd);
+}
+
+int main()
+{
+    PRINT_TEST_BANNER();
+    test_setup();
+
+    const UnitTest tests[] =
+    {
+        unit_test(test_stale_entries_are_pruned),
+        unit_test(test_unchanged_file_is_not_read_again),
+        unit_test(test_changed_file_is_rehashed),
+        unit_test(test_recent_file_is_not_indexed),
+    };
+
+    int ret = run_tests(tests);
+
+    test_teardown();
+    return ret;
+}
@@ -0,0 +1,203 @@
+#include <test.h>
+
+#include <process_lib.h>
+#include <process_unix_priv.h>
+#include <file_lib.h>                                          /* FullWrite */
+#include <misc_lib.h>                                          /* xsnprintf */
+
+/* A fake procfs with two processes and some noise. The tests change it, in
+ * the order they run. */
+
+static char PROC_DIR[] = "/tmp/linux_process_table_test.XXXXXX";
+
+#define BOOT_TIME 1600000000
+
+static void WriteProcFile(const char *name, const char *contents, size_t len)
+{
+    char path[PATH_MAX];
+    xsnprintf(path, sizeof(path), "%s/%s", PROC_DIR, name);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    assert_int_not_equal(fd, -1);
+    assert_int_equal(FullWrite(fd, contents, len), len);
+    close(fd);
+}
+
+static void WriteProcString(const char *name, const char *contents)
+{
+    WriteProcFile(name, contents, strlen(contents));
+}
+
+static void MakeProcDir(const char *name)
+{
+    char path[PATH_MAX];
+    xsnprintf(path, sizeof(path), "%s/%s", PROC_DIR, name);
+    assert_int_equal(mkdir(path, 0700), 0);
+}
+
+static void setup(void)
+{
+    assert_true(mkdtemp(PROC_DIR) != NULL);
+
+    char contents[1024];
+    const long ticks = sysconf(_SC_CLK_TCK);
+
+    xsnprintf(contents, sizeof(contents),
+              "cpu  1 2 3 4 5 6 7 0 0 0\nbtime %d\nprocesses 100\n", BOOT_TIME);
+    WriteProcString("stat", contents);
+    WriteProcString("meminfo", "MemTotal:       1000000 kB\nMemFree:         500000 kB\n");
+
+    /* Started 100 s after boot, 30 s of CPU time, on pts/3. */
+    MakeProcDir("1");
+    xsnprintf(contents, sizeof(contents),
+              "1 (init) S 0 1 1 %d 1 4194560 100 0 0 0 %ld %ld 0 0 20 -5 3 0 %ld 8192000 100 18446744073709551615",
+              (136 << 8) | 3, 20 * ticks, 10 * ticks, 100 * ticks);
+    WriteProcString("1/stat", contents);
+    WriteProcString("1/status", "Name:\tinit\nState:\tS (sleeping)\nUid:\t0\t4242\t0\t0\nGid:\t0\t0\t0\t0\n");
+    WriteProcFile("1/cmdline", "/sbin/init\0splash\0", 18);
+
+    /* A zombie with parentheses in its name, and no command line. */
+    MakeProcDir("42");
+    xsnprintf(contents, sizeof(contents),
+              "42 (my (weird) proc) Z 1 42 42 0 -1 4194560 0 0 0 0 0 0 0 0 20 0 1 0 %ld 0 0 18446744073709551615",
+              200 * ticks);
+    WriteProcString("42/stat", contents);
+    WriteProcString("42/status", "Name:\tmy (weird) proc\nUid:\t0\t0\t0\t0\n");
+    WriteProcString("42/cmdline", "");
+
+    /* Gone while reading, and not a process at all. */
+    MakeProcDir("7");
+    MakeProcDir("self");
+}
+
+static void teardown(void)
+{
+    const char *files[] = {
+        "stat", "meminfo",
+        "1/stat", "1/status", "1/cmdline", "1",
+        "42/stat", "42/status", "42/cmdline", "42",
+        "43/status", "43/cmdline", "43",
+        "7", "self",
+    };
+
+    char path[PATH_MAX];
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++)
+    {
+        xsnprintf(path, sizeof(path), "%s/%s", PROC_DIR, files[i]);
+        remove(path);
+    }
+    rmdir(PROC_DIR);
+}
+
+static void test_read_table(void)
+{
+    Seq *table = ReadProcessInfoTable(PROC_DIR);
+    assert_true(table != NULL);
+    assert_int_equal(SeqLength(table), 2);
+
+    const ProcessInfo *init = SeqAt(table, 0);
+    assert_int_equal(init->pid, 1);
+    assert_int_equal(init->ppid, 0);
+    assert_int_equal(init->pgid, 1);
+    assert_int_equal(init->uid, 4242);
+    assert_true(init->user != NULL);
+    assert_int_equal(init->state, 'S');
+    assert_int_equal(init->nice, -5);
+    assert_int_equal(init->threads, 3);
+    assert_int_equal(init->vsize, 8000);
+    assert_int_equal(init->rss, 100 * (sysconf(_SC_PAGESIZE) / 1024));
+    assert_int_equal(init->start_time, BOOT_TIME + 100);
+    assert_int_equal(init->cpu_time, 30);
+    assert_true(init->pmem > 0);
+    assert_string_equal(init->tty, "pts/3");
+    assert_string_equal(init->command, "/sbin/init splash");
+
+    const ProcessInfo *zombie = SeqAt(table, 1);
+    assert_int_equal(zombie->pid, 42);
+    assert_int_equal(zombie->ppid, 1);
+    assert_int_equal(zombie->state, 'Z');
+    assert_int_equal(zombie->start_time, BOOT_TIME + 200);
+    assert_string_equal(zombie->tty, "?");
+    assert_string_equal(zombie->command, "[my (weird) proc] <defunct>");
+
+    SeqDestroy(table);
+}
+
+static void test_refresh_table(void)
+{
+    Seq *table = ReadProcessInfoTable(PROC_DIR);
+    assert_true(table != NULL);
+    assert_int_equal(SeqLength(table), 2);
+
+    /* init used more CPU, 42 rewrote its command line without anything
+     * else changing, and 43 is new. */
+    char contents[1024];
+    const long ticks = sysconf(_SC_CLK_TCK);
+    xsnprintf(contents, sizeof(contents),
+              "1 (init) S 0 1 1 %d 1 4194560 100 0 0 0 %ld %ld 0 0 20 -5 3 0 %ld 8192000 100 18446744073709551615",
+              (136 << 8) | 3, 50 * ticks, 10 * ticks, 100 * ticks);
+    WriteProcString("1/stat", contents);
+    WriteProcString("42/cmdline", "rewritten");
+
+    MakeProcDir("43");
+    xsnprintf(contents, sizeof(contents),
+              "43 (sleep) S 1 43 43 0 -1 4194560 0 0 0 0 0 0 0 0 20 0 1 0 %ld 4096 10 18446744073709551615",
+              300 * ticks);
+    WriteProcString("43/stat", contents);
+    WriteProcString("43/status", "Name:\tsleep\nUid:\t0\t0\t0\t0\n");
+    WriteProcFile("43/cmdline", "sleep\0" "100\0", 10);
+
+    table = RefreshProcessInfoTable(PROC_DIR, table);
+    assert_true(table != NULL);
+    assert_int_equal(SeqLength(table), 3);
+
+    const ProcessInfo *init = SeqAt(table, 0);
+    assert_int_equal(init->pid, 1);
+    assert_int_equal(init->cpu_time, 60);
+
+    /* Same stat, but the new arguments are not missed. */
+    const ProcessInfo *zombie = SeqAt(table, 1);
+    assert_int_equal(zombie->pid, 42);
+    assert_string_equal(zombie->command, "rewritten");
+
+    const ProcessInfo *sleep = SeqAt(table, 2);
+    assert_int_equal(sleep->pid, 43);
+    assert_string_equal(sleep->command, "sleep 100");
+
+    /* Gone, and init changed its euid, which stat doesn't show either. */
+    char path[PATH_MAX];
+    xsnprintf(path, sizeof(path), "%s/43/stat", PROC_DIR);
+    assert_int_equal(unlink(path), 0);
+    WriteProcString("1/status", "Name:\tinit\nState:\tS (sleeping)\nUid:\t0\t0\t0\t0\nGid:\t0\t0\t0\t0\n");
+
+    table = RefreshProcessInfoTable(PROC_DIR, table);
+    assert_true(table != NULL);
+    assert_int_equal(SeqLength(table), 2);
+    assert_int_equal(((const ProcessInfo *) SeqAt(table, 0))->uid, 0);
+    assert_int_equal(((const ProcessInfo *) SeqAt(table, 1))->pid, 42);
+
+    SeqDestroy(table);
+}
+
+static void test_no_proc(void)
+{
+    assert_true(ReadProcessInfoTable("/nonexistent/proc") == NULL);
+}
+
+int main()
+{
+    PRINT_TEST_BANNER();
+    setup();
+
+    const UnitTest tests[] =
+    {
+        unit_test(test_read_table),
+        unit_test(test_refresh_table),
+        unit_test(test_no_proc),
+    };
+
+    int ret = run_tests(tests);
+
+    teardown();
+    return ret;
+}
@@ -0,0 +1,192 @@
+#include <test.h>
+
+#include <package_module.c>
+#include <misc_lib.h>                                          /* xsnprintf */
+
+char CFWORKDIR[CF_BUFSIZE];
+
+void tests_setup(void)
+{
+    static char env[] = /* Needs to be static for putenv() */
+        "CFENGINE_TEST_OVERRIDE_WORKDIR=/tmp/CFENGINE_package_module_test.XXXXXX";
+    char *workdir = strchr(env, '=');
+    assert(workdir && workdir[1] == '/');
+    workdir++;
+
+    mkdtemp(workdir);
+    strlcpy(CFWORKDIR, workdir, CF_BUFSIZE);
+    putenv(env);
+
+    mkdir(GetStateDir(), 0766);
+}
+
+void tests_teardown(void)
+{
+    char cmd[CF_BUFSIZE];
+    xsnprintf(cmd, CF_BUFSIZE, "rm -rf '%s'", CFWORKDIR);
+    system(cmd);
+}
+
+static PackageInfo *NewPackage(const char *version)
+{
+    PackageInfo *package = xcalloc(1, sizeof(PackageInfo));
+    package->name = xstrdup("pkg");
+    package->version = xstrdup(version);
+    package->arch = xstrdup("noarch");
+    return package;
+}
+
+static void AssertVersions(const Seq *versions, const char *const *expected,
+                           size_t n_expected)
+{
+    assert_true(versions != NULL);
+    assert_int_equal(SeqLength(versions), n_expected);
+    for (size_t i = 0; i < n_expected; i++)
+    {
+        const PackageInfo *package = SeqAt(versions, i);
+        assert_string_equal(package->version, expected[i]);
+    }
+}
+
+static void test_compare_package_updates(void)
+{
+    const char *versions[] = { "1.2", "2.0", "1.2.1", "1.3", "1-4" };
+    const size_t n = sizeof(versions) / sizeof(versions[0]);
+
+    Seq *seq = SeqNew(n, FreePackageInfo);
+    for (size_t i = 0; i < n; i++)
+    {
+        SeqAppend(seq, NewPackage(versions[i]));
+    }
+
+    /* Consistent both ways, so that sorting is well defined. */
+    for (size_t i = 0; i < n; i++)
+    {
+        for (size_t j = 0; j < n; j++)
+        {
+            const int ij = ComparePackageUpdates(SeqAt(seq, i), SeqAt(seq, j), NULL);
+            const int ji = ComparePackageUpdates(SeqAt(seq, j), SeqAt(seq, i), NULL);
+            if (i == j)
+            {
+                assert_int_equal(ij, 0);
+            }
+            else
+            {
+                assert_true((ij < 0 && ji > 0) || (ij > 0 && ji < 0));
+            }
+        }
+    }
+
+    /* Newest first, "1-4" is of a different versioning model than the
+     * others and is ordered by strcmp(). */
+    SeqSort(seq, ComparePackageUpdates, NULL);
+    const char *expected[] = { "2.0", "1.3", "1.2.1", "1.2", "1-4" };
+    AssertVersions(seq, expected, n);
+
+    SeqDestroy(seq);
+}
+
+static void test_updates_index(void)
+{
+    PackageUpdatesMap *updates = PackageUpdatesMapNew();
+
+    const char entry[] =
+        "V<1.2>A<x86_64>\n"
+        "V<2.0>A<x86_64>\n"
+        "garbage\n"
+        "V<1.3>A<noarch>\n";
+    PackageInventoryAddUpdatesEntry(updates, "pkg", entry, strlen(entry));
+    PackageInventoryAddUpdate(updates, "other", "0.1", "i386");
+    SortPackageUpdates(updates);
+
+    const Seq *versions = PackageUpdatesMapGet(updates, "pkg");
+    const char *expected[] = { "2.0", "1.3", "1.2" };
+    AssertVersions(versions, expected, 3);
+    assert_string_equal(((PackageInfo *) SeqAt(versions, 1))->arch, "noarch");
+    assert_string_equal(((PackageInfo *) SeqAt(versions, 1))->name, "pkg");
+
+    versions = PackageUpdatesMapGet(updates, "other");
+    assert_int_equal(SeqLength(versions), 1);
+    assert_string_equal(((PackageInfo *) SeqAt(versions, 0))->arch, "i386");
+
+    assert_true(PackageUpdatesMapGet(updates, "missing") == NULL);
+
+    PackageUpdatesMapDestroy(updates);
+}
+
+static void test_installed_index(void)
+{
+    PackageModuleBody body = { .name = "test_module" };
+    PackageModuleWrapper wrapper = { .package_module = &body };
+
+    Rlist *data = NULL;
+    RlistAppendScalar(&data, "Name=pkg");
+    RlistAppendScalar(&data, "Version=1.2");
+    RlistAppendScalar(&data, "Architecture=x86_64");
+    RlistAppendScalar(&data, "Name=lib");
+    RlistAppendScalar(&data, "Version=0.9");
+    RlistAppendScalar(&data, "Architecture=noarch");
+    assert_int_equal(UpdatePackagesDB(data, body.name, UPDATE_TYPE_INSTALLED), 0);
+    RlistDestroy(data);
+
+    /* First from the index UpdatePackagesDB() kept, then from the one
+     * loaded from the database. */
+    for (int i = 0; i < 2; i++)
+    {
+        assert_int_equal(IsPackageInCache(NULL, &wrapper, "pkg", NULL, NULL), 1);
+        assert_int_equal(IsPackageInCache(NULL, &wrapper, "pkg", "1.2", NULL), 1);
+        assert_int_equal(IsPackageInCache(NULL, &wrapper, "pkg", "latest", "x86_64"), 1);
+        assert_int_equal(IsPackageInCache(NULL, &wrapper, "pkg", "1.2", "x86_64"), 1);
+        assert_int_equal(IsPackageInCache(NULL, &wrapper, "lib", "0.9", "noarch"), 1);
+
+        assert_int_equal(IsPackageInCache(NULL, &wrapper, "pkg", "1.3", NULL), 0);
+        assert_int_equal(IsPackageInCache(NULL, &wrapper, "pkg", "1.2", "noarch"), 0);
+        assert_int_equal(IsPackageInCache(NULL, &wrapper, "missing", NULL, NULL), 0);
+
+        FinalizePackageModules();
+    }
+}
+
+static void test_updates_index_reload(void)
+{
+    Rlist *data = NULL;
+    RlistAppendScalar(&data, "Name=pkg");
+    RlistAppendScalar(&data, "Version=1.2");
+    RlistAppendScalar(&data, "Architecture=x86_64");
+    RlistAppendScalar(&data, "Name=pkg");
+    RlistAppendScalar(&data, "Version=2.0");
+    RlistAppendScalar(&data, "Architecture=x86_64");
+    assert_int_equal(UpdatePackagesDB(data, "test_module", UPDATE_TYPE_UPDATES), 0);
+    RlistDestroy(data);
+
+    const char *expected[] = { "2.0", "1.2" };
+    for (int i = 0; i < 2; i++)
+    {
+        const PackageInventory *inventory =
+            GetLoadedPackageInventory("test_module", UPDATE_TYPE_UPDATES);
+        assert_true(inventory != NULL);
+        AssertVersions(PackageUpdatesMapGet(inventory->updates, "pkg"), expected, 2);
+
+        FinalizePackageModules();
+    }
+}
+
+int main()
+{
+    PRINT_TEST_BANNER();
+    tests_setup();
+
+    const UnitTest tests[] =
+    {
+        unit_test(test_compare_package_updates),
+        unit_test(test_updates_index),
+        unit_test(test_installed_index),
+        unit_test(test_updates_index_reload),
+    };
+
+    int ret = run_tests(tests);
+
+    tests_teardown();
+
+    return ret;
+}
@@ -2,6 +2,7 @@
 
 #include <cf3.defs.h>
 #include <locks.h>
+#include <policy.h>
 #include <misc_lib.h>                                          /* xsnprintf */
 #include <known_dirs.h>
 
@@ -27,6 +28,74 @@ static void tests_teardown(void)
     system(cmd);
 }
 
+/* An expansion of org, with the given promiser and "edit_line" value. */
+static Promise *ExpandedPromise(const Promise *org, const char *promiser,
+                                const char *edit_line, const char *mtime)
+{
+    Promise *pp = BundleSectionAppendPromise(org->parent_section, promiser,
+                                             (Rval) { NULL, RVAL_TYPE_NOPROMISEE },
+                                             NULL, NULL);
+    pp->org_pp = org;
+    PromiseAppendConstraint(pp, "create", RvalNew("true", RVAL_TYPE_SCALAR), false);
+    PromiseAppendConstraint(pp, "edit_line", RvalNew(edit_line, RVAL_TYPE_SCALAR), false);
+    PromiseAppendConstraint(pp, "mtime", RvalNew(mtime, RVAL_TYPE_SCALAR), false);
+    return pp;
+}
+
+static void test_promise_lock_hash(void)
+{
+    Policy *policy = PolicyNew();
+    Bundle *bp = PolicyAppendBundle(policy, "default", "bundle", "agent",
+                                    NULL, NULL, EVAL_ORDER_UNDEFINED);
+    BundleSection *sp = BundleAppendSection(bp, "files");
+    Promise *org = BundleSectionAppendPromise(sp, "/tmp/$(x)",
+                                              (Rval) { NULL, RVAL_TYPE_NOPROMISEE },
+                                              NULL, NULL);
+    PromiseAppendConstraint(org, "create", RvalNew("true", RVAL_TYPE_SCALAR), false);
+    PromiseAppendConstraint(org, "edit_line", RvalNew("$(y)", RVAL_TYPE_SCALAR), false);
+    PromiseAppendConstraint(org, "mtime", RvalNew("$(now)", RVAL_TYPE_SCALAR), false);
+
+    const Promise *a1 = ExpandedPromise(org, "/tmp/a", "one", "1");
+    const Promise *a2 = ExpandedPromise(org, "/tmp/a", "one", "2");
+    const Promise *b = ExpandedPromise(org, "/tmp/b", "one", "1");
+    const Promise *a_two = ExpandedPromise(org, "/tmp/a", "two", "1");
+
+    const uint64_t hash = PromiseLockHash(a1, "/tmp/a");
+    assert_true(org->lock_static != NULL);
+
+    /* Same iteration, computed again. */
+    assert_true(PromiseLockHash(a1, "/tmp/a") == hash);
+    /* Times do not make another promise. */
+    assert_true(PromiseLockHash(a2, "/tmp/a") == hash);
+
+    assert_true(PromiseLockHash(b, "/tmp/a") != hash);
+    assert_true(PromiseLockHash(a_two, "/tmp/a") != hash);
+    assert_true(PromiseLockHash(a1, "/tmp/b") != hash);
+    assert_true(PromiseLockHash(a1, NULL) != hash);
+
+    /* Package list updates share one lock across promisers. */
+    assert_true(PromiseLockHash(a1, "packageuplist") ==
+                PromiseLockHash(b, "packageuplist"));
+
+    /* Same promise in another bundle. */
+    {
+        Bundle *bp2 = PolicyAppendBundle(policy, "default", "bundle2", "agent",
+                                         NULL, NULL, EVAL_ORDER_UNDEFINED);
+        BundleSection *sp2 = BundleAppendSection(bp2, "files");
+        Promise *org2 = BundleSectionAppendPromise(sp2, "/tmp/$(x)",
+                                                   (Rval) { NULL, RVAL_TYPE_NOPROMISEE },
+                                                   NULL, NULL);
+        PromiseAppendConstraint(org2, "create", RvalNew("true", RVAL_TYPE_SCALAR), false);
+        PromiseAppendConstraint(org2, "edit_line", RvalNew("$(y)", RVAL_TYPE_SCALAR), false);
+        PromiseAppendConstraint(org2, "mtime", RvalNew("$(now)", RVAL_TYPE_SCALAR), false);
+
+        const Promise *other = ExpandedPromise(org2, "/tmp/a", "one", "1");
+        assert_true(PromiseLockHash(other, "/tmp/a") != hash);
+    }
+
+    PolicyDestroy(policy);
+}
+
 int main()
 {
     PRINT_TEST_BANNER();
@@ -34,7 +103,7 @@ int main()
 
     const UnitTest tests[] =
       {
-
+          unit_test(test_promise_lock_hash),
       };
 
     int ret = run_tests(tests);
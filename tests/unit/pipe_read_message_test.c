@@ -0,0 +1,147 @@
+#include <test.h>
+
+#include <pipes.h>
+#include <rlist.h>
+#include <sys/wait.h>
+
+
+/* Chunks written by the child, with a pause in between so that they are
+ * read separately. */
+typedef struct
+{
+    const char *chunks[4];
+    bool close_after;           /* close the pipe instead of staying alive */
+} Writer;
+
+static pid_t ForkWriter(const Writer *writer, IOData *io)
+{
+    int fds[2];
+    assert_int_equal(pipe(fds), 0);
+
+    pid_t pid = fork();
+    assert_int_not_equal(pid, -1);
+    if (pid == 0)
+    {
+        close(fds[0]);
+        for (size_t i = 0; writer->chunks[i] != NULL; i++)
+        {
+            const size_t len = strlen(writer->chunks[i]);
+            if (write(fds[1], writer->chunks[i], len) != (ssize_t) len)
+            {
+                _exit(1);
+            }
+            usleep(100000);
+        }
+        if (!writer->close_after)
+        {
+            /* Like a module waiting for the next request. */
+            sleep(2);
+        }
+        _exit(0);
+    }
+
+    close(fds[1]);
+    *io = (IOData) { .write_fd = -1, .read_fd = fds[0] };
+    return pid;
+}
+
+static bool ReadMessage(const Writer *writer, Rlist **message)
+{
+    IOData io;
+    pid_t pid = ForkWriter(writer, &io);
+
+    *message = NULL;
+    bool ret = PipeReadMessage(&io, 10, 1, message);
+
+    close(io.read_fd);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return ret;
+}
+
+static void AssertLines(const Rlist *message, const char *const *lines)
+{
+    size_t i = 0;
+    for (const Rlist *rp = message; rp != NULL; rp = rp->next, i++)
+    {
+        assert_true(lines[i] != NULL);
+        assert_string_equal(RlistScalarValue(rp), lines[i]);
+    }
+    assert_true(lines[i] == NULL);
+}
+
+static void test_single_read(void)
+{
+    const Writer writer = { { "Name=a\nVersion=1\n\n", NULL } };
+    Rlist *message;
+    assert_true(ReadMessage(&writer, &message));
+
+    const char *const lines[] = { "Name=a", "Version=1", NULL };
+    AssertLines(message, lines);
+    RlistDestroy(message);
+}
+
+static void test_split_reads(void)
+{
+    /* Split inside a line, and between the last line and the empty one. */
+    const Writer writer = { { "Name=a\nVers", "ion=1\n", "\n", NULL } };
+    Rlist *message;
+    assert_true(ReadMessage(&writer, &message));
+
+    const char *const lines[] = { "Name=a", "Version=1", NULL };
+    AssertLines(message, lines);
+    RlistDestroy(message);
+}
+
+static void test_crlf(void)
+{
+    const Writer writer = { { "Name=a\r\n", "Version=1\r\n\r\n", NULL } };
+    Rlist *message;
+    assert_true(ReadMessage(&writer, &message));
+
+    const char *const lines[] = { "Name=a", "Version=1", NULL };
+    AssertLines(message, lines);
+    RlistDestroy(message);
+}
+
+static void test_empty_message(void)
+{
+    const Writer writer = { { "\n", NULL } };
+    Rlist *message;
+    assert_true(ReadMessage(&writer, &message));
+    assert_true(message == NULL);
+
+    const Writer writer_crlf = { { "\r\n", NULL } };
+    assert_true(ReadMessage(&writer_crlf, &message));
+    assert_true(message == NULL);
+}
+
+static void test_eof_in_message(void)
+{
+    const Writer writer = { { "Name=a\n", "Version=1\n", NULL }, .close_after = true };
+    Rlist *message;
+    assert_false(ReadMessage(&writer, &message));
+    assert_true(message == NULL);
+
+    /* Nothing at all. */
+    const Writer writer_nothing = { { NULL }, .close_after = true };
+    assert_false(ReadMessage(&writer_nothing, &message));
+    assert_true(message == NULL);
+}
+
+int main()
+{
+    PRINT_TEST_BANNER();
+    const UnitTest tests[] =
+    {
+        unit_test(test_single_read),
+        unit_test(test_split_reads),
+        unit_test(test_crlf),
+        unit_test(test_empty_message),
+        unit_test(test_eof_in_message),
+    };
+
+    int ret = run_tests(tests);
+
+    return ret;
+}
@@ -0,0 +1,167 @@
+#include <test.h>
+
+#include <policy_cache.h>
+#include <parser.h>
+#include <json.h>
+#include <known_dirs.h>                                        /* GetStateDir */
+#include <misc_lib.h>                                          /* xsnprintf */
+#include <utime.h>
+
+
+static Policy *ParsePolicy(AgentType agent_type, const char *filename,
+                           char *path, size_t path_size)
+{
+    xsnprintf(path, path_size, "%s/%s", TESTDATADIR, filename);
+    Policy *policy = ParserParseFile(agent_type, path, 0, 0);
+    assert_true(policy != NULL);
+    return policy;
+}
+
+static void AssertPoliciesEqual(const Policy *a, const Policy *b)
+{
+    JsonElement *json_a = PolicyToJson(a);
+    JsonElement *json_b = PolicyToJson(b);
+    assert_int_equal(JsonCompare(json_a, json_b), 0);
+    JsonDestroy(json_a);
+    JsonDestroy(json_b);
+}
+
+static void test_store_and_load(void)
+{
+    char path[PATH_MAX];
+    Policy *parsed = ParsePolicy(AGENT_TYPE_AGENT, "benchmark.cf", path, sizeof(path));
+
+    assert_true(PolicyCacheLoad("SHA=benchmark", AGENT_TYPE_AGENT, path) == NULL);
+    assert_true(PolicyCacheStore("SHA=benchmark", AGENT_TYPE_AGENT, parsed));
+
+    Policy *loaded = PolicyCacheLoad("SHA=benchmark", AGENT_TYPE_AGENT, path);
+    assert_true(loaded != NULL);
+    AssertPoliciesEqual(parsed, loaded);
+
+    /* Promises keep the order of the file, for the top-down order. */
+    const Bundle *parsed_bundle = SeqAt(parsed->bundles, 0);
+    const Bundle *loaded_bundle = SeqAt(loaded->bundles, 0);
+    assert_int_equal(SeqLength(parsed_bundle->all_promises),
+                     SeqLength(loaded_bundle->all_promises));
+    for (size_t i = 0; i < SeqLength(parsed_bundle->all_promises); i++)
+    {
+        const Promise *parsed_pp = SeqAt(parsed_bundle->all_promises, i);
+        const Promise *loaded_pp = SeqAt(loaded_bundle->all_promises, i);
+        assert_string_equal(parsed_pp->promiser, loaded_pp->promiser);
+        assert_int_equal(parsed_pp->offset.line, loaded_pp->offset.line);
+    }
+
+    PolicyDestroy(loaded);
+    PolicyDestroy(parsed);
+}
+
+static void test_other_agent_type_is_not_used(void)
+{
+    char path[PATH_MAX];
+
+    /* cf-execd doesn't keep the agent bundles. */
+    Policy *executor_parsed = ParsePolicy(AGENT_TYPE_EXECUTOR, "benchmark.cf", path, sizeof(path));
+    assert_int_equal(SeqLength(executor_parsed->bundles), 0);
+    assert_true(PolicyCacheStore("SHA=agent_types", AGENT_TYPE_EXECUTOR, executor_parsed));
+
+    assert_true(PolicyCacheLoad("SHA=agent_types", AGENT_TYPE_AGENT, path) == NULL);
+
+    Policy *agent_parsed = ParsePolicy(AGENT_TYPE_AGENT, "benchmark.cf", path, sizeof(path));
+    assert_true(PolicyCacheStore("SHA=agent_types", AGENT_TYPE_AGENT, agent_parsed));
+
+    Policy *agent_loaded = PolicyCacheLoad("SHA=agent_types", AGENT_TYPE_AGENT, path);
+    assert_true(agent_loaded != NULL);
+    assert_int_equal(SeqLength(agent_loaded->bundles), 1);
+    AssertPoliciesEqual(agent_parsed, agent_loaded);
+
+    Policy *executor_loaded = PolicyCacheLoad("SHA=agent_types", AGENT_TYPE_EXECUTOR, path);
+    assert_true(executor_loaded != NULL);
+    AssertPoliciesEqual(executor_parsed, executor_loaded);
+
+    PolicyDestroy(executor_loaded);
+    PolicyDestroy(agent_loaded);
+    PolicyDestroy(agent_parsed);
+    PolicyDestroy(executor_parsed);
+}
+
+static void test_broken_entry_is_removed(void)
+{
+    char path[PATH_MAX];
+    Policy *parsed = ParsePolicy(AGENT_TYPE_AGENT, "benchmark.cf", path, sizeof(path));
+    assert_true(PolicyCacheStore("SHA=broken", AGENT_TYPE_AGENT, parsed));
+    PolicyDestroy(parsed);
+
+    char entry[PATH_MAX];
+    xsnprintf(entry, sizeof(entry), "%s/policy_cache/SHA=broken.agent", GetStateDir());
+    struct stat sb;
+    assert_int_equal(stat(entry, &sb), 0);
+    assert_int_equal(truncate(entry, sb.st_size - 4), 0);
+
+    assert_true(PolicyCacheLoad("SHA=broken", AGENT_TYPE_AGENT, path) == NULL);
+    assert_int_equal(stat(entry, &sb), -1);
+}
+
+/* An entry last used 8 days ago. */
+static void MakeOldEntry(const char *name, char *entry, size_t entry_size)
+{
+    char dir[PATH_MAX];
+    xsnprintf(dir, sizeof(dir), "%s/policy_cache", GetStateDir());
+    mkdir(dir, 0700);
+    xsnprintf(entry, entry_size, "%s/%s", dir, name);
+
+    FILE *file = fopen(entry, "w");
+    assert_true(file != NULL);
+    fclose(file);
+
+    const time_t old = time(NULL) - 8 * SECONDS_PER_DAY;
+    struct utimbuf times = { .actime = old, .modtime = old };
+    assert_int_equal(utime(entry, &times), 0);
+}
+
+/* Must run first, the directory is only pruned once per process. */
+static void test_old_entries_pruned_once(void)
+{
+    char path[PATH_MAX];
+    Policy *parsed = ParsePolicy(AGENT_TYPE_AGENT, "benchmark.cf", path, sizeof(path));
+
+    char first[PATH_MAX], second[PATH_MAX];
+    struct stat sb;
+    MakeOldEntry("SHA=old1.agent", first, sizeof(first));
+    assert_true(PolicyCacheStore("SHA=new1", AGENT_TYPE_AGENT, parsed));
+    assert_int_equal(stat(first, &sb), -1);
+
+    MakeOldEntry("SHA=old2.agent", second, sizeof(second));
+    assert_true(PolicyCacheStore("SHA=new2", AGENT_TYPE_AGENT, parsed));
+    assert_int_equal(stat(second, &sb), 0);
+
+    PolicyDestroy(parsed);
+}
+
+static void test_setup(void)
+{
+    static char env[] = /* Needs to be static for putenv() */
+        "CFENGINE_TEST_OVERRIDE_WORKDIR=/tmp/policy_cache_test.XXXXXX";
+
+    char *workdir = strchr(env, '=') + 1; /* start of the path */
+    assert(workdir - 1 && workdir[0] == '/');
+
+    mkdtemp(workdir);
+    putenv(env);
+    mkdir(GetStateDir(), (S_IRWXU | S_IRWXG | S_IRWXO));
+}
+
+int main()
+{
+    PRINT_TEST_BANNER();
+    test_setup();
+
+    const UnitTest tests[] =
+    {
+        unit_test(test_old_entries_pruned_once),
+        unit_test(test_store_and_load),
+        unit_test(test_other_agent_type_is_not_used),
+        unit_test(test_broken_entry_is_removed),
+    };
+
+    return run_tests(tests);
+}
@@ -33,12 +33,69 @@ static void test_SplitProcLine_windows(void)
     }
 }
 
+#ifdef __linux__
+static void test_SelectProcessInfo(void)
+{
+    ProcessInfo info = {
+        .pid = 100,
+        .ppid = 1,
+        .pgid = 100,
+        .user = "root",
+        .state = 'S',
+        .threads = 1,
+        .start_time = 1600000000,
+        .cpu_time = 90,
+        .tty = "?",
+        .command = "/usr/sbin/sshd -D",
+    };
+
+    ProcessSelect a = PROCESS_SELECT_INIT;
+    assert_true(SelectProcessInfo(&info, "sshd", &a, false));
+    assert_false(SelectProcessInfo(&info, "nginx", &a, false));
+
+    /* No attributes, no selection. */
+    assert_false(SelectProcessInfo(&info, "sshd", &a, true));
+
+    a.min_pid = 1;
+    a.max_pid = 200;
+    assert_true(SelectProcessInfo(&info, "sshd", &a, true));
+    a.min_pid = 200;
+    a.max_pid = 300;
+    assert_false(SelectProcessInfo(&info, "sshd", &a, true));
+
+    a.process_result = "process_owner.ttime";
+    RlistAppendScalar(&a.owner, "ro.*");
+    a.min_ttime = 60;
+    a.max_ttime = 120;
+    assert_true(SelectProcessInfo(&info, "sshd", &a, true));
+    a.max_ttime = 80;
+    assert_false(SelectProcessInfo(&info, "sshd", &a, true));
+    RlistDestroy(a.owner);
+    a.owner = NULL;
+
+    /* Like with ps on Linux, which does not show it. */
+    a.process_result = "status";
+    a.status = "S";
+    assert_false(SelectProcessInfo(&info, "sshd", &a, true));
+
+    /* Anchored, unlike the process regex. */
+    a.process_result = "command";
+    a.command = "sshd";
+    assert_false(SelectProcessInfo(&info, "sshd", &a, true));
+    a.command = "/usr/sbin/sshd.*";
+    assert_true(SelectProcessInfo(&info, "sshd", &a, true));
+}
+#endif
+
 int main()
 {
     PRINT_TEST_BANNER();
     const UnitTest tests[] =
     {
           unit_test(test_SplitProcLine_windows),
+#ifdef __linux__
+          unit_test(test_SelectProcessInfo),
+#endif
     };
 
     return run_tests(tests);
@@ -0,0 +1,241 @@
+#include <test.h>
+
+#include <cmockery.h>
+#include <server_access.h>
+#include <strlist.h>
+
+
+/* Resource entries, directories have a trailing '/'. */
+static const char *const PATHS[] =
+{
+    "/",
+    "/var/cfengine/masterfiles/",
+    "/var/cfengine/masterfiles/secret/",
+    "/var/cfengine/masterfiles/secret/public.cf",
+    "/var/cfengine/masterfiles/promises.cf",
+    "/srv/data/",
+    "/srv/data/hosts/",
+    "/srv/data/hosts/$(connection.ip).json",
+    "/home/user",
+};
+
+static const char *const REQUESTS[] =
+{
+    "/",
+    "/etc/passwd",
+    "/var/cfengine/masterfiles",
+    "/var/cfengine/masterfiles/",
+    "/var/cfengine/masterfiles/def.cf",
+    "/var/cfengine/masterfiles/lib/files.cf",
+    "/var/cfengine/masterfiles/secret/key.dat",
+    "/var/cfengine/masterfiles/secret/public.cf",
+    "/var/cfengine/masterfiles/secret/public.cf/",
+    "/var/cfengine/masterfiles/promises.cf",
+    "/var/cfengine/masterfiles/promises.cfx",
+    "/srv/data/hosts/10.1.2.3.json",
+    "/srv/data/hosts/",
+    "/srv/data//hosts/x",
+    "/home/user",
+    "/home/user/",
+    "/home/username",
+    "/home",
+};
+
+static const char *const PEERS[][3] =
+{
+    /* ipaddr, hostname, key */
+    { "10.1.2.3",     "hub.example.com",   "SHA=aaaa" },
+    { "10.2.0.1",     "client.example.com", "SHA=bbbb" },
+    { "192.168.1.20", "laptop.home.lan",   "SHA=cccc" },
+    { "192.168.1.21", "",                  "SHA=dddd" },
+    { "2001:db8::5",  "v6.example.org",    "SHA=eeee" },
+    { "8.8.8.8",      "dns.google",        "" },
+    { "10.9.9.9",     "laptopxhome.lan",   "" },
+};
+
+static struct acl *MakeACL(void)
+{
+    struct acl *acl = xcalloc(1, sizeof(*acl));
+
+    for (size_t i = 0; i < sizeof(PATHS) / sizeof(PATHS[0]); i++)
+    {
+        size_t pos = acl_SortedInsert(&acl, PATHS[i]);
+        assert_int_not_equal(pos, (size_t) -1);
+    }
+
+    /* Give every entry a different mix of rules. */
+    for (size_t i = 0; i < acl->len; i++)
+    {
+        struct resource_acl *racl = &acl->acls[i];
+        switch (i % 4)
+        {
+        case 0:
+            StrList_Append(&racl->admit.ips, "10.1");
+            StrList_Append(&racl->admit.ips, "192.168.1.0/24");
+            StrList_Append(&racl->deny.ips, "192.168.1.21");
+            break;
+        case 1:
+            StrList_Append(&racl->admit.hostnames, ".example.com");
+            StrList_Append(&racl->admit.hostnames, "laptop.home.lan");
+            StrList_Append(&racl->deny.hostnames, "client.example.com");
+            break;
+        case 2:
+            StrList_Append(&racl->admit.keys, "SHA=bbbb");
+            StrList_Append(&racl->admit.keys, "SHA=eeee");
+            StrList_Append(&racl->admit.ips, "2001:db8::/32");
+            StrList_Append(&racl->admit.ips, "8\\.8\\..*");
+            break;
+        default:
+            StrList_Append(&racl->admit.ips, "$(connection.ip)");
+            StrList_Append(&racl->admit.hostnames, "dns.google");
+            StrList_Append(&racl->deny.keys, "SHA=aaaa");
+            break;
+        }
+        StrList_Sort(racl->admit.hostnames, string_CompareFromEnd);
+        StrList_Sort(racl->admit.keys, string_Compare);
+        StrList_Sort(racl->deny.hostnames, string_CompareFromEnd);
+        StrList_Sort(racl->deny.keys, string_Compare);
+    }
+
+    return acl;
+}
+
+#define NUM_REQUESTS (sizeof(REQUESTS) / sizeof(REQUESTS[0]))
+#define NUM_PEERS    (sizeof(PEERS) / sizeof(PEERS[0]))
+
+static void test_compiled_same_as_linear(void)
+{
+    struct acl *acl = MakeACL();
+    bool expected[NUM_REQUESTS][NUM_PEERS];
+
+    for (size_t i = 0; i < NUM_REQUESTS; i++)
+    {
+        for (size_t j = 0; j < NUM_PEERS; j++)
+        {
+            expected[i][j] = acl_CheckPath(acl, REQUESTS[i], PEERS[j][0],
+                                           PEERS[j][1], PEERS[j][2]);
+        }
+    }
+
+    acl_Compile(acl);
+
+    size_t admitted = 0;
+    for (size_t i = 0; i < NUM_REQUESTS; i++)
+    {
+        for (size_t j = 0; j < NUM_PEERS; j++)
+        {
+            bool actual = acl_CheckPath(acl, REQUESTS[i], PEERS[j][0],
+                                        PEERS[j][1], PEERS[j][2]);
+            if (actual != expected[i][j])
+            {
+                printf("Mismatch for '%s' from %s: expected %d, got %d\n",
+                       REQUESTS[i], PEERS[j][0], expected[i][j], actual);
+            }
+            assert_int_equal(actual, expected[i][j]);
+            admitted += actual;
+        }
+    }
+
+    /* Make sure we are not comparing all-deny against all-deny. */
+    assert_true(admitted > 0);
+    assert_true(admitted < NUM_REQUESTS * NUM_PEERS);
+
+    acl_Free(acl);
+}
+
+static void test_longest_prefix(void)
+{
+    struct acl *acl = xcalloc(1, sizeof(*acl));
+    size_t dir = acl_SortedInsert(&acl, "/data/");
+    StrList_Append(&acl->acls[dir].admit.ips, "10.0.0.0/8");
+    size_t sub = acl_SortedInsert(&acl, "/data/private/");
+    StrList_Append(&acl->acls[sub].admit.ips, "10.0.0.1");
+    acl_Compile(acl);
+
+    assert_true(acl_CheckPath(acl, "/data/x", "10.0.0.2", "", ""));
+    assert_true(acl_CheckPath(acl, "/data/private/x", "10.0.0.1", "", ""));
+    /* The more specific entry wins. */
+    assert_false(acl_CheckPath(acl, "/data/private/x", "10.0.0.2", "", ""));
+    /* Directory entries only match their children. */
+    assert_false(acl_CheckPath(acl, "/data", "10.0.0.1", "", ""));
+    assert_false(acl_CheckPath(acl, "/other/x", "10.0.0.1", "", ""));
+
+    acl_Free(acl);
+}
+
+static void CheckLegacyRegex(const struct acl *acl)
+{
+    /* Every entry is a regex, a '.' matches any character. */
+    assert_true(acl_CheckPath(acl, "/data/x", "", "laptop.home.lan", ""));
+    assert_true(acl_CheckPath(acl, "/data/x", "", "laptopxhome.lan", ""));
+    assert_false(acl_CheckPath(acl, "/data/x", "", "laptop.home.lan.x", ""));
+
+    /* Anchored and escaped patterns, which IsRegex() does not recognise. */
+    assert_true(acl_CheckPath(acl, "/data/x", "10.0.0.7", "", ""));
+    assert_false(acl_CheckPath(acl, "/data/x", "10.0.0.9", "", ""));
+    assert_false(acl_CheckPath(acl, "/data/x", "10.0.1.7", "", ""));
+    assert_true(acl_CheckPath(acl, "/data/x", "", "www.example.com", ""));
+    assert_false(acl_CheckPath(acl, "/data/x", "", "web1.example.com", ""));
+}
+
+static void test_legacy_regex(void)
+{
+    struct acl *acl = xcalloc(1, sizeof(*acl));
+    size_t pos = acl_SortedInsert(&acl, "/data/");
+    struct resource_acl *racl = &acl->acls[pos];
+    StrList_Append(&racl->admit.hostnames, "laptop.home.lan");
+    StrList_Append(&racl->admit.hostnames, ".example.com");
+    StrList_Append(&racl->admit.ips, "^10\\.0\\.0\\.\\d+$");
+    StrList_Append(&racl->deny.hostnames, "web\\d\\.example\\.com");
+    StrList_Append(&racl->deny.ips, "^10\\.0\\.0\\.9$");
+    StrList_Sort(racl->admit.hostnames, string_CompareFromEnd);
+    StrList_Sort(racl->deny.hostnames, string_CompareFromEnd);
+
+    CheckLegacyRegex(acl);
+    acl_Compile(acl);
+    CheckLegacyRegex(acl);
+
+    acl_Free(acl);
+}
+
+int main()
+{
+    PRINT_TEST_BANNER();
+    const UnitTest tests[] =
+    {
+        unit_test(test_compiled_same_as_linear),
+        unit_test(test_longest_prefix),
+        unit_test(test_legacy_regex),
+    };
+
+    int ret = run_tests(tests);
+
+    return ret;
+}
+
+/* STUBS */
+
+size_t ReplaceSpecialVariables(char *buf, size_t buf_size,
+                               const char *find1, const char *repl1,
+                               const char *find2, const char *repl2,
+                               const char *find3, const char *repl3)
+{
+    /* Only the first one is used by the tests. */
+    (void) find2; (void) repl2; (void) find3; (void) repl3;
+
+    char *at = strstr(buf, find1);
+    if (at == NULL || find1[0] == '\0')
+    {
+        return 0;
+    }
+
+    size_t find_len = strlen(find1), repl_len = strlen(repl1);
+    size_t len = strlen(buf);
+    if (len - find_len + repl_len >= buf_size)
+    {
+        return (size_t) -1;
+    }
+    memmove(at + repl_len, at + find_len, strlen(at + find_len) + 1);
+    memcpy(at, repl1, repl_len);
+    return len - find_len + repl_len;
+}
@@ -0,0 +1,68 @@
+#include <test.h>
+
+#include <cmockery.h>
+#include <server_conntable.h>
+
+
+static void test_one_per_host(void)
+{
+    ConnectionTable *table = ConnectionTableNew(100);
+
+    ConnectionRecord *a = ConnectionTableAdd(table, "10.0.0.1", 1000, false);
+    assert_true(a != NULL);
+    assert_true(ConnectionTableAdd(table, "10.0.0.1", 1001, false) == NULL);
+
+    ConnectionRecord *b = ConnectionTableAdd(table, "10.0.0.1", 1002, true);
+    assert_true(b != NULL);
+    assert_int_equal(ConnectionTableCountHost(table, "10.0.0.1"), 2);
+    assert_int_equal(ConnectionTableCount(table), 2);
+
+    ConnectionTableRemove(table, a);
+    ConnectionTableRemove(table, b);
+    assert_int_equal(ConnectionTableCountHost(table, "10.0.0.1"), 0);
+    assert_int_equal(ConnectionTableCount(table), 0);
+
+    a = ConnectionTableAdd(table, "10.0.0.1", 1003, false);
+    assert_true(a != NULL);
+    ConnectionTableRemove(table, a);
+
+    ConnectionTableDestroy(table);
+}
+
+static void test_purge(void)
+{
+    ConnectionTable *table = ConnectionTableNew(100);
+
+    ConnectionRecord *old = ConnectionTableAdd(table, "10.0.0.1", 1000, false);
+    ConnectionRecord *new = ConnectionTableAdd(table, "10.0.0.2", 1050, false);
+
+    assert_int_equal(ConnectionTablePurge(table, 1100), 0);
+    assert_int_equal(ConnectionTablePurge(table, 1101), 1);
+    assert_int_equal(ConnectionTableCount(table), 1);
+
+    /* The purged host may connect again. */
+    ConnectionRecord *again = ConnectionTableAdd(table, "10.0.0.1", 1101, false);
+    assert_true(again != NULL);
+
+    /* Records are still released by their owners, in any order. */
+    ConnectionTableRemove(table, again);
+    ConnectionTableRemove(table, old);
+    ConnectionTableRemove(table, new);
+    assert_int_equal(ConnectionTableCount(table), 0);
+
+    ConnectionTableDestroy(table);
+}
+
+int main()
+{
+    PRINT_TEST_BANNER();
+    const UnitTest tests[] =
+    {
+        unit_test(test_one_per_host),
+        unit_test(test_purge),
+    };
+
+    int ret = run_tests(tests);
+
+    return ret;
+}
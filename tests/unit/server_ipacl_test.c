@@ -0,0 +1,102 @@
+#include <test.h>
+
+#include <cmockery.h>
+#include <server_ipacl.h>
+#include <item_lib.h>
+
+
+/* Every entry kind that can show up in allowconnects/denyconnects. */
+static const char *const ENTRIES[] =
+{
+    "10.1",                                   /* partial IPv4, octet prefix */
+    "192.168.1.10",                           /* single IPv4 address */
+    "172.16.0.0/12",                          /* IPv4 CIDR */
+    "192.168.5.10-20",                        /* IPv4 range */
+    "2001:db8::1",                            /* single IPv6 address */
+    "2001:db8:aa00::/40",                     /* IPv6 CIDR */
+    "2001:db8:cc00::/36",                     /* IPv6 CIDR, not whole bytes */
+    "127\\.0\\.0\\.[0-9]+",                   /* regex */
+    "10.01",                                  /* non-canonical, never matches */
+};
+
+static const char *const ADDRESSES[] =
+{
+    "10.1.2.3", "10.12.2.3", "10.10.1.1",
+    "192.168.1.10", "192.168.1.100", "192.168.1.1",
+    "172.16.0.1", "172.31.255.255", "172.32.0.1",
+    "192.168.5.15", "192.168.5.21",
+    "2001:db8::1", "2001:db8::2",
+    "2001:db8:aa12::5", "2001:db8:ab00::5",
+    "2001:db8:cc00::5", "2001:db8:c000::5", "2001:db8:cf00::5",
+    "127.0.0.1", "8.8.8.8", "::1",
+};
+
+static Item *MakeList(void)
+{
+    Item *list = NULL;
+    for (size_t i = 0; i < sizeof(ENTRIES) / sizeof(ENTRIES[0]); i++)
+    {
+        PrependItem(&list, ENTRIES[i], NULL);
+    }
+    return list;
+}
+
+static void test_same_as_IsMatchItemIn(void)
+{
+    Item *list = MakeList();
+    IPAcl *acl = IPAclCompile(list);
+
+    for (size_t i = 0; i < sizeof(ADDRESSES) / sizeof(ADDRESSES[0]); i++)
+    {
+        bool expected = IsMatchItemIn(list, ADDRESSES[i]);
+        bool actual = IPAclMatch(acl, ADDRESSES[i]);
+        if (expected != actual)
+        {
+            printf("Mismatch for '%s': expected %d, got %d\n",
+                   ADDRESSES[i], expected, actual);
+        }
+        assert_int_equal(expected, actual);
+    }
+
+    IPAclDestroy(acl);
+    DeleteItemList(list);
+}
+
+static void test_prefixes(void)
+{
+    Item *list = NULL;
+    PrependItem(&list, "10.0.0.0/8", NULL);
+    PrependItem(&list, "10.1.2.0/24", NULL);     /* covered by the /8 */
+    PrependItem(&list, "0.0.0.0/0", NULL);
+    IPAcl *acl = IPAclCompile(list);
+
+    assert_true(IPAclMatch(acl, "10.1.2.3"));
+    assert_true(IPAclMatch(acl, "1.2.3.4"));        /* /0 matches all IPv4 */
+    assert_false(IPAclMatch(acl, "::1"));           /* but not IPv6 */
+
+    IPAclDestroy(acl);
+    DeleteItemList(list);
+}
+
+static void test_empty(void)
+{
+    IPAcl *acl = IPAclCompile(NULL);
+    assert_false(IPAclMatch(acl, "10.1.2.3"));
+    assert_false(IPAclMatch(acl, "::1"));
+    IPAclDestroy(acl);
+}
+
+int main()
+{
+    PRINT_TEST_BANNER();
+    const UnitTest tests[] =
+    {
+        unit_test(test_same_as_IsMatchItemIn),
+        unit_test(test_prefixes),
+        unit_test(test_empty),
+    };
+
+    int ret = run_tests(tests);
+
+    return ret;
+}
@@ -0,0 +1,188 @@
+#include <test.h>
+
+#include <cmockery.h>
+#include <server_pool.h>
+#include <connection_info.h>
+#include <mutex.h>
+
+
+#define NUM_CONNS 16
+
+static int PEERS[NUM_CONNS];
+static int SLOW_PEER = -1;
+static pthread_mutex_t closed_lock = PTHREAD_MUTEX_INITIALIZER;
+static int CLOSED = 0;
+
+/* Requests are two bytes long. */
+
+/* Echo one request per dispatch, close on EOF. */
+static ServerPoolNext EchoServe(ServerConnectionState *conn)
+{
+    int sd = ConnectionInfoSocket(conn->conn_info);
+    char req[2];
+    ssize_t n = recv(sd, req, sizeof(req), MSG_WAITALL);
+    if (n != sizeof(req) || write(sd, req, sizeof(req)) != sizeof(req))
+    {
+        return SERVER_POOL_CLOSE;
+    }
+    return SERVER_POOL_WAIT_READ;
+}
+
+/* Ready once a whole request arrived, or on EOF. */
+static bool EchoReady(ServerConnectionState *conn)
+{
+    char req[2];
+    ssize_t n = recv(ConnectionInfoSocket(conn->conn_info), req, sizeof(req),
+                     MSG_PEEK | MSG_DONTWAIT);
+    return (n == sizeof(req) || n == 0 ||
+            (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK));
+}
+
+static void CountingClose(ServerConnectionState *conn)
+{
+    close(ConnectionInfoSocket(conn->conn_info));
+    ConnectionInfoDestroy(&conn->conn_info);
+    free(conn);
+
+    ThreadLock(&closed_lock);
+    CLOSED++;
+    ThreadUnlock(&closed_lock);
+}
+
+static int GetClosed(void)
+{
+    ThreadLock(&closed_lock);
+    int closed = CLOSED;
+    ThreadUnlock(&closed_lock);
+    return closed;
+}
+
+static ServerConnectionState *NewPeer(int *peer)
+{
+    int sv[2];
+    assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    *peer = sv[0];
+
+    ConnectionInfo *info = ConnectionInfoNew();
+    ConnectionInfoSetSocket(info, sv[1]);
+    ServerConnectionState *conn = xcalloc(1, sizeof(*conn));
+    conn->conn_info = info;
+    return conn;
+}
+
+static void Echo(int peer, const char *req)
+{
+    char in[2] = { 0 };
+    assert_int_equal(write(peer, req, 2), 2);
+    assert_int_equal(read(peer, in, 2), 2);
+    assert_memory_equal(in, req, 2);
+}
+
+static void test_start(void)
+{
+    assert_true(ServerPoolStart(4, 60, EchoServe, EchoReady, CountingClose));
+    assert_true(ServerPoolIsRunning());
+
+    ServerPoolStats stats;
+    ServerPoolGetStats(&stats);
+    assert_int_equal(stats.workers, 4);
+}
+
+static void test_submit_and_echo(void)
+{
+    for (int i = 0; i < NUM_CONNS; i++)
+    {
+        assert_true(ServerPoolSubmit(NewPeer(&PEERS[i])));
+    }
+
+    /* Several round trips per connection, more connections than workers:
+     * only works if idle connections release their worker. */
+    for (int round = 0; round < 3; round++)
+    {
+        for (int i = 0; i < NUM_CONNS; i++)
+        {
+            char req[2] = { 'a' + i, '0' + round };
+            Echo(PEERS[i], req);
+        }
+    }
+
+    ServerPoolStats stats;
+    ServerPoolGetStats(&stats);
+    assert_true(stats.dispatched >= NUM_CONNS);
+    assert_int_equal(GetClosed(), 0);
+}
+
+static void test_partial_request(void)
+{
+    if (!ServerPoolCanPark())
+    {
+        return;
+    }
+
+    ServerPoolStats before, after;
+    ServerPoolGetStats(&before);
+
+    /* Neither a silent client nor half a request may take a worker. */
+    assert_true(ServerPoolSubmit(NewPeer(&SLOW_PEER)));
+    usleep(200000);
+    assert_int_equal(write(SLOW_PEER, "x", 1), 1);
+    usleep(200000);
+
+    ServerPoolGetStats(&after);
+    assert_int_equal(after.dispatched, before.dispatched);
+    assert_int_equal(after.busy, 0);
+
+    char in = 0;
+    assert_int_equal(write(SLOW_PEER, "y", 1), 1);
+    assert_int_equal(read(SLOW_PEER, &in, 1), 1);
+    assert_int_equal(in, 'x');
+    assert_int_equal(read(SLOW_PEER, &in, 1), 1);
+    assert_int_equal(in, 'y');
+}
+
+static void test_close_by_peer(void)
+{
+    close(PEERS[0]);
+    for (int i = 0; i < 50 && GetClosed() < 1; i++)
+    {
+        usleep(100000);
+    }
+    assert_int_equal(GetClosed(), 1);
+}
+
+static void test_stop(void)
+{
+    /* Give the workers time to park everything. */
+    usleep(200000);
+    ServerPoolStop();
+    assert_false(ServerPoolIsRunning());
+    /* Serve functions must not leave connections to a stopped pool. */
+    assert_false(ServerPoolCanPark());
+    assert_int_equal(GetClosed(), NUM_CONNS + (SLOW_PEER != -1 ? 1 : 0));
+
+    for (int i = 1; i < NUM_CONNS; i++)
+    {
+        close(PEERS[i]);
+    }
+    if (SLOW_PEER != -1)
+    {
+        close(SLOW_PEER);
+    }
+}
+
+int main()
+{
+    PRINT_TEST_BANNER();
+    const UnitTest tests[] =
+    {
+        unit_test(test_start),
+        unit_test(test_submit_and_echo),
+        unit_test(test_partial_request),
+        unit_test(test_close_by_peer),
+        unit_test(test_stop),
+    };
+
+    int ret = run_tests(tests);
+
+    return ret;
+}
@@ -0,0 +1,263 @@
+#include <test.h>
+
+#include <cmockery.h>
+#include <server.h>
+#include <server_access.h>
+#include <strlist.h>
+#include <connection_info.h>
+#include <net.h>                              /* ReceiveTransaction */
+#include <file_lib.h>                         /* FullWrite */
+#include <sequence.h>
+
+#include <server_common.c>                        /* StatTreeSend */
+
+
+static char TEST_DIR[PATH_MAX];                 /* with a trailing '/' */
+
+/*
+ * TEST_DIR/a           file
+ * TEST_DIR/l -> a      symlink
+ * TEST_DIR/d/          directory
+ * TEST_DIR/d/b         file
+ * TEST_DIR/d/e/        directory, denied by the ACL
+ * TEST_DIR/d/e/c       file
+ */
+static void MakeFile(const char *relpath)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s%s", TEST_DIR, relpath);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert_int_not_equal(fd, -1);
+    assert_int_equal(FullWrite(fd, "data", 4), 4);
+    close(fd);
+}
+
+static void MakeDir(const char *relpath)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s%s", TEST_DIR, relpath);
+    assert_int_equal(mkdir(path, 0755), 0);
+}
+
+static void AddACL(const char *relpath, bool deny)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s%s", TEST_DIR, relpath);
+    size_t pos = acl_SortedInsert(&paths_acl, path);
+    assert_int_not_equal(pos, (size_t) -1);
+
+    struct resource_acl *racl = &paths_acl->acls[pos];
+    StrList_Append(deny ? &racl->deny.ips : &racl->admit.ips, "127.0.0.1");
+}
+
+static void setup(void)
+{
+    xsnprintf(TEST_DIR, sizeof(TEST_DIR), "/tmp/server_stattree_test.XXXXXX");
+    assert_true(mkdtemp(TEST_DIR) != NULL);
+    strlcat(TEST_DIR, "/", sizeof(TEST_DIR));
+
+    MakeFile("a");
+    char link_path[PATH_MAX];
+    snprintf(link_path, sizeof(link_path), "%sl", TEST_DIR);
+    assert_int_equal(symlink("a", link_path), 0);
+    MakeDir("d");
+    MakeFile("d/b");
+    MakeDir("d/e");
+    MakeFile("d/e/c");
+
+    paths_acl = xcalloc(1, sizeof(*paths_acl));
+    AddACL("", false);
+    AddACL("d/e/", true);
+}
+
+static void teardown(void)
+{
+    acl_Free(paths_acl);
+    paths_acl = NULL;
+
+    char cmd[PATH_MAX + 16];
+    snprintf(cmd, sizeof(cmd), "rm -rf '%s'", TEST_DIR);
+    assert_int_equal(system(cmd), 0);
+}
+
+/**
+ * Run StatTreeSend() on TEST_DIR and collect the reply, one
+ * "relpath OK|BAD children" string per record, or the error reply alone.
+ */
+static Seq *StatTree(const char *dirname, int maxdepth, size_t max_entries)
+{
+    int sv[2];
+    assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+
+    ServerConnectionState *conn = xcalloc(1, sizeof(*conn));
+    conn->conn_info = ConnectionInfoNew();
+    ConnectionInfoSetSocket(conn->conn_info, sv[0]);
+    ConnectionInfoSetProtocolVersion(conn->conn_info, CF_PROTOCOL_CLASSIC);
+    strlcpy(conn->ipaddr, "127.0.0.1", sizeof(conn->ipaddr));
+    strlcpy(conn->revdns, "localhost", sizeof(conn->revdns));
+
+    char sendbuffer[CF_MSGSIZE];
+    StatTreeState *st = xcalloc(1, sizeof(StatTreeState));
+    st->conn        = conn;
+    st->key         = "SHA=test";
+    st->sendbuffer  = sendbuffer;
+    st->max_entries = max_entries;
+    st->maxdepth    = maxdepth;
+
+    /* Small enough a reply to fit in the socket buffer. */
+    StatTreeSend(st, dirname);
+    free(st);
+    close(sv[0]);
+    ConnectionInfoDestroy(&conn->conn_info);
+    free(conn);
+
+    ConnectionInfo *client = ConnectionInfoNew();
+    ConnectionInfoSetSocket(client, sv[1]);
+    ConnectionInfoSetProtocolVersion(client, CF_PROTOCOL_CLASSIC);
+
+    Seq *records = SeqNew(16, free);
+    char recvbuffer[CF_BUFSIZE];
+    int more = 1;
+    while (more)
+    {
+        int nbytes = ReceiveTransaction(client, recvbuffer, &more);
+        assert_true(nbytes > 0);
+
+        if (SeqLength(records) == 0 && strncmp(recvbuffer, "BAD:", 4) == 0)
+        {
+            assert_int_equal(more, 0);
+            SeqAppend(records, xstrdup("BAD"));
+            break;
+        }
+
+        const char *p = recvbuffer;
+        while (p < recvbuffer + nbytes)
+        {
+            const char *fields[5];
+            for (size_t i = 0; i < 5; i++)
+            {
+                fields[i] = p;
+                p += strlen(p) + 1;
+                if (i == 0 && strcmp(fields[0], CFD_TERMINATOR) == 0)
+                {
+                    assert_int_equal(more, 0);
+                    goto done;
+                }
+            }
+            assert_true(p <= recvbuffer + nbytes);
+
+            char *record;
+            xasprintf(&record, "%s %s %s", fields[0],
+                      (strncmp(fields[1], "OK:", 3) == 0) ? "OK" : "BAD",
+                      fields[4]);
+            SeqAppend(records, record);
+        }
+    }
+  done:
+
+    close(sv[1]);
+    ConnectionInfoDestroy(&client);
+    return records;
+}
+
+static bool HasRecord(const Seq *records, const char *record)
+{
+    const size_t length = SeqLength(records);
+    for (size_t i = 0; i < length; i++)
+    {
+        if (strcmp(SeqAt(records, i), record) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void test_walk(void)
+{
+    setup();
+    Seq *records = StatTree(TEST_DIR, 10, STATTREE_MAX_ENTRIES);
+
+    assert_int_equal(SeqLength(records), 6);
+    assert_string_equal(SeqAt(records, 0), ". OK 1");
+    assert_true(HasRecord(records, "a OK 0"));
+    assert_true(HasRecord(records, "l OK 0"));
+    assert_true(HasRecord(records, "d OK 1"));
+    assert_true(HasRecord(records, "d/b OK 0"));
+    /* Listed, but neither stat'ed nor walked. */
+    assert_true(HasRecord(records, "d/e BAD 0"));
+
+    SeqDestroy(records);
+    teardown();
+}
+
+static void test_walk_depth(void)
+{
+    setup();
+    Seq *records = StatTree(TEST_DIR, 1, STATTREE_MAX_ENTRIES);
+
+    assert_int_equal(SeqLength(records), 4);
+    assert_string_equal(SeqAt(records, 0), ". OK 1");
+    assert_true(HasRecord(records, "a OK 0"));
+    assert_true(HasRecord(records, "l OK 0"));
+    assert_true(HasRecord(records, "d OK 0"));
+
+    SeqDestroy(records);
+    teardown();
+}
+
+static void test_walk_entry_cap(void)
+{
+    setup();
+
+    /* Past the cap, directories are sent without their contents. */
+    Seq *records = StatTree(TEST_DIR, 10, 0);
+    assert_int_equal(SeqLength(records), 4);
+    assert_true(HasRecord(records, "d OK 0"));
+    SeqDestroy(records);
+
+    /* The cap is checked when a directory is reached: d comes after at
+     * most two other entries, so it is still walked. */
+    records = StatTree(TEST_DIR, 10, 3);
+    assert_int_equal(SeqLength(records), 6);
+    assert_true(HasRecord(records, "d OK 1"));
+    SeqDestroy(records);
+
+    teardown();
+}
+
+static void test_not_a_directory(void)
+{
+    setup();
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%sa/", TEST_DIR);
+    Seq *records = StatTree(path, 10, STATTREE_MAX_ENTRIES);
+    assert_int_equal(SeqLength(records), 1);
+    assert_string_equal(SeqAt(records, 0), "BAD");
+    SeqDestroy(records);
+
+    snprintf(path, sizeof(path), "%smissing/", TEST_DIR);
+    records = StatTree(path, 10, STATTREE_MAX_ENTRIES);
+    assert_int_equal(SeqLength(records), 1);
+    assert_string_equal(SeqAt(records, 0), "BAD");
+    SeqDestroy(records);
+
+    teardown();
+}
+
+int main()
+{
+    PRINT_TEST_BANNER();
+    const UnitTest tests[] =
+    {
+        unit_test(test_walk),
+        unit_test(test_walk_depth),
+        unit_test(test_walk_entry_cap),
+        unit_test(test_not_a_directory),
+    };
+
+    int ret = run_tests(tests);
+
+    return ret;
+}
@@ -0,0 +1,358 @@
+#include <test.h>
+
+#include <cmockery.h>
+#include <stat_cache.h>
+#include <alloc.h>
+#include <item_lib.h>
+
+#include <stat_cache.c>                                    /* StatTreeParse */
+
+
+static Stat *NewStat(const char *file_name, off_t size)
+{
+    Stat *data = xcalloc(1, sizeof(Stat));
+    data->cf_filename = xstrdup(file_name);
+    data->cf_server = xstrdup("server");
+    data->cf_size = size;
+    return data;
+}
+
+static void test_insert_get(void)
+{
+    StatCache *cache = StatCacheNew(10);
+
+    StatCacheInsert(cache, "server", "5308", NewStat("/a", 1));
+    StatCacheInsert(cache, "server", "5308", NewStat("/b", 2));
+
+    const Stat *sp = StatCacheGet(cache, "server", "5308", "/a");
+    assert_true(sp != NULL);
+    assert_int_equal(sp->cf_size, 1);
+
+    /* Same path on another server or port is another file. */
+    assert_true(StatCacheGet(cache, "other", "5308", "/a") == NULL);
+    assert_true(StatCacheGet(cache, "server", "5309", "/a") == NULL);
+    assert_true(StatCacheGet(cache, "server", NULL, "/a") == NULL);
+
+    /* Replacing keeps one entry. */
+    StatCacheInsert(cache, "server", "5308", NewStat("/a", 3));
+    sp = StatCacheGet(cache, "server", "5308", "/a");
+    assert_true(sp != NULL);
+    assert_int_equal(sp->cf_size, 3);
+
+    StatCacheStats stats;
+    StatCacheGetStats(cache, &stats);
+    assert_int_equal(stats.entries, 2);
+    assert_int_equal(stats.hits, 2);
+    assert_int_equal(stats.misses, 3);
+    assert_int_equal(stats.evictions, 0);
+
+    StatCacheDestroy(cache);
+}
+
+static void test_negative_entry(void)
+{
+    StatCache *cache = StatCacheNew(10);
+
+    Stat *failed = NewStat("/missing", 0);
+    failed->cf_failed = true;
+    StatCacheInsert(cache, "server", NULL, failed);
+
+    const Stat *sp = StatCacheGet(cache, "server", NULL, "/missing");
+    assert_true(sp != NULL);
+    assert_true(sp->cf_failed);
+
+    StatCacheDestroy(cache);
+}
+
+static void test_lru_eviction(void)
+{
+    StatCache *cache = StatCacheNew(3);
+
+    StatCacheInsert(cache, "server", NULL, NewStat("/1", 1));
+    StatCacheInsert(cache, "server", NULL, NewStat("/2", 2));
+    StatCacheInsert(cache, "server", NULL, NewStat("/3", 3));
+
+    /* Touch /1, so that /2 is the least recently used. */
+    assert_true(StatCacheGet(cache, "server", NULL, "/1") != NULL);
+
+    StatCacheInsert(cache, "server", NULL, NewStat("/4", 4));
+    assert_true(StatCacheGet(cache, "server", NULL, "/2") == NULL);
+    assert_true(StatCacheGet(cache, "server", NULL, "/1") != NULL);
+    assert_true(StatCacheGet(cache, "server", NULL, "/3") != NULL);
+    assert_true(StatCacheGet(cache, "server", NULL, "/4") != NULL);
+
+    /* Now /1 is the oldest. */
+    StatCacheInsert(cache, "server", NULL, NewStat("/5", 5));
+    assert_true(StatCacheGet(cache, "server", NULL, "/1") == NULL);
+
+    StatCacheStats stats;
+    StatCacheGetStats(cache, &stats);
+    assert_int_equal(stats.entries, 3);
+    assert_int_equal(stats.evictions, 2);
+
+    StatCacheDestroy(cache);
+}
+
+static void test_many(void)
+{
+    StatCache *cache = StatCacheNew(1000);
+    char name[64];
+
+    for (int i = 0; i < 5000; i++)
+    {
+        snprintf(name, sizeof(name), "/dir/file%d", i);
+        StatCacheInsert(cache, "server", "5308", NewStat(name, i));
+    }
+
+    for (int i = 0; i < 5000; i++)
+    {
+        snprintf(name, sizeof(name), "/dir/file%d", i);
+        const Stat *sp = StatCacheGet(cache, "server", "5308", name);
+        if (i < 4000)
+        {
+            assert_true(sp == NULL);
+        }
+        else
+        {
+            assert_true(sp != NULL);
+            assert_int_equal(sp->cf_size, i);
+        }
+    }
+
+    StatCacheStats stats;
+    StatCacheGetStats(cache, &stats);
+    assert_int_equal(stats.entries, 1000);
+    assert_int_equal(stats.evictions, 4000);
+
+    StatCacheDestroy(cache);
+}
+
+/* STATTREE reply parsing. */
+
+#define DIR_STAT  "OK: 2 493 0 0 0 4096 0 0 0 0 1 2 1"
+#define FILE_STAT "OK: 0 420 0 0 0 10 0 0 0 0 2 1 1"
+
+/* Bigger than a transaction, so that deeply nested replies fit. */
+typedef struct
+{
+    char data[4 * CF_BUFSIZE];
+    size_t len;
+} Reply;
+
+static void AppendField(Reply *reply, const char *field)
+{
+    size_t field_len = strlen(field) + 1;
+    assert_true(reply->len + field_len <= sizeof(reply->data));
+    memcpy(reply->data + reply->len, field, field_len);
+    reply->len += field_len;
+}
+
+static void AppendRecord(Reply *reply, const char *relpath,
+                         const char *statline, const char *children)
+{
+    AppendField(reply, relpath);
+    AppendField(reply, statline);
+    AppendField(reply, "");                                   /* link */
+    AppendField(reply, "");                                   /* digest */
+    AppendField(reply, children);
+}
+
+static void ParserInit(StatTreeParser *parser)
+{
+    memset(parser, 0, sizeof(*parser));
+    parser->server  = "server";
+    parser->dirname = "/srv/";
+    parser->entries = SeqNew(16, DestroyStatCache);
+}
+
+static const Stat *ParsedEntry(const StatTreeParser *parser,
+                               const char *file_name)
+{
+    const size_t length = SeqLength(parser->entries);
+    for (size_t i = 0; i < length; i++)
+    {
+        const Stat *sp = SeqAt(parser->entries, i);
+        if (strcmp(sp->cf_filename, file_name) == 0)
+        {
+            return sp;
+        }
+    }
+    return NULL;
+}
+
+static void test_stattree_parse(void)
+{
+    StatTreeParser parser;
+    ParserInit(&parser);
+
+    /* Records never span transactions, but a reply may have many. */
+    Reply reply = { .len = 0 };
+    AppendRecord(&reply, ".", DIR_STAT, "1");
+    AppendRecord(&reply, "a", FILE_STAT, "0");
+    AppendRecord(&reply, "d", DIR_STAT, "1");
+    AppendRecord(&reply, "d/b", FILE_STAT, "0");
+    assert_true(StatTreeParse(&parser, reply.data, reply.len));
+    assert_false(parser.done);
+
+    reply.len = 0;
+    AppendRecord(&reply, "e", DIR_STAT, "0");
+    AppendRecord(&reply, "f", "BAD: access denied", "0");
+    AppendField(&reply, CFD_TERMINATOR);
+    assert_true(StatTreeParse(&parser, reply.data, reply.len));
+    assert_true(parser.done);
+
+    /* Entries that can't be stat'ed are listed, but not cached. */
+    assert_int_equal(SeqLength(parser.entries), 5);
+    assert_true(ParsedEntry(&parser, "/srv/f") == NULL);
+
+    const Stat *root = ParsedEntry(&parser, "/srv/");
+    assert_true(root != NULL);
+    assert_true(S_ISDIR(root->cf_mode));
+    assert_int_equal(ListLen(root->cf_entries), 6);
+    assert_true(IsItemIn(root->cf_entries, "."));
+    assert_true(IsItemIn(root->cf_entries, ".."));
+    assert_true(IsItemIn(root->cf_entries, "a"));
+    assert_true(IsItemIn(root->cf_entries, "d"));
+    assert_true(IsItemIn(root->cf_entries, "e"));
+    assert_true(IsItemIn(root->cf_entries, "f"));
+
+    const Stat *d = ParsedEntry(&parser, "/srv/d");
+    assert_true(d != NULL);
+    assert_int_equal(ListLen(d->cf_entries), 3);
+    assert_true(IsItemIn(d->cf_entries, "b"));
+
+    const Stat *b = ParsedEntry(&parser, "/srv/d/b");
+    assert_true(b != NULL);
+    assert_true(S_ISREG(b->cf_mode));
+    assert_int_equal(b->cf_size, 10);
+    assert_string_equal(b->cf_server, "server");
+
+    /* Not listed, so RemoteDirList() has to ask for it. */
+    const Stat *e = ParsedEntry(&parser, "/srv/e");
+    assert_true(e != NULL);
+    assert_true(e->cf_entries == NULL);
+
+    SeqDestroy(parser.entries);
+}
+
+static void test_stattree_truncated(void)
+{
+    StatTreeParser parser;
+    Reply reply = { .len = 0 };
+
+    /* Too few fields. */
+    ParserInit(&parser);
+    AppendRecord(&reply, ".", DIR_STAT, "1");
+    AppendField(&reply, "a");
+    AppendField(&reply, FILE_STAT);
+    assert_false(StatTreeParse(&parser, reply.data, reply.len));
+    SeqDestroy(parser.entries);
+
+    /* Last field not terminated. */
+    ParserInit(&parser);
+    reply.len = 0;
+    AppendRecord(&reply, ".", DIR_STAT, "1");
+    AppendRecord(&reply, "a", FILE_STAT, "0");
+    assert_false(StatTreeParse(&parser, reply.data, reply.len - 1));
+    SeqDestroy(parser.entries);
+
+    /* Whole records, but no CFD_TERMINATOR: cf_remote_stat_tree() must not
+     * take it as complete. */
+    ParserInit(&parser);
+    assert_true(StatTreeParse(&parser, reply.data, reply.len));
+    assert_false(parser.done);
+    SeqDestroy(parser.entries);
+}
+
+static void test_stattree_malformed(void)
+{
+    StatTreeParser parser;
+    Reply reply = { .len = 0 };
+
+    /* The root itself failed. */
+    ParserInit(&parser);
+    AppendRecord(&reply, ".", "BAD: cfengine, couldn't open dir", "1");
+    assert_false(StatTreeParse(&parser, reply.data, reply.len));
+    SeqDestroy(parser.entries);
+
+    /* Entry of a directory that isn't being listed. */
+    ParserInit(&parser);
+    reply.len = 0;
+    AppendRecord(&reply, ".", DIR_STAT, "1");
+    AppendRecord(&reply, "x/y", FILE_STAT, "0");
+    assert_false(StatTreeParse(&parser, reply.data, reply.len));
+    SeqDestroy(parser.entries);
+
+    /* Entry after a root without contents. */
+    ParserInit(&parser);
+    reply.len = 0;
+    AppendRecord(&reply, ".", DIR_STAT, "0");
+    AppendRecord(&reply, "a", FILE_STAT, "0");
+    assert_false(StatTreeParse(&parser, reply.data, reply.len));
+    SeqDestroy(parser.entries);
+
+    /* A garbled STAT reply only drops that entry. */
+    ParserInit(&parser);
+    reply.len = 0;
+    AppendRecord(&reply, ".", DIR_STAT, "1");
+    AppendRecord(&reply, "a", "OK: 0 420 garbage", "0");
+    AppendRecord(&reply, "b", "OK: 9 420 0 0 0 10 0 0 0 0 2 1 1", "0");
+    AppendField(&reply, CFD_TERMINATOR);
+    assert_true(StatTreeParse(&parser, reply.data, reply.len));
+    assert_true(parser.done);
+    assert_int_equal(SeqLength(parser.entries), 1);
+    SeqDestroy(parser.entries);
+}
+
+/* Nest #levels directories below the root. */
+static bool ParseNested(size_t levels)
+{
+    StatTreeParser parser;
+    ParserInit(&parser);
+    Reply reply = { .len = 0 };
+    AppendRecord(&reply, ".", DIR_STAT, "1");
+
+    char relpath[2 * STATTREE_STACK_SIZE + 2] = "d";
+    for (size_t i = 0; i < levels; i++)
+    {
+        AppendRecord(&reply, relpath, DIR_STAT, "1");
+        strcat(relpath, "/d");
+    }
+    AppendField(&reply, CFD_TERMINATOR);
+
+    bool ok = StatTreeParse(&parser, reply.data, reply.len);
+    if (ok)
+    {
+        assert_true(parser.done);
+        assert_int_equal(SeqLength(parser.entries), levels + 1);
+    }
+    SeqDestroy(parser.entries);
+    return ok;
+}
+
+static void test_stattree_depth_limit(void)
+{
+    /* The root takes one place on the stack. */
+    assert_true(ParseNested(STATTREE_STACK_SIZE - 1));
+    assert_false(ParseNested(STATTREE_STACK_SIZE));
+}
+
+int main()
+{
+    PRINT_TEST_BANNER();
+    const UnitTest tests[] =
+    {
+        unit_test(test_insert_get),
+        unit_test(test_negative_entry),
+        unit_test(test_lru_eviction),
+        unit_test(test_many),
+        unit_test(test_stattree_parse),
+        unit_test(test_stattree_truncated),
+        unit_test(test_stattree_malformed),
+        unit_test(test_stattree_depth_limit),
+    };
+
+    int ret = run_tests(tests);
+
+    return ret;
+}